@@ -0,0 +1,334 @@
+#include "batchio.h"
+#include "stopwatch.h"
+#include "trace.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * The waiting stage spins BATCHIO_SPIN times, yields the processor for
+ * another BATCHIO_SPIN times and then sleeps BATCHIO_SLEEP_NS per check.
+ */
+#define BATCHIO_SPIN 64
+#define BATCHIO_SLEEP_NS 20000
+
+/*
+ * A slot of the ring: the batch and the buffers of the streams, which are
+ * not mapped.
+ */
+struct batchio_slot {
+    struct batch batch;
+    float *input;
+    float *target;
+};
+
+/*
+ * The batch `seq` is in slot `seq % depth`. The counters are the number of
+ * batches read, computed and written: written <= done <= read <=
+ * written + depth. Each counter is written by one thread only and lives in
+ * its own cache line. With mapped input and target files, the compute thread
+ * fills the slots (and counts the read batches) itself.
+ */
+struct batchio {
+    FILE *input, *target, *output;
+    uint32_t batch_len, input_len, target_len, depth;
+    size_t output_size;
+    struct dataset input_map, target_map;
+    const uint32_t *order;  // the order of the records or NULL
+    size_t pos;             // the next record of the input
+    bool reader_running;
+    struct batchio_slot *ring;
+    alignas(64) _Atomic uint64_t read;
+    alignas(64) _Atomic uint64_t done;
+    alignas(64) _Atomic uint64_t written;
+    alignas(64) uint64_t next;  // the batch of the compute thread
+    double stall_us;
+    pthread_t reader, writer;
+};
+
+struct dataset dataset_map(FILE *stream, uint32_t len) {
+    struct dataset d = {.len = len};
+    struct stat st;
+    const off_t pos = ftello(stream);
+    if (fstat(fileno(stream), &st) || !S_ISREG(st.st_mode) || pos < 0 ||
+        st.st_size <= pos) {
+        return d;
+    }
+    d.map_len = (size_t)st.st_size;
+    d.map = mmap(NULL, d.map_len, PROT_READ, MAP_PRIVATE, fileno(stream), 0);
+    if (d.map == MAP_FAILED) {
+        return (struct dataset){.len = len};
+    }
+    madvise(d.map, d.map_len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(d.map, d.map_len, MADV_HUGEPAGE);
+#endif
+    d.data = (const float *)((const char *)d.map + pos);
+    d.rec  = (d.map_len - (size_t)pos) / (sizeof(float) * len);
+    return d;
+}
+
+void dataset_unmap(struct dataset d) {
+    if (d.data != NULL) munmap(d.map, d.map_len);
+}
+
+/*
+ * Wait until the counter is greater than `seq`.
+ */
+static void batchio_wait(_Atomic uint64_t *counter, uint64_t seq) {
+    const struct timespec sleep = {0, BATCHIO_SLEEP_NS};
+    for (uint32_t i = 0;
+         atomic_load_explicit(counter, memory_order_acquire) <= seq; i++) {
+        if (i >= 2 * BATCHIO_SPIN) {
+            nanosleep(&sleep, NULL);
+        } else if (i >= BATCHIO_SPIN) {
+            sched_yield();
+        }
+    }
+}
+
+static void batchio_prefetch(const float *row, uint32_t len) {
+    for (size_t i = 0; i < sizeof(float) * len; i += 64) {
+        __builtin_prefetch((const char *)row + i);
+    }
+}
+
+void dataset_gather(const struct dataset *d, const uint32_t *rows,
+                    uint32_t len, float *dst) {
+    for (uint32_t k = 0; k < len; k++) {
+        if (k + 1 < len) {
+            batchio_prefetch(&d->data[(size_t)rows[k + 1] * d->len], d->len);
+        }
+        memcpy(&dst[k * d->len], &d->data[(size_t)rows[k] * d->len],
+               sizeof(float) * d->len);
+    }
+}
+
+/*
+ * Gather the records `order[pos]`, ... of the batch from the mapped files
+ * into the buffers of the slot.
+ */
+static void batchio_gather(struct batchio *io, struct batchio_slot *s) {
+    struct batch *b   = &s->batch;
+    const size_t left = io->input_map.rec - io->pos;
+    b->len            = left < io->batch_len ? (uint32_t)left : io->batch_len;
+    dataset_gather(&io->input_map, &io->order[io->pos], b->len, s->input);
+    if (io->target_map.data) {
+        dataset_gather(&io->target_map, &io->order[io->pos], b->len, s->target);
+    }
+    io->pos += b->len;
+}
+
+/*
+ * Fill the slot with the next batch: gather the records in the given order,
+ * point into the mapped files or read the streams into the buffers of the
+ * slot.
+ */
+static void batchio_fill(struct batchio *io, struct batchio_slot *s) {
+    struct batch *b = &s->batch;
+    if (io->order != NULL) {
+        batchio_gather(io, s);
+        return;
+    }
+    if (io->input_map.data != NULL) {
+        const size_t left = io->input_map.rec - io->pos;
+        b->len   = left < io->batch_len ? (uint32_t)left : io->batch_len;
+        b->input = &io->input_map.data[io->pos * io->input_len];
+    } else {
+        b->len = fread(s->input, sizeof(float) * io->input_len, io->batch_len,
+                       io->input);
+    }
+    if (b->len > 0 && io->target_map.data != NULL) {
+        if (io->pos + b->len > io->target_map.rec) {
+            errx(EXIT_FAILURE, "loading target array");
+        }
+        b->target = &io->target_map.data[io->pos * io->target_len];
+    } else if (b->len > 0 && io->target != NULL &&
+               fread(s->target, sizeof(float) * io->target_len, b->len,
+                     io->target) != b->len) {
+        err(EXIT_FAILURE, "loading target array");
+    }
+    io->pos += b->len;
+}
+
+/*
+ * Read the batches into the free slots. An empty batch marks the end of the
+ * input stream.
+ */
+static void *batchio_reader(void *arg) {
+    struct batchio *io = arg;
+    TRACE_THREAD("reader");
+    for (uint64_t seq = 0;; seq++) {
+        if (seq >= io->depth) batchio_wait(&io->written, seq - io->depth);
+        struct batchio_slot *s = &io->ring[seq % io->depth];
+        TRACE_BEGIN(span, "read");
+        batchio_fill(io, s);
+        TRACE_END(span);
+        atomic_store_explicit(&io->read, seq + 1, memory_order_release);
+        if (s->batch.len == 0) return NULL;
+    }
+}
+
+/*
+ * Write the outputs of the computed batches and release their slots.
+ */
+static void *batchio_writer(void *arg) {
+    struct batchio *io = arg;
+    TRACE_THREAD("writer");
+    for (uint64_t seq = 0;; seq++) {
+        batchio_wait(&io->done, seq);
+        const struct batch *b = &io->ring[seq % io->depth].batch;
+        const uint32_t len    = b->len;
+        TRACE_BEGIN(span, "write");
+        if (len > 0 && io->output != NULL &&
+            fwrite(b->output, io->output_size, len, io->output) != len) {
+            err(EXIT_FAILURE, "writing output array");
+        }
+        TRACE_END(span);
+        if (len == 0 && io->output != NULL) fflush(io->output);
+        atomic_store_explicit(&io->written, seq + 1, memory_order_release);
+        if (len == 0) return NULL;
+    }
+}
+
+static void batchio_advise(struct dataset d) {
+    if (d.data == NULL) return;
+    madvise(d.map, d.map_len, MADV_NORMAL);
+    madvise(d.map, d.map_len, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+    madvise(d.map, d.map_len, MADV_HUGEPAGE);
+#endif
+}
+
+static void *batchio_alloc(uint32_t m, size_t size) {
+    void *p = NULL;
+    return posix_memalign(&p, 64, m * size) ? NULL : p;
+}
+
+static void batchio_free(struct batchio *io) {
+    for (uint32_t i = 0; io->ring != NULL && i < io->depth; i++) {
+        free(io->ring[i].input);
+        free(io->ring[i].target);
+        free(io->ring[i].batch.output);
+    }
+    free(io->ring);
+    dataset_unmap(io->input_map);
+    dataset_unmap(io->target_map);
+    free(io);
+}
+
+struct batchio *batchio_open(FILE *input, FILE *target, FILE *output,
+                             uint32_t batch_len, uint32_t input_len,
+                             uint32_t target_len, size_t output_size,
+                             uint32_t depth, const uint32_t *order) {
+    struct batchio *io = NULL;
+    if (depth < 2 || posix_memalign((void **)&io, 64, sizeof(*io))) {
+        return NULL;
+    }
+    *io = (struct batchio){
+        .input       = input,
+        .target      = target,
+        .output      = output,
+        .batch_len   = batch_len,
+        .input_len   = input_len,
+        .target_len  = target_len,
+        .output_size = output_size,
+        .depth       = depth,
+        .order       = order,
+        .input_map   = dataset_map(input, input_len),
+        .target_map  = target ? dataset_map(target, target_len)
+                              : (struct dataset){.len = target_len},
+        .ring        = calloc(depth, sizeof(struct batchio_slot))};
+    const bool unmapped = io->input_map.data == NULL ||
+                          (target != NULL &&
+                           io->target_map.rec < io->input_map.rec);
+    if (io->ring == NULL || (order != NULL && unmapped)) {
+        batchio_free(io);
+        return NULL;
+    }
+    if (order != NULL) {
+        // the records are read in random order, again in each epoch
+        batchio_advise(io->input_map);
+        batchio_advise(io->target_map);
+    }
+    // the reader thread gathers the records in the given order
+    const bool read_input  = io->input_map.data == NULL || order != NULL;
+    const bool read_target = target != NULL &&
+                             (io->target_map.data == NULL || order != NULL);
+    const size_t input_size  = sizeof(float) * input_len;
+    const size_t target_size = sizeof(float) * target_len;
+    for (uint32_t i = 0; i < depth; i++) {
+        struct batchio_slot *s = &io->ring[i];
+        s->input  = read_input ? batchio_alloc(batch_len, input_size) : NULL;
+        s->target = read_target ? batchio_alloc(batch_len, target_size) : NULL;
+        s->batch  = (struct batch){.input  = s->input,
+                                   .target = s->target,
+                                   .output = batchio_alloc(batch_len,
+                                                           output_size)};
+        if (s->batch.output == NULL || (read_input && s->input == NULL) ||
+            (read_target && s->target == NULL)) {
+            batchio_free(io);
+            return NULL;
+        }
+    }
+    io->reader_running = read_input || read_target;
+    if ((io->reader_running &&
+         pthread_create(&io->reader, NULL, batchio_reader, io)) ||
+        pthread_create(&io->writer, NULL, batchio_writer, io)) {
+        errx(EXIT_FAILURE, "create the batch io threads");
+    }
+    return io;
+}
+
+struct batch *batchio_read(struct batchio *io) {
+    if (!io->reader_running) {
+        // the slot is free again after its output is written
+        if (io->next >= io->depth &&
+            atomic_load_explicit(&io->written, memory_order_acquire) <=
+                io->next - io->depth) {
+            struct timespec sw = stopwatch_start();
+            batchio_wait(&io->written, io->next - io->depth);
+            io->stall_us += stopwatch_stop_us(sw);
+        }
+        if (atomic_load_explicit(&io->read, memory_order_relaxed) <= io->next) {
+            batchio_fill(io, &io->ring[io->next % io->depth]);
+            atomic_store_explicit(&io->read, io->next + 1,
+                                  memory_order_relaxed);
+        }
+    } else if (atomic_load_explicit(&io->read, memory_order_acquire) <=
+               io->next) {
+        struct timespec sw = stopwatch_start();
+        batchio_wait(&io->read, io->next);
+        io->stall_us += stopwatch_stop_us(sw);
+    }
+    struct batch *b = &io->ring[io->next % io->depth].batch;
+    if (b->len == 0) {
+        // pass the end of the stream to the writer
+        atomic_store_explicit(&io->done, ++io->next, memory_order_release);
+        return NULL;
+    }
+    return b;
+}
+
+void batchio_write(struct batchio *io, struct batch *b) {
+    if (b != &io->ring[io->next % io->depth].batch) {
+        errx(EXIT_FAILURE, "write the batches in the order of reading");
+    }
+    atomic_store_explicit(&io->done, ++io->next, memory_order_release);
+}
+
+double batchio_stall_us(const struct batchio *io) { return io->stall_us; }
+
+void batchio_close(struct batchio *io) {
+    if (io->reader_running) pthread_join(io->reader, NULL);
+    pthread_join(io->writer, NULL);
+    batchio_free(io);
+}
@@ -0,0 +1,168 @@
+// The asynchronous batch input and output of gstnn: a reader thread fills
+// the batches of a ring of preallocated buffers, the compute thread predicts
+// (and trains) them in order and a writer thread writes their outputs. The
+// stages pass the batches by the atomic sequence counters of the ring, so the
+// reading of batch k + 1 and the writing of batch k - 1 overlap with the
+// computation of batch k.
+//
+// Regular input and target files are mapped into memory instead (see struct
+// dataset): the batches point into the mapping without a copy and the reader
+// thread is not needed. To train in a random order, the reader thread gathers
+// the records of the mapped files in the given order into the ring.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * ### BATCHIO_DEPTH - The default number of batch buffers of the ring.
+ */
+#define BATCHIO_DEPTH 4
+
+/**
+ * ### struct batch
+ *
+ * A batch of the ring.
+ *
+ *  - `len` The number of vectors of the batch (the last batch of a file may
+ *     be shorter).
+ *  - `input` The `len` input vectors (in the buffer of the ring or in the
+ *     mapped file).
+ *  - `target` The `len` target vectors or NULL without a target stream.
+ *  - `output` The `len` output records, written by the writer thread.
+ */
+struct batch {
+    uint32_t len;
+    const float *input;
+    const float *target;
+    void *output;
+};
+
+/**
+ * ### struct dataset
+ *
+ * A regular file of fixed length float records (vectors) mapped into memory.
+ *
+ *  - `data` The first record or NULL if the file is not mapped.
+ *  - `rec` The number of (complete) records.
+ *  - `len` The length of a record.
+ */
+struct dataset {
+    const float *data;
+    size_t rec;
+    uint32_t len;
+    void *map;
+    size_t map_len;
+};
+
+/**
+ * ### dataset_map()
+ *
+ * Map the records of the stream from its current position on. The mapping
+ * is advised for sequential access (and transparent huge pages if
+ * available).
+ *
+ * #### Parameters
+ *
+ *  - `stream` The stream of the records.
+ *  - `len` The length of a record.
+ *
+ *  Returns the dataset, its `data` is NULL if the stream is no (empty)
+ *  regular file or could not be mapped.
+ */
+struct dataset dataset_map(FILE *stream, uint32_t len);
+
+/**
+ * ### dataset_unmap()
+ *
+ * Release the mapping of the dataset.
+ */
+void dataset_unmap(struct dataset d);
+
+/**
+ * ### dataset_gather()
+ *
+ * Copy the records `rows[0]`, ..., `rows[len - 1]` of the dataset into
+ * consecutive vectors. The next record is prefetched while a record is
+ * copied.
+ *
+ * #### Parameters
+ *
+ *  - `d` The mapped dataset.
+ *  - `rows` The indices of the records.
+ *  - `len` The number of records.
+ *  - `dst` The `len` vectors of `d->len` elements.
+ */
+void dataset_gather(const struct dataset *d, const uint32_t *rows,
+                    uint32_t len, float *dst);
+
+struct batchio;
+
+/**
+ * ### batchio_open()
+ *
+ * Allocate the ring and start the reader and the writer thread. Regular
+ * files are mapped (see dataset_map()), the reader thread reads the other
+ * streams only.
+ *
+ * #### Parameters
+ *
+ *  - `input` The stream of the input vectors.
+ *  - `target` The stream of the target vectors or NULL.
+ *  - `output` The stream of the output vectors or NULL.
+ *  - `batch_len` The maximal number of vectors of a batch.
+ *  - `input_len` The length of an input vector.
+ *  - `target_len` The length of a target vector.
+ *  - `output_size` The size of an output record in bytes.
+ *  - `depth` The number of batch buffers of the ring (at least 2).
+ *  - `order` The order of the records (a permutation of the input records)
+ *     or NULL for the order of the streams. The input and target must be
+ *     mapped files: the reader thread gathers the records into the buffers
+ *     of the ring.
+ *
+ *  Returns the batch io or NULL if the memory could not be allocated (or the
+ *  files of an `order` could not be mapped).
+ */
+struct batchio *batchio_open(FILE *input, FILE *target, FILE *output,
+                             uint32_t batch_len, uint32_t input_len,
+                             uint32_t target_len, size_t output_size,
+                             uint32_t depth, const uint32_t *order);
+
+/**
+ * ### batchio_read()
+ *
+ * Return the next batch read by the reader thread. Waits (stalls) if the
+ * batch is not read yet or (with mapped files) if its output buffer is not
+ * written yet.
+ *
+ * Returns the batch or NULL at the end of the input stream.
+ */
+struct batch *batchio_read(struct batchio *io);
+
+/**
+ * ### batchio_write()
+ *
+ * Pass the batch with its output to the writer thread. The buffers of the
+ * batch must not be used after the call.
+ */
+void batchio_write(struct batchio *io, struct batch *b);
+
+/**
+ * ### batchio_stall_us()
+ *
+ * Returns the time the compute thread waited in batchio_read() in
+ * microseconds.
+ */
+double batchio_stall_us(const struct batchio *io);
+
+/**
+ * ### batchio_close()
+ *
+ * Wait for the writer thread to write the outputs of all passed batches,
+ * stop the threads and release the ring. All batches have to be read first
+ * (batchio_read() returned NULL).
+ */
+void batchio_close(struct batchio *io);
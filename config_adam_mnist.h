@@ -7,6 +7,8 @@
 #include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "kern.h"
 #include "stats.h"
@@ -18,9 +20,17 @@
 typedef float num_type;
 
 /**
- * `BATCH_LENGTH` - The number (batch) of input vectors read simultaneously
+ * `BATCH_LENGTH` - The default number (batch) of input vectors read
+ * simultaneously. `gstnn -b N` sets the `batch_length` at runtime, the
+ * activation and delta buffers of the layers are allocated for it.
+ *
+ * The batch length, the buffers and the gradients are thread local
+ * (`_Thread_local`): the training threads of `gstnn -j N` share the weights
+ * and the adam moments, but each thread computes its batches in its own
+ * buffers (see `layer_buffers_construct()`).
  */
 #define BATCH_LENGTH 1
+_Thread_local uint32_t batch_length = BATCH_LENGTH;
 
 /**
  * INPUT_LENGTH - The length of the input array.
@@ -38,7 +48,7 @@ typedef float num_type;
  * the model in response to the estimated error each time the model weights
  * are updated.
  */
-#define LEARN_RATE 0.001f
+#define LEARN_RATE 0.0005f
 #define BETA1 0.9f
 #define BETA2 0.999f
 #define EPSILON 1e-8f
@@ -48,34 +58,191 @@ typedef float num_type;
  */
 #define HIDDEN_LENGTH 280
 
+/**
+ * `WEIGHT_TYPE` - The storage type of the weight files: `WEIGHT_F32`, or
+ * `WEIGHT_F16` and `WEIGHT_BF16` with half the file size and memory traffic.
+ * The training updates a float master copy, which is rounded back to the
+ * file at the end. Remove the weight files after changing the type.
+ */
+#define WEIGHT_TYPE WEIGHT_F32
+
 #define HIDDEN_ACTIVATION relu
 #define HIDDEN_ACTIVATION_DERIVED Derived(relu)
 #define HIDDEN_WEIGHTS_FILENAME "data/weights_hidden.gstnn"
+#define HIDDEN_BIAS_FILENAME "data/bias_hidden.gstnn"
+#define HIDDEN_SPARSE_FILENAME "data/weights_hidden.sparse"
 num_type *hidden_weights;
+struct hmatrix hidden_h;
+num_type *hidden_bias;
 num_type *hidden_mom;
 num_type *hidden_veloc;
+_Thread_local num_type *hidden_grad;
+num_type hidden_bias_mom[HIDDEN_LENGTH];
+num_type hidden_bias_veloc[HIDDEN_LENGTH];
 float hidden_counter = 1;
-num_type hidden_output[HIDDEN_LENGTH * BATCH_LENGTH];
-num_type hidden_delta[HIDDEN_LENGTH * BATCH_LENGTH];
+_Thread_local num_type *hidden_output;
+_Thread_local num_type *hidden_delta;
 
+/**
+ * `OUTPUT_SOFTMAX` - The output layer predicts the class probabilities (the
+ * softmax of the logits) and is trained with the cross entropy loss, fused
+ * into one pass (see `softmax_xent()`). Set it to false to train the
+ * `OUTPUT_ACTIVATION` with the mean squared error.
+ */
+#define OUTPUT_SOFTMAX true
 #define OUTPUT_ACTIVATION sigmoid
 #define OUTPUT_ACTIVATION_DERIVED Derived(sigmoid)
+/* the output layer computes the logits with OUTPUT_SOFTMAX */
+#define OUTPUT_LAYER_ACTIVATION (OUTPUT_SOFTMAX ? NULL : OUTPUT_ACTIVATION)
 #define OUTPUT_WEIGHTS_FILENAME "data/weights_output.gstnn"
+#define OUTPUT_BIAS_FILENAME "data/bias_output.gstnn"
+#define OUTPUT_SPARSE_FILENAME "data/weights_output.sparse"
 num_type *output_weights;
+struct hmatrix output_h;
+num_type *output_bias;
 num_type *output_mom;
 num_type *output_veloc;
+_Thread_local num_type *output_grad;
+num_type output_bias_mom[OUTPUT_LENGTH];
+num_type output_bias_veloc[OUTPUT_LENGTH];
 float output_counter = 1;
-num_type output[OUTPUT_LENGTH * BATCH_LENGTH];
-num_type output_delta[OUTPUT_LENGTH * BATCH_LENGTH];
+_Thread_local num_type *output;
+_Thread_local num_type *output_logits;
+_Thread_local num_type *output_delta;
+
+/**
+ * `QUANTIZE_FROZEN` - Predict with int8 quantized weights if the net is
+ * frozen (`-f`). The weights are quantized per output channel at start.
+ */
+#define QUANTIZE_FROZEN false
+struct qmatrix hidden_q8;
+struct qmatrix output_q8;
+bool int8_inference = false;
+bool half_inference = false;
 
 /**
- * `layer_construct` - Construct the neural network layer.
+ * `SPARSE_WEIGHTS` - Train and predict with the block sparse weights. The
+ * sparse weight files are written by `gstnn -p RATIO`, which prunes the
+ * trained weights by magnitude. Training (`-t`) fine-tunes the stored blocks,
+ * the frozen net (`-f`) is compared with the dense (unpruned) weights.
  */
-static void layer_construct() {
-    if (NULL == (hidden_weights = weights_create_or_load(
-                     HIDDEN_WEIGHTS_FILENAME, INPUT_LENGTH, HIDDEN_LENGTH))) {
+#define SPARSE_WEIGHTS false
+struct smatrix hidden_sparse;
+struct smatrix output_sparse;
+bool sparse_inference = false;
+
+/**
+ * `FROZEN_MODES` - The frozen net (`-f`) predicts with one kind of weights:
+ * the sparse (`SPARSE_WEIGHTS`), the int8 (`QUANTIZE_FROZEN`) or the 16 bit
+ * weights (`WEIGHT_TYPE`). Combining them is rejected.
+ */
+#define FROZEN_MODES \
+    (SPARSE_WEIGHTS + QUANTIZE_FROZEN + (WEIGHT_TYPE != WEIGHT_F32))
+_Static_assert(FROZEN_MODES <= 1,
+               "SPARSE_WEIGHTS, QUANTIZE_FROZEN and a 16 bit WEIGHT_TYPE "
+               "are mutually exclusive");
+num_type *hidden_sparse_mom;
+num_type *hidden_sparse_veloc;
+_Thread_local num_type *hidden_sparse_grad;
+num_type *output_sparse_mom;
+num_type *output_sparse_veloc;
+_Thread_local num_type *output_sparse_grad;
+
+/*
+ * Load the m x n block sparse weights of the file if it exists (see
+ * `SPARSE_WEIGHTS`).
+ */
+static struct smatrix layer_sparse_load(const char *filename, uint32_t m,
+                                        uint32_t n) {
+    struct smatrix s = {0};
+    if (SPARSE_WEIGHTS && access(filename, F_OK) == 0) {
+        s = smatrix_load(filename, m, n);
+    }
+    return s;
+}
+
+/*
+ * Allocate the zero initialized adam state of the sparse weights `s`.
+ */
+static num_type *layer_sparse_alloc(struct smatrix s) {
+    num_type *v = calloc((size_t)s.nnzb * SPARSE_BLOCK + 1, sizeof(num_type));
+    if (NULL == v) {
+        err(EXIT_FAILURE, "allocate sparse adam memory");
+    }
+    return v;
+}
+
+/*
+ * Allocate the (aligned) buffer of `n` values per input vector of the batch.
+ */
+static num_type *layer_alloc(uint32_t n, const char *name) {
+    num_type *v = matrix_alloc(batch_length, n);
+    if (NULL == v) {
+        err(EXIT_FAILURE, "allocate %s memory", name);
+    }
+    return v;
+}
+
+/**
+ * `layer_buffers_construct` - Allocate the activation, delta and gradient
+ * buffers of the calling thread for batches of `batch_len` input vectors. A
+ * training thread allocates (and first touches) its own buffers, so they are
+ * placed in the memory of its NUMA node.
+ */
+static void layer_buffers_construct(uint32_t batch_len) {
+    batch_length  = batch_len;
+    hidden_output = layer_alloc(HIDDEN_LENGTH, "hidden output");
+    hidden_delta  = layer_alloc(HIDDEN_LENGTH, "hidden delta");
+    output        = layer_alloc(OUTPUT_LENGTH, "output");
+    output_logits = layer_alloc(OUTPUT_LENGTH, "output logits");
+    output_delta  = layer_alloc(OUTPUT_LENGTH, "output delta");
+    if (NULL == (hidden_grad = matrix_alloc(INPUT_LENGTH, HIDDEN_LENGTH))) {
+        err(EXIT_FAILURE, "allocate hidden gradient memory");
+    }
+    if (NULL == (output_grad = matrix_alloc(HIDDEN_LENGTH, OUTPUT_LENGTH))) {
+        err(EXIT_FAILURE, "allocate output gradient memory");
+    }
+    if (sparse_inference) {
+        hidden_sparse_grad = layer_sparse_alloc(hidden_sparse);
+        output_sparse_grad = layer_sparse_alloc(output_sparse);
+    }
+}
+
+/**
+ * `layer_buffers_destruct` - Release the buffers of the calling thread.
+ */
+static void layer_buffers_destruct(void) {
+    free(hidden_output);
+    free(hidden_delta);
+    free(output);
+    free(output_logits);
+    free(output_delta);
+    free(hidden_grad);
+    free(output_grad);
+    free(hidden_sparse_grad);
+    free(output_sparse_grad);
+}
+
+/**
+ * `layer_construct` - Construct the neural network layer for batches of
+ * `batch_len` input vectors.
+ */
+static void layer_construct(uint32_t batch_len) {
+    if (WEIGHT_TYPE != WEIGHT_F32) {
+        hidden_h = hmatrix_create_or_load(HIDDEN_WEIGHTS_FILENAME, WEIGHT_TYPE,
+                                          INPUT_LENGTH, HIDDEN_LENGTH);
+        hidden_weights = hidden_h.w != NULL ? hmatrix_to_f32(hidden_h) : NULL;
+    } else {
+        hidden_weights = weights_create_or_load(HIDDEN_WEIGHTS_FILENAME,
+                                                INPUT_LENGTH, HIDDEN_LENGTH);
+    }
+    if (NULL == hidden_weights) {
         err(EXIT_FAILURE, "allocate hidden weights memory");
     }
+    if (NULL == (hidden_bias = bias_create_or_load(HIDDEN_BIAS_FILENAME,
+                                                   HIDDEN_LENGTH))) {
+        err(EXIT_FAILURE, "allocate hidden bias memory");
+    }
     if (NULL == (hidden_mom = matrix_alloc(INPUT_LENGTH, HIDDEN_LENGTH))) {
         err(EXIT_FAILURE, "allocate hidden momentum weights memory");
     }
@@ -87,10 +254,21 @@ static void layer_construct() {
 
     hidden_counter = 1;
 
-    if (NULL == (output_weights = weights_create_or_load(
-                     OUTPUT_WEIGHTS_FILENAME, HIDDEN_LENGTH, OUTPUT_LENGTH))) {
+    if (WEIGHT_TYPE != WEIGHT_F32) {
+        output_h = hmatrix_create_or_load(OUTPUT_WEIGHTS_FILENAME, WEIGHT_TYPE,
+                                          HIDDEN_LENGTH, OUTPUT_LENGTH);
+        output_weights = output_h.w != NULL ? hmatrix_to_f32(output_h) : NULL;
+    } else {
+        output_weights = weights_create_or_load(OUTPUT_WEIGHTS_FILENAME,
+                                                HIDDEN_LENGTH, OUTPUT_LENGTH);
+    }
+    if (NULL == output_weights) {
         err(EXIT_FAILURE, "allocate output weights memory");
     }
+    if (NULL == (output_bias = bias_create_or_load(OUTPUT_BIAS_FILENAME,
+                                                   OUTPUT_LENGTH))) {
+        err(EXIT_FAILURE, "allocate output bias memory");
+    }
 
     if (NULL == (output_mom = matrix_alloc(HIDDEN_LENGTH, OUTPUT_LENGTH))) {
         err(EXIT_FAILURE, "allocate hidden momentum weights memory");
@@ -102,71 +280,233 @@ static void layer_construct() {
     matrix_init(HIDDEN_LENGTH, OUTPUT_LENGTH, output_veloc);
 
     output_counter = 1;
+
+    hidden_sparse = layer_sparse_load(HIDDEN_SPARSE_FILENAME, INPUT_LENGTH,
+                                      HIDDEN_LENGTH);
+    output_sparse = layer_sparse_load(OUTPUT_SPARSE_FILENAME, HIDDEN_LENGTH,
+                                      OUTPUT_LENGTH);
+    sparse_inference = hidden_sparse.val != NULL && output_sparse.val != NULL;
+    if (sparse_inference) {
+        hidden_sparse_mom   = layer_sparse_alloc(hidden_sparse);
+        hidden_sparse_veloc = layer_sparse_alloc(hidden_sparse);
+        output_sparse_mom   = layer_sparse_alloc(output_sparse);
+        output_sparse_veloc = layer_sparse_alloc(output_sparse);
+    }
+    layer_buffers_construct(batch_len);
+}
+
+/*
+ * Prune the m x n weight matrix `w` and replace the sparse weights `s`.
+ */
+static void layer_prune_weights(const char *name, const char *filename,
+                                uint32_t m, uint32_t n, const num_type *w,
+                                float ratio, struct smatrix *s) {
+    smatrix_free(*s);
+    *s = smatrix_prune(m, n, w, ratio);
+    if (s->val == NULL) {
+        err(EXIT_FAILURE, "allocate sparse %s weights memory", name);
+    }
+    fprintf(stderr, "%s: %.1f%% pruned (%u blocks stored) to '%s'\n", name,
+            100.0 * (1.0 - smatrix_density(*s)), s->nnzb, filename);
+}
+
+/**
+ * `layer_prune` - Prune `ratio` of the (dense) weights by magnitude. The
+ * block sparse weight files are written by `layer_destruct()`.
+ */
+static void layer_prune(float ratio) {
+    layer_prune_weights("hidden", HIDDEN_SPARSE_FILENAME, INPUT_LENGTH,
+                        HIDDEN_LENGTH, hidden_weights, ratio, &hidden_sparse);
+    layer_prune_weights("output", OUTPUT_SPARSE_FILENAME, HIDDEN_LENGTH,
+                        OUTPUT_LENGTH, output_weights, ratio, &output_sparse);
+}
+
+/*
+ * Switch the prediction to the sparse weights (see `SPARSE_WEIGHTS`).
+ */
+static bool layer_sparse(bool enable) {
+    sparse_inference = enable && hidden_sparse.val != NULL;
+    return hidden_sparse.val != NULL;
+}
+
+/*
+ * Switch the prediction to the int8 weights (see `QUANTIZE_FROZEN`), which
+ * are quantized at the first call.
+ */
+static bool layer_int8(bool enable) {
+    if (enable && hidden_q8.w == NULL) {
+        hidden_q8 =
+            qmatrix_quantize(INPUT_LENGTH, HIDDEN_LENGTH, hidden_weights);
+        output_q8 =
+            qmatrix_quantize(HIDDEN_LENGTH, OUTPUT_LENGTH, output_weights);
+        if (hidden_q8.w == NULL || output_q8.w == NULL) {
+            err(EXIT_FAILURE, "allocate quantized weights memory");
+        }
+    }
+    int8_inference = enable;
+    return true;
+}
+
+/*
+ * Switch the prediction to the 16 bit weights (see `WEIGHT_TYPE`).
+ */
+static bool layer_half(bool enable) {
+    half_inference = enable && WEIGHT_TYPE != WEIGHT_F32;
+    return WEIGHT_TYPE != WEIGHT_F32;
+}
+
+/**
+ * `layer_quantize` - Switch the prediction to the weights of the configured
+ * mode (see `FROZEN_MODES`) or back to the float weights.
+ *
+ * Returns false if the net has no other weights than the float weights.
+ */
+static bool layer_quantize(bool enable) {
+    if (SPARSE_WEIGHTS) return layer_sparse(enable);
+    if (QUANTIZE_FROZEN) return layer_int8(enable);
+    return layer_half(enable);
 }
 
 /**
  * `layer_destruct` - Destruct the created neural network.
  */
 static void layer_destruct() {
-    if (HIDDEN_WEIGHTS_FILENAME != NULL) {
+    layer_buffers_destruct();
+    qmatrix_free(hidden_q8);
+    qmatrix_free(output_q8);
+    if (hidden_sparse.val != NULL &&
+        !smatrix_save(HIDDEN_SPARSE_FILENAME, hidden_sparse)) {
+        err(EXIT_FAILURE, "write sparse file '%s'", HIDDEN_SPARSE_FILENAME);
+    }
+    if (output_sparse.val != NULL &&
+        !smatrix_save(OUTPUT_SPARSE_FILENAME, output_sparse)) {
+        err(EXIT_FAILURE, "write sparse file '%s'", OUTPUT_SPARSE_FILENAME);
+    }
+    smatrix_free(hidden_sparse);
+    smatrix_free(output_sparse);
+    free(hidden_sparse_mom);
+    free(hidden_sparse_veloc);
+    free(output_sparse_mom);
+    free(output_sparse_veloc);
+    if (WEIGHT_TYPE != WEIGHT_F32) {
+        hmatrix_store(hidden_h, hidden_weights);
+        hmatrix_free(hidden_h);
+        free(hidden_weights);
+    } else if (HIDDEN_WEIGHTS_FILENAME != NULL) {
         munmap(hidden_weights, INPUT_LENGTH * HIDDEN_LENGTH);
     } else {
         free(hidden_weights);
     }
+    if (HIDDEN_BIAS_FILENAME != NULL) {
+        munmap(hidden_bias, HIDDEN_LENGTH);
+    } else {
+        free(hidden_bias);
+    }
     free(hidden_mom);
     free(hidden_veloc);
-    if (OUTPUT_WEIGHTS_FILENAME != NULL) {
+    if (WEIGHT_TYPE != WEIGHT_F32) {
+        hmatrix_store(output_h, output_weights);
+        hmatrix_free(output_h);
+        free(output_weights);
+    } else if (OUTPUT_WEIGHTS_FILENAME != NULL) {
         munmap(output_weights, HIDDEN_LENGTH * OUTPUT_LENGTH);
     } else {
         free(output_weights);
     }
+    if (OUTPUT_BIAS_FILENAME != NULL) {
+        munmap(output_bias, OUTPUT_LENGTH);
+    } else {
+        free(output_bias);
+    }
     free(output_mom);
     free(output_veloc);
 }
 
+/*
+ * Calculate the output of the layers (the logits with `OUTPUT_SOFTMAX`).
+ *
+ * The bias and the activation of each layer are fused into the
+ * matrix multiplication (see `trans_act()`, `trans_act_q8()`,
+ * `trans_act_h()` and `trans_act_sparse()`).
+ */
+static void predict_layers(const num_type input[INPUT_LENGTH]) {
+    if (sparse_inference) {
+        trans_act_sparse(batch_length, hidden_sparse, hidden_bias, input,
+                         HIDDEN_ACTIVATION, hidden_output);
+        trans_act_sparse(batch_length, output_sparse, output_bias,
+                         hidden_output, OUTPUT_LAYER_ACTIVATION, output);
+        return;
+    }
+    if (int8_inference) {
+        trans_act_q8(batch_length, hidden_q8, hidden_bias, input,
+                     HIDDEN_ACTIVATION, hidden_output);
+        trans_act_q8(batch_length, output_q8, output_bias, hidden_output,
+                     OUTPUT_LAYER_ACTIVATION, output);
+        return;
+    }
+    if (half_inference) {
+        trans_act_h(batch_length, hidden_h, hidden_bias, input,
+                    HIDDEN_ACTIVATION, hidden_output);
+        trans_act_h(batch_length, output_h, output_bias, hidden_output,
+                    OUTPUT_LAYER_ACTIVATION, output);
+        return;
+    }
+    trans_act(batch_length, INPUT_LENGTH, HIDDEN_LENGTH, hidden_weights,
+              hidden_bias, input, HIDDEN_ACTIVATION, hidden_output);
+    trans_act(batch_length, HIDDEN_LENGTH, OUTPUT_LENGTH, output_weights,
+              output_bias, hidden_output, OUTPUT_LAYER_ACTIVATION, output);
+}
+
 /**
  * `predict` - Predict the output based on the given input.
  *
+ * With `OUTPUT_SOFTMAX` the logits are kept for the loss and the output is
+ * the softmax of the logits.
+ *
  * - `input`: The input vector
  */
 static void predict(const num_type input[INPUT_LENGTH]) {
-    trans(BATCH_LENGTH, INPUT_LENGTH, HIDDEN_LENGTH, hidden_weights, input,
-          hidden_output);
-    HIDDEN_ACTIVATION(BATCH_LENGTH * HIDDEN_LENGTH, hidden_output);
-    trans(BATCH_LENGTH, HIDDEN_LENGTH, OUTPUT_LENGTH, output_weights,
-          hidden_output, output);
-    OUTPUT_ACTIVATION(BATCH_LENGTH * OUTPUT_LENGTH, output);
+    predict_layers(input);
+    if (OUTPUT_SOFTMAX) {
+        memcpy(output_logits, output,
+               sizeof(num_type) * OUTPUT_LENGTH * batch_length);
+        for (uint32_t k = 0; k < batch_length; k++) {
+            softmax(OUTPUT_LENGTH, &output_logits[k * OUTPUT_LENGTH],
+                    &output[k * OUTPUT_LENGTH]);
+        }
+    }
 }
 
 /**
  * `prediction_error` - Calculates the error between the output and the expected (target) array.
  *
  * - `target`: The target vector
- * Returns the The calculated error value
+ * Returns the The calculated error value: the cross entropy with
+ * `OUTPUT_SOFTMAX`, otherwise the mean squared error.
  */
 static double prediction_error(const num_type *target) {
-    return vec_delta(OUTPUT_LENGTH * BATCH_LENGTH, output, target,
+    if (OUTPUT_SOFTMAX) {
+        return softmax_xent(batch_length, OUTPUT_LENGTH, output_logits, target,
+                            output_delta);
+    }
+    return vec_delta(OUTPUT_LENGTH * batch_length, output, target,
                      output_delta);
 }
 
 /*
- * Change this procedure to adapt the monitoring (logging) output on stdout.
+ * Change this procedure to adapt the monitoring: returns the number of hits
+ * (the predicted class is the target class) of the batch. The hits are
+ * accumulated and reported by the report module (see report.h).
  */
-static uint64_t monitor(uint32_t target_len, const num_type *target, struct stats error, struct stats duration,
-                        uint64_t total, uint64_t hits) {
+static uint32_t monitor(uint32_t target_len, const num_type *target) {
     float max_value;
-    (void)error;
-    (void)duration;
-    (void)total;
-    for (uint32_t i = 0; i < BATCH_LENGTH; i++) {
+    uint32_t hits = 0;
+    for (uint32_t i = 0; i < batch_length; i++) {
         size_t max_pos =
             argmax(OUTPUT_LENGTH, &output[i * OUTPUT_LENGTH], &max_value);
         size_t target_pos =
             argmax(target_len, &target[i * target_len], &max_value);
-        if (target_pos == max_pos) {
-            ++hits;
-        }
-        fprintf(stderr, ", %zu, %zu", target_pos, max_pos);
+        hits += target_pos == max_pos;
     }
     return hits;
 }
@@ -176,20 +516,48 @@ static uint64_t monitor(uint32_t target_len, const num_type *target, struct stat
  *
  * - `input`: The input vector
  */
-static void train(const num_type input[INPUT_LENGTH * BATCH_LENGTH]) {
-    loss(BATCH_LENGTH, HIDDEN_LENGTH, OUTPUT_LENGTH, output_weights,
-         output_delta, hidden_delta);
+static void train(const num_type input[INPUT_LENGTH * batch_length]) {
+    if (sparse_inference) {
+        loss_sparse(batch_length, output_sparse, output_delta, hidden_delta);
+    } else {
+        loss(batch_length, HIDDEN_LENGTH, OUTPUT_LENGTH, output_weights,
+             output_delta, hidden_delta);
+    }
 
-    HIDDEN_ACTIVATION_DERIVED(BATCH_LENGTH * HIDDEN_LENGTH, hidden_output,
+    HIDDEN_ACTIVATION_DERIVED(batch_length * HIDDEN_LENGTH, hidden_output,
                               hidden_delta);
-    hidden_counter =
-        train_adam(BATCH_LENGTH, INPUT_LENGTH, HIDDEN_LENGTH, input,
-                   hidden_delta, hidden_counter, LEARN_RATE, BETA1, BETA2,
-                   EPSILON, hidden_weights, hidden_mom, hidden_veloc);
-    OUTPUT_ACTIVATION_DERIVED(BATCH_LENGTH * OUTPUT_LENGTH, output,
-                              output_delta);
-    output_counter =
-        train_adam(BATCH_LENGTH, HIDDEN_LENGTH, OUTPUT_LENGTH, hidden_output,
-                   output_delta, output_counter, LEARN_RATE, BETA1, BETA2,
-                   EPSILON, output_weights, output_mom, output_veloc);
+    train_adam_bias(batch_length, HIDDEN_LENGTH, hidden_delta, hidden_counter,
+                    LEARN_RATE, BETA1, BETA2, EPSILON, hidden_bias,
+                    hidden_bias_mom, hidden_bias_veloc, hidden_grad);
+    if (sparse_inference) {
+        hidden_counter = train_adam_sparse(
+            batch_length, hidden_sparse, input, hidden_delta, hidden_counter,
+            LEARN_RATE, BETA1, BETA2, EPSILON, hidden_sparse_mom,
+            hidden_sparse_veloc, hidden_sparse_grad);
+    } else {
+        hidden_counter =
+            train_adam(batch_length, INPUT_LENGTH, HIDDEN_LENGTH, input,
+                       hidden_delta, hidden_counter, LEARN_RATE, BETA1, BETA2,
+                       EPSILON, hidden_weights, hidden_mom, hidden_veloc,
+                       hidden_grad);
+    }
+    if (!OUTPUT_SOFTMAX) {
+        OUTPUT_ACTIVATION_DERIVED(batch_length * OUTPUT_LENGTH, output,
+                                  output_delta);
+    }
+    train_adam_bias(batch_length, OUTPUT_LENGTH, output_delta, output_counter,
+                    LEARN_RATE, BETA1, BETA2, EPSILON, output_bias,
+                    output_bias_mom, output_bias_veloc, output_grad);
+    if (sparse_inference) {
+        output_counter = train_adam_sparse(
+            batch_length, output_sparse, hidden_output, output_delta,
+            output_counter, LEARN_RATE, BETA1, BETA2, EPSILON,
+            output_sparse_mom, output_sparse_veloc, output_sparse_grad);
+    } else {
+        output_counter =
+            train_adam(batch_length, HIDDEN_LENGTH, OUTPUT_LENGTH,
+                       hidden_output, output_delta, output_counter, LEARN_RATE,
+                       BETA1, BETA2, EPSILON, output_weights, output_mom,
+                       output_veloc, output_grad);
+    }
 }
@@ -0,0 +1,280 @@
+// A convolutional MNIST net: a 5 x 5 convolution with 8 filters, a 2 x 2 max
+// pooling and the output layer. It needs about a third of the multiplications
+// of the dense net of config_mnist.h.
+//
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kern.h"
+#include "stats.h"
+
+/**
+ * num_type - The type of the neural network cell (weights, input, output, etc.)
+ * Don't change this type!
+ */
+typedef float num_type;
+
+/**
+ * `BATCH_LENGTH` - The default number (batch) of input vectors read
+ * simultaneously. `gstnn -b N` sets the `batch_length` at runtime, the
+ * activation and delta buffers of the layers are allocated for it.
+ *
+ * The batch length and the buffers are thread local (`_Thread_local`): the
+ * training threads of `gstnn -j N` share the weights, but each thread
+ * computes its batches in its own buffers (see `layer_buffers_construct()`).
+ */
+#define BATCH_LENGTH 1
+_Thread_local uint32_t batch_length = BATCH_LENGTH;
+
+/**
+ * INPUT_LENGTH - The length of the input array (a 28 x 28 image).
+ */
+#define INPUT_SIZE 28
+#define INPUT_LENGTH (INPUT_SIZE * INPUT_SIZE)
+
+/**
+ * OUTPUT_LENGTH - The length of the output array.
+ */
+#define OUTPUT_LENGTH 10
+
+/**
+ * The sgd learn rate
+ * The learning rate is a hyperparameter that controls how much to change
+ * the model in response to the estimated error each time the model weights
+ * are updated. The rate is divided by the batch length (the sgd update is the
+ * sum of the sample gradients).
+ */
+#define LEARN_RATE 0.01f
+
+/**
+ * The convolution layer: `CONV_FILTERS` filters of `CONV_KERNEL` x
+ * `CONV_KERNEL` pixels. The image is padded to keep its size.
+ */
+#define CONV_FILTERS 8
+#define CONV_KERNEL 5
+#define CONV_PATCH (CONV_KERNEL * CONV_KERNEL)
+#define CONV_PIXELS (INPUT_SIZE * INPUT_SIZE)
+#define CONV_LENGTH (CONV_PIXELS * CONV_FILTERS)
+#define CONV_ACTIVATION relu
+#define CONV_ACTIVATION_DERIVED Derived(relu)
+#define CONV_WEIGHTS_FILENAME "data/weights_conv.gstnn"
+#define CONV_BIAS_FILENAME "data/bias_conv.gstnn"
+static const struct conv2d conv_shape = {.c      = 1,
+                                         .h      = INPUT_SIZE,
+                                         .w      = INPUT_SIZE,
+                                         .k      = CONV_KERNEL,
+                                         .stride = 1,
+                                         .pad    = CONV_KERNEL / 2,
+                                         .f      = CONV_FILTERS};
+num_type *conv_weights;
+num_type *conv_bias;
+_Thread_local num_type *conv_col;
+_Thread_local num_type *conv_output;
+_Thread_local num_type *conv_delta;
+
+/**
+ * The 2 x 2 max pooling layer
+ */
+#define POOL_SIZE (INPUT_SIZE / 2)
+#define POOL_LENGTH (POOL_SIZE * POOL_SIZE * CONV_FILTERS)
+static const struct pool2d pool_shape = {.c      = CONV_FILTERS,
+                                         .h      = INPUT_SIZE,
+                                         .w      = INPUT_SIZE,
+                                         .k      = 2,
+                                         .stride = 2};
+_Thread_local num_type *pool_output;
+_Thread_local num_type *pool_delta;
+_Thread_local uint32_t *pool_index;
+
+/**
+ * The output layer predicts the class probabilities (the softmax of the
+ * logits) and is trained with the cross entropy loss (see `softmax_xent()`).
+ */
+#define OUTPUT_WEIGHTS_FILENAME "data/weights_conv_output.gstnn"
+#define OUTPUT_BIAS_FILENAME "data/bias_conv_output.gstnn"
+num_type *output_weights;
+num_type *output_bias;
+_Thread_local num_type *output;
+_Thread_local num_type *output_logits;
+_Thread_local num_type *output_delta;
+
+/*
+ * Allocate the (aligned) buffer of `n` values per input vector of the batch.
+ */
+static num_type *layer_alloc(uint32_t n, const char *name) {
+    num_type *v = matrix_alloc(batch_length, n);
+    if (NULL == v) {
+        err(EXIT_FAILURE, "allocate %s memory", name);
+    }
+    return v;
+}
+
+/**
+ * `layer_buffers_construct` - Allocate the activation and delta buffers of
+ * the calling thread for batches of `batch_len` input vectors. A training
+ * thread allocates (and first touches) its own buffers, so they are placed in
+ * the memory of its NUMA node.
+ */
+static void layer_buffers_construct(uint32_t batch_len) {
+    batch_length  = batch_len;
+    conv_col      = layer_alloc(CONV_PIXELS * CONV_PATCH, "convolution patch");
+    conv_output   = layer_alloc(CONV_LENGTH, "convolution output");
+    conv_delta    = layer_alloc(CONV_LENGTH, "convolution delta");
+    pool_output   = layer_alloc(POOL_LENGTH, "pooling output");
+    pool_delta    = layer_alloc(POOL_LENGTH, "pooling delta");
+    output        = layer_alloc(OUTPUT_LENGTH, "output");
+    output_logits = layer_alloc(OUTPUT_LENGTH, "output logits");
+    output_delta  = layer_alloc(OUTPUT_LENGTH, "output delta");
+    pool_index = reallocarray(NULL, batch_len * POOL_LENGTH, sizeof(uint32_t));
+    if (NULL == pool_index) {
+        err(EXIT_FAILURE, "allocate pooling index memory");
+    }
+}
+
+/**
+ * `layer_buffers_destruct` - Release the buffers of the calling thread.
+ */
+static void layer_buffers_destruct(void) {
+    free(conv_col);
+    free(conv_output);
+    free(conv_delta);
+    free(pool_output);
+    free(pool_delta);
+    free(pool_index);
+    free(output);
+    free(output_logits);
+    free(output_delta);
+}
+
+/**
+ * `layer_construct` - Construct the neural network layer for batches of
+ * `batch_len` input vectors.
+ */
+static void layer_construct(uint32_t batch_len) {
+    layer_buffers_construct(batch_len);
+    if (NULL == (conv_weights = weights_create_or_load(
+                     CONV_WEIGHTS_FILENAME, CONV_PATCH, CONV_FILTERS))) {
+        err(EXIT_FAILURE, "allocate convolution weights memory");
+    }
+    if (NULL ==
+        (conv_bias = bias_create_or_load(CONV_BIAS_FILENAME, CONV_FILTERS))) {
+        err(EXIT_FAILURE, "allocate convolution bias memory");
+    }
+    if (NULL == (output_weights = weights_create_or_load(
+                     OUTPUT_WEIGHTS_FILENAME, POOL_LENGTH, OUTPUT_LENGTH))) {
+        err(EXIT_FAILURE, "allocate output weights memory");
+    }
+    if (NULL == (output_bias = bias_create_or_load(OUTPUT_BIAS_FILENAME,
+                                                   OUTPUT_LENGTH))) {
+        err(EXIT_FAILURE, "allocate output bias memory");
+    }
+}
+
+/**
+ * `layer_prune` - The convolution net has no sparse weights.
+ */
+static void layer_prune(float ratio) {
+    (void)ratio;
+    errx(EXIT_FAILURE, "the convolution net has no sparse weights");
+}
+
+/**
+ * `layer_quantize` - The convolution net predicts with the float weights.
+ *
+ * Returns false, the net has no other weights than the float weights.
+ */
+static bool layer_quantize(bool enable) {
+    (void)enable;
+    return false;
+}
+
+/**
+ * `layer_destruct` - Destruct the created neural network.
+ */
+static void layer_destruct() {
+    layer_buffers_destruct();
+    munmap(conv_weights, CONV_PATCH * CONV_FILTERS);
+    munmap(conv_bias, CONV_FILTERS);
+    munmap(output_weights, POOL_LENGTH * OUTPUT_LENGTH);
+    munmap(output_bias, OUTPUT_LENGTH);
+}
+
+/**
+ * `predict` - Predict the output based on the given input.
+ *
+ * The logits are kept for the loss and the output is the softmax of the
+ * logits.
+ *
+ * - `input`: The input vector
+ */
+static void predict(const num_type input[INPUT_LENGTH]) {
+    conv2d(batch_length, conv_shape, conv_weights, conv_bias, input,
+           CONV_ACTIVATION, conv_col, conv_output);
+    maxpool(batch_length, pool_shape, conv_output, pool_output, pool_index);
+    trans_act(batch_length, POOL_LENGTH, OUTPUT_LENGTH, output_weights,
+              output_bias, pool_output, NULL, output_logits);
+    for (uint32_t k = 0; k < batch_length; k++) {
+        softmax(OUTPUT_LENGTH, &output_logits[k * OUTPUT_LENGTH],
+                &output[k * OUTPUT_LENGTH]);
+    }
+}
+
+/**
+ * `prediction_error` - Calculates the error between the output and the expected (target) array.
+ *
+ * - `target`: The target vector
+ * Returns the The calculated error value (the cross entropy).
+ */
+static double prediction_error(const num_type *target) {
+    return softmax_xent(batch_length, OUTPUT_LENGTH, output_logits, target,
+                        output_delta);
+}
+
+/*
+ * Change this procedure to adapt the monitoring: returns the number of hits
+ * (the predicted class is the target class) of the batch. The hits are
+ * accumulated and reported by the report module (see report.h).
+ */
+static uint32_t monitor(uint32_t target_len, const num_type *target) {
+    float max_value;
+    uint32_t hits = 0;
+    for (uint32_t i = 0; i < batch_length; i++) {
+        size_t max_pos =
+            argmax(OUTPUT_LENGTH, &output[i * OUTPUT_LENGTH], &max_value);
+        size_t target_pos =
+            argmax(target_len, &target[i * target_len], &max_value);
+        hits += target_pos == max_pos;
+    }
+    return hits;
+}
+
+/**
+ * `train` - Train the weight matrix based on the target vector
+ *
+ * The filters are trained with the packed image patches of the prediction
+ * (see `conv2d()`). The input delta of the convolution is not needed.
+ *
+ * - `input`: The input vector
+ */
+static void train(const num_type input[INPUT_LENGTH * batch_length]) {
+    const float rate = LEARN_RATE / batch_length;
+    (void)input;
+    loss(batch_length, POOL_LENGTH, OUTPUT_LENGTH, output_weights,
+         output_delta, pool_delta);
+    train_sgd(batch_length, POOL_LENGTH, OUTPUT_LENGTH, pool_output,
+              output_delta, rate, output_weights);
+    train_sgd_bias(batch_length, OUTPUT_LENGTH, output_delta, rate,
+                   output_bias);
+
+    maxpool_loss(batch_length, pool_shape, pool_delta, pool_index, conv_delta);
+    CONV_ACTIVATION_DERIVED(batch_length * CONV_LENGTH, conv_output,
+                            conv_delta);
+    conv2d_train_sgd(batch_length, conv_shape, conv_col, conv_delta,
+                     rate, conv_weights, conv_bias);
+}
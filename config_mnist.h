@@ -7,6 +7,8 @@
 #include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "kern.h"
 #include "stats.h"
@@ -18,9 +20,16 @@
 typedef float num_type;
 
 /**
- * `BATCH_LENGTH` - The number (batch) of input vectors read simultaneously
+ * `BATCH_LENGTH` - The default number (batch) of input vectors read
+ * simultaneously. `gstnn -b N` sets the `batch_length` at runtime, the
+ * activation and delta buffers of the layers are allocated for it.
+ *
+ * The batch length and the buffers are thread local (`_Thread_local`): the
+ * training threads of `gstnn -j N` share the weights, but each thread
+ * computes its batches in its own buffers (see `layer_buffers_construct()`).
  */
 #define BATCH_LENGTH 1
+_Thread_local uint32_t batch_length = BATCH_LENGTH;
 
 /**
  * INPUT_LENGTH - The length of the input array.
@@ -36,103 +45,416 @@ typedef float num_type;
  * The sgd learn rate
  * The learning rate is a hyperparameter that controls how much to change
  * the model in response to the estimated error each time the model weights
- * are updated.
+ * are updated. The rate is divided by the batch length (the sgd update is the
+ * sum of the sample gradients).
  */
-#define LEARN_RATE 0.05f
+#define LEARN_RATE 0.01f
 
 /**
  * The length of the hidden layer
  */
 #define HIDDEN_LENGTH 280
 
+/**
+ * `WEIGHT_TYPE` - The storage type of the weight files: `WEIGHT_F32`, or
+ * `WEIGHT_F16` and `WEIGHT_BF16` with half the file size and memory traffic.
+ * The training updates a float master copy, which is rounded back to the
+ * file at the end. Remove the weight files after changing the type.
+ */
+#define WEIGHT_TYPE WEIGHT_F32
+
 #define HIDDEN_ACTIVATION relu
 #define HIDDEN_ACTIVATION_DERIVED Derived(relu)
 #define HIDDEN_WEIGHTS_FILENAME "data/weights_hidden.gstnn"
+#define HIDDEN_BIAS_FILENAME "data/bias_hidden.gstnn"
+#define HIDDEN_SPARSE_FILENAME "data/weights_hidden.sparse"
 num_type *hidden_weights;
-num_type hidden_output[HIDDEN_LENGTH * BATCH_LENGTH];
-num_type hidden_delta[HIDDEN_LENGTH * BATCH_LENGTH];
+struct hmatrix hidden_h;
+num_type *hidden_bias;
+_Thread_local num_type *hidden_output;
+_Thread_local num_type *hidden_delta;
 
+/**
+ * `OUTPUT_SOFTMAX` - The output layer predicts the class probabilities (the
+ * softmax of the logits) and is trained with the cross entropy loss, fused
+ * into one pass (see `softmax_xent()`). Set it to false to train the
+ * `OUTPUT_ACTIVATION` with the mean squared error.
+ */
+#define OUTPUT_SOFTMAX true
 #define OUTPUT_ACTIVATION sigmoid
 #define OUTPUT_ACTIVATION_DERIVED Derived(sigmoid)
+/* the output layer computes the logits with OUTPUT_SOFTMAX */
+#define OUTPUT_LAYER_ACTIVATION (OUTPUT_SOFTMAX ? NULL : OUTPUT_ACTIVATION)
 #define OUTPUT_WEIGHTS_FILENAME "data/weights_output.gstnn"
+#define OUTPUT_BIAS_FILENAME "data/bias_output.gstnn"
+#define OUTPUT_SPARSE_FILENAME "data/weights_output.sparse"
 num_type *output_weights;
-num_type output[OUTPUT_LENGTH * BATCH_LENGTH];
-num_type output_delta[OUTPUT_LENGTH * BATCH_LENGTH];
+struct hmatrix output_h;
+num_type *output_bias;
+_Thread_local num_type *output;
+_Thread_local num_type *output_logits;
+_Thread_local num_type *output_delta;
+
+/**
+ * `QUANTIZE_FROZEN` - Predict with int8 quantized weights if the net is
+ * frozen (`-f`). The weights are quantized per output channel at start.
+ */
+#define QUANTIZE_FROZEN false
+struct qmatrix hidden_q8;
+struct qmatrix output_q8;
+bool int8_inference = false;
+bool half_inference = false;
 
 /**
- * `layer_construct` - Construct the neural network layer.
+ * `SPARSE_WEIGHTS` - Train and predict with the block sparse weights. The
+ * sparse weight files are written by `gstnn -p RATIO`, which prunes the
+ * trained weights by magnitude. Training (`-t`) fine-tunes the stored blocks,
+ * the frozen net (`-f`) is compared with the dense (unpruned) weights.
+ */
+#define SPARSE_WEIGHTS false
+struct smatrix hidden_sparse;
+struct smatrix output_sparse;
+bool sparse_inference = false;
+
+/**
+ * `FROZEN_MODES` - The frozen net (`-f`) predicts with one kind of weights:
+ * the sparse (`SPARSE_WEIGHTS`), the int8 (`QUANTIZE_FROZEN`) or the 16 bit
+ * weights (`WEIGHT_TYPE`). Combining them is rejected.
+ */
+#define FROZEN_MODES \
+    (SPARSE_WEIGHTS + QUANTIZE_FROZEN + (WEIGHT_TYPE != WEIGHT_F32))
+_Static_assert(FROZEN_MODES <= 1,
+               "SPARSE_WEIGHTS, QUANTIZE_FROZEN and a 16 bit WEIGHT_TYPE "
+               "are mutually exclusive");
+
+/**
+ * `SPARSE_INPUT_DENSITY` - Predict and train the hidden layer with the
+ * nonzero inputs only if the density (the ratio of the nonzero elements) of
+ * the input batch is below this value (see `trans_act_svector()`). The mnist
+ * images have a density of about 19%. Set it to 0 to disable the sparse input.
+ */
+#define SPARSE_INPUT_DENSITY 0.25f
+_Thread_local struct svector input_sparse;
+_Thread_local bool sparse_input = false;
+
+/*
+ * Load the m x n block sparse weights of the file if it exists (see
+ * `SPARSE_WEIGHTS`).
  */
-static void layer_construct() {
-    if (NULL == (hidden_weights = weights_create_or_load(
-                     HIDDEN_WEIGHTS_FILENAME, INPUT_LENGTH, HIDDEN_LENGTH))) {
+static struct smatrix layer_sparse_load(const char *filename, uint32_t m,
+                                        uint32_t n) {
+    struct smatrix s = {0};
+    if (SPARSE_WEIGHTS && access(filename, F_OK) == 0) {
+        s = smatrix_load(filename, m, n);
+    }
+    return s;
+}
+
+/*
+ * Allocate the (aligned) buffer of `n` values per input vector of the batch.
+ */
+static num_type *layer_alloc(uint32_t n, const char *name) {
+    num_type *v = matrix_alloc(batch_length, n);
+    if (NULL == v) {
+        err(EXIT_FAILURE, "allocate %s memory", name);
+    }
+    return v;
+}
+
+/**
+ * `layer_buffers_construct` - Allocate the activation and delta buffers of
+ * the calling thread for batches of `batch_len` input vectors. A training
+ * thread allocates (and first touches) its own buffers, so they are placed in
+ * the memory of its NUMA node.
+ */
+static void layer_buffers_construct(uint32_t batch_len) {
+    batch_length  = batch_len;
+    hidden_output = layer_alloc(HIDDEN_LENGTH, "hidden output");
+    hidden_delta  = layer_alloc(HIDDEN_LENGTH, "hidden delta");
+    output        = layer_alloc(OUTPUT_LENGTH, "output");
+    output_logits = layer_alloc(OUTPUT_LENGTH, "output logits");
+    output_delta  = layer_alloc(OUTPUT_LENGTH, "output delta");
+    input_sparse.m   = INPUT_LENGTH;
+    input_sparse.ptr = reallocarray(NULL, batch_len + 1, sizeof(uint32_t));
+    input_sparse.idx = reallocarray(NULL, batch_len * INPUT_LENGTH,
+                                    sizeof(uint32_t));
+    input_sparse.val = layer_alloc(INPUT_LENGTH, "sparse input");
+    if (NULL == input_sparse.ptr || NULL == input_sparse.idx) {
+        err(EXIT_FAILURE, "allocate sparse input memory");
+    }
+}
+
+/**
+ * `layer_buffers_destruct` - Release the buffers of the calling thread.
+ */
+static void layer_buffers_destruct(void) {
+    free(hidden_output);
+    free(hidden_delta);
+    free(output);
+    free(output_logits);
+    free(output_delta);
+    free(input_sparse.ptr);
+    free(input_sparse.idx);
+    free(input_sparse.val);
+}
+
+/**
+ * `layer_construct` - Construct the neural network layer for batches of
+ * `batch_len` input vectors.
+ */
+static void layer_construct(uint32_t batch_len) {
+    layer_buffers_construct(batch_len);
+    if (WEIGHT_TYPE != WEIGHT_F32) {
+        hidden_h = hmatrix_create_or_load(HIDDEN_WEIGHTS_FILENAME, WEIGHT_TYPE,
+                                          INPUT_LENGTH, HIDDEN_LENGTH);
+        hidden_weights = hidden_h.w != NULL ? hmatrix_to_f32(hidden_h) : NULL;
+    } else {
+        hidden_weights = weights_create_or_load(HIDDEN_WEIGHTS_FILENAME,
+                                                INPUT_LENGTH, HIDDEN_LENGTH);
+    }
+    if (NULL == hidden_weights) {
         err(EXIT_FAILURE, "allocate hidden weights memory");
     }
-    if (NULL == (output_weights = weights_create_or_load(
-                     OUTPUT_WEIGHTS_FILENAME, HIDDEN_LENGTH, OUTPUT_LENGTH))) {
+    if (NULL == (hidden_bias = bias_create_or_load(HIDDEN_BIAS_FILENAME,
+                                                   HIDDEN_LENGTH))) {
+        err(EXIT_FAILURE, "allocate hidden bias memory");
+    }
+    if (WEIGHT_TYPE != WEIGHT_F32) {
+        output_h = hmatrix_create_or_load(OUTPUT_WEIGHTS_FILENAME, WEIGHT_TYPE,
+                                          HIDDEN_LENGTH, OUTPUT_LENGTH);
+        output_weights = output_h.w != NULL ? hmatrix_to_f32(output_h) : NULL;
+    } else {
+        output_weights = weights_create_or_load(OUTPUT_WEIGHTS_FILENAME,
+                                                HIDDEN_LENGTH, OUTPUT_LENGTH);
+    }
+    if (NULL == output_weights) {
         err(EXIT_FAILURE, "allocate output weights memory");
     }
+    if (NULL == (output_bias = bias_create_or_load(OUTPUT_BIAS_FILENAME,
+                                                   OUTPUT_LENGTH))) {
+        err(EXIT_FAILURE, "allocate output bias memory");
+    }
+    hidden_sparse = layer_sparse_load(HIDDEN_SPARSE_FILENAME, INPUT_LENGTH,
+                                      HIDDEN_LENGTH);
+    output_sparse = layer_sparse_load(OUTPUT_SPARSE_FILENAME, HIDDEN_LENGTH,
+                                      OUTPUT_LENGTH);
+    sparse_inference = hidden_sparse.val != NULL && output_sparse.val != NULL;
+}
+
+/*
+ * Prune the m x n weight matrix `w` and replace the sparse weights `s`.
+ */
+static void layer_prune_weights(const char *name, const char *filename,
+                                uint32_t m, uint32_t n, const num_type *w,
+                                float ratio, struct smatrix *s) {
+    smatrix_free(*s);
+    *s = smatrix_prune(m, n, w, ratio);
+    if (s->val == NULL) {
+        err(EXIT_FAILURE, "allocate sparse %s weights memory", name);
+    }
+    fprintf(stderr, "%s: %.1f%% pruned (%u blocks stored) to '%s'\n", name,
+            100.0 * (1.0 - smatrix_density(*s)), s->nnzb, filename);
+}
+
+/**
+ * `layer_prune` - Prune `ratio` of the (dense) weights by magnitude. The
+ * block sparse weight files are written by `layer_destruct()`.
+ */
+static void layer_prune(float ratio) {
+    layer_prune_weights("hidden", HIDDEN_SPARSE_FILENAME, INPUT_LENGTH,
+                        HIDDEN_LENGTH, hidden_weights, ratio, &hidden_sparse);
+    layer_prune_weights("output", OUTPUT_SPARSE_FILENAME, HIDDEN_LENGTH,
+                        OUTPUT_LENGTH, output_weights, ratio, &output_sparse);
+}
+
+/*
+ * Switch the prediction to the sparse weights (see `SPARSE_WEIGHTS`).
+ */
+static bool layer_sparse(bool enable) {
+    sparse_inference = enable && hidden_sparse.val != NULL;
+    return hidden_sparse.val != NULL;
+}
+
+/*
+ * Switch the prediction to the int8 weights (see `QUANTIZE_FROZEN`), which
+ * are quantized at the first call.
+ */
+static bool layer_int8(bool enable) {
+    if (enable && hidden_q8.w == NULL) {
+        hidden_q8 =
+            qmatrix_quantize(INPUT_LENGTH, HIDDEN_LENGTH, hidden_weights);
+        output_q8 =
+            qmatrix_quantize(HIDDEN_LENGTH, OUTPUT_LENGTH, output_weights);
+        if (hidden_q8.w == NULL || output_q8.w == NULL) {
+            err(EXIT_FAILURE, "allocate quantized weights memory");
+        }
+    }
+    int8_inference = enable;
+    return true;
+}
+
+/*
+ * Switch the prediction to the 16 bit weights (see `WEIGHT_TYPE`).
+ */
+static bool layer_half(bool enable) {
+    half_inference = enable && WEIGHT_TYPE != WEIGHT_F32;
+    return WEIGHT_TYPE != WEIGHT_F32;
+}
+
+/**
+ * `layer_quantize` - Switch the prediction to the weights of the configured
+ * mode (see `FROZEN_MODES`) or back to the float weights.
+ *
+ * Returns false if the net has no other weights than the float weights.
+ */
+static bool layer_quantize(bool enable) {
+    if (SPARSE_WEIGHTS) return layer_sparse(enable);
+    if (QUANTIZE_FROZEN) return layer_int8(enable);
+    return layer_half(enable);
 }
 
 /**
  * `layer_destruct` - Destruct the created neural network.
  */
 static void layer_destruct() {
-    if (HIDDEN_WEIGHTS_FILENAME != NULL) {
+    layer_buffers_destruct();
+    qmatrix_free(hidden_q8);
+    qmatrix_free(output_q8);
+    if (hidden_sparse.val != NULL &&
+        !smatrix_save(HIDDEN_SPARSE_FILENAME, hidden_sparse)) {
+        err(EXIT_FAILURE, "write sparse file '%s'", HIDDEN_SPARSE_FILENAME);
+    }
+    if (output_sparse.val != NULL &&
+        !smatrix_save(OUTPUT_SPARSE_FILENAME, output_sparse)) {
+        err(EXIT_FAILURE, "write sparse file '%s'", OUTPUT_SPARSE_FILENAME);
+    }
+    smatrix_free(hidden_sparse);
+    smatrix_free(output_sparse);
+    if (WEIGHT_TYPE != WEIGHT_F32) {
+        hmatrix_store(hidden_h, hidden_weights);
+        hmatrix_free(hidden_h);
+        free(hidden_weights);
+    } else if (HIDDEN_WEIGHTS_FILENAME != NULL) {
         munmap(hidden_weights, INPUT_LENGTH * HIDDEN_LENGTH);
     } else {
         free(hidden_weights);
     }
-    if (OUTPUT_WEIGHTS_FILENAME != NULL) {
+    if (HIDDEN_BIAS_FILENAME != NULL) {
+        munmap(hidden_bias, HIDDEN_LENGTH);
+    } else {
+        free(hidden_bias);
+    }
+    if (WEIGHT_TYPE != WEIGHT_F32) {
+        hmatrix_store(output_h, output_weights);
+        hmatrix_free(output_h);
+        free(output_weights);
+    } else if (OUTPUT_WEIGHTS_FILENAME != NULL) {
         munmap(output_weights, HIDDEN_LENGTH * OUTPUT_LENGTH);
     } else {
         free(output_weights);
     }
+    if (OUTPUT_BIAS_FILENAME != NULL) {
+        munmap(output_bias, OUTPUT_LENGTH);
+    } else {
+        free(output_bias);
+    }
+}
+
+/*
+ * Calculate the output of the layers (the logits with `OUTPUT_SOFTMAX`).
+ *
+ * The bias and the activation of each layer are fused into the
+ * matrix multiplication (see `trans_act()`, `trans_act_q8()`,
+ * `trans_act_h()` and `trans_act_sparse()`). The float hidden layer skips the
+ * zero inputs of a sparse batch (see `SPARSE_INPUT_DENSITY`).
+ */
+static void predict_layers(const num_type input[INPUT_LENGTH]) {
+    if (sparse_inference) {
+        trans_act_sparse(batch_length, hidden_sparse, hidden_bias, input,
+                         HIDDEN_ACTIVATION, hidden_output);
+        trans_act_sparse(batch_length, output_sparse, output_bias,
+                         hidden_output, OUTPUT_LAYER_ACTIVATION, output);
+        return;
+    }
+    if (int8_inference) {
+        trans_act_q8(batch_length, hidden_q8, hidden_bias, input,
+                     HIDDEN_ACTIVATION, hidden_output);
+        trans_act_q8(batch_length, output_q8, output_bias, hidden_output,
+                     OUTPUT_LAYER_ACTIVATION, output);
+        return;
+    }
+    if (half_inference) {
+        trans_act_h(batch_length, hidden_h, hidden_bias, input,
+                    HIDDEN_ACTIVATION, hidden_output);
+        trans_act_h(batch_length, output_h, output_bias, hidden_output,
+                    OUTPUT_LAYER_ACTIVATION, output);
+        return;
+    }
+    sparse_input = SPARSE_INPUT_DENSITY > 0.0f &&
+                   svector_compress(batch_length, INPUT_LENGTH, input,
+                                    &input_sparse) < SPARSE_INPUT_DENSITY;
+    if (sparse_input) {
+        trans_act_svector(batch_length, HIDDEN_LENGTH, hidden_weights,
+                          hidden_bias, input_sparse, HIDDEN_ACTIVATION,
+                          hidden_output);
+    } else {
+        trans_act(batch_length, INPUT_LENGTH, HIDDEN_LENGTH, hidden_weights,
+                  hidden_bias, input, HIDDEN_ACTIVATION, hidden_output);
+    }
+    trans_act(batch_length, HIDDEN_LENGTH, OUTPUT_LENGTH, output_weights,
+              output_bias, hidden_output, OUTPUT_LAYER_ACTIVATION, output);
 }
 
 /**
  * `predict` - Predict the output based on the given input.
  *
+ * With `OUTPUT_SOFTMAX` the logits are kept for the loss and the output is
+ * the softmax of the logits.
+ *
  * - `input`: The input vector
  */
 static void predict(const num_type input[INPUT_LENGTH]) {
-    trans(BATCH_LENGTH, INPUT_LENGTH, HIDDEN_LENGTH, hidden_weights, input,
-          hidden_output);
-    HIDDEN_ACTIVATION(BATCH_LENGTH * HIDDEN_LENGTH, hidden_output);
-    trans(BATCH_LENGTH, HIDDEN_LENGTH, OUTPUT_LENGTH, output_weights,
-          hidden_output, output);
-    OUTPUT_ACTIVATION(BATCH_LENGTH * OUTPUT_LENGTH, output);
+    predict_layers(input);
+    if (OUTPUT_SOFTMAX) {
+        memcpy(output_logits, output,
+               sizeof(num_type) * OUTPUT_LENGTH * batch_length);
+        for (uint32_t k = 0; k < batch_length; k++) {
+            softmax(OUTPUT_LENGTH, &output_logits[k * OUTPUT_LENGTH],
+                    &output[k * OUTPUT_LENGTH]);
+        }
+    }
 }
 
 /**
  * `prediction_error` - Calculates the error between the output and the expected (target) array.
  *
  * - `target`: The target vector
- * Returns the The calculated error value
+ * Returns the The calculated error value: the cross entropy with
+ * `OUTPUT_SOFTMAX`, otherwise the mean squared error.
  */
 static double prediction_error(const num_type *target) {
-    return vec_delta(OUTPUT_LENGTH * BATCH_LENGTH, output, target,
+    if (OUTPUT_SOFTMAX) {
+        return softmax_xent(batch_length, OUTPUT_LENGTH, output_logits, target,
+                            output_delta);
+    }
+    return vec_delta(OUTPUT_LENGTH * batch_length, output, target,
                      output_delta);
 }
 
 /*
- * Change this procedure to adapt the monitoring (logging) output on stdout.
+ * Change this procedure to adapt the monitoring: returns the number of hits
+ * (the predicted class is the target class) of the batch. The hits are
+ * accumulated and reported by the report module (see report.h).
  */
-static uint64_t monitor(uint32_t target_len, const num_type *target,
-                        struct stats error, struct stats duration,
-                        uint64_t total, uint64_t hits) {
+static uint32_t monitor(uint32_t target_len, const num_type *target) {
     float max_value;
-    (void)error;
-    (void)duration;
-    (void)total;
-    for (uint32_t i = 0; i < BATCH_LENGTH; i++) {
+    uint32_t hits = 0;
+    for (uint32_t i = 0; i < batch_length; i++) {
         size_t max_pos =
             argmax(OUTPUT_LENGTH, &output[i * OUTPUT_LENGTH], &max_value);
         size_t target_pos =
             argmax(target_len, &target[i * target_len], &max_value);
-        if (target_pos == max_pos) {
-            ++hits;
-        }
-        fprintf(stderr, ", %zu, %zu", target_pos, max_pos);
+        hits += target_pos == max_pos;
     }
     return hits;
 }
@@ -142,16 +464,155 @@ static uint64_t monitor(uint32_t target_len, const num_type *target,
  *
  * - `input`: The input vector
  */
-static void train(const num_type input[INPUT_LENGTH * BATCH_LENGTH]) {
-    loss(BATCH_LENGTH, HIDDEN_LENGTH, OUTPUT_LENGTH, output_weights,
-         output_delta, hidden_delta);
+static void train(const num_type input[INPUT_LENGTH * batch_length]) {
+    const float rate = LEARN_RATE / batch_length;
+    if (sparse_inference) {
+        loss_sparse(batch_length, output_sparse, output_delta, hidden_delta);
+    } else {
+        loss(batch_length, HIDDEN_LENGTH, OUTPUT_LENGTH, output_weights,
+             output_delta, hidden_delta);
+    }
+
+    HIDDEN_ACTIVATION_DERIVED(batch_length * HIDDEN_LENGTH, hidden_output,
+                              hidden_delta);
+    if (sparse_inference) {
+        train_sgd_sparse(batch_length, hidden_sparse, input, hidden_delta, rate);
+    } else if (sparse_input) {
+        train_sgd_svector(batch_length, HIDDEN_LENGTH, input_sparse,
+                          hidden_delta, rate, hidden_weights);
+    } else {
+        train_sgd(batch_length, INPUT_LENGTH, HIDDEN_LENGTH, input,
+                  hidden_delta, rate, hidden_weights);
+    }
+    train_sgd_bias(batch_length, HIDDEN_LENGTH, hidden_delta, rate,
+                   hidden_bias);
+    if (!OUTPUT_SOFTMAX) {
+        OUTPUT_ACTIVATION_DERIVED(batch_length * OUTPUT_LENGTH, output,
+                                  output_delta);
+    }
+    if (sparse_inference) {
+        train_sgd_sparse(batch_length, output_sparse, hidden_output,
+                         output_delta, rate);
+    } else {
+        train_sgd(batch_length, HIDDEN_LENGTH, OUTPUT_LENGTH, hidden_output,
+                  output_delta, rate, output_weights);
+    }
+    train_sgd_bias(batch_length, OUTPUT_LENGTH, output_delta, rate,
+                   output_bias);
+}
+
+/**
+ * `LAYER_PARAMETERS` - The number of the trained parameters: the hidden
+ * weights and bias followed by the output weights and bias. The data
+ * parallel training (`gstnn -d N`) sums the gradients of the slices of a
+ * batch (see `gradient()`) and trains the sum (see `train_gradient()`).
+ */
+#define LAYER_PARAMETERS                                                    \
+    (INPUT_LENGTH * HIDDEN_LENGTH + HIDDEN_LENGTH +                         \
+     HIDDEN_LENGTH * OUTPUT_LENGTH + OUTPUT_LENGTH)
 
-    HIDDEN_ACTIVATION_DERIVED(BATCH_LENGTH * HIDDEN_LENGTH, hidden_output,
+/**
+ * `gradient` - Calculate the gradient of the parameters of the batch (after
+ * `predict()` and `prediction_error()`) without changing the weights. The
+ * gradient of the dense weights is computed, the sparse weights are not
+ * trained by gradient.
+ *
+ * - `input`: The input vector
+ * - `grad`: The gradient of the `LAYER_PARAMETERS` parameters
+ */
+static void gradient(const num_type input[INPUT_LENGTH * batch_length],
+                     float grad[LAYER_PARAMETERS]) {
+    if (sparse_inference) {
+        errx(EXIT_FAILURE, "the sparse weights are not trained by gradient");
+    }
+    float *hidden_grad      = grad;
+    float *hidden_bias_grad = &hidden_grad[INPUT_LENGTH * HIDDEN_LENGTH];
+    float *output_grad      = &hidden_bias_grad[HIDDEN_LENGTH];
+    float *output_bias_grad = &output_grad[HIDDEN_LENGTH * OUTPUT_LENGTH];
+    loss(batch_length, HIDDEN_LENGTH, OUTPUT_LENGTH, output_weights,
+         output_delta, hidden_delta);
+    HIDDEN_ACTIVATION_DERIVED(batch_length * HIDDEN_LENGTH, hidden_output,
                               hidden_delta);
-    train_sgd(BATCH_LENGTH, INPUT_LENGTH, HIDDEN_LENGTH, input, hidden_delta,
-              LEARN_RATE, hidden_weights);
-    OUTPUT_ACTIVATION_DERIVED(BATCH_LENGTH * OUTPUT_LENGTH, output,
-                              output_delta);
-    train_sgd(BATCH_LENGTH, HIDDEN_LENGTH, OUTPUT_LENGTH, hidden_output,
-              output_delta, LEARN_RATE, output_weights);
+    if (sparse_input) {
+        // Accumulate the gradient of the nonzero inputs only
+        memset(hidden_grad, 0, sizeof(float) * INPUT_LENGTH * HIDDEN_LENGTH);
+        train_sgd_svector(batch_length, HIDDEN_LENGTH, input_sparse,
+                          hidden_delta, -1.0f, hidden_grad);
+    } else {
+        weights_grad(batch_length, INPUT_LENGTH, HIDDEN_LENGTH, input,
+                     hidden_delta, hidden_grad);
+    }
+    bias_grad(batch_length, HIDDEN_LENGTH, hidden_delta, hidden_bias_grad);
+    if (!OUTPUT_SOFTMAX) {
+        OUTPUT_ACTIVATION_DERIVED(batch_length * OUTPUT_LENGTH, output,
+                                  output_delta);
+    }
+    weights_grad(batch_length, HIDDEN_LENGTH, OUTPUT_LENGTH, hidden_output,
+                 output_delta, output_grad);
+    bias_grad(batch_length, OUTPUT_LENGTH, output_delta, output_bias_grad);
+}
+
+/*
+ * The trained tensors in the order of the gradient.
+ */
+static uint32_t layer_tensors(num_type **param[], uint32_t len[]) {
+    param[0] = &hidden_weights;
+    param[1] = &hidden_bias;
+    param[2] = &output_weights;
+    param[3] = &output_bias;
+    len[0]   = INPUT_LENGTH * HIDDEN_LENGTH;
+    len[1]   = HIDDEN_LENGTH;
+    len[2]   = HIDDEN_LENGTH * OUTPUT_LENGTH;
+    len[3]   = OUTPUT_LENGTH;
+    return 4;
+}
+
+/**
+ * `train_gradient` - Train the parameters [begin, end) by the gradient
+ * summed over `batch_len` input vectors (the sgd update of `train()`).
+ *
+ * - `begin`, `end`: The range of the parameters
+ * - `batch_len`: The number of input vectors of the gradient
+ * - `grad`: The gradient of the `LAYER_PARAMETERS` parameters
+ */
+static void train_gradient(uint32_t begin, uint32_t end, uint32_t batch_len,
+                           const float grad[LAYER_PARAMETERS]) {
+    const float rate = LEARN_RATE / batch_len;
+    num_type **param[4];
+    uint32_t len[4];
+    const uint32_t n = layer_tensors(param, len);
+    for (uint32_t i = 0, pos = 0; i < n && pos < end; pos += len[i++]) {
+        const uint32_t from = begin > pos ? begin - pos : 0;
+        const uint32_t to   = end < pos + len[i] ? end - pos : len[i];
+        if (from < to) {
+            vec_axpy(to - from, -rate, &grad[pos + from], &(*param[i])[from]);
+        }
+    }
+}
+
+/**
+ * `layer_parameters_read` - Copy the parameters into `p` (in the order of the
+ * gradient).
+ */
+static void layer_parameters_read(float p[LAYER_PARAMETERS]) {
+    num_type **param[4];
+    uint32_t len[4];
+    const uint32_t n = layer_tensors(param, len);
+    for (uint32_t i = 0, pos = 0; i < n; pos += len[i++]) {
+        memcpy(&p[pos], *param[i], sizeof(float) * len[i]);
+    }
+}
+
+/**
+ * `layer_parameters_bind` - Copy the parameters into `p` and predict and
+ * train with the parameters of `p` from now on: a worker process of
+ * `gstnn -w N` trains its own copy of the parameters, which it pulls from
+ * the parameter server. Do not destruct the layers afterwards.
+ */
+static void layer_parameters_bind(float p[LAYER_PARAMETERS]) {
+    num_type **param[4];
+    uint32_t len[4];
+    const uint32_t n = layer_tensors(param, len);
+    layer_parameters_read(p);
+    for (uint32_t i = 0, pos = 0; i < n; pos += len[i++]) *param[i] = &p[pos];
 }
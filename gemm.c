@@ -0,0 +1,279 @@
+/*
+ * The built-in, cache blocked single precision matrix multiplication.
+ */
+
+#include "gemm.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "simd.h"
+
+/*
+ * Register block of the microkernel: MR rows x NR columns of C are kept in
+ * 2 * MR vector registers (AVX-512: 6 x 32, AVX2: 6 x 16).
+ */
+#define GEMM_MR 6
+#define GEMM_NR (2 * VF_LEN)
+
+/*
+ * Cache blocks: a MR x KC micro panel of A and a KC x NR micro panel of B fit
+ * into the L1 cache, the MC x KC block of A into the L2 and the KC x NC panel
+ * of B into the L3 cache.
+ */
+#define GEMM_MC 72
+#define GEMM_KC 256
+#define GEMM_NC 2048
+
+/*
+ * Products with less rows (e.g. batch length 1) or with less columns than a
+ * micro panel (e.g. the output layer) are computed without packing. The
+ * packing would cost more than the product itself.
+ */
+#define GEMM_SMALL_M 4
+
+/*
+ * Per thread buffers of the packed blocks (allocated on first use). The key
+ * releases them when the thread exits.
+ */
+static _Thread_local float *pack_a;
+static _Thread_local float *pack_b;
+static pthread_key_t pack_key;
+static pthread_once_t pack_once = PTHREAD_ONCE_INIT;
+
+static void pack_free(void *unused) {
+    (void)unused;
+    free(pack_a);
+    free(pack_b);
+    pack_a = pack_b = NULL;
+}
+
+static void pack_key_create(void) { pthread_key_create(&pack_key, pack_free); }
+
+static float *pack_alloc(size_t len) {
+    pthread_once(&pack_once, pack_key_create);
+    pthread_setspecific(pack_key, &pack_key);
+    float *buf = aligned_alloc(64, len * sizeof(float));
+    if (buf == NULL) {
+        err(EXIT_FAILURE, "allocate gemm packing buffer");
+    }
+    return buf;
+}
+
+/*
+ * Return the element (r, c) of op(X).
+ */
+static inline float op_at(const float *x, uint32_t ld, bool trans, uint32_t r,
+                          uint32_t c) {
+    return trans ? x[c * ld + r] : x[r * ld + c];
+}
+
+/*
+ * Pack the mc x kc block of op(A) starting at (i0, p0) into micro panels of
+ * GEMM_MR rows. Each micro panel is stored column after column, missing rows
+ * are filled with zeros.
+ */
+static void pack_block_a(uint32_t mc, uint32_t kc, const float *a,
+                         uint32_t lda, bool trans, uint32_t i0, uint32_t p0,
+                         float *restrict buf) {
+    for (uint32_t ir = 0; ir < mc; ir += GEMM_MR) {
+        const uint32_t mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+        for (uint32_t p = 0; p < kc; p++, buf += GEMM_MR) {
+            uint32_t i = 0;
+            for (; i < mr; i++) {
+                buf[i] = op_at(a, lda, trans, i0 + ir + i, p0 + p);
+            }
+            for (; i < GEMM_MR; i++) buf[i] = 0.0f;
+        }
+    }
+}
+
+/*
+ * Pack the kc x nc panel of op(B) starting at (p0, j0) into micro panels of
+ * GEMM_NR columns. Each micro panel is stored row after row, missing columns
+ * are filled with zeros.
+ */
+static void pack_panel_b(uint32_t kc, uint32_t nc, const float *b,
+                         uint32_t ldb, bool trans, uint32_t p0, uint32_t j0,
+                         float *restrict buf) {
+    for (uint32_t jr = 0; jr < nc; jr += GEMM_NR) {
+        const uint32_t nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+        for (uint32_t p = 0; p < kc; p++, buf += GEMM_NR) {
+            if (!trans && nr == GEMM_NR) {
+                const float *row = &b[(p0 + p) * ldb + j0 + jr];
+                vf_store(buf, vf_load(row));
+                vf_store(buf + VF_LEN, vf_load(row + VF_LEN));
+                continue;
+            }
+            uint32_t j = 0;
+            for (; j < nr; j++) {
+                buf[j] = op_at(b, ldb, trans, p0 + p, j0 + jr + j);
+            }
+            for (; j < GEMM_NR; j++) buf[j] = 0.0f;
+        }
+    }
+}
+
+/*
+ * The microkernel: c(mr, nr) = alpha * a(mr, kc) * b(kc, nr) + beta * c
+ * on a packed micro panel of A and B.
+ */
+static void gemm_micro(uint32_t kc, const float *restrict a,
+                       const float *restrict b, float alpha, float beta,
+                       float *restrict c, uint32_t ldc, uint32_t mr,
+                       uint32_t nr) {
+    vf c0[GEMM_MR], c1[GEMM_MR];
+    for (uint32_t i = 0; i < GEMM_MR; i++) c0[i] = c1[i] = vf_set(0.0f);
+    for (uint32_t p = 0; p < kc; p++, a += GEMM_MR, b += GEMM_NR) {
+        const vf b0 = vf_load(b);
+        const vf b1 = vf_load(b + VF_LEN);
+        for (uint32_t i = 0; i < GEMM_MR; i++) {
+            const vf ai = vf_set(a[i]);
+            c0[i]       = vf_fmadd(ai, b0, c0[i]);
+            c1[i]       = vf_fmadd(ai, b1, c1[i]);
+        }
+    }
+    const vf va = vf_set(alpha);
+    if (mr == GEMM_MR && nr == GEMM_NR) {
+        const vf vb = vf_set(beta);
+        for (uint32_t i = 0; i < GEMM_MR; i++) {
+            float *ci = &c[i * ldc];
+            vf r0     = vf_mul(va, c0[i]);
+            vf r1     = vf_mul(va, c1[i]);
+            if (beta != 0.0f) {
+                r0 = vf_fmadd(vb, vf_load(ci), r0);
+                r1 = vf_fmadd(vb, vf_load(ci + VF_LEN), r1);
+            }
+            vf_store(ci, r0);
+            vf_store(ci + VF_LEN, r1);
+        }
+    } else {
+        float t[GEMM_MR * GEMM_NR];
+        for (uint32_t i = 0; i < mr; i++) {
+            vf_store(&t[i * GEMM_NR], vf_mul(va, c0[i]));
+            vf_store(&t[i * GEMM_NR + VF_LEN], vf_mul(va, c1[i]));
+            for (uint32_t j = 0; j < nr; j++) {
+                c[i * ldc + j] = t[i * GEMM_NR + j] +
+                                 (beta != 0.0f ? beta * c[i * ldc + j] : 0.0f);
+            }
+        }
+    }
+}
+
+/*
+ * The blocked product of the packed operands.
+ */
+static void gemm_packed(bool trans_a, bool trans_b, uint32_t m, uint32_t n,
+                        uint32_t k, float alpha, const float *a, uint32_t lda,
+                        const float *b, uint32_t ldb, float beta, float *c,
+                        uint32_t ldc) {
+    if (pack_a == NULL) pack_a = pack_alloc(GEMM_MC * GEMM_KC);
+    if (pack_b == NULL) pack_b = pack_alloc(GEMM_KC * GEMM_NC);
+    for (uint32_t jc = 0; jc < n; jc += GEMM_NC) {
+        const uint32_t nc = n - jc < GEMM_NC ? n - jc : GEMM_NC;
+        for (uint32_t pc = 0; pc < k; pc += GEMM_KC) {
+            const uint32_t kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+            // the first block scales C by beta, the others accumulate
+            const float bc = pc == 0 ? beta : 1.0f;
+            pack_panel_b(kc, nc, b, ldb, trans_b, pc, jc, pack_b);
+            for (uint32_t ic = 0; ic < m; ic += GEMM_MC) {
+                const uint32_t mc = m - ic < GEMM_MC ? m - ic : GEMM_MC;
+                pack_block_a(mc, kc, a, lda, trans_a, ic, pc, pack_a);
+                for (uint32_t jr = 0; jr < nc; jr += GEMM_NR) {
+                    const uint32_t nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+                    for (uint32_t ir = 0; ir < mc; ir += GEMM_MR) {
+                        const uint32_t mr =
+                            mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+                        gemm_micro(kc, &pack_a[ir * kc], &pack_b[jr * kc],
+                                   alpha, bc, &c[(ic + ir) * ldc + jc + jr],
+                                   ldc, mr, nr);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * c[j] = alpha * dot(a, b[j * ldb]) + beta * c[j] for the n rows of B.
+ * Four rows of B share each load of `a`.
+ */
+static void gemm_dot(uint32_t n, uint32_t k, float alpha,
+                     const float *restrict a, const float *restrict b,
+                     uint32_t ldb, float beta, float *restrict c) {
+    uint32_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        const float *b0 = &b[j * ldb], *b1 = b0 + ldb, *b2 = b1 + ldb,
+                    *b3 = b2 + ldb;
+        vf s0 = vf_set(0.0f), s1 = s0, s2 = s0, s3 = s0;
+        uint32_t p = 0;
+        for (; p + VF_LEN <= k; p += VF_LEN) {
+            const vf ap = vf_load(&a[p]);
+            s0          = vf_fmadd(ap, vf_load(&b0[p]), s0);
+            s1          = vf_fmadd(ap, vf_load(&b1[p]), s1);
+            s2          = vf_fmadd(ap, vf_load(&b2[p]), s2);
+            s3          = vf_fmadd(ap, vf_load(&b3[p]), s3);
+        }
+        float r[4] = {vf_hsum(s0), vf_hsum(s1), vf_hsum(s2), vf_hsum(s3)};
+        for (; p < k; p++) {
+            r[0] += a[p] * b0[p];
+            r[1] += a[p] * b1[p];
+            r[2] += a[p] * b2[p];
+            r[3] += a[p] * b3[p];
+        }
+        for (uint32_t q = 0; q < 4; q++) {
+            c[j + q] = alpha * r[q] + (beta != 0.0f ? beta * c[j + q] : 0.0f);
+        }
+    }
+    for (; j < n; j++) {
+        const float *bj = &b[j * ldb];
+        vf s            = vf_set(0.0f);
+        uint32_t p      = 0;
+        for (; p + VF_LEN <= k; p += VF_LEN) {
+            s = vf_fmadd(vf_load(&a[p]), vf_load(&bj[p]), s);
+        }
+        float r = vf_hsum(s);
+        for (; p < k; p++) r += a[p] * bj[p];
+        c[j] = alpha * r + (beta != 0.0f ? beta * c[j] : 0.0f);
+    }
+}
+
+/*
+ * c = alpha * sum_p a[p] * b[p * ldb] + beta * c for a row vector c.
+ */
+static void gemm_axpy(uint32_t n, uint32_t k, float alpha,
+                      const float *restrict a, const float *restrict b,
+                      uint32_t ldb, float beta, float *restrict c) {
+    for (uint32_t j = 0; j < n; j++) c[j] = beta != 0.0f ? beta * c[j] : 0.0f;
+    for (uint32_t p = 0; p < k; p++) {
+        const float *bp = &b[p * ldb];
+        const float ap  = alpha * a[p];
+        const vf va     = vf_set(ap);
+        uint32_t j      = 0;
+        for (; j + VF_LEN <= n; j += VF_LEN) {
+            vf_store(&c[j], vf_fmadd(va, vf_load(&bp[j]), vf_load(&c[j])));
+        }
+        for (; j < n; j++) c[j] += ap * bp[j];
+    }
+}
+
+/*
+ * The instruction set variant of gemm_f32(), dispatched by the kern module.
+ */
+void ISA(gemm_f32)(bool trans_a, bool trans_b, uint32_t m, uint32_t n,
+                   uint32_t k, float alpha, const float *a, uint32_t lda,
+                   const float *b, uint32_t ldb, float beta, float *c,
+                   uint32_t ldc) {
+    if ((m < GEMM_SMALL_M || (n < GEMM_NR && trans_b)) && !trans_a) {
+        for (uint32_t i = 0; i < m; i++) {
+            if (trans_b) {
+                gemm_dot(n, k, alpha, &a[i * lda], b, ldb, beta, &c[i * ldc]);
+            } else {
+                gemm_axpy(n, k, alpha, &a[i * lda], b, ldb, beta, &c[i * ldc]);
+            }
+        }
+        return;
+    }
+    gemm_packed(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
+}
@@ -0,0 +1,48 @@
+/**
+ * # The geisten matrix multiplication
+ *
+ * The built-in single precision matrix multiplication. It replaces
+ * `cblas_sgemm()` of OpenBLAS if _gstnn_ is built with `make GEMM=builtin`.
+ *
+ * The implementation follows the BLIS design: the operands are packed into
+ * cache blocks (`KC` x `NC` panels of `B` for the L3, `MC` x `KC` blocks of
+ * `A` for the L2) and an `MR` x `NR` register microkernel runs on the packed
+ * micro panels (L1). Products with a small number of rows `M` (batch length 1
+ * in _gstnn_) skip the packing and run as vectorized dot or axpy kernels
+ * directly on the operands.
+ *
+ * The kernels are compiled for each instruction set; the variant is selected
+ * at program start by the kern module (see kern_isa()).
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * ### gemm_f32()
+ *
+ * Compute `C = alpha * op(A) * op(B) + beta * C` with row major matrices.
+ *
+ * If `beta` is `0`, `C` is not read (it may be uninitialized).
+ *
+ * #### Parameters
+ *
+ *  - `trans_a` Use the transposed `A` (`op(A) = A^T`).
+ *  - `trans_b` Use the transposed `B` (`op(B) = B^T`).
+ *  - `m` The number of rows of `op(A)` and `C`.
+ *  - `n` The number of columns of `op(B)` and `C`.
+ *  - `k` The number of columns of `op(A)` and rows of `op(B)`.
+ *  - `alpha` The scalar factor of the product.
+ *  - `a` The matrix `A`.
+ *  - `lda` The leading dimension (row stride) of `A`.
+ *  - `b` The matrix `B`.
+ *  - `ldb` The leading dimension (row stride) of `B`.
+ *  - `beta` The scalar factor of `C`.
+ *  - `c` The m x n result matrix `C`.
+ *  - `ldc` The leading dimension (row stride) of `C`.
+ */
+void gemm_f32(bool trans_a, bool trans_b, uint32_t m, uint32_t n, uint32_t k,
+              float alpha, const float *a, uint32_t lda, const float *b,
+              uint32_t ldb, float beta, float *c, uint32_t ldc);
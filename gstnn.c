@@ -1,33 +1,771 @@
 //
 // Created by germar on 02.04.21.
 //
+#define _GNU_SOURCE
 #include <err.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "batchio.h"
 #include "config.h"
+#include "iserver.h"
+#include "pserver.h"
+#include "report.h"
 #include "stats.h"
 #include "stopwatch.h"
+#include "trace.h"
 
-#define USAGE_FMT "%s [-t FILE] [-h] [-f]"
+#define USAGE_FMT \
+    "%s [-t FILE] [-h] [-f] [-c] [-v] [-b BATCH] [-e EPOCHS] [-d|-j THREADS] " \
+    "[-o float|label|topK] [-r SAMPLES|MSms] [-m csv|binary] [-l FILE] " \
+    "[-w WORKERS[,STALENESS[,BATCHES]]] [-u SOCKET[,WAIT_US]] [-p RATIO] " \
+    "[-s SEED] [-T FILE]"
 
-static void report_print(uint64_t total, uint64_t hits, struct stats error,
-                         struct stats duration) {
-    double time_rsdev  = stats_rsdev_unbiased(&duration);
-    double error_rsdev = stats_rsdev_unbiased(&error);
-    fprintf(stderr, "%1.4e, %4.02f, %.4f, %.3f, %5.2e, %4.02f",
-            stats_mean(&error), error_rsdev, (double)hits / (double)total,
-            (100.0 * (1.0 - (double)hits / (double)total)),
-            stats_mean(&duration), time_rsdev);
+/*
+ * The output record of an input vector: the output vector (float), the class
+ * of its max element (label, an 8 bit unsigned integer or a 16 bit one if
+ * OUTPUT_LENGTH exceeds 256) or the classes of its k max elements (16 bit
+ * unsigned integers) followed by their values (topk), in descending order.
+ */
+enum output_mode { OUTPUT_FLOAT, OUTPUT_LABEL, OUTPUT_TOPK };
+
+#if OUTPUT_LENGTH > 256
+typedef uint16_t label_type;
+#else
+typedef uint8_t label_type;
+#endif
+
+static size_t output_size(enum output_mode mode, uint32_t k) {
+    switch (mode) {
+        case OUTPUT_LABEL:
+            return sizeof(label_type);
+        case OUTPUT_TOPK:
+            return k * (sizeof(uint16_t) + sizeof(float));
+        default:
+            return OUTPUT_LENGTH * sizeof(num_type);
+    }
+}
+
+/*
+ * Encode the `len` output vectors `y` as the records of the output mode. The
+ * classes and values of the top k elements are computed for the whole batch
+ * at once (into `idx` and `val`).
+ */
+static void output_encode(enum output_mode mode, uint32_t k, uint32_t len,
+                          const float *y, uint16_t *idx, float *val,
+                          void *rec) {
+    if (mode == OUTPUT_FLOAT) {
+        memcpy(rec, y, output_size(mode, k) * len);
+        return;
+    }
+    topk(len, OUTPUT_LENGTH, k, y, idx, val);
+    if (mode == OUTPUT_LABEL) {
+        label_type *label = rec;
+        for (uint32_t i = 0; i < len; i++) label[i] = (label_type)idx[i];
+        return;
+    }
+    char *r = rec;
+    for (uint32_t i = 0; i < len; i++, r += output_size(mode, k)) {
+        memcpy(r, &idx[i * k], k * sizeof(uint16_t));
+        memcpy(r + k * sizeof(uint16_t), &val[i * k], k * sizeof(float));
+    }
+}
+
+/*
+ * Return the i-th processor (modulo their count) of the set.
+ */
+static uint32_t thread_cpu(const cpu_set_t *cpus, uint32_t i) {
+    uint32_t n = i % (uint32_t)CPU_COUNT(cpus);
+    for (uint32_t cpu = 0;; cpu++) {
+        if (CPU_ISSET(cpu, cpus) && n-- == 0) return cpu;
+    }
+}
+
+/*
+ * Bind the calling thread to the processor.
+ */
+static void thread_bind(uint32_t cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+/*
+ * Return the processors the process may run on (at least one).
+ */
+static cpu_set_t thread_cpus(void) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) || CPU_COUNT(&cpus) == 0) {
+        CPU_SET(0, &cpus);
+    }
+    return cpus;
+}
+
+#ifdef WITH_TRACE
+/*
+ * The trace file of -T (see trace.h).
+ */
+static const char *trace_path = NULL;
+
+/*
+ * Write the trace of the process to the trace file, the trace of the worker
+ * process `worker` of -w to the file FILE.worker.
+ */
+static void trace_finish(uint32_t worker) {
+    char path[4096];
+    if (trace_path == NULL) return;
+    if (worker > 0) {
+        snprintf(path, sizeof(path), "%s.%u", trace_path, worker);
+    } else {
+        snprintf(path, sizeof(path), "%s", trace_path);
+    }
+    if (!trace_write(path)) {
+        err(EXIT_FAILURE, "write trace file '%s'", path);
+    }
+}
+#endif
+
+/*
+ * A training thread of `-j THREADS` (Hogwild): each thread trains its shard
+ * [begin, end) of the records of the mapped files (in the given order or in
+ * the order of the files) and updates the shared weights without a lock. Each
+ * thread collects its own report, the reports are merged after the epoch.
+ */
+struct hogwild {
+    pthread_t thread;
+    const struct dataset *input, *target;
+    const uint32_t *order;
+    uint32_t begin, end, batch_len, cpu;
+    struct report report;
+};
+
+static void *hogwild_train(void *arg) {
+    struct hogwild *h = arg;
+    // Stay on a processor and allocate (first touch) the buffers there: the
+    // activations and deltas of the thread are in the memory of its node
+    thread_bind(h->cpu);
+    layer_buffers_construct(h->batch_len);
+    TRACE_THREAD("hogwild");
+    num_type *input  = NULL;
+    num_type *target = NULL;
+    if (h->order != NULL) {
+        input  = reallocarray(NULL, h->batch_len * INPUT_LENGTH,
+                              sizeof(num_type));
+        target = reallocarray(NULL, h->batch_len * OUTPUT_LENGTH,
+                              sizeof(num_type));
+        if (NULL == input || NULL == target) {
+            err(EXIT_FAILURE, "allocate the batch memory of a thread");
+        }
+    }
+    for (uint32_t pos = h->begin; pos < h->end; pos += batch_length) {
+        const uint32_t left = h->end - pos;
+        batch_length        = left < h->batch_len ? left : h->batch_len;
+        const num_type *x = &h->input->data[(size_t)pos * INPUT_LENGTH];
+        const num_type *t = &h->target->data[(size_t)pos * OUTPUT_LENGTH];
+        if (h->order != NULL) {
+            TRACE_SCOPE("gather");
+            dataset_gather(h->input, &h->order[pos], batch_length, input);
+            dataset_gather(h->target, &h->order[pos], batch_length, target);
+            x = input;
+            t = target;
+        }
+        struct timespec period = stopwatch_start();
+        TRACE_BEGIN(predict_span, "predict");
+        predict(x);
+        TRACE_END(predict_span);
+        TRACE_BEGIN(error_span, "error");
+        const double error = prediction_error(t);
+        TRACE_END(error_span);
+        TRACE_BEGIN(train_span, "train");
+        train(x);
+        TRACE_END(train_span);
+        const double duration = stopwatch_stop_us(period);
+        TRACE_BEGIN(report_span, "report");
+        const uint32_t hits = monitor(OUTPUT_LENGTH, t);
+        report_collect(&h->report, batch_length, hits, error, duration);
+        TRACE_END(report_span);
+    }
+    free(input);
+    free(target);
+    layer_buffers_destruct();
+    return NULL;
+}
+
+
+/*
+ * Train the records of the mapped files once in `threads` threads. The
+ * threads are placed on the processors the process may run on in turn.
+ */
+static void hogwild_epoch(uint32_t threads, const struct dataset *input,
+                          const struct dataset *target, const uint32_t *order,
+                          uint32_t batch_len, struct report *report) {
+    const cpu_set_t cpus = thread_cpus();
+    struct hogwild *h = calloc(threads, sizeof(struct hogwild));
+    if (NULL == h) {
+        err(EXIT_FAILURE, "allocate the thread memory");
+    }
+    const uint64_t records = input->rec;
+    for (uint32_t i = 0; i < threads; i++) {
+        const uint32_t begin = (uint32_t)(records * i / threads);
+        const uint32_t end   = (uint32_t)(records * (i + 1) / threads);
+        h[i] = (struct hogwild){.input     = input,
+                                .target    = target,
+                                .order     = order,
+                                .begin     = begin,
+                                .end       = end,
+                                .batch_len = batch_len,
+                                .cpu       = thread_cpu(&cpus, i),
+                                .report = report_init(NULL, REPORT_CSV, 0, 0)};
+        if (pthread_create(&h[i].thread, NULL, hogwild_train, &h[i])) {
+            errx(EXIT_FAILURE, "create the training threads");
+        }
+    }
+    for (uint32_t i = 0; i < threads; i++) pthread_join(h[i].thread, NULL);
+    for (uint32_t i = 0; i < threads; i++) report_merge(report, &h[i].report);
+    free(h);
+}
+
+/*
+ * The sharded evaluation of `-f` with `-d` or `-j THREADS`: the records of the
+ * mapped input and target files are split into shards of SHARD_LENGTH vectors
+ * (rounded up to whole batches), which the threads take in turn. Each shard
+ * collects its own report and the reports are merged in the order of the
+ * shards: the batches and the merged error and accuracy are the same for any
+ * number of threads.
+ */
+#define SHARD_LENGTH 512
+
+struct shards {
+    const struct dataset *input, *target;
+    uint32_t batch_len, shard_len, len;
+    atomic_uint next;       // the next shard to evaluate
+    struct report *report;  // the report of each shard
+    bool *done;             // the evaluated shards (under the lock)
+    pthread_mutex_t lock;
+    pthread_cond_t evaluated;
+};
+
+struct shard_thread {
+    pthread_t thread;
+    struct shards *shards;
+    uint32_t cpu;
+};
+
+static void *shard_evaluate(void *arg) {
+    const struct shard_thread *t = arg;
+    struct shards *s             = t->shards;
+    thread_bind(t->cpu);
+    layer_buffers_construct(s->batch_len);
+    TRACE_THREAD("shard");
+    for (uint32_t k; (k = atomic_fetch_add(&s->next, 1)) < s->len;) {
+        const uint64_t begin = (uint64_t)k * s->shard_len;
+        const uint64_t end   = begin + s->shard_len < s->input->rec
+                                   ? begin + s->shard_len
+                                   : s->input->rec;
+        for (uint64_t pos = begin; pos < end; pos += batch_length) {
+            const uint64_t left = end - pos;
+            batch_length = left < s->batch_len ? (uint32_t)left : s->batch_len;
+            const num_type *x = &s->input->data[pos * INPUT_LENGTH];
+            const num_type *y = &s->target->data[pos * OUTPUT_LENGTH];
+            struct timespec period = stopwatch_start();
+            TRACE_BEGIN(predict_span, "predict");
+            predict(x);
+            TRACE_END(predict_span);
+            TRACE_BEGIN(error_span, "error");
+            const double error    = prediction_error(y);
+            const double duration = stopwatch_stop_us(period);
+            TRACE_END(error_span);
+            TRACE_BEGIN(report_span, "report");
+            report_collect(&s->report[k], batch_length,
+                           monitor(OUTPUT_LENGTH, y), error, duration);
+            TRACE_END(report_span);
+        }
+        pthread_mutex_lock(&s->lock);
+        s->done[k] = true;
+        pthread_cond_signal(&s->evaluated);
+        pthread_mutex_unlock(&s->lock);
+    }
+    layer_buffers_destruct();
+    return NULL;
+}
+
+/*
+ * Evaluate the records of the mapped files in `threads` threads. The shard
+ * reports are merged into the report as soon as the shards before are
+ * merged, so the report lines are written during the evaluation.
+ */
+static void shard_epoch(uint32_t threads, const struct dataset *input,
+                        const struct dataset *target, uint32_t batch_len,
+                        struct report *report) {
+    const cpu_set_t cpus    = thread_cpus();
+    const uint32_t per_batch = (SHARD_LENGTH + batch_len - 1) / batch_len;
+    const uint32_t shard_len = per_batch * batch_len;
+    struct shards s = {.input     = input,
+                       .target    = target,
+                       .batch_len = batch_len,
+                       .shard_len = shard_len,
+                       .len = (uint32_t)((input->rec + shard_len - 1) /
+                                         shard_len),
+                       .lock      = PTHREAD_MUTEX_INITIALIZER,
+                       .evaluated = PTHREAD_COND_INITIALIZER};
+    s.report               = calloc(s.len, sizeof(struct report));
+    s.done                 = calloc(s.len, sizeof(bool));
+    struct shard_thread *t = calloc(threads, sizeof(struct shard_thread));
+    if (NULL == s.report || NULL == s.done || NULL == t) {
+        err(EXIT_FAILURE, "allocate the shard memory");
+    }
+    for (uint32_t k = 0; k < s.len; k++) {
+        s.report[k] = report_init(NULL, REPORT_CSV, 0, 0);
+    }
+    for (uint32_t i = 0; i < threads; i++) {
+        t[i] = (struct shard_thread){.shards = &s,
+                                     .cpu    = thread_cpu(&cpus, i)};
+        if (pthread_create(&t[i].thread, NULL, shard_evaluate, &t[i])) {
+            errx(EXIT_FAILURE, "create the evaluation threads");
+        }
+    }
+    for (uint32_t k = 0; k < s.len; k++) {
+        pthread_mutex_lock(&s.lock);
+        while (!s.done[k]) pthread_cond_wait(&s.evaluated, &s.lock);
+        pthread_mutex_unlock(&s.lock);
+        report_merge(report, &s.report[k]);
+    }
+    for (uint32_t i = 0; i < threads; i++) pthread_join(t[i].thread, NULL);
+    free(s.report);
+    free(s.done);
+    free(t);
+}
+
+#ifdef LAYER_PARAMETERS
+/*
+ * SLICE_LENGTH - The number of input vectors of a slice of the data parallel
+ * training (`-d THREADS`). A batch is split into slices of SLICE_LENGTH
+ * vectors (the last one may be shorter), independent of the number of
+ * threads.
+ */
+#define SLICE_LENGTH 16
+
+/*
+ * SUM_BLOCK - The number of parameters summed and trained at a time.
+ */
+#define SUM_BLOCK 4096
+
+/*
+ * The data parallel training of `-d THREADS`: the threads compute the
+ * gradients of the slices of a batch (slice k in thread k % threads), sum
+ * them by a tree of fixed order (slice k += slice k + s for s = 1, 2, 4, ...)
+ * and train the weights by the sum. Each thread sums and trains its range of
+ * the parameters, so each parameter is computed in the same order for any
+ * number of threads: the trained weights are bit identical.
+ */
+struct parallel {
+    uint32_t threads, batch_len;
+    const struct dataset *input, *target;
+    const uint32_t *order;
+    float **grad;    // the gradients of the slices of a batch
+    double *error;   // the error of each slice (times its length)
+    uint32_t *hits;  // the hits of each slice
+    struct report *report;
+    pthread_barrier_t barrier;
+};
+
+struct parallel_thread {
+    pthread_t thread;
+    struct parallel *p;
+    uint32_t index, cpu;
+};
+
+/*
+ * Return the first parameter of the range of thread `i` (in whole cache
+ * lines).
+ */
+static uint32_t parallel_range(uint32_t i, uint32_t threads) {
+    if (i == threads) return LAYER_PARAMETERS;
+    return (uint32_t)((uint64_t)LAYER_PARAMETERS * i / threads) & ~15u;
+}
+
+static void *parallel_train(void *arg) {
+    const struct parallel_thread *pt = arg;
+    struct parallel *p               = pt->p;
+    thread_bind(pt->cpu);
+    layer_buffers_construct(SLICE_LENGTH);
+    TRACE_THREAD("parallel");
+    num_type *input  = NULL;
+    num_type *target = NULL;
+    if (p->order != NULL) {
+        input  = reallocarray(NULL, SLICE_LENGTH * INPUT_LENGTH,
+                              sizeof(num_type));
+        target = reallocarray(NULL, SLICE_LENGTH * OUTPUT_LENGTH,
+                              sizeof(num_type));
+        if (NULL == input || NULL == target) {
+            err(EXIT_FAILURE, "allocate the slice memory of a thread");
+        }
+    }
+    const uint32_t begin   = parallel_range(pt->index, p->threads);
+    const uint32_t end     = parallel_range(pt->index + 1, p->threads);
+    const uint32_t records = (uint32_t)p->input->rec;
+    for (uint32_t pos = 0; pos < records; pos += p->batch_len) {
+        struct timespec period = stopwatch_start();
+        const uint32_t len     = records - pos < p->batch_len ? records - pos
+                                                              : p->batch_len;
+        const uint32_t slices  = (len + SLICE_LENGTH - 1) / SLICE_LENGTH;
+        for (uint32_t k = pt->index; k < slices; k += p->threads) {
+            const uint32_t first = pos + k * SLICE_LENGTH;
+            const uint32_t left  = pos + len - first;
+            batch_length = left < SLICE_LENGTH ? left : SLICE_LENGTH;
+            const num_type *x = &p->input->data[(size_t)first * INPUT_LENGTH];
+            const num_type *t = &p->target->data[(size_t)first * OUTPUT_LENGTH];
+            if (p->order != NULL) {
+                TRACE_SCOPE("gather");
+                dataset_gather(p->input, &p->order[first], batch_length, input);
+                dataset_gather(p->target, &p->order[first], batch_length,
+                               target);
+                x = input;
+                t = target;
+            }
+            TRACE_BEGIN(predict_span, "predict");
+            predict(x);
+            TRACE_END(predict_span);
+            TRACE_BEGIN(error_span, "error");
+            p->error[k] = prediction_error(t) * batch_length;
+            TRACE_END(error_span);
+            TRACE_BEGIN(gradient_span, "gradient");
+            gradient(x, p->grad[k]);
+            TRACE_END(gradient_span);
+            p->hits[k] = monitor(OUTPUT_LENGTH, t);
+        }
+        TRACE_BEGIN(barrier_span, "barrier");
+        pthread_barrier_wait(&p->barrier);
+        TRACE_END(barrier_span);
+
+        // Sum the gradients of the slices and train the range of the thread,
+        // a block at a time (the block stays in the cache for all levels)
+        TRACE_BEGIN(sum_span, "sum");
+        for (uint32_t i = begin; i < end; i += SUM_BLOCK) {
+            const uint32_t n = end - i < SUM_BLOCK ? end - i : SUM_BLOCK;
+            for (uint32_t s = 1; s < slices; s *= 2) {
+                for (uint32_t k = 0; k + s < slices; k += 2 * s) {
+                    vec_axpy(n, 1.0f, &p->grad[k + s][i], &p->grad[k][i]);
+                }
+            }
+            train_gradient(i, i + n, len, p->grad[0]);
+        }
+        TRACE_END(sum_span);
+        double error  = 0.0;
+        uint32_t hits = 0;
+        for (uint32_t k = 0; pt->index == 0 && k < slices; k++) {
+            error += p->error[k];
+            hits += p->hits[k];
+        }
+        TRACE_BEGIN(trained_span, "barrier");
+        pthread_barrier_wait(&p->barrier);
+        TRACE_END(trained_span);
+        if (pt->index == 0) {
+            report_collect(p->report, len, hits, error / len,
+                           stopwatch_stop_us(period));
+        }
+    }
+    free(input);
+    free(target);
+    layer_buffers_destruct();
+    return NULL;
+}
+
+/*
+ * Train the records of the mapped files once in `threads` threads by the
+ * data parallel training.
+ */
+static void parallel_epoch(uint32_t threads, const struct dataset *input,
+                           const struct dataset *target,
+                           const uint32_t *order, uint32_t batch_len,
+                           struct report *report) {
+    const uint32_t slices = (batch_len + SLICE_LENGTH - 1) / SLICE_LENGTH;
+    const size_t grad_size =
+        (sizeof(float) * LAYER_PARAMETERS + 63) / 64 * 64;
+    struct parallel p = {.threads   = threads,
+                         .batch_len = batch_len,
+                         .input     = input,
+                         .target    = target,
+                         .order     = order,
+                         .grad      = calloc(slices, sizeof(float *)),
+                         .error     = calloc(slices, sizeof(double)),
+                         .hits      = calloc(slices, sizeof(uint32_t)),
+                         .report    = report};
+    struct parallel_thread *pt = calloc(threads, sizeof(*pt));
+    if (NULL == p.grad || NULL == p.error || NULL == p.hits || NULL == pt) {
+        err(EXIT_FAILURE, "allocate the data parallel memory");
+    }
+    for (uint32_t k = 0; k < slices; k++) {
+        if (NULL == (p.grad[k] = aligned_alloc(64, grad_size))) {
+            err(EXIT_FAILURE, "allocate the gradient memory");
+        }
+    }
+    pthread_barrier_init(&p.barrier, NULL, threads);
+    const cpu_set_t cpus = thread_cpus();
+    for (uint32_t i = 0; i < threads; i++) {
+        pt[i] = (struct parallel_thread){
+            .p = &p, .index = i, .cpu = thread_cpu(&cpus, i)};
+        if (pthread_create(&pt[i].thread, NULL, parallel_train, &pt[i])) {
+            errx(EXIT_FAILURE, "create the training threads");
+        }
+    }
+    for (uint32_t i = 0; i < threads; i++) pthread_join(pt[i].thread, NULL);
+    pthread_barrier_destroy(&p.barrier);
+    for (uint32_t k = 0; k < slices; k++) free(p.grad[k]);
+    free(p.grad);
+    free(p.error);
+    free(p.hits);
+    free(pt);
+}
+
+/*
+ * A worker process of `-w WORKERS`: it trains its shard [begin, end) of the
+ * records of the mapped files `epochs` times (in a new random order each
+ * time if `epochs` is not 0) with its own copy of the parameters. It pushes
+ * the gradient summed over `push_len` batches to the parameter server and
+ * pulls the trained parameters.
+ */
+struct pserver_worker {
+    const struct dataset *input, *target;
+    uint32_t begin, end, epochs, batch_len, push_len;
+    struct rng rng;
+};
+
+static void pserver_train(struct pserver *ps, struct pserver_worker *w) {
+    const size_t size = (sizeof(float) * LAYER_PARAMETERS + 63) / 64 * 64;
+    float *param      = aligned_alloc(64, size);
+    float *grad       = aligned_alloc(64, size);
+    const uint32_t n  = w->end - w->begin;
+    uint32_t *order   = w->epochs > 0 ? calloc(n, sizeof(uint32_t)) : NULL;
+    num_type *input   = reallocarray(NULL, w->batch_len * INPUT_LENGTH,
+                                     sizeof(num_type));
+    num_type *target  = reallocarray(NULL, w->batch_len * OUTPUT_LENGTH,
+                                     sizeof(num_type));
+    if (NULL == param || NULL == grad || NULL == input || NULL == target ||
+        (w->epochs > 0 && NULL == order)) {
+        err(EXIT_FAILURE, "allocate the worker memory");
+    }
+    for (uint32_t i = 0; order != NULL && i < n; i++) order[i] = w->begin + i;
+    layer_parameters_bind(param);
+    pserver_pull(ps, param);
+
+    struct pserver_push push = {0};
+    float *slot              = NULL;
+    uint32_t batches         = 0;
+    struct timespec period   = stopwatch_start();
+    for (uint32_t epoch = 0; epoch < (w->epochs > 0 ? w->epochs : 1);
+         epoch++) {
+        if (order != NULL) rng_shuffle(&w->rng, n, order);
+        for (uint32_t pos = 0; pos < n; pos += batch_length) {
+            batch_length = n - pos < w->batch_len ? n - pos : w->batch_len;
+            const num_type *x =
+                &w->input->data[(size_t)(w->begin + pos) * INPUT_LENGTH];
+            const num_type *t =
+                &w->target->data[(size_t)(w->begin + pos) * OUTPUT_LENGTH];
+            if (order != NULL) {
+                TRACE_SCOPE("gather");
+                dataset_gather(w->input, &order[pos], batch_length, input);
+                dataset_gather(w->target, &order[pos], batch_length, target);
+                x = input;
+                t = target;
+            }
+            if (batches == 0) {
+                TRACE_SCOPE("slot");
+                slot   = pserver_slot(ps);
+                period = stopwatch_start();
+            }
+            TRACE_BEGIN(predict_span, "predict");
+            predict(x);
+            TRACE_END(predict_span);
+            TRACE_BEGIN(error_span, "error");
+            push.error += prediction_error(t) * batch_length;
+            TRACE_END(error_span);
+            TRACE_BEGIN(gradient_span, "gradient");
+            gradient(x, batches == 0 ? slot : grad);
+            if (batches > 0) vec_axpy(LAYER_PARAMETERS, 1.0f, grad, slot);
+            TRACE_END(gradient_span);
+            push.hits += monitor(OUTPUT_LENGTH, t);
+            push.samples += batch_length;
+
+            // Push the gradient of the batches and pull the parameters
+            if (++batches == w->push_len) {
+                push.error /= push.samples;
+                push.duration = stopwatch_stop_us(period);
+                TRACE_BEGIN(push_span, "push");
+                pserver_push(ps, &push);
+                TRACE_END(push_span);
+                TRACE_BEGIN(pull_span, "pull");
+                pserver_pull(ps, param);
+                TRACE_END(pull_span);
+                push    = (struct pserver_push){0};
+                batches = 0;
+            }
+        }
+    }
+    if (batches > 0) {
+        push.error /= push.samples;
+        push.duration = stopwatch_stop_us(period);
+        pserver_push(ps, &push);
+    }
+    pserver_close(ps);
+}
+
+/*
+ * Train the parameters by the pushed gradients and publish them, until all
+ * workers have finished.
+ */
+static void pserver_serve(struct pserver *ps, struct report *report) {
+    struct pserver_push *push = calloc(pserver_slots(ps), sizeof(*push));
+    if (NULL == push) {
+        err(EXIT_FAILURE, "allocate the parameter server memory");
+    }
+    for (;;) {
+        TRACE_BEGIN(receive_span, "receive");
+        const uint32_t n = pserver_receive(ps, push);
+        TRACE_END(receive_span);
+        if (n == 0) break;
+        TRACE_BEGIN(train_span, "train");
+        for (uint32_t i = 0; i < n; i++) {
+            train_gradient(0, LAYER_PARAMETERS, push[i].samples,
+                           pserver_gradient(ps, &push[i]));
+            report_collect(report, push[i].samples, push[i].hits,
+                           push[i].error, push[i].duration);
+        }
+        TRACE_END(train_span);
+        TRACE_BEGIN(publish_span, "publish");
+        layer_parameters_read(pserver_publish_begin(ps));
+        pserver_publish_end(ps);
+        pserver_ack(ps, push, n);
+        TRACE_END(publish_span);
+    }
+    free(push);
+}
+
+/*
+ * Fork the worker processes and serve their parameters. Each worker trains
+ * its shard of the records.
+ */
+static void pserver_run(uint32_t workers, uint32_t staleness,
+                        uint32_t push_len, const struct dataset *input,
+                        const struct dataset *target, uint32_t epochs,
+                        uint32_t batch_len, struct report *report) {
+    struct pserver *ps =
+        pserver_create(workers, LAYER_PARAMETERS, staleness);
+    if (NULL == ps) {
+        err(EXIT_FAILURE, "create the parameter server");
+    }
+    layer_parameters_read(pserver_publish_begin(ps));
+    pserver_publish_end(ps);
+    fflush(NULL);
+    pid_t *pid = calloc(workers, sizeof(pid_t));
+    if (NULL == pid) {
+        err(EXIT_FAILURE, "allocate the worker memory");
+    }
+    for (uint32_t i = 0; i < workers; i++) {
+        if ((pid[i] = fork()) < 0) {
+            err(EXIT_FAILURE, "fork the worker processes");
+        }
+        if (pid[i] == 0) {
+#ifdef WITH_TRACE
+            trace_discard();
+#endif
+            TRACE_THREAD("worker");
+            // the random order of a worker is its own stream
+            struct pserver_worker w = {
+                .input     = input,
+                .target    = target,
+                .begin     = (uint32_t)(input->rec * i / workers),
+                .end       = (uint32_t)(input->rec * (i + 1) / workers),
+                .epochs    = epochs,
+                .batch_len = batch_len,
+                .push_len  = push_len,
+                .rng       = rng_stream(((uint64_t)1 << 32) + i)};
+            pserver_attach(ps, i);
+            pserver_train(ps, &w);
+#ifdef WITH_TRACE
+            trace_finish(i + 1);
+#endif
+            _exit(EXIT_SUCCESS);
+        }
+    }
+    pserver_attach(ps, workers);
+    pserver_serve(ps, report);
+    for (uint32_t i = 0; i < workers; i++) {
+        int status;
+        if (waitpid(pid[i], &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS) {
+            errx(EXIT_FAILURE, "worker %u failed", i + 1);
+        }
+    }
+    free(pid);
+    pserver_close(ps);
+}
+#endif
+
+/*
+ * The inference server of -u, stopped by SIGINT or SIGTERM.
+ */
+static struct iserver *server = NULL;
+
+static void serve_stop(int sig) {
+    (void)sig;
+    iserver_stop(server);
+}
+
+/*
+ * Predict the micro-batches of the inference server until it is stopped and
+ * send the output records to the clients. The prediction time and the wait
+ * of the first request of a batch are collected. Returns the number of
+ * requests.
+ */
+static uint64_t serve(enum output_mode mode, uint32_t k, uint16_t *idx,
+                      float *val, struct stats *predict_duration,
+                      struct stats *batch_wait) {
+    const struct sigaction stop = {.sa_handler = serve_stop};
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    uint64_t requests = 0;
+    for (;;) {
+        TRACE_BEGIN(input_span, "input");
+        struct iserver_batch *batch = iserver_read(server);
+        TRACE_END(input_span);
+        if (batch == NULL) break;
+        batch_length = batch->len;
+
+        struct timespec route_period = stopwatch_start();
+        TRACE_BEGIN(predict_span, "predict");
+        predict(batch->input);
+        TRACE_END(predict_span);
+        stats_collect2(predict_duration, stopwatch_stop_us(route_period));
+        stats_collect2(batch_wait, batch->wait_us);
+        TRACE_BEGIN(output_span, "output");
+        output_encode(mode, k, batch->len, output, idx, val, batch->output);
+        iserver_write(server, batch);
+        TRACE_END(output_span);
+        requests += batch->len;
+    }
+    return requests;
 }
 
 void usage(char *progname) {
     fprintf(stderr, USAGE_FMT "\n", progname);
+#ifndef LAYER_PARAMETERS
+    fprintf(stderr, "Training with -d or -w needs the gradient() of the net, "
+                    "which only config_mnist.h provides.\n");
+#endif
     exit(EXIT_FAILURE);
     /* NOTREACHED */
 }
@@ -38,9 +776,26 @@ bool freeze         = false;
 
 int main(const int argc, char *argv[]) {
     int opt;
+    float prune_ratio                = -1.0f;
+    uint32_t batch_len               = BATCH_LENGTH;
+    enum output_mode output_mode     = OUTPUT_FLOAT;
+    uint32_t top_k                   = 1;
+    uint64_t report_every            = REPORT_SAMPLES;
+    uint64_t report_every_ms         = REPORT_MS;
+    enum report_format report_format = REPORT_CSV;
+    FILE *report_stream              = stderr;
+    uint32_t epochs                  = 0;
+    uint32_t threads                 = 0;
+    bool deterministic               = false;
+    bool compare                     = false;
+    uint32_t workers                 = 0;
+    uint32_t staleness               = PSERVER_STALENESS;
+    uint32_t push_len                = 1;
+    const char *socket_path          = NULL;
+    uint64_t wait_us                 = ISERVER_WAIT_US;
 
     // Handle the command line input
-    while ((opt = getopt(argc, argv, "hft:")) != EOF) {
+    while ((opt = getopt(argc, argv, "hfcvb:d:e:j:l:m:o:p:r:s:t:u:w:T:")) != EOF) {
         switch (opt) {  // NOLINT(hicpp-multiway-paths-covered)
             case 't':
                 target_stream = fopen(optarg, "r");
@@ -51,6 +806,150 @@ int main(const int argc, char *argv[]) {
             case 'f':
                 freeze = true;
                 break;
+            case 'c':
+                compare = true;
+                break;
+            case 'b': {
+                char *end;
+                const unsigned long len = strtoul(optarg, &end, 0);
+                if (*optarg == '\0' || *end != '\0' || len == 0 ||
+                    len > UINT16_MAX) {
+                    usage(basename(argv[0]));
+                }
+                batch_len = (uint32_t)len;
+                break;
+            }
+            case 'e': {
+                char *end;
+                const unsigned long n = strtoul(optarg, &end, 0);
+                if (*optarg == '\0' || *end != '\0' || n == 0 ||
+                    n > UINT32_MAX) {
+                    usage(basename(argv[0]));
+                }
+                epochs = (uint32_t)n;
+                break;
+            }
+            case 'd':
+            case 'j': {
+                char *end;
+                const unsigned long n = strtoul(optarg, &end, 0);
+                if (*optarg == '\0' || *end != '\0' || n == 0 ||
+                    n > CPU_SETSIZE || threads > 0) {
+                    usage(basename(argv[0]));
+                }
+                threads       = (uint32_t)n;
+                deterministic = opt == 'd';
+                break;
+            }
+            case 'w': {
+                // WORKERS[,STALENESS[,BATCHES]]
+                char *end;
+                const unsigned long n = strtoul(optarg, &end, 0);
+                unsigned long s = staleness, g = push_len;
+                if (*end == ',') s = strtoul(end + 1, &end, 0);
+                if (*end == ',') g = strtoul(end + 1, &end, 0);
+                if (*optarg == '\0' || *end != '\0' || n == 0 ||
+                    n > CPU_SETSIZE || s > 64 || g == 0 || g > UINT32_MAX) {
+                    usage(basename(argv[0]));
+                }
+                workers   = (uint32_t)n;
+                staleness = (uint32_t)s;
+                push_len  = (uint32_t)g;
+                break;
+            }
+            case 'u': {
+                // SOCKET[,WAIT_US]
+                char *wait = strrchr(optarg, ',');
+                if (wait != NULL) {
+                    char *end;
+                    *wait   = '\0';
+                    wait_us = strtoull(wait + 1, &end, 10);
+                    if (wait[1] == '\0' || *end != '\0') {
+                        usage(basename(argv[0]));
+                    }
+                }
+                if (*optarg == '\0') usage(basename(argv[0]));
+                socket_path = optarg;
+                break;
+            }
+            case 'r': {
+                char *end;
+                const unsigned long long n = strtoull(optarg, &end, 0);
+                if (*optarg == '\0' || n == 0) usage(basename(argv[0]));
+                if (strcmp(end, "ms") == 0) {
+                    report_every    = 0;
+                    report_every_ms = n;
+                } else if (*end == '\0') {
+                    report_every    = n;
+                    report_every_ms = 0;
+                } else {
+                    usage(basename(argv[0]));
+                }
+                break;
+            }
+            case 'm':
+                if (strcmp(optarg, "csv") == 0) {
+                    report_format = REPORT_CSV;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    report_format = REPORT_BINARY;
+                } else {
+                    usage(basename(argv[0]));
+                }
+                break;
+            case 'l':
+                report_stream = fopen(optarg, "w");
+                if (report_stream == NULL) {
+                    err(EXIT_FAILURE, "open report file");
+                }
+                break;
+            case 'o': {
+                char *end;
+                if (strcmp(optarg, "float") == 0) {
+                    output_mode = OUTPUT_FLOAT;
+                } else if (strcmp(optarg, "label") == 0) {
+                    output_mode = OUTPUT_LABEL;
+                } else if (strncmp(optarg, "top", 3) == 0) {
+                    const unsigned long k = strtoul(optarg + 3, &end, 10);
+                    if (optarg[3] == '\0' || *end != '\0' || k == 0 ||
+                        k > OUTPUT_LENGTH) {
+                        usage(basename(argv[0]));
+                    }
+                    output_mode = OUTPUT_TOPK;
+                    top_k       = (uint32_t)k;
+                } else {
+                    usage(basename(argv[0]));
+                }
+                break;
+            }
+            case 'p': {
+                char *end;
+                prune_ratio = strtof(optarg, &end);
+                if (*optarg == '\0' || *end != '\0' ||
+                    !(prune_ratio >= 0.0f && prune_ratio <= 1.0f)) {
+                    usage(basename(argv[0]));
+                }
+                break;
+            }
+            case 's': {
+                char *end;
+                const unsigned long long seed = strtoull(optarg, &end, 0);
+                if (*optarg == '\0' || *end != '\0') {
+                    usage(basename(argv[0]));
+                }
+                kern_seed(seed);
+                break;
+            }
+            case 'T':
+#ifdef WITH_TRACE
+                trace_path = optarg;
+#else
+                errx(EXIT_FAILURE, "-T needs the trace hooks (make TRACE=1)");
+#endif
+                break;
+            case 'v':
+                fprintf(stderr, "gstnn %s, instruction set: %s\n", KERN_VERSION,
+                        kern_isa());
+                break;
             case 'h':
             default:
                 usage(basename(argv[0]));
@@ -63,61 +962,306 @@ int main(const int argc, char *argv[]) {
         break;  //stop after first file parameter is read
     }
 
-    // Create the data arrays
-    num_type input[INPUT_LENGTH * BATCH_LENGTH];
-    num_type target[OUTPUT_LENGTH * BATCH_LENGTH];
     double batch_error = 0.0;
 
-    layer_construct();
+#ifdef WITH_TRACE
+    if (trace_path != NULL) trace_start();
+#endif
+    TRACE_THREAD("main");
+    layer_construct(batch_len);
 
-    struct stats avg_duration = {};
-    struct stats error_stats  = {};
-    uint64_t hits = 0, total = 0;
+    // Write the pruned (sparse) weight files and exit
+    if (prune_ratio >= 0.0f) {
+        layer_prune(prune_ratio);
+        layer_destruct();
+        return EXIT_SUCCESS;
+    }
 
-    while (fread(input, sizeof(num_type), ARRAY_LENGTH(input), input_stream) ==
-           ARRAY_LENGTH(input)) {
-        struct timespec route_period = stopwatch_start();
+    // Predict with the sparse, int8 or 16 bit weights if frozen and compare
+    // the accuracy with the float weights if asked (-c) and the targets are
+    // given
+    const bool quantized = freeze && layer_quantize(true);
+    const bool reference = quantized && compare && target_stream != NULL;
+    uint32_t *ref_class = reallocarray(NULL, batch_len, sizeof(uint32_t));
+    if (NULL == ref_class) {
+        err(EXIT_FAILURE, "allocate reference class memory");
+    }
+    uint16_t *top_idx = reallocarray(NULL, batch_len * top_k, sizeof(uint16_t));
+    float *top_val    = reallocarray(NULL, batch_len * top_k, sizeof(float));
+    if (NULL == top_idx || NULL == top_val) {
+        err(EXIT_FAILURE, "allocate top k memory");
+    }
+    uint64_t ref_hits = 0, ref_agree = 0;
+    struct stats ref_duration = {}, predict_duration = {}, batch_wait = {};
+
+    // The hits, the error and the duration of the batches are reported
+    // every report_every samples or report_every_ms milliseconds
+    struct report report = report_init(report_stream, report_format,
+                                       report_every, report_every_ms);
+    uint64_t samples = 0;
+    struct timespec run_period = stopwatch_start();
+
+    // Train epochs: each epoch passes the records of the mapped input and
+    // target files in a new random order (no output is written). Train in
+    // `threads` threads on the shared weights (Hogwild) if -j is given, or
+    // data parallel with bit identical results for any thread count (-d).
+    // With -f, the threads evaluate the shards of the files.
+    uint32_t *order   = NULL;
+    uint32_t records  = 0;
+    struct dataset in = {0}, tg = {0};
+    if (workers > 0 && freeze) {
+        errx(EXIT_FAILURE, "-w trains, it cannot be used with -f");
+    }
+    if (threads > 0 && workers > 0) usage(basename(argv[0]));
+#ifndef LAYER_PARAMETERS
+    if ((deterministic && !freeze) || workers > 0) {
+        errx(EXIT_FAILURE, "-%c needs the gradient() of the net, which only "
+                           "config_mnist.h provides", workers > 0 ? 'w' : 'd');
+    }
+#endif
+    if (socket_path != NULL && (target_stream != NULL || epochs > 0 ||
+                                threads > 0 || workers > 0)) {
+        errx(EXIT_FAILURE, "-u predicts, it cannot be used with -t, -e, -d, "
+                           "-j or -w");
+    }
+    if (epochs > 0 || threads > 0 || workers > 0) {
+        in = dataset_map(input_stream, INPUT_LENGTH);
+        tg = target_stream ? dataset_map(target_stream, OUTPUT_LENGTH)
+                           : (struct dataset){0};
+        if (in.data == NULL || tg.data == NULL || tg.rec < in.rec ||
+            in.rec > UINT32_MAX) {
+            errx(EXIT_FAILURE,
+                 "-e, -d, -j and -w need regular input and target files");
+        }
+        records = (uint32_t)in.rec;
+    }
+    if (threads > 0 || workers > 0) {
+        // The threads (or processes) call the gemm concurrently, each
+        // computes in its thread
+        kern_threads(1);
+    } else {
+        dataset_unmap(in);
+        dataset_unmap(tg);
+    }
+    if (epochs > 0 && workers == 0) {
+        order = reallocarray(NULL, records, sizeof(uint32_t));
+        if (NULL == order) {
+            err(EXIT_FAILURE, "allocate the record order memory");
+        }
+        for (uint32_t i = 0; i < records; i++) order[i] = i;
+    }
 
-        predict(input);
+    // Train in worker processes, which shuffle their shards themselves
+#ifdef LAYER_PARAMETERS
+    if (workers > 0) {
+        pserver_run(workers, staleness, push_len, &in, &tg, epochs, batch_len,
+                    &report);
+        samples = report.samples;
+    }
+#endif
+
+    // Serve the predictions of the clients of the socket
+    if (socket_path != NULL) {
+        server = iserver_open(socket_path, batch_len, INPUT_LENGTH,
+                              output_size(output_mode, top_k), wait_us);
+        if (NULL == server) {
+            err(EXIT_FAILURE, "listen on %s", socket_path);
+        }
+        samples = serve(output_mode, top_k, top_idx, top_val,
+                        &predict_duration, &batch_wait);
+        iserver_close(server);
+    }
 
-        // Process (train) only if target_stream file is set (and open) to get
-        // the expected output
-        if (target_stream != NULL) {
-            if (fread(target, sizeof(num_type), ARRAY_LENGTH(target),
-                      target_stream) != ARRAY_LENGTH(target)) {
-                err(EXIT_FAILURE, "loading target array");
+    double stall_us = 0.0;
+    const bool batches = workers == 0 && socket_path == NULL;
+    for (uint32_t epoch = 0; batches && epoch < (epochs > 0 ? epochs : 1);
+         epoch++) {
+        TRACE_SCOPE("epoch");
+        const uint64_t epoch_samples = report.samples;
+        const uint64_t epoch_hits    = report.hits;
+        struct timespec epoch_period = stopwatch_start();
+        if (order != NULL) rng_shuffle(kern_rng(), records, order);
+        if (threads > 0) {
+            if (freeze) {
+                shard_epoch(threads, &in, &tg, batch_len, &report);
+            } else {
+#ifdef LAYER_PARAMETERS
+                if (deterministic) {
+                    parallel_epoch(threads, &in, &tg, order, batch_len,
+                                   &report);
+                } else {
+                    hogwild_epoch(threads, &in, &tg, order, batch_len,
+                                  &report);
+                }
+#else
+                hogwild_epoch(threads, &in, &tg, order, batch_len, &report);
+#endif
+            }
+            samples += report.samples - epoch_samples;
+            if (report.samples == epoch_samples) continue;
+            const double accuracy = (double)(report.hits - epoch_hits) /
+                                    (double)(report.samples - epoch_samples);
+            if (freeze) {
+                fprintf(stderr, "evaluation: %.3f s, %llu samples, "
+                                "accuracy %.4f\n",
+                        stopwatch_stop_us(epoch_period) * 1e-6,
+                        (unsigned long long)(report.samples - epoch_samples),
+                        accuracy);
+            } else {
+                fprintf(stderr, "epoch %u: %.3f s, accuracy %.4f\n",
+                        epoch + 1, stopwatch_stop_us(epoch_period) * 1e-6,
+                        accuracy);
             }
-            batch_error = prediction_error(target);
+            continue;
+        }
 
-            if (!freeze) {
-                train(input);
+        // The input and target batches are read by the reader thread (or
+        // gathered in the order of the epoch) and the outputs are written by
+        // the writer thread of the batch io. The last batch is shorter if the
+        // input ends within a batch.
+        struct batchio *io = batchio_open(
+            input_stream, target_stream, order ? NULL : stdout, batch_len,
+            INPUT_LENGTH, OUTPUT_LENGTH, output_size(output_mode, top_k),
+            BATCHIO_DEPTH, order);
+        if (NULL == io) {
+            err(EXIT_FAILURE, "allocate batch io memory");
+        }
+        for (;;) {
+            TRACE_BEGIN(input_span, "input");
+            struct batch *batch = batchio_read(io);
+            TRACE_END(input_span);
+            if (batch == NULL) break;
+            const num_type *input  = batch->input;
+            const num_type *target = batch->target;
+            batch_length           = batch->len;
+            samples += batch->len;
+            if (reference) {
+                TRACE_SCOPE("reference");
+                float max;
+                layer_quantize(false);
+                struct timespec ref_period = stopwatch_start();
+                predict(input);
+                stats_collect2(&ref_duration, stopwatch_stop_us(ref_period));
+                for (uint32_t i = 0; i < batch_length; i++) {
+                    ref_class[i] = argmax(OUTPUT_LENGTH,
+                                          &output[i * OUTPUT_LENGTH], &max);
+                }
+                layer_quantize(true);
             }
 
-            stats_collect2(&avg_duration, stopwatch_stop_us(route_period));
-            stats_collect2(&error_stats, batch_error);
+            struct timespec route_period = stopwatch_start();
+
+            TRACE_BEGIN(predict_span, "predict");
+            predict(input);
+            TRACE_END(predict_span);
+            stats_collect2(&predict_duration, stopwatch_stop_us(route_period));
+
+            // Process (train) only if target_stream file is set (and open) to
+            // get the expected output
+            if (target_stream != NULL) {
+                TRACE_BEGIN(error_span, "error");
+                batch_error = prediction_error(target);
 
-            report_print(++total, hits, error_stats, avg_duration);
-            hits = monitor(ARRAY_LENGTH(target), target, error_stats,
-                           avg_duration, total, hits);
-            //create new line and close the monitor output
-            fprintf(stderr, "\n");
+                for (uint32_t i = 0; reference && i < batch_length; i++) {
+                    float max;
+                    const uint32_t t =
+                        argmax(OUTPUT_LENGTH, &target[i * OUTPUT_LENGTH], &max);
+                    const uint32_t q =
+                        argmax(OUTPUT_LENGTH, &output[i * OUTPUT_LENGTH], &max);
+                    ref_hits += ref_class[i] == t;
+                    ref_agree += ref_class[i] == q;
+                }
+                TRACE_END(error_span);
+
+                if (!freeze) {
+                    TRACE_SCOPE("train");
+                    train(input);
+                }
+
+                const double duration = stopwatch_stop_us(route_period);
+                TRACE_BEGIN(report_span, "report");
+                report_collect(&report, batch_length,
+                               monitor(OUTPUT_LENGTH, target), batch_error,
+                               duration);
+                TRACE_END(report_span);
+            }
+
+            // Pass the resulting output records to the writer (stdout)
+            TRACE_BEGIN(output_span, "output");
+            if (order == NULL) {
+                output_encode(output_mode, top_k, batch_length, output,
+                              top_idx, top_val, batch->output);
+            }
+            batchio_write(io, batch);
+            TRACE_END(output_span);
         }
+        stall_us += batchio_stall_us(io);
+        batchio_close(io);
 
-        // Write the resulting output array to stdout
-        if (fwrite(output, sizeof(num_type), OUTPUT_LENGTH * BATCH_LENGTH,
-                   stdout) != OUTPUT_LENGTH * BATCH_LENGTH) {
-            err(EXIT_FAILURE, "writing output array");
+        // Write the time and the (training) accuracy of the epoch
+        if (order != NULL && report.samples > epoch_samples) {
+            fprintf(stderr, "epoch %u: %.3f s, accuracy %.4f\n", epoch + 1,
+                    stopwatch_stop_us(epoch_period) * 1e-6,
+                    (double)(report.hits - epoch_hits) /
+                        (double)(report.samples - epoch_samples));
         }
     }
+    free(order);
+    const double run_us = stopwatch_stop_us(run_period);
+    report_summary(&report);
+    if (threads > 0 || workers > 0) {
+        dataset_unmap(in);
+        dataset_unmap(tg);
+    }
+
+    // Write the throughput of the batch length (including the file input and
+    // output), the mean time of a prediction and the share of the time the
+    // computation waited for the input
+    if (samples > 0 && socket_path != NULL) {
+        fprintf(stderr,
+                "batch %u: %llu requests, %.1f per batch, predict %.1f "
+                "us/batch, wait %.1f us/batch\n",
+                batch_len, (unsigned long long)samples,
+                (double)samples / stats_samples(&predict_duration),
+                stats_mean(&predict_duration), stats_mean(&batch_wait));
+    } else if (samples > 0 && workers > 0) {
+        fprintf(stderr, "batch %u: %.1f samples/s, workers %u\n", batch_len,
+                (double)samples * 1e6 / run_us, workers);
+    } else if (samples > 0 && threads > 0) {
+        fprintf(stderr, "batch %u: %.1f samples/s, threads %u\n", batch_len,
+                (double)samples * 1e6 / run_us, threads);
+    } else if (samples > 0) {
+        fprintf(stderr,
+                "batch %u: %.1f samples/s, predict %.1f us/batch, "
+                "io stall %.1f%%\n",
+                batch_len, (double)samples * 1e6 / run_us,
+                stats_mean(&predict_duration), 100.0 * stall_us / run_us);
+    }
 
     // Write the training report to stdout and close the target stream if
     // training is enabled
     if (NULL != target_stream) {
         fclose(target_stream);
+        if (reference && threads == 0 && report.samples > 0) {
+            const double n = (double)report.samples;
+            fprintf(stderr,
+                    "quantized accuracy: %.4f, fp32 accuracy: %.4f, "
+                    "agreement: %.4f, speedup: %.2f\n",
+                    (double)report.hits / n, (double)ref_hits / n,
+                    (double)ref_agree / n,
+                    stats_mean(&ref_duration) / stats_mean(&predict_duration));
+        }
     }
 
     layer_destruct();
+    free(ref_class);
+    free(top_idx);
+    free(top_val);
 
     if (input_stream != stdin) fclose(input_stream);
+    if (report_stream != stderr) fclose(report_stream);
+#ifdef WITH_TRACE
+    trace_finish(0);
+#endif
     return EXIT_SUCCESS;
 }
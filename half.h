@@ -0,0 +1,87 @@
+/**
+ * # The 16 bit floating point formats
+ *
+ * Conversions between `float` and the 16 bit storage formats of the weights:
+ * IEEE 754 half precision (fp16: 5 exponent, 10 mantissa bits) and bfloat16
+ * (bf16: the upper 16 bits of a float, 8 exponent, 7 mantissa bits).
+ *
+ * The conversions to 16 bit round to the nearest even value. They are the
+ * portable fallback of the vectorized conversions (F16C, AVX-512) in simd.h.
+ */
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * ### f16_to_f32()
+ *
+ * Return the float value of the fp16 bits `h` (exact).
+ */
+static inline float f16_to_f32(uint16_t h) {
+    const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    const uint32_t exp  = (h >> 10) & 0x1f;
+    const uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (mant << 13);
+    } else if (exp == 0) {
+        // zero and subnormal numbers: mant * 2^-24
+        const float f = (float)mant * 0x1p-24f;
+        return sign ? -f : f;
+    } else {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/**
+ * ### f32_to_f16()
+ *
+ * Return the fp16 bits of the float `f`. Values beyond the fp16 range are
+ * converted to infinity.
+ */
+static inline uint16_t f32_to_f16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    const uint16_t sign = (x >> 16) & 0x8000;
+    const uint32_t absx = x & 0x7fffffff;
+    if (absx > 0x7f800000) return sign | 0x7e00;  // NaN
+    if (absx >= 0x477ff000) return sign | 0x7c00; // >= 65520: infinity
+    if (absx < 0x38800000) {
+        // zero and subnormal numbers (< 2^-14): multiples of 2^-24
+        float a;
+        memcpy(&a, &absx, sizeof(a));
+        return sign | (uint16_t)lrintf(a * 0x1p24f);
+    }
+    const uint32_t r = absx + 0xfff + ((absx >> 13) & 1) - (112u << 23);
+    return sign | (uint16_t)(r >> 13);
+}
+
+/**
+ * ### bf16_to_f32()
+ *
+ * Return the float value of the bf16 bits `h` (exact).
+ */
+static inline float bf16_to_f32(uint16_t h) {
+    const uint32_t bits = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/**
+ * ### f32_to_bf16()
+ *
+ * Return the bf16 bits of the float `f`.
+ */
+static inline uint16_t f32_to_bf16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7fffffff) > 0x7f800000) return (x >> 16) | 0x40; // quiet NaN
+    return (uint16_t)((x + 0x7fff + ((x >> 16) & 1)) >> 16);
+}
@@ -0,0 +1,63 @@
+#include "hist.h"
+
+#define HIST_SUB (1u << HIST_SUB_BITS)
+
+/*
+ * Return the bucket of the value: the values below HIST_SUB are their own
+ * bucket, a greater value is in the sub-bucket of its HIST_SUB_BITS bits
+ * after the most significant one (of the buckets of its power of two).
+ */
+static uint32_t hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) return (uint32_t)v;
+    const uint32_t msb = 63u - (uint32_t)__builtin_clzll(v);
+    if (msb >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+    const uint32_t shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) |
+           (uint32_t)((v >> shift) & (HIST_SUB - 1));
+}
+
+/*
+ * Return the least value of the bucket and its width (in `width`).
+ */
+static uint64_t hist_lowest(uint32_t bucket, uint64_t *width) {
+    const uint32_t block = bucket >> HIST_SUB_BITS;
+    const uint64_t sub   = bucket & (HIST_SUB - 1);
+    if (block == 0) {
+        *width = 1;
+        return sub;
+    }
+    *width = 1ull << (block - 1);
+    return (HIST_SUB + sub) << (block - 1);
+}
+
+void hist_collect(struct hist *h, double us) {
+    const uint64_t ns = us > 0.0 ? (uint64_t)(us * 1e3 + 0.5) : 0;
+    h->count++;
+    if (ns > h->max) h->max = ns;
+    h->bucket[hist_bucket(ns)]++;
+}
+
+void hist_merge(struct hist *h, const struct hist *part) {
+    h->count += part->count;
+    if (part->max > h->max) h->max = part->max;
+    for (uint32_t i = 0; i < HIST_BUCKETS; i++) h->bucket[i] += part->bucket[i];
+}
+
+double hist_quantile(const struct hist *h, double q) {
+    if (h->count == 0) return 0.0;
+    if (q >= 1.0) return (double)h->max * 1e-3;
+    // the rank of the duration (1 to count)
+    const double r = q * (double)h->count;
+    uint64_t rank  = r < 1.0 ? 1 : (uint64_t)r;
+    rank += (double)rank < r;
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < HIST_BUCKETS; i++) {
+        n += h->bucket[i];
+        if (n < rank) continue;
+        uint64_t width;
+        const double mid = (double)hist_lowest(i, &width) +
+                           (double)(width - 1) * 0.5;
+        return (mid < (double)h->max ? mid : (double)h->max) * 1e-3;
+    }
+    return (double)h->max * 1e-3;
+}
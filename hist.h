@@ -0,0 +1,64 @@
+// A latency histogram with logarithmic buckets (like the HDR histogram): the
+// durations are counted in nanoseconds, the values below 2^HIST_SUB_BITS ns
+// exactly and the greater values in 2^HIST_SUB_BITS linear sub-buckets per
+// power of two. The relative error of a quantile is at most
+// 2^-HIST_SUB_BITS (1.6%) at any scale, the maximum is exact.
+//
+// The histograms of disjoint sets of durations (e.g. of threads or shards)
+// are merged by adding their buckets: the merged quantiles are the quantiles
+// of all durations.
+//
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * ### HIST_SUB_BITS - The sub-buckets per power of two (log2).
+ */
+#define HIST_SUB_BITS 6
+
+/**
+ * ### HIST_MAX_BITS - The durations up to 2^HIST_MAX_BITS ns (68 s) are
+ * resolved, longer ones are counted in the last bucket.
+ */
+#define HIST_MAX_BITS 36
+
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/**
+ * ### struct hist
+ *
+ *  - `count` The number of durations.
+ *  - `max` The maximal duration in ns.
+ *  - `bucket` The number of durations of a bucket.
+ */
+struct hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+/**
+ * ### hist_collect()
+ *
+ * Count a duration of `us` microseconds (resolved to nanoseconds, negative
+ * durations count as 0).
+ */
+void hist_collect(struct hist *h, double us);
+
+/**
+ * ### hist_merge()
+ *
+ * Add the durations of the histogram `part` to the histogram `h`.
+ */
+void hist_merge(struct hist *h, const struct hist *part);
+
+/**
+ * ### hist_quantile()
+ *
+ * Returns the duration in microseconds, which `q` (0 to 1) of the durations
+ * do not exceed: the middle of its bucket (at most the maximal duration), the
+ * maximal duration for q = 1 and 0 for an empty histogram.
+ */
+double hist_quantile(const struct hist *h, double q);
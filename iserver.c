@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+#include "iserver.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The server polls the listening socket (poll[0]), the pipe of
+ * iserver_stop() (poll[1]) and the `clients` connections (poll[2], ...). A
+ * request of the batch remembers the number of its client, -1 if the
+ * connection is closed.
+ */
+#define ISERVER_FDS 2
+
+/*
+ * The replies of a client, which did not fit into its socket: `len` bytes
+ * from `head` of the buffer `out` (of `size` bytes). `since` is the time (in
+ * ns) since which the client has taken no reply.
+ */
+struct iserver_queue {
+    char *out;
+    size_t head, len, size;
+    uint64_t since;
+};
+
+struct iserver {
+    int fd;
+    int stop[2];  // the pipe of iserver_stop(): [0] read, [1] write
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    uint32_t input_len;
+    size_t output_size;
+    uint64_t wait_ns;
+    uint64_t timeout_ns;  // see ISERVER_TIMEOUT_MS
+    struct pollfd *poll;
+    struct iserver_queue *queue;  // the queue of each client
+    uint32_t clients, capacity;
+    uint32_t next;  // the client received first (round robin)
+    bool stopped;
+    struct iserver_batch batch;
+    uint32_t batch_len;
+    int *client;        // the client of a request
+    uint64_t first_ns;  // the arrival of the first request of the batch
+};
+
+static uint64_t iserver_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+struct iserver *iserver_open(const char *path, uint32_t batch_len,
+                             uint32_t input_len, size_t output_size,
+                             uint64_t wait_us) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct iserver *srv = calloc(1, sizeof(*srv));
+    if (srv == NULL) return NULL;
+    srv->input_len    = input_len;
+    srv->output_size  = output_size;
+    srv->wait_ns      = wait_us * 1000;
+    srv->timeout_ns   = (uint64_t)ISERVER_TIMEOUT_MS * 1000000;
+    srv->batch_len    = batch_len;
+    srv->capacity     = 16;
+    srv->poll         = calloc(ISERVER_FDS + 16, sizeof(struct pollfd));
+    srv->queue        = calloc(16, sizeof(struct iserver_queue));
+    srv->client       = calloc(batch_len, sizeof(int));
+    srv->batch.input  = calloc((size_t)batch_len * input_len, sizeof(float));
+    srv->batch.output = calloc(batch_len, output_size);
+    srv->stop[0]      = -1;
+    srv->stop[1]      = -1;
+    strcpy(srv->path, path);
+
+    const int type = SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC;
+    srv->fd        = socket(AF_UNIX, type, 0);
+    if (srv->poll == NULL || srv->queue == NULL || srv->client == NULL ||
+        srv->batch.input == NULL || srv->batch.output == NULL || srv->fd < 0 ||
+        pipe2(srv->stop, O_NONBLOCK | O_CLOEXEC)) {
+        goto fail;
+    }
+    unlink(path);
+    if (bind(srv->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(srv->fd, ISERVER_BACKLOG)) {
+        goto fail;
+    }
+    srv->poll[0] = (struct pollfd){.fd = srv->fd, .events = POLLIN};
+    srv->poll[1] = (struct pollfd){.fd = srv->stop[0], .events = POLLIN};
+    return srv;
+fail:;
+    const int error = errno;
+    if (srv->fd >= 0) close(srv->fd);
+    if (srv->stop[0] >= 0) close(srv->stop[0]);
+    if (srv->stop[1] >= 0) close(srv->stop[1]);
+    free(srv->poll);
+    free(srv->queue);
+    free(srv->client);
+    free(srv->batch.input);
+    free(srv->batch.output);
+    free(srv);
+    errno = error;
+    return NULL;
+}
+
+/*
+ * Accept the pending connections (without blocking).
+ */
+static void iserver_accept(struct iserver *srv) {
+    int fd;
+    while ((fd = accept4(srv->fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if (srv->clients == srv->capacity) {
+            struct pollfd *p =
+                reallocarray(srv->poll, ISERVER_FDS + 2 * srv->capacity,
+                             sizeof(*p));
+            if (p == NULL) {
+                close(fd);
+                return;
+            }
+            srv->poll = p;
+            struct iserver_queue *q =
+                reallocarray(srv->queue, 2 * srv->capacity, sizeof(*q));
+            if (q == NULL) {
+                close(fd);
+                return;
+            }
+            srv->queue = q;
+            srv->capacity *= 2;
+        }
+        srv->queue[srv->clients] = (struct iserver_queue){0};
+        srv->poll[ISERVER_FDS + srv->clients++] =
+            (struct pollfd){.fd = fd, .events = POLLIN};
+    }
+}
+
+/*
+ * Close the connection of the client `i`: its queued replies and its
+ * requests of the batch get no reply. The last client takes its place.
+ */
+static void iserver_drop(struct iserver *srv, uint32_t i) {
+    struct pollfd *p    = &srv->poll[ISERVER_FDS];
+    const uint32_t last = --srv->clients;
+    for (uint32_t k = 0; k < srv->batch.len; k++) {
+        if (srv->client[k] == (int)i) {
+            srv->client[k] = -1;
+        } else if (srv->client[k] == (int)last) {
+            srv->client[k] = (int)i;
+        }
+    }
+    close(p[i].fd);
+    free(srv->queue[i].out);
+    p[i]          = p[last];
+    srv->queue[i] = srv->queue[last];
+}
+
+/*
+ * Poll the connection of the client `i` for its requests (unless the server
+ * is stopped) and, if replies are queued, for room for them.
+ */
+static void iserver_events(struct iserver *srv, uint32_t i) {
+    srv->poll[ISERVER_FDS + i].events =
+        (short)((srv->stopped ? 0 : POLLIN) |
+                (srv->queue[i].len > 0 ? POLLOUT : 0));
+}
+
+/*
+ * Send the reply `rec` to the client `i` or, if its socket is full, queue it
+ * behind its queued replies. Returns false if the connection failed.
+ */
+static bool iserver_send(struct iserver *srv, uint32_t i, const char *rec) {
+    struct iserver_queue *q = &srv->queue[i];
+    const size_t size       = srv->output_size;
+    if (q->len == 0) {
+        const int fd = srv->poll[ISERVER_FDS + i].fd;
+        if (send(fd, rec, size, MSG_NOSIGNAL) >= 0) return true;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+        q->since = iserver_now_ns();
+    }
+    if (q->head + q->len + size > q->size) {
+        // move the queued replies to the front and grow the buffer
+        if (q->head > 0) memmove(q->out, &q->out[q->head], q->len);
+        q->head = 0;
+        if (q->len + size > q->size) {
+            const size_t n = 2 * (q->len + size);
+            char *out      = realloc(q->out, n);
+            if (out == NULL) return false;
+            q->out  = out;
+            q->size = n;
+        }
+    }
+    memcpy(&q->out[q->head + q->len], rec, size);
+    q->len += size;
+    iserver_events(srv, i);
+    return true;
+}
+
+/*
+ * Send the queued replies of the client `i` until its socket is full.
+ * Returns false if the connection failed.
+ */
+static bool iserver_flush(struct iserver *srv, uint32_t i) {
+    struct iserver_queue *q = &srv->queue[i];
+    const int fd            = srv->poll[ISERVER_FDS + i].fd;
+    bool sent               = false;
+    while (q->len > 0) {
+        if (send(fd, &q->out[q->head], srv->output_size, MSG_NOSIGNAL) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+            break;
+        }
+        q->head += srv->output_size;
+        q->len -= srv->output_size;
+        sent = true;
+    }
+    if (q->len == 0) {
+        q->head = 0;
+    } else if (sent) {
+        q->since = iserver_now_ns();
+    }
+    iserver_events(srv, i);
+    return true;
+}
+
+/*
+ * Returns the time (in ns) at which the first client with queued replies
+ * times out or UINT64_MAX.
+ */
+static uint64_t iserver_expiry(const struct iserver *srv) {
+    uint64_t expiry = UINT64_MAX;
+    for (uint32_t i = 0; i < srv->clients; i++) {
+        const struct iserver_queue *q = &srv->queue[i];
+        if (q->len > 0 && q->since + srv->timeout_ns < expiry) {
+            expiry = q->since + srv->timeout_ns;
+        }
+    }
+    return expiry;
+}
+
+/*
+ * Send the queued replies of the clients with room in their sockets and
+ * close the connections of the clients, which have taken no reply for the
+ * timeout.
+ */
+static void iserver_service(struct iserver *srv) {
+    const short ready = POLLOUT | POLLERR | POLLHUP;
+    // downwards: a dropped client is replaced by one already serviced
+    for (uint32_t i = srv->clients; i-- > 0;) {
+        const struct iserver_queue *q = &srv->queue[i];
+        if (q->len == 0) continue;
+        if ((srv->poll[ISERVER_FDS + i].revents & ready) &&
+            !iserver_flush(srv, i)) {
+            iserver_drop(srv, i);
+        } else if (q->len > 0 &&
+                   iserver_now_ns() >= q->since + srv->timeout_ns) {
+            iserver_drop(srv, i);
+        }
+    }
+}
+
+/*
+ * Returns the ppoll() timeout until the time `deadline` (in ns) or NULL if
+ * it is UINT64_MAX.
+ */
+static struct timespec *iserver_timeout(uint64_t deadline,
+                                        struct timespec *timeout) {
+    if (deadline == UINT64_MAX) return NULL;
+    const uint64_t now  = iserver_now_ns();
+    const uint64_t left = deadline > now ? deadline - now : 0;
+    *timeout = (struct timespec){.tv_sec  = (time_t)(left / 1000000000),
+                                 .tv_nsec = (long)(left % 1000000000)};
+    return timeout;
+}
+
+/*
+ * Receive the pending requests of the clients into the batch, beginning with
+ * the client after the one of the last call, so that a client with many
+ * requests cannot starve the others.
+ */
+static void iserver_receive(struct iserver *srv) {
+    const size_t size      = sizeof(float) * srv->input_len;
+    struct pollfd *p       = &srv->poll[ISERVER_FDS];
+    const uint32_t clients = srv->clients;
+    const uint32_t first = clients ? srv->next % clients : 0;
+    for (uint32_t n = 0; n < clients && srv->batch.len < srv->batch_len; n++) {
+        const uint32_t i = (first + n) % clients;
+        if (i >= srv->clients || (p[i].revents & ~POLLOUT) == 0) continue;
+        for (;;) {
+            if (srv->batch.len == srv->batch_len) {
+                // the next batch begins with the next client, this one
+                // receives the rest after the others
+                srv->next = i + 1;
+                return;
+            }
+            float *x =
+                &srv->batch.input[(size_t)srv->batch.len * srv->input_len];
+            // the length of a longer message is returned (MSG_TRUNC)
+            const ssize_t len = recv(p[i].fd, x, size, MSG_TRUNC);
+            if (len == (ssize_t)size) {
+                if (srv->batch.len == 0) srv->first_ns = iserver_now_ns();
+                srv->client[srv->batch.len++] = (int)i;
+                continue;
+            }
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            // closed by the client, failed or a message of another size
+            p[i].revents = 0;
+            iserver_drop(srv, i);
+            break;
+        }
+    }
+    srv->next = first + 1;
+}
+
+struct iserver_batch *iserver_read(struct iserver *srv) {
+    srv->batch.len = 0;
+    while (!srv->stopped && srv->batch.len < srv->batch_len) {
+        // wait for the deadline of the batch or the timeout of a client
+        uint64_t deadline = iserver_expiry(srv);
+        if (srv->batch.len > 0) {
+            const uint64_t waited = iserver_now_ns() - srv->first_ns;
+            if (waited >= srv->wait_ns) break;
+            if (srv->first_ns + srv->wait_ns < deadline) {
+                deadline = srv->first_ns + srv->wait_ns;
+            }
+        }
+        struct timespec timeout;
+        if (ppoll(srv->poll, ISERVER_FDS + srv->clients,
+                  iserver_timeout(deadline, &timeout), NULL) < 0) {
+            if (errno == EINTR || errno == ENOMEM) continue;
+            break;
+        }
+        if (srv->poll[1].revents) srv->stopped = true;
+        if (srv->poll[0].revents) iserver_accept(srv);
+        iserver_service(srv);
+        iserver_receive(srv);
+    }
+    if (srv->batch.len == 0) return NULL;
+    srv->batch.wait_us = (double)(iserver_now_ns() - srv->first_ns) * 1e-3;
+    return &srv->batch;
+}
+
+void iserver_write(struct iserver *srv, struct iserver_batch *batch) {
+    const char *rec = batch->output;
+    for (uint32_t k = 0; k < batch->len; k++, rec += srv->output_size) {
+        const int i = srv->client[k];
+        if (i >= 0 && !iserver_send(srv, (uint32_t)i, rec)) {
+            iserver_drop(srv, (uint32_t)i);
+        }
+    }
+}
+
+void iserver_stop(struct iserver *srv) {
+    const char stop = 1;
+    (void)!write(srv->stop[1], &stop, sizeof(stop));
+}
+
+void iserver_close(struct iserver *srv) {
+    // send the queued replies: the other connections are closed, a client,
+    // which takes no reply for the timeout, is dropped
+    srv->stopped   = true;
+    srv->batch.len = 0;
+    for (;;) {
+        for (uint32_t i = srv->clients; i-- > 0;) {
+            if (srv->queue[i].len == 0) {
+                iserver_drop(srv, i);
+            } else {
+                iserver_events(srv, i);
+            }
+        }
+        if (srv->clients == 0) break;
+        struct timespec timeout;
+        if (ppoll(&srv->poll[ISERVER_FDS], srv->clients,
+                  iserver_timeout(iserver_expiry(srv), &timeout), NULL) < 0 &&
+            errno != EINTR && errno != ENOMEM) {
+            break;
+        }
+        iserver_service(srv);
+    }
+    for (uint32_t i = 0; i < srv->clients; i++) {
+        close(srv->poll[ISERVER_FDS + i].fd);
+        free(srv->queue[i].out);
+    }
+    close(srv->fd);
+    close(srv->stop[0]);
+    close(srv->stop[1]);
+    unlink(srv->path);
+    free(srv->poll);
+    free(srv->queue);
+    free(srv->client);
+    free(srv->batch.input);
+    free(srv->batch.output);
+    free(srv);
+}
@@ -0,0 +1,117 @@
+// The inference server (`gstnn -u SOCKET`): clients connect to a Unix domain
+// socket and send single input vectors, the server coalesces the requests of
+// all clients into micro-batches, which are predicted at once, and sends each
+// client the output records of its requests (in the order of its requests).
+//
+// A micro-batch is complete when it holds `batch_len` requests or when its
+// first request has waited `wait_us` microseconds: the batches are large
+// under load and a single request waits at most `wait_us` (plus the
+// prediction of the batch before).
+//
+// A request is a message (SOCK_SEQPACKET) of one input vector (`input_len`
+// floats), its reply a message of one output record (`output_size` bytes). A
+// client may send further requests before it receives the replies. A message
+// of another size closes the connection.
+//
+// The server never blocks on a client: the replies, which do not fit into the
+// socket of a client, are queued and sent while the server waits for the
+// requests. A client, which takes no reply for ISERVER_TIMEOUT_MS, is
+// disconnected.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * ### ISERVER_WAIT_US - The default deadline of a micro-batch in us.
+ */
+#define ISERVER_WAIT_US 1000
+
+/**
+ * ### ISERVER_TIMEOUT_MS - The time in ms a client with queued replies may
+ * take none of them before its connection is closed.
+ */
+#define ISERVER_TIMEOUT_MS 1000
+
+/**
+ * ### ISERVER_BACKLOG - The number of pending connections of the socket.
+ */
+#define ISERVER_BACKLOG 64
+
+/**
+ * ### struct iserver_batch
+ *
+ * A micro-batch of requests.
+ *
+ *  - `len` The number of requests.
+ *  - `input` The `len` input vectors.
+ *  - `output` The `len` output records, written by the caller.
+ *  - `wait_us` The time the first request waited for the batch in us.
+ */
+struct iserver_batch {
+    uint32_t len;
+    float *input;
+    void *output;
+    double wait_us;
+};
+
+struct iserver;
+
+/**
+ * ### iserver_open()
+ *
+ * Create the socket (replacing a stale socket file of the path) and listen
+ * for the clients.
+ *
+ * #### Parameters
+ *
+ *  - `path` The path of the Unix domain socket.
+ *  - `batch_len` The maximal number of requests of a micro-batch.
+ *  - `input_len` The length of an input vector.
+ *  - `output_size` The size of an output record in bytes.
+ *  - `wait_us` The deadline of a micro-batch in microseconds.
+ *
+ *  Returns the server or NULL on failure (see errno).
+ */
+struct iserver *iserver_open(const char *path, uint32_t batch_len,
+                             uint32_t input_len, size_t output_size,
+                             uint64_t wait_us);
+
+/**
+ * ### iserver_read()
+ *
+ * Accept the connections, receive the requests until the micro-batch is
+ * complete and send the queued replies. After iserver_stop(), the received
+ * requests are returned as the last batch.
+ *
+ * Returns the micro-batch or NULL if the server is stopped.
+ */
+struct iserver_batch *iserver_read(struct iserver *srv);
+
+/**
+ * ### iserver_write()
+ *
+ * Send the output records of the micro-batch to their clients without
+ * blocking: the records, which do not fit into the socket of a client, are
+ * queued (see iserver_read()). A client, which closed its connection, is
+ * skipped.
+ */
+void iserver_write(struct iserver *srv, struct iserver_batch *batch);
+
+/**
+ * ### iserver_stop()
+ *
+ * Stop the server (iserver_read() returns NULL). It is async-signal-safe: a
+ * signal handler may call it.
+ */
+void iserver_stop(struct iserver *srv);
+
+/**
+ * ### iserver_close()
+ *
+ * Send the queued replies (waiting at most ISERVER_TIMEOUT_MS for a client),
+ * close the connections and the socket and remove the socket file.
+ */
+void iserver_close(struct iserver *srv);
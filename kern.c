@@ -3,14 +3,22 @@
  */
 
 #include "kern.h"
+#include "gemm.h"
+#include "half.h"
+#include "kern_simd.h"
+#include "trace.h"
 
+#ifdef WITH_OPENBLAS
 #include <cblas.h>
+#endif
 #include <err.h>
 #include <fcntl.h>
 #include <float.h>
 #include <math.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
@@ -25,6 +33,119 @@
 
 #define PRAGMA(X) _Pragma(#X)
 
+/*
+ * The instruction set variants are optional at link time (`make ISA=` links
+ * the scalar variant only). The kernels need an x86-64 compiler: simd.h and
+ * qgemm.c use the x86 intrinsics in every variant.
+ */
+#pragma weak kern_simd_sse42
+#pragma weak kern_simd_avx2
+#pragma weak kern_simd_avx512
+
+/* The kernels of the selected instruction set. */
+static const struct kern_simd *simd = &kern_simd_scalar;
+
+/* The int8 product of the selected instruction set (VNNI if supported). */
+static void (*qgemm_dot)(uint32_t n, uint32_t ld, const int8_t *x,
+                         const int8_t *w, const int32_t *wsum,
+                         int32_t *y) = NULL;
+
+/*
+ * Return the kernel table of the instruction set `name` or NULL, if the
+ * variant is not linked or not supported by the CPU.
+ */
+static const struct kern_simd *isa_table(const char *name) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (strcmp(name, "avx512") == 0 && &kern_simd_avx512 != NULL &&
+        __builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512dq") &&
+        __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vl")) {
+        return &kern_simd_avx512;
+    }
+    if (strcmp(name, "avx2") == 0 && &kern_simd_avx2 != NULL &&
+        __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+        __builtin_cpu_supports("f16c")) {
+        return &kern_simd_avx2;
+    }
+    if (strcmp(name, "sse42") == 0 && &kern_simd_sse42 != NULL &&
+        __builtin_cpu_supports("sse4.2")) {
+        return &kern_simd_sse42;
+    }
+#endif
+    if (strcmp(name, "scalar") == 0) return &kern_simd_scalar;
+    return NULL;
+}
+
+bool kern_isa_select(const char *name) {
+    const struct kern_simd *table = isa_table(name);
+    if (table == NULL) return false;
+    simd      = table;
+    qgemm_dot = table->qgemm_dot;
+#if defined(__x86_64__) || defined(__i386__)
+    if (table->qgemm_dot_vnni != NULL &&
+        __builtin_cpu_supports("avx512vnni")) {
+        qgemm_dot = table->qgemm_dot_vnni;
+    }
+#endif
+    return true;
+}
+
+const char *kern_isa(void) { return simd->isa; }
+
+void kern_threads(uint32_t n) {
+#ifdef WITH_OPENBLAS
+    openblas_set_num_threads((int)n);
+#else
+    (void)n;
+#endif
+}
+
+/*
+ * Select the best instruction set supported by the CPU before main() runs.
+ * The environment variable `GSTNN_ISA` overrides the selection.
+ */
+__attribute__((constructor)) static void kern_isa_init(void) {
+    const char *env = getenv("GSTNN_ISA");
+    if (env != NULL && *env != '\0') {
+        if (!kern_isa_select(env)) {
+            errx(EXIT_FAILURE, "GSTNN_ISA: instruction set '%s' not available",
+                 env);
+        }
+        return;
+    }
+    const char *best[] = {"avx512", "avx2", "sse42", "scalar"};
+    for (size_t i = 0; i < sizeof(best) / sizeof(best[0]); i++) {
+        if (kern_isa_select(best[i])) return;
+    }
+}
+
+void gemm_f32(bool trans_a, bool trans_b, uint32_t m, uint32_t n, uint32_t k,
+              float alpha, const float *a, uint32_t lda, const float *b,
+              uint32_t ldb, float beta, float *c, uint32_t ldc) {
+    simd->gemm_f32(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, beta, c,
+                   ldc);
+}
+
+/*
+ * Row major matrix multiplication c = alpha * op(a) * op(b) + beta * c.
+ * Computed by OpenBLAS or by the built-in gemm_f32() if built with
+ * `make GEMM=builtin`.
+ */
+static inline void matmul(bool trans_a, bool trans_b, uint32_t m, uint32_t n,
+                          uint32_t k, float alpha, const float *a, uint32_t lda,
+                          const float *b, uint32_t ldb, float beta, float *c,
+                          uint32_t ldc) {
+#ifdef WITH_OPENBLAS
+    cblas_sgemm(CblasRowMajor, trans_a ? CblasTrans : CblasNoTrans,
+                trans_b ? CblasTrans : CblasNoTrans, m, n, k, alpha, a, lda, b,
+                ldb, beta, c, ldc);
+#else
+    gemm_f32(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
+#endif
+}
+
 /*
  * Transform the input vector to the output stream.
  * The m x n matrix is stored with column arrays.
@@ -35,8 +156,105 @@
  */
 void trans(uint32_t batch_len, uint32_t m, uint32_t n, const float *w,
            const float *x, float *y) {
-    cblas_sgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, batch_len, n, m,
-                1.0f, x, batch_len, w, m, 0.0f, y, batch_len);
+    TRACE_KERNEL();
+    matmul(false, true, batch_len, n, m, 1.0f, x, m, w, m, 0.0f, y, n);
+}
+
+/*
+ * The number of output columns computed per tile by trans_act(). The bias and
+ * the activation are applied to the tile while it is still in the L1 cache.
+ */
+#define TRANS_TILE 64
+
+void trans_act(uint32_t batch_len, uint32_t m, uint32_t n, const float w[m * n],
+               const float *b, const float x[m * batch_len],
+               void (*act)(uint32_t len, float *y), float y[n * batch_len]) {
+    TRACE_KERNEL();
+    for (uint32_t j0 = 0; j0 < n; j0 += TRANS_TILE) {
+        const uint32_t nb = n - j0 < TRANS_TILE ? n - j0 : TRANS_TILE;
+        matmul(false, true, batch_len, nb, m, 1.0f, x, m, &w[m * j0], m, 0.0f,
+               &y[j0], n);
+        for (uint32_t k = 0; k < batch_len; k++) {
+            float *restrict yr = &y[k * n + j0];
+            if (b != NULL) {
+                for (uint32_t j = 0; j < nb; j++) yr[j] += b[j0 + j];
+            }
+            if (act != NULL && nb < n) act(nb, yr);
+        }
+        // a single tile is contiguous: one call for all rows
+        if (act != NULL && nb == n) act(batch_len * n, y);
+    }
+}
+
+/*
+ * The rows of the quantized matrices are padded to a multiple of 64 bytes, so
+ * the int8 kernels need no tail handling.
+ */
+#define QROW_ALIGN 64
+
+/*
+ * Quantize the vector `x` symmetric to int8: q = round(x / scale) with
+ * scale = max|x| / 127. Return the scale.
+ */
+static float quantize_row(uint32_t len, const float x[restrict len],
+                          int8_t q[restrict len]) {
+    float max = 0.0f;
+    for (uint32_t i = 0; i < len; i++) max = fmaxf(max, fabsf(x[i]));
+    if (max == 0.0f) {
+        memset(q, 0, len);
+        return 0.0f;
+    }
+    const float inv = 127.0f / max;
+    for (uint32_t i = 0; i < len; i++) q[i] = (int8_t)lrintf(x[i] * inv);
+    return max / 127.0f;
+}
+
+struct qmatrix qmatrix_quantize(uint32_t m, uint32_t n, const float w[m * n]) {
+    struct qmatrix q = {
+        .m  = m,
+        .n  = n,
+        .ld = (m + QROW_ALIGN - 1) / QROW_ALIGN * QROW_ALIGN,
+    };
+    q.w     = aligned_alloc(QROW_ALIGN, (size_t)n * q.ld);
+    q.scale = reallocarray(NULL, n, sizeof(float));
+    q.sum   = reallocarray(NULL, n, sizeof(int32_t));
+    if (q.w == NULL || q.scale == NULL || q.sum == NULL) {
+        qmatrix_free(q);
+        return (struct qmatrix){0};
+    }
+    for (uint32_t j = 0; j < n; j++) {
+        int8_t *row = &q.w[(size_t)j * q.ld];
+        q.scale[j]  = quantize_row(m, &w[(size_t)j * m], row);
+        memset(&row[m], 0, q.ld - m);
+        q.sum[j] = 0;
+        for (uint32_t i = 0; i < m; i++) q.sum[j] += row[i];
+    }
+    return q;
+}
+
+void qmatrix_free(struct qmatrix q) {
+    free(q.w);
+    free(q.scale);
+    free(q.sum);
+}
+
+void trans_act_q8(uint32_t batch_len, struct qmatrix w, const float *b,
+                  const float x[w.m * batch_len],
+                  void (*act)(uint32_t len, float *y),
+                  float y[w.n * batch_len]) {
+    TRACE_KERNEL();
+    int8_t xq[w.ld];
+    int32_t yq[w.n];
+    memset(&xq[w.m], 0, w.ld - w.m);
+    for (uint32_t k = 0; k < batch_len; k++) {
+        const float sx     = quantize_row(w.m, &x[k * w.m], xq);
+        float *restrict yr = &y[k * w.n];
+        qgemm_dot(w.n, w.ld, xq, w.w, w.sum, yq);
+        for (uint32_t j = 0; j < w.n; j++) {
+            yr[j] = sx * w.scale[j] * (float)yq[j] + (b != NULL ? b[j] : 0.0f);
+        }
+        if (act != NULL) act(w.n, yr);
+    }
 }
 
 /*
@@ -51,40 +269,70 @@ void trans(uint32_t batch_len, uint32_t m, uint32_t n, const float *w,
 void train_sgd(uint32_t batch_len, uint32_t m, uint32_t n,
                const float x[m * batch_len], const float y[n * batch_len],
                float rate, float w[m * n]) {
-    cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans, n, m, batch_len, -rate,
-                y, n, x, m, 1.0f, w, m);
+    TRACE_KERNEL();
+    matmul(true, false, n, m, batch_len, -rate, y, n, x, m, 1.0f, w, m);
 }
 
 /*
  * adam optimizer for the weight matrix
+ *
+ * The gradient of the whole batch is computed once:
+ * grad(n,m) = dy(l,n)^T * x(l,m)
+ * grad[m * j + $i] = dy[n * $k + j] * x[m * k + $i]
  */
 float train_adam(uint32_t batch_len, uint32_t m, uint32_t n,
-                 const float x[restrict m * batch_len],
-                 const float dy[restrict const n * batch_len], float counter,
-                 float N, float beta1, float beta2, float epsilon,
-                 float w[m * n], float mom[n * m], float veloc[n * m]) {
-    float *restrict wr;
-    float *restrict mr;
-    float *restrict vr;
-    const float *restrict xr;
-    float dr;
-    uint32_t k, i;
-    for (uint32_t j = 0; j < n; j++) {
-        for (k = 0, wr = &w[m * j], vr = &veloc[j * m], mr = &mom[j * m];
-             k < batch_len; k++) {
-            for (i = 0, xr = &x[k * m], dr = dy[k * n + j]; i < m; i++) {
-                const float g      = dr * xr[i];
-                mr[i]              = beta1 * mr[i] + ((1 - beta1) * g);
-                const float mr_hat = mr[i] / (1 - powf(beta1, counter));
-                vr[i] = beta2 * vr[i] + ((1 - beta2) * (powf(g, 2)));
-                const float vr_hat = vr[i] / (1 - powf(beta2, counter));
-                wr[i] -= N * mr_hat / (sqrtf(vr_hat + epsilon));
-            }
-        }
-    }
+                 const float *restrict x, const float *restrict dy,
+                 float counter, float N, float beta1, float beta2,
+                 float epsilon, float *w, float *mom, float *veloc,
+                 float *grad) {
+    TRACE_KERNEL();
+    matmul(true, false, n, m, batch_len, 1.0f, dy, n, x, m, 0.0f, grad, m);
+    const float rate  = N / (1.0f - powf(beta1, counter));
+    const float vcorr = 1.0f / (1.0f - powf(beta2, counter));
+    simd->adam_update(m * n, grad, rate, beta1, beta2, vcorr, epsilon, w, mom,
+                      veloc);
     return counter + 1.0f;
 }
 
+void weights_grad(uint32_t batch_len, uint32_t m, uint32_t n,
+                  const float x[m * batch_len], const float dy[n * batch_len],
+                  float grad[n * m]) {
+    TRACE_KERNEL();
+    matmul(true, false, n, m, batch_len, 1.0f, dy, n, x, m, 0.0f, grad, m);
+}
+
+/*
+ * db(n) = sum_k dy(k,n)
+ */
+void bias_grad(uint32_t batch_len, uint32_t n,
+               const float dy[restrict batch_len * n], float db[restrict n]) {
+    TRACE_KERNEL();
+    for (uint32_t j = 0; j < n; j++) db[j] = dy[j];
+    for (uint32_t k = 1; k < batch_len; k++) {
+        for (uint32_t j = 0; j < n; j++) db[j] += dy[k * n + j];
+    }
+}
+
+void train_sgd_bias(uint32_t batch_len, uint32_t n,
+                    const float dy[batch_len * n], float rate, float b[n]) {
+    TRACE_KERNEL();
+    for (uint32_t k = 0; k < batch_len; k++) {
+        for (uint32_t j = 0; j < n; j++) b[j] -= rate * dy[k * n + j];
+    }
+}
+
+void train_adam_bias(uint32_t batch_len, uint32_t n,
+                     const float dy[batch_len * n], float counter, float N,
+                     float beta1, float beta2, float epsilon, float b[n],
+                     float mom[n], float veloc[n], float grad[n]) {
+    TRACE_KERNEL();
+    bias_grad(batch_len, n, dy, grad);
+    const float rate  = N / (1.0f - powf(beta1, counter));
+    const float vcorr = 1.0f / (1.0f - powf(beta2, counter));
+    simd->adam_update(n, grad, rate, beta1, beta2, vcorr, epsilon, b, mom,
+                      veloc);
+}
+
 /*
  * Original:
  * dx(l,m) = dy(l,n) * w(m,n)^T
@@ -92,8 +340,17 @@ float train_adam(uint32_t batch_len, uint32_t m, uint32_t n,
  */
 void loss(uint32_t batch_len, uint32_t m, uint32_t n, const float *w,
           const float *dy, float *dx) {
-    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, batch_len, m, n, 1.0f,
-                dy, n, w, m, .0f, dx, m);
+    TRACE_KERNEL();
+    matmul(false, false, batch_len, m, n, 1.0f, dy, n, w, m, .0f, dx, m);
+}
+
+/*
+ * y += a * x
+ */
+void vec_axpy(uint32_t len, float a, const float x[restrict len],
+              float y[restrict len]) {
+    TRACE_KERNEL();
+    for (uint32_t i = 0; i < len; i++) y[i] += a * x[i];
 }
 
 /*
@@ -107,12 +364,19 @@ void loss(uint32_t batch_len, uint32_t m, uint32_t n, const float *w,
  */
 double vec_delta(uint32_t size, const float *vec1, const float *vec2,
                  float *deltas) {
-    double error = 0.0;
-    for (size_t i = 0; i < size; i++) {
-        deltas[i] = vec1[i] - vec2[i];
-        error += pow(deltas[i], 2.0);
+    TRACE_KERNEL();
+    return simd->vec_delta(size, vec1, vec2, deltas);
+}
+
+float softmax_xent(uint32_t batch_len, uint32_t n,
+                   const float x[n * batch_len], const float t[n * batch_len],
+                   float d[n * batch_len]) {
+    TRACE_KERNEL();
+    double loss = 0.0;
+    for (uint32_t k = 0; k < batch_len; k++) {
+        loss += simd->softmax_xent(n, &x[k * n], &t[k * n], &d[k * n]);
     }
-    return error / (float)size;
+    return (float)(loss / batch_len);
 }
 
 bool vec_is_equal_f32(uint32_t n, const float a[n], const float b[n],
@@ -127,125 +391,138 @@ bool vec_is_equal_f32(uint32_t n, const float a[n], const float b[n],
 }
 
 /*
- * In each iteration of the while loop two normal random variables are
- * generated. On the first call of the function, two normal random variables are
- * generated.
- * On the after call, the second generated number will be returned.
+ * The seed of the default streams (see kern_rng()). A change of the seed
+ * increments the generation, which restarts the default streams.
  */
-float rand_normal(float mu, float sigma) {
-    float U1, U2, W, mult;
-    static float X1, X2;
-    static bool call = false;
+static uint64_t rng_seed;
+static atomic_uint rng_generation;
+static atomic_uint rng_streams;
+static _Thread_local struct rng rng_default;
+static _Thread_local unsigned rng_default_generation;
+static _Thread_local bool rng_default_init;
 
-    if (call == true) {
-        call = !call;
-        return mu + sigma * X2;
-    }
-
-    do {
-        U1 = -1 + ((float)random() / (float)(RAND_MAX)) * 2;
-        U2 = -1 + ((float)random() / (float)(RAND_MAX)) * 2;
-        W  = powf(U1, 2) + powf(U2, 2);
-    } while (W >= 1 || W == 0);
+void kern_seed(uint64_t seed) {
+    rng_seed = seed;
+    atomic_fetch_add(&rng_generation, 1);
+}
 
-    mult = sqrtf((-2 * logf(W)) / W);
-    X1   = U1 * mult;
-    X2   = U2 * mult;
+/*
+ * Seed the default streams with the time before main() runs (see the
+ * command line option `-s`).
+ */
+__attribute__((constructor)) static void kern_seed_init(void) {
+    kern_seed((uint64_t)time(NULL));
+}
 
-    call = !call;
-    return (mu + sigma * X1);
+struct rng rng_stream(uint64_t stream) {
+    return (struct rng){.seed = rng_seed, .stream = stream, .counter = 0};
 }
 
-void weights_norm_init(uint32_t in_size, uint32_t out_size, float *weights) {
-    srandom(time(NULL));
-    for (unsigned long long i = 0; i < (in_size * out_size); i++) {
-        weights[i] = rand_normal(0.0f, sqrtf(2.0f / in_size));
+struct rng *kern_rng(void) {
+    const unsigned generation = atomic_load(&rng_generation);
+    if (!rng_default_init) {
+        rng_default.stream = atomic_fetch_add(&rng_streams, 1);
+        rng_default_init   = true;
     }
+    if (rng_default_generation != generation) {
+        rng_default            = rng_stream(rng_default.stream);
+        rng_default_generation = generation;
+    }
+    return &rng_default;
 }
 
-uint32_t argmax(uint32_t len, const float x[len], float *max) {
-    *max             = x[0];
-    uint32_t max_pos = 0;
-    for (uint32_t i = 0; i < len; i++) {
-        if (x[i] > *max) {
-            *max    = x[i];
-            max_pos = i;
-        }
-    }
-    return max_pos;
+void rng_bits(struct rng *r, uint32_t blocks, uint32_t bits[4 * blocks]) {
+    simd->rng_bits(blocks, r->seed, r->counter, r->stream, bits);
+    r->counter += blocks;
 }
 
-void softmax(uint32_t len, const float x[len], float xs[len]) {
-    float max;
-    argmax(len, x, &max);
-    float sum = .0f;
-    for (uint32_t i = 0; i < len; i++) {
-        xs[i] = expf(x[i] - max);
-        sum += xs[i];
-    }
-    for (uint32_t i = 0; i < len; i++) {
-        xs[i] = xs[i] / sum;
-    }
+void rng_uniform(struct rng *r, uint32_t len, float u[len]) {
+    simd->rng_uniform(len, r->seed, r->counter, r->stream, u);
+    r->counter += (len + 3) / 4;
 }
 
-// List of activation functions
-// Convention: derived activation functions are prefixed with label 'derived'
-/*
- * The sigmoid function
- */
-float fsigmoid(float x) { return 1.0f / (1.0f + expf(-x)); }
+void rng_normal(struct rng *r, uint32_t len, float mu, float sigma,
+                float x[len]) {
+    simd->rng_normal(len, r->seed, r->counter, r->stream, mu, sigma, x);
+    r->counter += (len + 3) / 4;
+}
 
 /*
- * The derived of the sigmoid function
+ * Fisher-Yates: swap each element with one of the elements before it (or
+ * itself). The random position j < i is the high word of bits * i.
  */
-float derived_fsigmoid(float y) { return (y * (1.0f - y)); }
-
-float frelu(float x) { return (float)(x > .0) * x; }
-
-float derived_frelu(float x) { return (float)(x > .0); }
+void rng_shuffle(struct rng *r, uint32_t len, uint32_t x[len]) {
+    uint32_t bits[4 * 64];
+    for (uint32_t i = len; i > 1;) {
+        rng_bits(r, 64, bits);
+        for (uint32_t k = 0; k < 4 * 64 && i > 1; k++, i--) {
+            const uint32_t j = (uint32_t)(((uint64_t)bits[k] * i) >> 32);
+            const uint32_t t = x[i - 1];
+            x[i - 1]         = x[j];
+            x[j]             = t;
+        }
+    }
+}
 
-float ftanh(float x) { return tanhf(x); }
+void weights_norm_init(uint32_t in_size, uint32_t out_size, float *weights) {
+    rng_normal(kern_rng(), in_size * out_size, 0.0f, sqrtf(2.0f / in_size),
+               weights);
+}
 
-float derived_ftanh(float x) { return 1.0f - powf(ftanh(x), 2.0f); }
+uint32_t argmax(uint32_t len, const float x[len], float *max) {
+    return simd->argmax(len, x, max);
+}
 
-static void vec_func_f32(uint32_t len, float result[len], float (*f)(float)) {
-    for (uint32_t d = 0; d < len; d++) {
-        result[d] = f(result[d]);
-    }
+void topk(uint32_t batch_len, uint32_t len, uint32_t k,
+          const float x[batch_len * len], uint16_t idx[batch_len * k],
+          float val[batch_len * k]) {
+    TRACE_KERNEL();
+    simd->topk(batch_len, len, k, x, idx, val);
 }
 
-void sigmoid(uint32_t len, float *result) {
-    vec_func_f32(len, result, fsigmoid);
+void softmax(uint32_t len, const float x[len], float xs[len]) {
+    simd->softmax(len, x, xs);
 }
 
-void relu(uint32_t len, float *result) { vec_func_f32(len, result, frelu); }
+void sigmoid(uint32_t len, float result[len]) {
+    TRACE_KERNEL();
+    simd->sigmoid(len, result);
+}
 
-void tanhg(uint32_t len, float *result) { vec_func_f32(len, result, ftanh); }
+void relu(uint32_t len, float result[len]) {
+    TRACE_KERNEL();
+    simd->relu(len, result);
+}
 
-static void vec_derived_f32(uint32_t len, const float result[len],
-                            float delta[len], float (*f)(float)) {
-    for (uint32_t d = 0; d < len; d++) {
-        delta[d] = f(result[d]) * delta[d];
-    }
+void tanhg(uint32_t len, float result[len]) {
+    TRACE_KERNEL();
+    simd->tanhg(len, result);
 }
 
 void relu_derived(uint32_t len, const float *result, float *delta) {
-    vec_derived_f32(len, result, delta, derived_frelu);
+    TRACE_KERNEL();
+    simd->relu_derived(len, result, delta);
 }
 
 void tanhg_derived(uint32_t len, const float *result, float *delta) {
-    vec_derived_f32(len, result, delta, derived_ftanh);
+    TRACE_KERNEL();
+    simd->tanhg_derived(len, result, delta);
 }
 
 void sigmoid_derived(uint32_t len, const float *result, float *delta) {
-    vec_derived_f32(len, result, delta, derived_fsigmoid);
+    TRACE_KERNEL();
+    simd->sigmoid_derived(len, result, delta);
 }
 
 /*
  * Allocate memory for a float matrix.
  */
 float *matrix_alloc(uint32_t m, uint32_t n) {
-    return reallocarray(NULL, m * n, sizeof(float));
+    void *p = NULL;
+    if (posix_memalign(&p, MATRIX_ALIGN, (size_t)m * n * sizeof(float))) {
+        return NULL;
+    }
+    return p;
 }
 
 void matrix_init(uint32_t m, uint32_t n, float matrix[m * n]) {
@@ -254,15 +531,21 @@ void matrix_init(uint32_t m, uint32_t n, float matrix[m * n]) {
     }
 }
 
-float *weights_create_or_load(const char *filename, uint32_t input_len,
-                              uint32_t output_len) {
-    float *weight;
+/*
+ * Map the m x n matrix of `size` byte elements from the file or allocate it if
+ * `filename` is NULL.
+ * `created` is set, if the matrix values are not initialized yet.
+ */
+static void *matrix_map(const char *filename, uint32_t m, uint32_t n,
+                        size_t size, bool *created) {
+    void *matrix;
+    *created = false;
     if (filename == NULL) {
-        weight = matrix_alloc(input_len, output_len);
-        weights_norm_init(input_len, output_len, weight);
+        matrix   = reallocarray(NULL, (size_t)m * n, size);
+        *created = true;
     } else {
         struct stat statbuf;
-        size_t size_expected = input_len * output_len * sizeof(float);
+        size_t size_expected = (size_t)m * n * size;
 
         int fd = open(filename, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
         if (fd < 0) {
@@ -277,27 +560,572 @@ float *weights_create_or_load(const char *filename, uint32_t input_len,
             if (ftruncate(fd, size_expected)) {
                 err(EXIT_FAILURE, "file truncate");
             }
-            weight = mmap(0, size_expected, PROT_WRITE, MAP_SHARED, fd, 0);
-            close(fd);
-            weights_norm_init(input_len, output_len, weight);
-            return weight;
+            *created = true;
         } else if (statbuf.st_size > 0 &&
                    (unsigned long)statbuf.st_size < size_expected) {
             errx(EXIT_FAILURE, "invalid data size. Expected: %lu; given: %ld",
                  size_expected, statbuf.st_size);
         }
-        weight = mmap(0, size_expected, PROT_WRITE, MAP_SHARED, fd, 0);
+        matrix = mmap(0, size_expected, PROT_WRITE, MAP_SHARED, fd, 0);
         close(fd);
+        if (matrix == MAP_FAILED) return NULL;
+    }
+    return matrix;
+}
+
+float *weights_create_or_load(const char *filename, uint32_t input_len,
+                              uint32_t output_len) {
+    bool created;
+    float *weight =
+        matrix_map(filename, input_len, output_len, sizeof(float), &created);
+    if (weight != NULL && created) {
+        weights_norm_init(input_len, output_len, weight);
     }
     return weight;
 }
 
-static inline float fbernoulli(float p /* must between [0,1] */) {
-    return (float)(p < (((float)random() / (float)(RAND_MAX))));
+struct hmatrix hmatrix_create_or_load(const char *filename,
+                                      enum weight_type type, uint32_t m,
+                                      uint32_t n) {
+    bool created;
+    struct hmatrix h = {
+        .m = m, .n = n, .type = type, .mapped = filename != NULL};
+    h.w = matrix_map(filename, m, n, sizeof(uint16_t), &created);
+    if (h.w != NULL && created) {
+        float *w = matrix_alloc(m, n);
+        if (w == NULL) {
+            hmatrix_free(h);
+            return (struct hmatrix){0};
+        }
+        weights_norm_init(m, n, w);
+        hmatrix_store(h, w);
+        free(w);
+    }
+    return h;
+}
+
+void hmatrix_free(struct hmatrix h) {
+    if (h.w == NULL) return;
+    if (h.mapped) {
+        munmap(h.w, (size_t)h.m * h.n * sizeof(uint16_t));
+    } else {
+        free(h.w);
+    }
+}
+
+float *hmatrix_to_f32(struct hmatrix h) {
+    float *w = matrix_alloc(h.m, h.n);
+    if (w == NULL) return NULL;
+    for (size_t i = 0; i < (size_t)h.m * h.n; i++) {
+        w[i] = h.type == WEIGHT_BF16 ? bf16_to_f32(h.w[i]) : f16_to_f32(h.w[i]);
+    }
+    return w;
+}
+
+void hmatrix_store(struct hmatrix h, const float w[h.m * h.n]) {
+    for (size_t i = 0; i < (size_t)h.m * h.n; i++) {
+        h.w[i] = h.type == WEIGHT_BF16 ? f32_to_bf16(w[i]) : f32_to_f16(w[i]);
+    }
+}
+
+void trans_act_h(uint32_t batch_len, struct hmatrix w, const float *b,
+                 const float x[w.m * batch_len],
+                 void (*act)(uint32_t len, float *y),
+                 float y[w.n * batch_len]) {
+    TRACE_KERNEL();
+    const uint32_t m = w.m, n = w.n;
+    for (uint32_t j0 = 0; j0 < n; j0 += TRANS_TILE) {
+        const uint32_t nb = n - j0 < TRANS_TILE ? n - j0 : TRANS_TILE;
+        simd->hgemm_dot(batch_len, m, nb, x, &w.w[(size_t)m * j0],
+                        w.type == WEIGHT_BF16, &y[j0], n);
+        for (uint32_t k = 0; k < batch_len; k++) {
+            float *restrict yr = &y[k * n + j0];
+            if (b != NULL) {
+                for (uint32_t j = 0; j < nb; j++) yr[j] += b[j0 + j];
+            }
+            if (act != NULL && nb < n) act(nb, yr);
+        }
+        // a single tile is contiguous: one call for all rows
+        if (act != NULL && nb == n) act(batch_len * n, y);
+    }
+}
+
+/* The file magic of the sparse matrix files. */
+#define SPARSE_MAGIC "gstnnbs1"
+
+static int float_cmp(const void *a, const void *b) {
+    const float fa = *(const float *)a, fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+/*
+ * Allocate the arrays of the sparse matrix; `val` is NULL on failure.
+ */
+static struct smatrix smatrix_alloc(uint32_t m, uint32_t n, uint32_t nnzb) {
+    struct smatrix s = {.m = m, .n = n, .nnzb = nnzb};
+    s.row_ptr        = reallocarray(NULL, n + 1, sizeof(uint32_t));
+    s.col            = reallocarray(NULL, nnzb + 1, sizeof(uint32_t));
+    s.val =
+        reallocarray(NULL, (size_t)(nnzb + 1) * SPARSE_BLOCK, sizeof(float));
+    if (s.row_ptr == NULL || s.col == NULL || s.val == NULL) {
+        smatrix_free(s);
+        return (struct smatrix){0};
+    }
+    return s;
+}
+
+struct smatrix smatrix_prune(uint32_t m, uint32_t n, const float w[m * n],
+                             float ratio) {
+    const uint32_t mb    = (m + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+    const size_t total   = (size_t)mb * n;
+    float *norm          = reallocarray(NULL, total, sizeof(float));
+    float *sorted        = reallocarray(NULL, total, sizeof(float));
+    if (norm == NULL || sorted == NULL) {
+        free(norm);
+        free(sorted);
+        return (struct smatrix){0};
+    }
+    for (uint32_t j = 0; j < n; j++) {
+        for (uint32_t cb = 0; cb < mb; cb++) {
+            float sum = 0.0f;
+            for (uint32_t i = cb * SPARSE_BLOCK;
+                 i < m && i < (cb + 1) * SPARSE_BLOCK; i++) {
+                sum += w[j * m + i] * w[j * m + i];
+            }
+            norm[j * mb + cb] = sum;
+        }
+    }
+    // the blocks with a norm up to the threshold are pruned
+    memcpy(sorted, norm, total * sizeof(float));
+    qsort(sorted, total, sizeof(float), float_cmp);
+    const size_t pruned = ratio <= 0.0f   ? 0
+                          : ratio >= 1.0f ? total
+                                          : (size_t)(ratio * total + 0.5f);
+    const float threshold = pruned == 0 ? -1.0f : sorted[pruned - 1];
+    free(sorted);
+
+    uint32_t nnzb = 0;
+    for (size_t b = 0; b < total; b++) nnzb += norm[b] > threshold;
+    struct smatrix s = smatrix_alloc(m, n, nnzb);
+    if (s.val == NULL) {
+        free(norm);
+        return s;
+    }
+    uint32_t b = 0;
+    for (uint32_t j = 0; j < n; j++) {
+        s.row_ptr[j] = b;
+        for (uint32_t cb = 0; cb < mb; cb++) {
+            if (norm[j * mb + cb] <= threshold) continue;
+            float *vb = &s.val[b * SPARSE_BLOCK];
+            s.col[b]  = cb;
+            for (uint32_t v = 0; v < SPARSE_BLOCK; v++) {
+                const uint32_t i = cb * SPARSE_BLOCK + v;
+                vb[v]            = i < m ? w[j * m + i] : 0.0f;
+            }
+            b++;
+        }
+    }
+    s.row_ptr[n] = b;
+    free(norm);
+    return s;
+}
+
+float smatrix_density(struct smatrix s) {
+    const uint32_t mb = (s.m + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+    return (float)s.nnzb / (float)((size_t)mb * s.n);
+}
+
+bool smatrix_save(const char *filename, struct smatrix s) {
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL) return false;
+    const uint32_t header[] = {s.m, s.n, SPARSE_BLOCK, s.nnzb};
+    bool ok = fwrite(SPARSE_MAGIC, 1, 8, fp) == 8 &&
+              fwrite(header, sizeof(header), 1, fp) == 1 &&
+              fwrite(s.row_ptr, sizeof(uint32_t), s.n + 1, fp) == s.n + 1 &&
+              fwrite(s.col, sizeof(uint32_t), s.nnzb, fp) == s.nnzb &&
+              fwrite(s.val, sizeof(float) * SPARSE_BLOCK, s.nnzb, fp) ==
+                  s.nnzb;
+    return fclose(fp) == 0 && ok;
+}
+
+/*
+ * Check the structure of a read sparse matrix: the row pointers ascend from 0
+ * to nnzb and each block column is within the m rows, so the kernels read
+ * the stored blocks and the input only.
+ */
+static bool smatrix_valid(struct smatrix s) {
+    const uint32_t blocks = (s.m + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+    if (s.row_ptr[0] != 0 || s.row_ptr[s.n] != s.nnzb) return false;
+    for (uint32_t j = 0; j < s.n; j++) {
+        if (s.row_ptr[j] > s.row_ptr[j + 1]) return false;
+    }
+    for (uint32_t b = 0; b < s.nnzb; b++) {
+        if (s.col[b] >= blocks) return false;
+    }
+    return true;
+}
+
+struct smatrix smatrix_load(const char *filename, uint32_t m, uint32_t n) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        err(EXIT_FAILURE, "open sparse file '%s'", filename);
+    }
+    char magic[8];
+    uint32_t header[4];
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, SPARSE_MAGIC, 8) != 0 ||
+        fread(header, sizeof(header), 1, fp) != 1 || header[0] != m ||
+        header[1] != n || header[2] != SPARSE_BLOCK) {
+        errx(EXIT_FAILURE, "invalid sparse file '%s'. Expected: %u x %u",
+             filename, m, n);
+    }
+    const uint32_t blocks = (m + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+    if ((uint64_t)header[3] > (uint64_t)blocks * n) {
+        errx(EXIT_FAILURE, "invalid sparse file '%s'", filename);
+    }
+    struct smatrix s = smatrix_alloc(m, n, header[3]);
+    if (s.val == NULL) {
+        err(EXIT_FAILURE, "allocate sparse matrix memory");
+    }
+    if (fread(s.row_ptr, sizeof(uint32_t), n + 1, fp) != n + 1 ||
+        fread(s.col, sizeof(uint32_t), s.nnzb, fp) != s.nnzb ||
+        fread(s.val, sizeof(float) * SPARSE_BLOCK, s.nnzb, fp) != s.nnzb ||
+        !smatrix_valid(s)) {
+        errx(EXIT_FAILURE, "invalid sparse file '%s'", filename);
+    }
+    fclose(fp);
+    return s;
+}
+
+void smatrix_free(struct smatrix s) {
+    free(s.row_ptr);
+    free(s.col);
+    free(s.val);
+}
+
+void trans_act_sparse(uint32_t batch_len, struct smatrix w, const float *b,
+                      const float x[w.m * batch_len],
+                      void (*act)(uint32_t len, float *y),
+                      float y[w.n * batch_len]) {
+    TRACE_KERNEL();
+    simd->sparse_dot(batch_len, w.m, w.n, w.row_ptr, w.col, w.val, x, y, w.n);
+    for (uint32_t k = 0; k < batch_len; k++) {
+        float *restrict yr = &y[k * w.n];
+        if (b != NULL) {
+            for (uint32_t j = 0; j < w.n; j++) yr[j] += b[j];
+        }
+        if (act != NULL) act(w.n, yr);
+    }
+}
+
+void loss_sparse(uint32_t batch_len, struct smatrix w,
+                 const float dy[w.n * batch_len], float dx[w.m * batch_len]) {
+    TRACE_KERNEL();
+    simd->sparse_axpy(batch_len, w.m, w.n, w.row_ptr, w.col, w.val, dy, dx);
+}
+
+void train_sgd_sparse(uint32_t batch_len, struct smatrix w,
+                      const float x[w.m * batch_len],
+                      const float dy[w.n * batch_len], float rate) {
+    TRACE_KERNEL();
+    simd->sparse_update(batch_len, w.m, w.n, w.row_ptr, w.col, w.val, x, dy,
+                        rate);
+}
+
+float train_adam_sparse(uint32_t batch_len, struct smatrix w,
+                        const float x[w.m * batch_len],
+                        const float dy[w.n * batch_len], float counter,
+                        float N, float beta1, float beta2, float epsilon,
+                        float mom[w.nnzb * SPARSE_BLOCK],
+                        float veloc[w.nnzb * SPARSE_BLOCK],
+                        float grad[w.nnzb * SPARSE_BLOCK]) {
+    TRACE_KERNEL();
+    // the gradient of the stored blocks: an update of 0 with the rate -1
+    const size_t len = (size_t)w.nnzb * SPARSE_BLOCK;
+    memset(grad, 0, len * sizeof(float));
+    simd->sparse_update(batch_len, w.m, w.n, w.row_ptr, w.col, grad, x, dy,
+                        -1.0f);
+    const float rate  = N / (1.0f - powf(beta1, counter));
+    const float vcorr = 1.0f / (1.0f - powf(beta2, counter));
+    simd->adam_update(len, grad, rate, beta1, beta2, vcorr, epsilon, w.val,
+                      mom, veloc);
+    return counter + 1.0f;
+}
+
+/*
+ * The compaction is branch free: every element is stored, but only the
+ * nonzero elements advance the list.
+ */
+float svector_compress(uint32_t batch_len, uint32_t m,
+                       const float x[m * batch_len], struct svector *s) {
+    TRACE_KERNEL();
+    uint32_t nnz = 0;
+    s->m         = m;
+    for (uint32_t k = 0; k < batch_len; k++) {
+        const float *xk = &x[k * m];
+        s->ptr[k]       = nnz;
+        for (uint32_t i = 0; i < m; i++) {
+            s->idx[nnz] = i;
+            s->val[nnz] = xk[i];
+            nnz += xk[i] != 0.0f;
+        }
+    }
+    s->ptr[batch_len] = nnz;
+    return (float)nnz / (float)(m * batch_len);
+}
+
+void trans_act_svector(uint32_t batch_len, uint32_t n, const float *w,
+                       const float *b, struct svector x,
+                       void (*act)(uint32_t len, float *y),
+                       float y[n * batch_len]) {
+    TRACE_KERNEL();
+    simd->svector_dot(batch_len, x.m, n, x.ptr, x.idx, x.val, w, y);
+    for (uint32_t k = 0; k < batch_len; k++) {
+        float *restrict yr = &y[k * n];
+        if (b != NULL) {
+            for (uint32_t j = 0; j < n; j++) yr[j] += b[j];
+        }
+    }
+    if (act != NULL) act(batch_len * n, y);
+}
+
+void train_sgd_svector(uint32_t batch_len, uint32_t n, struct svector x,
+                       const float dy[n * batch_len], float rate, float *w) {
+    TRACE_KERNEL();
+    simd->svector_update(batch_len, x.m, n, x.ptr, x.idx, x.val, dy, rate, w);
+}
+
+/*
+ * Copy the image plane `x` into the plane `pad` padded with zeros.
+ */
+static void plane_pad(struct conv2d g, const float *restrict x,
+                      float *restrict pad) {
+    const uint32_t pw = g.w + 2 * g.pad;
+    memset(pad, 0, (size_t)(g.h + 2 * g.pad) * pw * sizeof(float));
+    for (uint32_t iy = 0; iy < g.h; iy++) {
+        memcpy(&pad[(iy + g.pad) * pw + g.pad], &x[iy * g.w],
+               g.w * sizeof(float));
+    }
+}
+
+/*
+ * col(l, (ch * k + ky) * k + kx, oy * ow + ox) =
+ *     x(l, ch, oy * stride - pad + ky, ox * stride - pad + kx)
+ *
+ * Each image plane is padded first, so every row segment of `col` is a plain
+ * (strided) copy of a padded image row.
+ */
+void im2col(uint32_t batch_len, struct conv2d g, const float *x, float *col) {
+    TRACE_KERNEL();
+    const uint32_t oh = CONV_OUT(g.h, g.k, g.stride, g.pad);
+    const uint32_t ow = CONV_OUT(g.w, g.k, g.stride, g.pad);
+    const uint32_t pw = g.w + 2 * g.pad;
+    float pad[(g.h + 2 * g.pad) * pw];
+    for (uint32_t q = 0; q < batch_len * g.c; q++) {
+        plane_pad(g, &x[(size_t)q * g.h * g.w], pad);
+        for (uint32_t ky = 0; ky < g.k; ky++) {
+            for (uint32_t kx = 0; kx < g.k; kx++) {
+                for (uint32_t oy = 0; oy < oh; oy++, col += ow) {
+                    const float *src = &pad[(oy * g.stride + ky) * pw + kx];
+                    if (g.stride == 1) {
+                        memcpy(col, src, ow * sizeof(float));
+                        continue;
+                    }
+                    for (uint32_t ox = 0; ox < ow; ox++) {
+                        col[ox] = src[ox * g.stride];
+                    }
+                }
+            }
+        }
+    }
+}
+
+void col2im(uint32_t batch_len, struct conv2d g, const float *col, float *x) {
+    TRACE_KERNEL();
+    const uint32_t oh = CONV_OUT(g.h, g.k, g.stride, g.pad);
+    const uint32_t ow = CONV_OUT(g.w, g.k, g.stride, g.pad);
+    const uint32_t pw = g.w + 2 * g.pad;
+    float pad[(g.h + 2 * g.pad) * pw];
+    for (uint32_t q = 0; q < batch_len * g.c; q++) {
+        memset(pad, 0, sizeof(pad));
+        for (uint32_t ky = 0; ky < g.k; ky++) {
+            for (uint32_t kx = 0; kx < g.k; kx++) {
+                for (uint32_t oy = 0; oy < oh; oy++, col += ow) {
+                    float *restrict dst = &pad[(oy * g.stride + ky) * pw + kx];
+                    for (uint32_t ox = 0; ox < ow; ox++) {
+                        dst[ox * g.stride] += col[ox];
+                    }
+                }
+            }
+        }
+        float *img = &x[(size_t)q * g.h * g.w];
+        for (uint32_t iy = 0; iy < g.h; iy++) {
+            memcpy(&img[iy * g.w], &pad[(iy + g.pad) * pw + g.pad],
+                   g.w * sizeof(float));
+        }
+    }
+}
+
+/*
+ * y(l, f, oh * ow) = w(f, k * k * c) * col(l, k * k * c, oh * ow)
+ */
+void conv2d(uint32_t batch_len, struct conv2d g, const float *w,
+            const float *b, const float *x,
+            void (*act)(uint32_t len, float *y), float *col, float *y) {
+    TRACE_KERNEL();
+    const uint32_t m      = g.k * g.k * g.c;
+    const uint32_t pixels = CONV_OUT(g.h, g.k, g.stride, g.pad) *
+                            CONV_OUT(g.w, g.k, g.stride, g.pad);
+    im2col(batch_len, g, x, col);
+    for (uint32_t l = 0; l < batch_len; l++) {
+        float *yl = &y[(size_t)l * g.f * pixels];
+        matmul(false, false, g.f, pixels, m, 1.0f, w, m,
+               &col[(size_t)l * m * pixels], pixels, 0.0f, yl, pixels);
+        for (uint32_t j = 0; b != NULL && j < g.f; j++) {
+            float *restrict yr = &yl[j * pixels];
+            for (uint32_t i = 0; i < pixels; i++) yr[i] += b[j];
+        }
+    }
+    if (act != NULL) act(batch_len * g.f * pixels, y);
 }
 
+/*
+ * dcol(l, k * k * c, oh * ow) = w(f, k * k * c)^T * dy(l, f, oh * ow)
+ */
+void conv2d_loss(uint32_t batch_len, struct conv2d g, const float *w,
+                 const float *dy, float *dcol, float *dx) {
+    TRACE_KERNEL();
+    const uint32_t m      = g.k * g.k * g.c;
+    const uint32_t pixels = CONV_OUT(g.h, g.k, g.stride, g.pad) *
+                            CONV_OUT(g.w, g.k, g.stride, g.pad);
+    for (uint32_t l = 0; l < batch_len; l++) {
+        matmul(true, false, m, pixels, g.f, 1.0f, w, m,
+               &dy[(size_t)l * g.f * pixels], pixels, 0.0f,
+               &dcol[(size_t)l * m * pixels], pixels);
+    }
+    col2im(batch_len, g, dcol, dx);
+}
+
+/*
+ * w(f, k * k * c) -= rate * dy(l, f, oh * ow) * col(l, k * k * c, oh * ow)^T
+ */
+void conv2d_train_sgd(uint32_t batch_len, struct conv2d g, const float *col,
+                      const float *dy, float rate, float *w, float b[g.f]) {
+    TRACE_KERNEL();
+    const uint32_t m      = g.k * g.k * g.c;
+    const uint32_t pixels = CONV_OUT(g.h, g.k, g.stride, g.pad) *
+                            CONV_OUT(g.w, g.k, g.stride, g.pad);
+    for (uint32_t l = 0; l < batch_len; l++) {
+        const float *dyl = &dy[(size_t)l * g.f * pixels];
+        matmul(false, true, g.f, m, pixels, -rate, dyl, pixels,
+               &col[(size_t)l * m * pixels], pixels, 1.0f, w, m);
+        for (uint32_t j = 0; b != NULL && j < g.f; j++) {
+            float sum = 0.0f;
+            for (uint32_t i = 0; i < pixels; i++) sum += dyl[j * pixels + i];
+            b[j] -= rate * sum;
+        }
+    }
+}
+
+void maxpool(uint32_t batch_len, struct pool2d p, const float *x, float *y,
+             uint32_t *idx) {
+    TRACE_KERNEL();
+    const uint32_t oh = CONV_OUT(p.h, p.k, p.stride, 0);
+    const uint32_t ow = CONV_OUT(p.w, p.k, p.stride, 0);
+    for (uint32_t q = 0; q < batch_len * p.c; q++) {
+        const uint32_t plane = q * p.h * p.w;
+        for (uint32_t oy = 0; oy < oh; oy++) {
+            for (uint32_t ox = 0; ox < ow; ox++, y++, idx++) {
+                const uint32_t i0 = plane + (oy * p.w + ox) * p.stride;
+                float max         = x[i0];
+                uint32_t pos      = i0;
+                for (uint32_t ky = 0; ky < p.k; ky++) {
+                    for (uint32_t kx = 0; kx < p.k; kx++) {
+                        const uint32_t i = i0 + ky * p.w + kx;
+                        pos              = x[i] > max ? i : pos;
+                        max              = x[i] > max ? x[i] : max;
+                    }
+                }
+                *y   = max;
+                *idx = pos;
+            }
+        }
+    }
+}
+
+void maxpool_loss(uint32_t batch_len, struct pool2d p, const float *dy,
+                  const uint32_t *idx, float *dx) {
+    TRACE_KERNEL();
+    const uint32_t len = CONV_OUT(p.h, p.k, p.stride, 0) *
+                         CONV_OUT(p.w, p.k, p.stride, 0) * p.c * batch_len;
+    memset(dx, 0, (size_t)batch_len * p.c * p.h * p.w * sizeof(float));
+    for (uint32_t i = 0; i < len; i++) dx[idx[i]] += dy[i];
+}
+
+void avgpool(uint32_t batch_len, struct pool2d p, const float *x, float *y) {
+    TRACE_KERNEL();
+    const uint32_t oh = CONV_OUT(p.h, p.k, p.stride, 0);
+    const uint32_t ow = CONV_OUT(p.w, p.k, p.stride, 0);
+    const float scale = 1.0f / (float)(p.k * p.k);
+    for (uint32_t q = 0; q < batch_len * p.c; q++) {
+        const uint32_t plane = q * p.h * p.w;
+        for (uint32_t oy = 0; oy < oh; oy++) {
+            for (uint32_t ox = 0; ox < ow; ox++, y++) {
+                const uint32_t i0 = plane + (oy * p.w + ox) * p.stride;
+                float sum         = 0.0f;
+                for (uint32_t ky = 0; ky < p.k; ky++) {
+                    for (uint32_t kx = 0; kx < p.k; kx++) {
+                        sum += x[i0 + ky * p.w + kx];
+                    }
+                }
+                *y = sum * scale;
+            }
+        }
+    }
+}
+
+void avgpool_loss(uint32_t batch_len, struct pool2d p, const float *dy,
+                  float *dx) {
+    TRACE_KERNEL();
+    const uint32_t oh = CONV_OUT(p.h, p.k, p.stride, 0);
+    const uint32_t ow = CONV_OUT(p.w, p.k, p.stride, 0);
+    const float scale = 1.0f / (float)(p.k * p.k);
+    memset(dx, 0, (size_t)batch_len * p.c * p.h * p.w * sizeof(float));
+    for (uint32_t q = 0; q < batch_len * p.c; q++) {
+        const uint32_t plane = q * p.h * p.w;
+        for (uint32_t oy = 0; oy < oh; oy++) {
+            for (uint32_t ox = 0; ox < ow; ox++, dy++) {
+                const uint32_t i0 = plane + (oy * p.w + ox) * p.stride;
+                for (uint32_t ky = 0; ky < p.k; ky++) {
+                    for (uint32_t kx = 0; kx < p.k; kx++) {
+                        dx[i0 + ky * p.w + kx] += *dy * scale;
+                    }
+                }
+            }
+        }
+    }
+}
+
+float *bias_create_or_load(const char *filename, uint32_t len) {
+    bool created;
+    float *bias = matrix_map(filename, 1, len, sizeof(float), &created);
+    if (bias != NULL && created) {
+        matrix_init(1, len, bias);
+    }
+    return bias;
+}
+
+/*
+ * The uniform random numbers of the dropout mask are drawn in chunks.
+ */
+#define DROPOUT_CHUNK 256
+
 void dropout(uint32_t len, const float vec[len], float p, float result[len]) {
-    for (uint32_t i = 0; i < len; i++) {
-        result[i] = vec[i] * fbernoulli(p);
+    TRACE_KERNEL();
+    float u[DROPOUT_CHUNK];
+    struct rng *r = kern_rng();
+    for (uint32_t i = 0; i < len; i += DROPOUT_CHUNK) {
+        const uint32_t n = len - i < DROPOUT_CHUNK ? len - i : DROPOUT_CHUNK;
+        rng_uniform(r, n, u);
+        simd->dropout_mask(n, &vec[i], u, p, &result[i]);
     }
 }
@@ -36,6 +36,154 @@
 #define ARRAY_LENGTH(_arr) (sizeof(_arr) / sizeof((_arr)[0]))
 #define Derived(_func) _func##_derived
 
+/** ## Types
+ */
+/**
+ * ### struct qmatrix
+ *
+ * The int8 quantized weight matrix of the inference (see trans_act_q8()).
+ * Each of the `n` rows (output channels) has its own scale:
+ * `w[j * m + i] ~ scale[j] * q[j * ld + i]`.
+ *
+ *  - `m` The number of input (matrix) rows.
+ *  - `n` The number of output (matrix) columns.
+ *  - `ld` The row length of `w`, `m` padded to a multiple of 64.
+ *  - `w` The n x ld int8 matrix (the padding is 0).
+ *  - `scale` The n scale factors.
+ *  - `sum` The n sums of the int8 rows.
+ */
+struct qmatrix {
+    uint32_t m, n, ld;
+    int8_t *w;
+    float *scale;
+    int32_t *sum;
+};
+
+/**
+ * ### enum weight_type
+ *
+ * The storage type of a weight matrix: `WEIGHT_F32` (float), `WEIGHT_F16`
+ * (IEEE half precision) or `WEIGHT_BF16` (bfloat16), see half.h.
+ */
+enum weight_type { WEIGHT_F32, WEIGHT_F16, WEIGHT_BF16 };
+
+/**
+ * ### struct hmatrix
+ *
+ * The m x n weight matrix stored with 16 bit floats (see trans_act_h()).
+ *
+ *  - `m` The number of input (matrix) rows.
+ *  - `n` The number of output (matrix) columns.
+ *  - `type` The 16 bit type `WEIGHT_F16` or `WEIGHT_BF16`.
+ *  - `mapped` The matrix is mapped from a file.
+ *  - `w` The n x m matrix of 16 bit floats.
+ */
+struct hmatrix {
+    uint32_t m, n;
+    enum weight_type type;
+    bool mapped;
+    uint16_t *w;
+};
+
+/**
+ * ### SPARSE_BLOCK
+ *
+ * The number of consecutive weights of a block of the sparse matrix.
+ */
+#define SPARSE_BLOCK 16
+
+/**
+ * ### struct smatrix
+ *
+ * The block sparse (pruned) m x n weight matrix. Each of the `n` rows is split
+ * into blocks of 16 consecutive weights (one cache line); only the blocks
+ * which survived the pruning are stored (block compressed sparse rows).
+ *
+ *  - `m` The number of input (matrix) rows.
+ *  - `n` The number of output (matrix) columns.
+ *  - `nnzb` The number of stored blocks.
+ *  - `row_ptr` The n + 1 offsets of the first block of each row.
+ *  - `col` The `nnzb` block column indices (the block starts at `col * 16`).
+ *  - `val` The `nnzb * 16` weights of the stored blocks.
+ */
+struct smatrix {
+    uint32_t m, n, nnzb;
+    uint32_t *row_ptr;
+    uint32_t *col;
+    float *val;
+};
+
+/**
+ * ### struct svector
+ *
+ * The sparse input vectors of a batch: the nonzero elements of each vector as
+ * a list of indices and values (compressed sparse rows). The lists are filled
+ * by svector_compress() or directly by the caller.
+ *
+ *  - `m` The length of the (dense) vectors.
+ *  - `ptr` The `batch_len + 1` offsets of the first element of each vector.
+ *  - `idx` The indices of the nonzero elements.
+ *  - `val` The values of the nonzero elements.
+ */
+struct svector {
+    uint32_t m;
+    uint32_t *ptr;
+    uint32_t *idx;
+    float *val;
+};
+
+/**
+ * ### CONV_OUT - Return the output length of a convolution or pooling window.
+ *
+ * #### Parameters
+ *
+ *  - `len` The input length (height or width).
+ *  - `k` The window (kernel) size.
+ *  - `stride` The step of the window.
+ *  - `pad` The number of zeros added at both sides.
+ */
+#define CONV_OUT(_len, _k, _stride, _pad)                                      \
+    (((_len) + 2 * (_pad) - (_k)) / (_stride) + 1)
+
+/**
+ * ### struct conv2d
+ *
+ * The shape of a 2d convolution layer. The images are stored plane by plane
+ * (channels x height x width), so the output image of a layer is the input of
+ * the next layer and the filters are applied by one wide matrix product per
+ * image.
+ *
+ *  - `c` The number of input channels.
+ *  - `h` The input height.
+ *  - `w` The input width.
+ *  - `k` The kernel size (k x k).
+ *  - `stride` The step of the kernel.
+ *  - `pad` The number of zero pixels added at each border.
+ *  - `f` The number of filters (output channels).
+ */
+struct conv2d {
+    uint32_t c, h, w;
+    uint32_t k, stride, pad;
+    uint32_t f;
+};
+
+/**
+ * ### struct pool2d
+ *
+ * The shape of a 2d pooling layer (the windows are not padded). The image
+ * layout is the one of `struct conv2d`.
+ *
+ *  - `c` The number of channels.
+ *  - `h` The input height.
+ *  - `w` The input width.
+ *  - `k` The window size (k x k).
+ *  - `stride` The step of the window.
+ */
+struct pool2d {
+    uint32_t c, h, w;
+    uint32_t k, stride;
+};
+
 /** ## Functions
  */
 /**
@@ -55,6 +203,78 @@
 void trans(uint32_t batch_len, uint32_t m, uint32_t n, const float w[m * n],
            const float x[m * batch_len], float y[n * batch_len]);
 
+/**
+ * ### trans_act()
+ *
+ * Transform the input data array to the output array via a weight matrix, add
+ * the bias vector and apply the activation function (`y = act(x * w + b)`).
+ *
+ * The output is computed in tiles of columns. The bias and the activation
+ * function are applied to a tile while it is still in the cache, which saves
+ * a separate pass over the output array.
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of parallel processed input data.
+ *  - `m` The number of input (matrix) rows.
+ *  - `n` The number of output (matrix) columns.
+ *  - `w` The m x n weight matrix.
+ *  - `b` The bias vector of length `n` or NULL.
+ *  - `x` The input vector of length `m * batch_len`.
+ *  - `act` The activation function (e.g. `relu`) or NULL.
+ *  - `y` The output (result) vector  of length `n * batch_len`.
+ */
+void trans_act(uint32_t batch_len, uint32_t m, uint32_t n, const float w[m * n],
+               const float *b, const float x[m * batch_len],
+               void (*act)(uint32_t len, float *y), float y[n * batch_len]);
+
+/**
+ * ### qmatrix_quantize()
+ *
+ * Quantize the weight matrix symmetric to int8 with one scale per output
+ * channel (`scale[j] = max|w_j| / 127`). The quantized matrix needs a quarter
+ * of the memory of the float matrix.
+ *
+ * #### Parameters
+ *
+ *  - `m` The number of input (matrix) rows.
+ *  - `n` The number of output (matrix) columns.
+ *  - `w` The m x n weight matrix.
+ *
+ *  Returns the quantized matrix, `w` is NULL if the allocation failed.
+ */
+struct qmatrix qmatrix_quantize(uint32_t m, uint32_t n, const float w[m * n]);
+
+/**
+ * ### qmatrix_free()
+ *
+ * Free the memory of the quantized matrix.
+ */
+void qmatrix_free(struct qmatrix q);
+
+/**
+ * ### trans_act_q8()
+ *
+ * The int8 variant of trans_act(). Each input vector is quantized to int8
+ * (one scale per vector), multiplied with the quantized weights to int32 and
+ * scaled back to float before the bias and the activation are applied.
+ *
+ * The relative error of the output is about 1% of the largest value.
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of parallel processed input data.
+ *  - `w` The quantized m x n weight matrix.
+ *  - `b` The bias vector of length `n` or NULL.
+ *  - `x` The input vector of length `m * batch_len`.
+ *  - `act` The activation function (e.g. `relu`) or NULL.
+ *  - `y` The output (result) vector  of length `n * batch_len`.
+ */
+void trans_act_q8(uint32_t batch_len, struct qmatrix w, const float *b,
+                  const float x[w.m * batch_len],
+                  void (*act)(uint32_t len, float *y),
+                  float y[w.n * batch_len]);
+
 /**
  * ### train_sgd()
  *
@@ -84,6 +304,9 @@ void train_sgd(uint32_t batch_len, uint32_t m, uint32_t n,
  *
  * Trains the weight matrix by the adam optimizer
  *
+ * The gradient of the batch is computed by a single matrix multiplication into
+ * `grad`, followed by one vectorized pass updating the moments and the weights.
+ *
  * See [Adam: A Method for Stochastic Optimization](https://arxiv.org/abs/1412.6980)
  *
  * ### Parameters
@@ -92,22 +315,119 @@ void train_sgd(uint32_t batch_len, uint32_t m, uint32_t n,
  *  - `m` The number of input (matrix) rows.
  *  - `n` The number of output (matrix) columns.
  *  - `x` The input vector of length `m * batch_len`.
- *  - `dy` The delta output (difference between output and expected output) vector  of length `n`.
+ *  - `dy` The delta output (difference between output and expected output) vector  of length `n * batch_len`.
  *  - `counter` Counts the iterations
  *  - `N` The leaning rate
  *  - `beta1` Default value: `0.9`
  *  - `beta2` Default value: `0.999`
  *  - `epsilon` Default value: `10^-8`
  *  - `w` The m x n weight matrix.
- *  - `mom` 1st moment vector
- *  - `veloc` 2nd moment vector
+ *  - `mom` 1st moment vector (same size as `w`).
+ *  - `veloc` 2nd moment vector (same size as `w`).
+ *  - `grad` Scratch buffer for the batch gradient (same size as `w`).
  *  Returns the incremented counter
  */
 float train_adam(uint32_t batch_len, uint32_t m, uint32_t n,
-                 const float x[restrict m * batch_len],
-                 const float dy[restrict const n * batch_len], float counter,
-                 float N, float beta1, float beta2, float epsilon,
-                 float w[m * n], float mom[n * m], float veloc[n * m]);
+                 const float *restrict x, const float *restrict dy,
+                 float counter, float N, float beta1, float beta2,
+                 float epsilon, float *w, float *mom, float *veloc,
+                 float *grad);
+
+/**
+ * ### train_sgd_bias()
+ *
+ * Trains the bias vector by the delta output array with the stochastic
+ * gradient descent.
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of parallel input data.
+ *  - `n` The length of the bias vector.
+ *  - `dy` The delta output vector of length `n * batch_len`.
+ *  - `rate` The leaning rate
+ *  - `b` The bias vector.
+ */
+void train_sgd_bias(uint32_t batch_len, uint32_t n,
+                    const float dy[batch_len * n], float rate, float b[n]);
+
+/**
+ * ### train_adam_bias()
+ *
+ * Trains the bias vector by the adam optimizer. The bias shares the
+ * iteration `counter` with the weight matrix of its layer, so call it before
+ * `train_adam()` increments the counter.
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of parallel input data.
+ *  - `n` The length of the bias vector.
+ *  - `dy` The delta output vector of length `n * batch_len`.
+ *  - `counter` Counts the iterations
+ *  - `N` The leaning rate
+ *  - `beta1` Default value: `0.9`
+ *  - `beta2` Default value: `0.999`
+ *  - `epsilon` Default value: `10^-8`
+ *  - `b` The bias vector.
+ *  - `mom` 1st moment vector
+ *  - `veloc` 2nd moment vector
+ *  - `grad` Scratch buffer for the bias gradient of length `n`.
+ */
+void train_adam_bias(uint32_t batch_len, uint32_t n,
+                     const float dy[batch_len * n], float counter, float N,
+                     float beta1, float beta2, float epsilon, float b[n],
+                     float mom[n], float veloc[n], float grad[n]);
+
+/**
+ * ### weights_grad()
+ *
+ * Calculates the gradient of the weight matrix of the batch: the sum of the
+ * gradients of the input vectors, which train_sgd() subtracts (times the
+ * rate) from the weights. The gradient has the layout of the weights.
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of parallel input data.
+ *  - `m` The number of input (matrix) rows.
+ *  - `n` The number of output (matrix) columns.
+ *  - `x` The input vector of length `m * batch_len`.
+ *  - `dy` The delta output vector of length `n * batch_len`.
+ *  - `grad` The calculated gradient of the m x n weight matrix.
+ */
+void weights_grad(uint32_t batch_len, uint32_t m, uint32_t n,
+                  const float x[m * batch_len], const float dy[n * batch_len],
+                  float grad[n * m]);
+
+/**
+ * ### bias_grad()
+ *
+ * Calculates the gradient of the bias vector of the batch (the sum of the
+ * delta output vectors).
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of parallel input data.
+ *  - `n` The length of the bias vector.
+ *  - `dy` The delta output vector of length `n * batch_len`.
+ *  - `db` The calculated gradient of the bias vector.
+ */
+void bias_grad(uint32_t batch_len, uint32_t n,
+               const float dy[restrict batch_len * n], float db[restrict n]);
+
+/**
+ * ### vec_axpy()
+ *
+ * Adds `a` times the vector `x` to the vector `y`. Each element is computed
+ * on its own, so the result does not depend on the vectorization.
+ *
+ * #### Parameters
+ *
+ *  - `len` The length of the vectors.
+ *  - `a` The factor.
+ *  - `x` The added vector.
+ *  - `y` The vector, which is changed.
+ */
+void vec_axpy(uint32_t len, float a, const float x[restrict len],
+              float y[restrict len]);
 
 /**
  * ### loss()
@@ -144,6 +464,27 @@ void loss(uint32_t batch_len, uint32_t m, uint32_t n, const float *w,
 double vec_delta(uint32_t size, const float v1[size], const float v2[size],
                  float d[size]);
 
+/**
+ * ### softmax_xent()
+ *
+ * The fused softmax cross entropy loss of the output layer: the loss of the
+ * logits `x` (the output without activation) and the target probabilities `t`
+ * and its gradient `d = softmax(x) - t` (the delta of the logits) in one pass
+ * per sample. The log-sum-exp keeps it stable for large logits.
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of samples.
+ *  - `n` The number of outputs (classes).
+ *  - `x` The logits.
+ *  - `t` The target probabilities (e.g. one-hot).
+ *  - `d` The calculated delta (gradient) of the logits.
+ *  Returns the mean cross entropy of the samples.
+ */
+float softmax_xent(uint32_t batch_len, uint32_t n,
+                   const float x[n * batch_len], const float t[n * batch_len],
+                   float d[n * batch_len]);
+
 /**
  * ### vec_is_equal_f32()
  *
@@ -160,10 +501,82 @@ double vec_delta(uint32_t size, const float v1[size], const float v2[size],
 bool vec_is_equal_f32(uint32_t n, const float a[n], const float b[n],
                       float epsilon);
 
+/**
+ * ### struct rng
+ *
+ * A stream of counter-based random numbers (Philox4x32-10). The numbers are a
+ * function of the seed, the stream number and the counter only: streams with
+ * different numbers (e.g. one per thread) are independent and each stream is
+ * reproducible, no state is shared.
+ *
+ *  - `seed` The key of the generator (see kern_seed()).
+ *  - `stream` The number of the stream.
+ *  - `counter` The next block of 4 random words of the stream.
+ */
+struct rng {
+    uint64_t seed, stream, counter;
+};
+
+/**
+ * ### kern_seed()
+ *
+ * Set the seed of the random number streams. The default seed is the time at
+ * program start. The default streams (see kern_rng()) restart.
+ */
+void kern_seed(uint64_t seed);
+
+/**
+ * ### rng_stream()
+ *
+ * Returns the random number stream number `stream` of the seed.
+ */
+struct rng rng_stream(uint64_t stream);
+
+/**
+ * ### kern_rng()
+ *
+ * Returns the default random number stream of the calling thread. Each thread
+ * gets its own stream (numbered in the order of the first call). It is used by
+ * dropout() and weights_norm_init().
+ */
+struct rng *kern_rng(void);
+
+/**
+ * ### rng_bits()
+ *
+ * Draw `blocks` blocks of 4 random 32 bit words from the stream `r`.
+ */
+void rng_bits(struct rng *r, uint32_t blocks, uint32_t bits[4 * blocks]);
+
+/**
+ * ### rng_uniform()
+ *
+ * Draw `len` uniform distributed floats in [0, 1) from the stream `r`.
+ */
+void rng_uniform(struct rng *r, uint32_t len, float u[len]);
+
+/**
+ * ### rng_normal()
+ *
+ * Draw `len` normal distributed floats with the mean `mu` and the standard
+ * deviation `sigma` from the stream `r`.
+ */
+void rng_normal(struct rng *r, uint32_t len, float mu, float sigma,
+                float x[len]);
+
+/**
+ * ### rng_shuffle()
+ *
+ * Permute the `len` elements of `x` randomly (Fisher-Yates) with the random
+ * numbers of the stream `r`.
+ */
+void rng_shuffle(struct rng *r, uint32_t len, uint32_t x[len]);
+
 /**
  * ### weights_norm_init()
  *
- * Initialize a weight matrix with random noise values.
+ * Initialize a weight matrix with normal distributed random values (He
+ * initialization), drawn from the default stream (see kern_rng()).
  *
  * #### Parameters
  *
@@ -205,6 +618,29 @@ void matrix_init(uint32_t m, uint32_t n, float matrix[m * n]);
  */
 uint32_t argmax(uint32_t len, const float x[len], float *max);
 
+/**
+ * ### topk()
+ *
+ * Find the `k` max elements of each vector of a batch in descending order.
+ *
+ * The vectors of the batch are ranked in parallel (one vector per SIMD lane).
+ * Of identical elements, the first position ranks higher, so `k = 1` gives
+ * the argmax() of each vector. The vectors must not contain NaN (the rank of
+ * a NaN element is unspecified).
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of vectors.
+ *  - `len` The length of a vector (at most 65536).
+ *  - `k` The number of max elements (at most `len`).
+ *  - `x` The `batch_len` vectors.
+ *  - `idx` The positions of the `k` max elements of each vector.
+ *  - `val` The values of the `k` max elements of each vector.
+ */
+void topk(uint32_t batch_len, uint32_t len, uint32_t k,
+          const float x[batch_len * len], uint16_t idx[batch_len * k],
+          float val[batch_len * k]);
+
 /**
  * ### softmax()
  *
@@ -219,6 +655,12 @@ uint32_t argmax(uint32_t len, const float x[len], float *max);
  */
 void softmax(uint32_t len, const float x[len], float xs[len]) ;
 
+/**
+ * The activation functions and their derivatives are vectorized (AVX-512,
+ * AVX2 or a scalar fallback, see `simd.h`). The derivatives are computed from
+ * the stored activation output `result` and multiplied into `delta`.
+ */
+
 /**
  * ### relu()
  *
@@ -242,6 +684,8 @@ void relu(uint32_t len, float y[len]);
  * But unlike Sigmoid, its output is zero-centered. Therefore, in practice
  * the tanh non-linearity is always preferred to the sigmoid nonlinearity.
  *
+ * Rational approximation with a maximum absolute error of `4e-7`.
+ *
  * #### Parameters
  *
  *  - `len` The length of the vector.
@@ -250,13 +694,15 @@ void relu(uint32_t len, float y[len]);
 void tanhg(uint32_t len, float y[len]);
 
 /**
- * ### tanhg()
+ * ### sigmoid()
  *
  * Sigmoid activation function.
  *
  * Sigmoid takes a real value as input and outputs another value between 0 and 1.
  * It’s non-linear, continuously differentiable, monotonic, and has a fixed output range.
  *
+ * Polynomial approximation of `exp()` with a maximum absolute error of `3e-7`.
+ *
  * #### Parameters
  *
  *  - `len` The length of the vector.
@@ -271,9 +717,10 @@ void tanhg_derived(uint32_t len, const float *result, float *delta);
 void sigmoid_derived(uint32_t len, const float *result, float *delta);
 
 /**
- * ### weights_create_or_load()
+ * ### matrix_alloc()
  *
- * Allocate a matrix from memory.
+ * Allocate a matrix from memory. The matrix is aligned to the cache line
+ * (`MATRIX_ALIGN` bytes) and is released with free().
  *
  * The matrix is not permanent and will be lost when the program ends.
  *
@@ -285,6 +732,7 @@ void sigmoid_derived(uint32_t len, const float *result, float *delta);
  *  - `n` The columns of the weight matrix.
  * Returns the allocated matrix memory or NULL if an error occurred.
  */
+#define MATRIX_ALIGN 64
 float *matrix_alloc(uint32_t m, uint32_t n);
 
 /**
@@ -306,6 +754,363 @@ float *matrix_alloc(uint32_t m, uint32_t n);
 float *weights_create_or_load(const char *filename, uint32_t input_len,
                               uint32_t output_len);
 
+/**
+ * ### hmatrix_create_or_load()
+ *
+ * Create or load the 16 bit weight matrix from a memory mapped file or direct
+ * from memory (if `filename` == NULL). A new matrix is initialized like
+ * weights_create_or_load(). The file has half the size of a float matrix.
+ *
+ * #### Parameters
+ *
+ *  - `filename` The file name to save the weight matrix.
+ *  - `type` The 16 bit type `WEIGHT_F16` or `WEIGHT_BF16`.
+ *  - `m` The number of input (matrix) rows.
+ *  - `n` The number of output (matrix) columns.
+ *
+ *  Returns the matrix, `w` is NULL if an error occurred.
+ */
+struct hmatrix hmatrix_create_or_load(const char *filename,
+                                      enum weight_type type, uint32_t m,
+                                      uint32_t n);
+
+/**
+ * ### hmatrix_free()
+ *
+ * Unmap or free the 16 bit weight matrix.
+ */
+void hmatrix_free(struct hmatrix h);
+
+/**
+ * ### hmatrix_to_f32()
+ *
+ * Return a newly allocated float copy (e.g. the master copy of the training)
+ * of the 16 bit matrix or NULL if the allocation failed.
+ */
+float *hmatrix_to_f32(struct hmatrix h);
+
+/**
+ * ### hmatrix_store()
+ *
+ * Round the float matrix `w` to the nearest 16 bit values of `h`.
+ */
+void hmatrix_store(struct hmatrix h, const float w[h.m * h.n]);
+
+/**
+ * ### trans_act_h()
+ *
+ * The variant of trans_act() with 16 bit weights. The weights are converted
+ * on the fly and accumulated in float, which halves the memory traffic of
+ * the weights.
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of parallel processed input data.
+ *  - `w` The 16 bit m x n weight matrix.
+ *  - `b` The bias vector of length `n` or NULL.
+ *  - `x` The input vector of length `m * batch_len`.
+ *  - `act` The activation function (e.g. `relu`) or NULL.
+ *  - `y` The output (result) vector  of length `n * batch_len`.
+ */
+void trans_act_h(uint32_t batch_len, struct hmatrix w, const float *b,
+                 const float x[w.m * batch_len],
+                 void (*act)(uint32_t len, float *y),
+                 float y[w.n * batch_len]);
+
+/**
+ * ### smatrix_prune()
+ *
+ * Prune the weight matrix by magnitude: the blocks with the smallest L2 norm
+ * are removed until `ratio` of the blocks are pruned.
+ *
+ * #### Parameters
+ *
+ *  - `m` The number of input (matrix) rows.
+ *  - `n` The number of output (matrix) columns.
+ *  - `w` The m x n weight matrix.
+ *  - `ratio` The fraction of the blocks to remove (0 - 1).
+ *
+ *  Returns the sparse matrix, `val` is NULL if the allocation failed.
+ */
+struct smatrix smatrix_prune(uint32_t m, uint32_t n, const float w[m * n],
+                             float ratio);
+
+/**
+ * ### smatrix_density()
+ *
+ * Return the fraction of the stored (not pruned) blocks.
+ */
+float smatrix_density(struct smatrix s);
+
+/**
+ * ### smatrix_save()
+ *
+ * Write the sparse matrix to the file `filename`.
+ *
+ *  Returns false if the file could not be written.
+ */
+bool smatrix_save(const char *filename, struct smatrix s);
+
+/**
+ * ### smatrix_load()
+ *
+ * Read the m x n sparse matrix from the file `filename` (see smatrix_save()).
+ * Exit the program if the file is missing or invalid.
+ */
+struct smatrix smatrix_load(const char *filename, uint32_t m, uint32_t n);
+
+/**
+ * ### smatrix_free()
+ *
+ * Free the memory of the sparse matrix.
+ */
+void smatrix_free(struct smatrix s);
+
+/**
+ * ### trans_act_sparse()
+ *
+ * The variant of trans_act() with a block sparse weight matrix. The pruned
+ * blocks are skipped.
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of parallel processed input data.
+ *  - `w` The sparse m x n weight matrix.
+ *  - `b` The bias vector of length `n` or NULL.
+ *  - `x` The input vector of length `m * batch_len`.
+ *  - `act` The activation function (e.g. `relu`) or NULL.
+ *  - `y` The output (result) vector  of length `n * batch_len`.
+ */
+void trans_act_sparse(uint32_t batch_len, struct smatrix w, const float *b,
+                      const float x[w.m * batch_len],
+                      void (*act)(uint32_t len, float *y),
+                      float y[w.n * batch_len]);
+
+/**
+ * ### loss_sparse()
+ *
+ * The variant of loss() with a block sparse weight matrix:
+ * `dx = dy * w^T` over the stored blocks.
+ */
+void loss_sparse(uint32_t batch_len, struct smatrix w,
+                 const float dy[w.n * batch_len], float dx[w.m * batch_len]);
+
+/**
+ * ### train_sgd_sparse()
+ *
+ * The variant of train_sgd() with a block sparse weight matrix. Only the
+ * stored blocks are updated, the pruned blocks stay 0.
+ */
+void train_sgd_sparse(uint32_t batch_len, struct smatrix w,
+                      const float x[w.m * batch_len],
+                      const float dy[w.n * batch_len], float rate);
+
+/**
+ * ### train_adam_sparse()
+ *
+ * The variant of train_adam() with a block sparse weight matrix. Only the
+ * stored blocks are updated, the pruned blocks stay 0. The arrays `mom`,
+ * `veloc` and `grad` have the length `w.nnzb * SPARSE_BLOCK`.
+ */
+float train_adam_sparse(uint32_t batch_len, struct smatrix w,
+                        const float x[w.m * batch_len],
+                        const float dy[w.n * batch_len], float counter,
+                        float N, float beta1, float beta2, float epsilon,
+                        float mom[w.nnzb * SPARSE_BLOCK],
+                        float veloc[w.nnzb * SPARSE_BLOCK],
+                        float grad[w.nnzb * SPARSE_BLOCK]);
+
+/**
+ * ### svector_compress()
+ *
+ * Store the nonzero elements of the input vectors to the lists of `s`. The
+ * lists need the space of `m * batch_len` elements.
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of input vectors.
+ *  - `m` The length of the vectors.
+ *  - `x` The input vectors of length `m * batch_len`.
+ *  - `s` The sparse vectors.
+ *
+ *  Returns the density (the ratio of the nonzero elements) of the batch.
+ */
+float svector_compress(uint32_t batch_len, uint32_t m,
+                       const float x[m * batch_len], struct svector *s);
+
+/**
+ * ### trans_act_svector()
+ *
+ * The variant of trans_act() with sparse input vectors. Only the weights of
+ * the nonzero inputs are gathered and multiplied. The break-even density
+ * depends on the batch length and the gemm backend (see `make bench`).
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of parallel processed input data.
+ *  - `n` The number of output (matrix) columns.
+ *  - `w` The `x.m` x n weight matrix.
+ *  - `b` The bias vector of length `n` or NULL.
+ *  - `x` The sparse input vectors.
+ *  - `act` The activation function (e.g. `relu`) or NULL.
+ *  - `y` The output (result) vector  of length `n * batch_len`.
+ */
+void trans_act_svector(uint32_t batch_len, uint32_t n, const float *w,
+                       const float *b, struct svector x,
+                       void (*act)(uint32_t len, float *y),
+                       float y[n * batch_len]);
+
+/**
+ * ### train_sgd_svector()
+ *
+ * The variant of train_sgd() with sparse input vectors. Only the weights of
+ * the nonzero inputs are updated, the other weights have a zero gradient.
+ */
+void train_sgd_svector(uint32_t batch_len, uint32_t n, struct svector x,
+                       const float dy[n * batch_len], float rate, float *w);
+
+/**
+ * ### im2col()
+ *
+ * Pack the k x k x c patches of the images to the columns of the matrix
+ * `col`, one column per output pixel (the pixels of the padding are 0). The
+ * row `(ch * k + ky) * k + kx` of the matrix holds the shifted image plane
+ * `ch`, so it is copied row segment by row segment.
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of images.
+ *  - `g` The convolution shape.
+ *  - `x` The images of length `c * h * w * batch_len`.
+ *  - `col` The `k * k * c` x `oh * ow` matrices of the images.
+ */
+void im2col(uint32_t batch_len, struct conv2d g, const float *x, float *col);
+
+/**
+ * ### col2im()
+ *
+ * The adjoint of im2col(): sum the patch columns of `col` into the images `x`.
+ */
+void col2im(uint32_t batch_len, struct conv2d g, const float *col, float *x);
+
+/**
+ * ### conv2d()
+ *
+ * The convolution of the images with `f` filters, the bias and the activation
+ * (`y = act(conv(x, w) + b)`), computed per image as the matrix
+ * multiplication of the `f` x `k * k * c` filter matrix with the packed
+ * patches (see im2col()). The packed patches are kept in `col` for
+ * conv2d_train_sgd().
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of images.
+ *  - `g` The convolution shape.
+ *  - `w` The filter matrix, the filter `j` is stored at `w[j * k * k * c]`.
+ *  - `b` The bias vector of length `f` or NULL.
+ *  - `x` The images of length `c * h * w * batch_len`.
+ *  - `act` The activation function (e.g. `relu`) or NULL.
+ *  - `col` The packed patches of length `k * k * c * oh * ow * batch_len`.
+ *  - `y` The output images of length `f * oh * ow * batch_len`.
+ */
+void conv2d(uint32_t batch_len, struct conv2d g, const float *w,
+            const float *b, const float *x,
+            void (*act)(uint32_t len, float *y), float *col, float *y);
+
+/**
+ * ### conv2d_loss()
+ *
+ * The delta of the input images: the delta of the patches `w^T * dy` summed
+ * to the images by col2im().
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of images.
+ *  - `g` The convolution shape.
+ *  - `w` The filter matrix.
+ *  - `dy` The delta of the output images.
+ *  - `dcol` The delta of the packed patches (the length of `col`).
+ *  - `dx` The delta of the input images.
+ */
+void conv2d_loss(uint32_t batch_len, struct conv2d g, const float *w,
+                 const float *dy, float *dcol, float *dx);
+
+/**
+ * ### conv2d_train_sgd()
+ *
+ * Train the filters (`w -= rate * dy * col^T`) and the bias by the delta of
+ * the output images and the packed patches of conv2d().
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of images.
+ *  - `g` The convolution shape.
+ *  - `col` The packed patches of the prediction.
+ *  - `dy` The delta of the output images.
+ *  - `rate` The learning rate.
+ *  - `w` The filter matrix.
+ *  - `b` The bias vector of length `f` or NULL.
+ */
+void conv2d_train_sgd(uint32_t batch_len, struct conv2d g, const float *col,
+                      const float *dy, float rate, float *w, float b[g.f]);
+
+/**
+ * ### maxpool()
+ *
+ * The maximum of each window. The position of the maximum in `x` is stored
+ * in `idx` for maxpool_loss().
+ *
+ * #### Parameters
+ *
+ *  - `batch_len` The number of images.
+ *  - `p` The pooling shape.
+ *  - `x` The images of length `c * h * w * batch_len`.
+ *  - `y` The output images of length `c * oh * ow * batch_len`.
+ *  - `idx` The positions of the maxima (the length of `y`).
+ */
+void maxpool(uint32_t batch_len, struct pool2d p, const float *x, float *y,
+             uint32_t *idx);
+
+/**
+ * ### maxpool_loss()
+ *
+ * The delta of the input images: the delta of an output is passed to the
+ * position of its maximum, all other positions are 0.
+ */
+void maxpool_loss(uint32_t batch_len, struct pool2d p, const float *dy,
+                  const uint32_t *idx, float *dx);
+
+/**
+ * ### avgpool()
+ *
+ * The mean of each window.
+ */
+void avgpool(uint32_t batch_len, struct pool2d p, const float *x, float *y);
+
+/**
+ * ### avgpool_loss()
+ *
+ * The delta of the input images: the delta of an output is spread evenly
+ * over its window.
+ */
+void avgpool_loss(uint32_t batch_len, struct pool2d p, const float *dy,
+                  float *dx);
+
+/**
+ * ### bias_create_or_load()
+ *
+ * Create or load the bias vector fom a memory mapped file or direct from
+ * memory (if `filename` == NULL). A new bias vector is initialized with `0.0`.
+ *
+ * #### Parameters
+ *
+ *  - `filename` The file name to save the bias vector.
+ *  - `len` The length of the bias vector.
+ *
+ *  Returns the allocated vector memory or NULL if an error occurred.
+ */
+float *bias_create_or_load(const char *filename, uint32_t len);
+
 /**
  * ### dropout()
  *
@@ -318,4 +1123,41 @@ float *weights_create_or_load(const char *filename, uint32_t input_len,
  *  - `p` The related probability to set the element to _0_.
  *  - `result` The new vector with some of the elements is set to _0_.
  */
-void dropout(uint32_t len, const float vec[len], float p, float result[len]);
\ No newline at end of file
+void dropout(uint32_t len, const float vec[len], float p, float result[len]);
+/**
+ * ### kern_isa()
+ *
+ * Return the name of the instruction set of the vectorized kern functions
+ * (`scalar`, `sse42`, `avx2` or `avx512`).
+ *
+ * At program start the best instruction set supported by the CPU is selected.
+ * The environment variable `GSTNN_ISA` overrides this selection.
+ */
+const char *kern_isa(void);
+
+/**
+ * ### kern_isa_select()
+ *
+ * Select the instruction set of the vectorized kern functions.
+ *
+ * #### Parameters
+ *
+ *  - `name` The name of the instruction set (see kern_isa()).
+ *
+ *  Returns false if the instruction set is not supported by the CPU.
+ */
+bool kern_isa_select(const char *name);
+
+/**
+ * ### kern_threads()
+ *
+ * Set the number of threads of a matrix multiplication. Only OpenBLAS
+ * computes in several threads, the built-in gemm computes in the calling
+ * thread. Set it to 1 if the program calls the kern functions from several
+ * threads itself.
+ *
+ * #### Parameters
+ *
+ *  - `n` The number of threads.
+ */
+void kern_threads(uint32_t n);
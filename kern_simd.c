@@ -0,0 +1,681 @@
+/*
+ * The vectorized kern functions. This file is compiled once per instruction
+ * set (see simd.h and the Makefile) and exports the table `kern_simd_<isa>`.
+ */
+
+#include "kern_simd.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "simd.h"
+
+// List of activation functions
+// Convention: derived activation functions are suffixed with label 'derived'.
+// The derivatives are computed from the stored activation outputs.
+
+/*
+ * The sigmoid function 1 / (1 + exp(-x)).
+ * Max. absolute error compared to libm: 3e-7.
+ */
+static inline vf vf_sigmoid(vf x) {
+    const vf one = vf_set(1.0f);
+    return vf_div(one, vf_add(one, vf_exp(vf_sub(vf_set(0.0f), x))));
+}
+
+/*
+ * tanh(x) - a [13/6] rational approximation on [-7.9053, 7.9053]. Beyond this
+ * interval tanh(x) rounds to +/-1 in single precision.
+ * Max. absolute error compared to libm: 4e-7.
+ */
+static inline vf vf_tanh(vf x) {
+    x = vf_min(vf_max(x, vf_set(-7.90531110763549805f)),
+               vf_set(7.90531110763549805f));
+    const vf z = vf_mul(x, x);
+    vf p       = vf_set(-2.76076847742355e-16f);
+    p          = vf_fmadd(p, z, vf_set(2.00018790482477e-13f));
+    p          = vf_fmadd(p, z, vf_set(-8.60467152213735e-11f));
+    p          = vf_fmadd(p, z, vf_set(5.12229709037114e-08f));
+    p          = vf_fmadd(p, z, vf_set(1.48572235717979e-05f));
+    p          = vf_fmadd(p, z, vf_set(6.37261928875436e-04f));
+    p          = vf_fmadd(p, z, vf_set(4.89352455891786e-03f));
+    vf q       = vf_set(1.19825839466702e-06f);
+    q          = vf_fmadd(q, z, vf_set(1.18534705686654e-04f));
+    q          = vf_fmadd(q, z, vf_set(2.26843463243900e-03f));
+    q          = vf_fmadd(q, z, vf_set(4.89352518554385e-03f));
+    return vf_div(vf_mul(x, p), q);
+}
+
+static inline vf vf_relu(vf x) { return vf_max(x, vf_set(0.0f)); }
+
+static inline vf vf_sigmoid_derived(vf y, vf delta) {
+    return vf_mul(delta, vf_mul(y, vf_sub(vf_set(1.0f), y)));
+}
+
+static inline vf vf_tanh_derived(vf y, vf delta) {
+    return vf_mul(delta, vf_fnmadd(y, y, vf_set(1.0f)));
+}
+
+static inline vf vf_relu_derived(vf y, vf delta) {
+    return vf_select(vf_gt(y, vf_set(0.0f)), delta, vf_set(0.0f));
+}
+
+static void sigmoid(uint32_t len, float result[len]) {
+    VF_MAP(len, result, vf_sigmoid);
+}
+
+static void relu(uint32_t len, float result[len]) {
+    VF_MAP(len, result, vf_relu);
+}
+
+static void tanhg(uint32_t len, float result[len]) {
+    VF_MAP(len, result, vf_tanh);
+}
+
+static void relu_derived(uint32_t len, const float *result, float *delta) {
+    VF_MAP2(len, result, delta, vf_relu_derived);
+}
+
+static void tanhg_derived(uint32_t len, const float *result, float *delta) {
+    VF_MAP2(len, result, delta, vf_tanh_derived);
+}
+
+static void sigmoid_derived(uint32_t len, const float *result, float *delta) {
+    VF_MAP2(len, result, delta, vf_sigmoid_derived);
+}
+
+/*
+ * Fused adam moment and weight update of `len` elements.
+ *
+ * The bias corrections are hoisted out of the loop by the caller:
+ * `rate` = N / (1 - beta1^t) and `vcorr` = 1 / (1 - beta2^t).
+ *
+ * w -= rate * m / sqrt(vcorr * v + epsilon)
+ */
+static void adam_update(uint32_t len, const float *restrict g, float rate,
+                        float beta1, float beta2, float vcorr, float epsilon,
+                        float *restrict w, float *restrict mom,
+                        float *restrict veloc) {
+    const vf b1  = vf_set(beta1);
+    const vf b1c = vf_set(1.0f - beta1);
+    const vf b2  = vf_set(beta2);
+    const vf b2c = vf_set(1.0f - beta2);
+    const vf vc  = vf_set(vcorr);
+    const vf eps = vf_set(epsilon);
+    const vf r   = vf_set(rate);
+    uint32_t i   = 0;
+    for (; i + VF_LEN <= len; i += VF_LEN) {
+        const vf gi = vf_load(&g[i]);
+        const vf mi = vf_fmadd(b1c, gi, vf_mul(b1, vf_load(&mom[i])));
+        const vf vi =
+            vf_fmadd(b2c, vf_mul(gi, gi), vf_mul(b2, vf_load(&veloc[i])));
+        vf_store(&mom[i], mi);
+        vf_store(&veloc[i], vi);
+        const vf d = vf_sqrt(vf_fmadd(vc, vi, eps));
+        vf_store(&w[i], vf_fnmadd(r, vf_div(mi, d), vf_load(&w[i])));
+    }
+    for (; i < len; i++) {
+        mom[i]   = beta1 * mom[i] + (1.0f - beta1) * g[i];
+        veloc[i] = beta2 * veloc[i] + (1.0f - beta2) * g[i] * g[i];
+        w[i] -= rate * mom[i] / sqrtf(vcorr * veloc[i] + epsilon);
+    }
+}
+
+/*
+ * result = u > p ? vec : 0
+ */
+static void dropout_mask(uint32_t len, const float *vec, const float *u,
+                         float p, float *result) {
+    const vf vp = vf_set(p);
+    uint32_t i  = 0;
+    for (; i + VF_LEN <= len; i += VF_LEN) {
+        vf_store(&result[i], vf_select(vf_gt(vf_load(&u[i]), vp),
+                                       vf_load(&vec[i]), vf_set(0.0f)));
+    }
+    for (; i < len; i++) result[i] = u[i] > p ? vec[i] : 0.0f;
+}
+
+static float vec_max(uint32_t len, const float x[len]) {
+    vf m       = vf_set(x[0]);
+    uint32_t i = 0;
+    for (; i + VF_LEN <= len; i += VF_LEN) m = vf_max(m, vf_load(&x[i]));
+    float max = vf_hmax(m);
+    for (; i < len; i++) max = x[i] > max ? x[i] : max;
+    return max;
+}
+
+/*
+ * The vectorized max reduction, followed by the search of the first position
+ * of the max value.
+ */
+static uint32_t argmax(uint32_t len, const float x[len], float *max) {
+    *max = vec_max(len, x);
+    for (uint32_t i = 0; i < len; i++) {
+        if (x[i] == *max) return i;
+    }
+    return 0;
+}
+
+/*
+ * The top k values of VF_LEN vectors at once (one vector per lane, gathered
+ * element by element): the elements are inserted from the last to the first
+ * into the k descending registers of the lanes by a branch-free compare and
+ * swap. An element is inserted before the equal (later) ones, so the first of
+ * equal values ranks higher. The registers start at -INFINITY, which every
+ * element is inserted before, so after k <= len insertions the initial values
+ * are shifted out. The rank of a NaN element is unspecified (the kernels are
+ * built with -ffast-math). The remaining vectors of the batch are ranked one
+ * by one.
+ */
+static void topk(uint32_t batch_len, uint32_t len, uint32_t k,
+                 const float *x, uint16_t *idx, float *val) {
+    uint32_t s = 0;
+    uint32_t off[VF_LEN];
+    for (uint32_t l = 0; l < VF_LEN; l++) off[l] = l * len;
+    for (; VF_LEN > 1 && s + VF_LEN <= batch_len; s += VF_LEN) {
+        vf top[k], pos[k];
+        for (uint32_t r = 0; r < k; r++) {
+            top[r] = vf_set(-INFINITY);
+            pos[r] = vf_set(0.0f);
+        }
+        for (uint32_t j = len; j-- > 0;) {
+            vf v = vf_gather(&x[s * len + j], off);
+            vf p = vf_set((float)j);
+            for (uint32_t r = 0; r < k; r++) {
+                const vm m = vf_lt(v, top[r]);
+                const vf t = top[r], q = pos[r];
+                top[r]     = vf_select(m, t, v);
+                pos[r]     = vf_select(m, q, p);
+                v          = vf_select(m, v, t);
+                p          = vf_select(m, p, q);
+            }
+        }
+        float tv[VF_LEN], tp[VF_LEN];
+        for (uint32_t r = 0; r < k; r++) {
+            vf_store(tv, top[r]);
+            vf_store(tp, pos[r]);
+            for (uint32_t l = 0; l < VF_LEN; l++) {
+                val[(s + l) * k + r] = tv[l];
+                idx[(s + l) * k + r] = (uint16_t)tp[l];
+            }
+        }
+    }
+    for (; s < batch_len; s++) {
+        float *tv    = &val[s * k];
+        uint16_t *tp = &idx[s * k];
+        for (uint32_t r = 0; r < k; r++) {
+            tv[r] = -INFINITY;
+            tp[r] = 0;
+        }
+        for (uint32_t j = len; j-- > 0;) {
+            float v    = x[s * len + j];
+            uint16_t p = (uint16_t)j;
+            for (uint32_t r = 0; r < k; r++) {
+                if (!(v < tv[r])) {
+                    const float t    = tv[r];
+                    const uint16_t q = tp[r];
+                    tv[r]            = v;
+                    tp[r]            = p;
+                    v                = t;
+                    p                = q;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * e = exp(x - max), returns sum(e).
+ */
+static float exp_sum(uint32_t len, const float x[len], float max,
+                     float e[len]) {
+    const vf vmax = vf_set(max);
+    vf sum        = vf_set(0.0f);
+    uint32_t i    = 0;
+    for (; i + VF_LEN <= len; i += VF_LEN) {
+        const vf ei = vf_exp(vf_sub(vf_load(&x[i]), vmax));
+        vf_store(&e[i], ei);
+        sum = vf_add(sum, ei);
+    }
+    float total = vf_hsum(sum);
+    if (i < len) {
+        float t[VF_LEN] = {0};
+        memcpy(t, &x[i], (len - i) * sizeof(float));
+        vf_store(t, vf_exp(vf_sub(vf_load(t), vmax)));
+        for (uint32_t j = 0; i < len; i++, j++) {
+            e[i] = t[j];
+            total += t[j];
+        }
+    }
+    return total;
+}
+
+static void softmax(uint32_t len, const float x[len], float xs[len]) {
+    const float total = exp_sum(len, x, vec_max(len, x), xs);
+    const vf scale    = vf_set(1.0f / total);
+    uint32_t i        = 0;
+    for (; i + VF_LEN <= len; i += VF_LEN) {
+        vf_store(&xs[i], vf_mul(vf_load(&xs[i]), scale));
+    }
+    for (; i < len; i++) xs[i] /= total;
+}
+
+/*
+ * The softmax cross entropy of the logits x and the target t:
+ * d = softmax(x) - t (the gradient of the logits), returns
+ * sum(t * (lse - x)) = -sum(t * log(softmax(x))) with the log-sum-exp
+ * lse = max + log(sum(exp(x - max))). The delta and the loss take one pass
+ * over the exponentials.
+ */
+static double softmax_xent(uint32_t len, const float *x, const float *t,
+                           float *d) {
+    const float max   = vec_max(len, x);
+    const float total = exp_sum(len, x, max, d);
+    const float lse   = max + logf(total);
+    const vf scale    = vf_set(1.0f / total);
+    const vf vlse     = vf_set(lse);
+    vf acc            = vf_set(0.0f);
+    uint32_t i        = 0;
+    for (; i + VF_LEN <= len; i += VF_LEN) {
+        const vf ti = vf_load(&t[i]);
+        vf_store(&d[i], vf_sub(vf_mul(vf_load(&d[i]), scale), ti));
+        acc = vf_fmadd(ti, vf_sub(vlse, vf_load(&x[i])), acc);
+    }
+    if (i < len) {
+        // the zero padding of t adds nothing
+        float xt[VF_LEN] = {0}, tt[VF_LEN] = {0}, dt[VF_LEN] = {0};
+        memcpy(xt, &x[i], (len - i) * sizeof(float));
+        memcpy(tt, &t[i], (len - i) * sizeof(float));
+        memcpy(dt, &d[i], (len - i) * sizeof(float));
+        const vf ti = vf_load(tt);
+        vf_store(dt, vf_sub(vf_mul(vf_load(dt), scale), ti));
+        acc = vf_fmadd(ti, vf_sub(vlse, vf_load(xt)), acc);
+        memcpy(&d[i], dt, (len - i) * sizeof(float));
+    }
+    return vf_hsum(acc);
+}
+
+static double vec_delta(uint32_t len, const float *restrict v1,
+                        const float *restrict v2, float *restrict d) {
+    vf acc     = vf_set(0.0f);
+    uint32_t i = 0;
+    for (; i + VF_LEN <= len; i += VF_LEN) {
+        const vf di = vf_sub(vf_load(&v1[i]), vf_load(&v2[i]));
+        vf_store(&d[i], di);
+        acc = vf_fmadd(di, di, acc);
+    }
+    double error = vf_hsum(acc);
+    for (; i < len; i++) {
+        d[i] = v1[i] - v2[i];
+        error += d[i] * d[i];
+    }
+    return error / (double)len;
+}
+
+/*
+ * y[k * ldy + j] = dot(x[k * m], w[j * m]) for the n rows of the 16 bit
+ * matrix W. The weights are widened on the fly and accumulated in float.
+ * Four rows of W are loaded once for all batch rows (they stay in the L1).
+ */
+#define HGEMM_DOT(_name, _load, _cvt)                                          \
+    static void _name(uint32_t batch_len, uint32_t m, uint32_t n,              \
+                      const float *restrict x, const uint16_t *restrict w,     \
+                      float *restrict y, uint32_t ldy) {                       \
+        uint32_t j = 0;                                                        \
+        for (; j + 4 <= n; j += 4) {                                           \
+            const uint16_t *w0 = &w[j * m], *w1 = w0 + m, *w2 = w1 + m,        \
+                           *w3 = w2 + m;                                       \
+            for (uint32_t k = 0; k < batch_len; k++) {                         \
+                const float *xk = &x[k * m];                                   \
+                vf s0 = vf_set(0.0f), s1 = s0, s2 = s0, s3 = s0;               \
+                uint32_t p = 0;                                                \
+                for (; p + VF_LEN <= m; p += VF_LEN) {                         \
+                    const vf xp = vf_load(&xk[p]);                             \
+                    s0          = vf_fmadd(xp, _load(&w0[p]), s0);             \
+                    s1          = vf_fmadd(xp, _load(&w1[p]), s1);             \
+                    s2          = vf_fmadd(xp, _load(&w2[p]), s2);             \
+                    s3          = vf_fmadd(xp, _load(&w3[p]), s3);             \
+                }                                                              \
+                float r[4] = {vf_hsum(s0), vf_hsum(s1), vf_hsum(s2),           \
+                              vf_hsum(s3)};                                    \
+                for (; p < m; p++) {                                           \
+                    r[0] += xk[p] * _cvt(w0[p]);                               \
+                    r[1] += xk[p] * _cvt(w1[p]);                               \
+                    r[2] += xk[p] * _cvt(w2[p]);                               \
+                    r[3] += xk[p] * _cvt(w3[p]);                               \
+                }                                                              \
+                memcpy(&y[k * ldy + j], r, sizeof(r));                         \
+            }                                                                  \
+        }                                                                      \
+        for (; j < n; j++) {                                                   \
+            const uint16_t *wj = &w[j * m];                                    \
+            for (uint32_t k = 0; k < batch_len; k++) {                         \
+                const float *xk = &x[k * m];                                   \
+                vf s            = vf_set(0.0f);                                \
+                uint32_t p      = 0;                                           \
+                for (; p + VF_LEN <= m; p += VF_LEN) {                         \
+                    s = vf_fmadd(vf_load(&xk[p]), _load(&wj[p]), s);           \
+                }                                                              \
+                float r = vf_hsum(s);                                          \
+                for (; p < m; p++) r += xk[p] * _cvt(wj[p]);                   \
+                y[k * ldy + j] = r;                                            \
+            }                                                                  \
+        }                                                                      \
+    }
+
+HGEMM_DOT(hgemm_dot_f16, vf_load_f16, f16_to_f32)
+HGEMM_DOT(hgemm_dot_bf16, vf_load_bf16, bf16_to_f32)
+
+static void hgemm_dot(uint32_t batch_len, uint32_t m, uint32_t n,
+                      const float *x, const uint16_t *w, bool bf16, float *y,
+                      uint32_t ldy) {
+    if (bf16) {
+        hgemm_dot_bf16(batch_len, m, n, x, w, y, ldy);
+    } else {
+        hgemm_dot_f16(batch_len, m, n, x, w, y, ldy);
+    }
+}
+
+/*
+ * The block sparse kernels (see struct smatrix). A block holds SPARSE_BLOCK
+ * consecutive weights of a row; the last block of a row may exceed `m` and is
+ * processed element by element.
+ */
+
+/*
+ * y[k * ldy + j] = dot(x[k * m], w[j]) over the stored blocks of row j.
+ */
+static void sparse_dot(uint32_t batch_len, uint32_t m, uint32_t n,
+                       const uint32_t *restrict row_ptr,
+                       const uint32_t *restrict col, const float *restrict val,
+                       const float *restrict x, float *restrict y,
+                       uint32_t ldy) {
+    for (uint32_t j = 0; j < n; j++) {
+        for (uint32_t k = 0; k < batch_len; k++) {
+            const float *xk = &x[k * m];
+            vf s            = vf_set(0.0f);
+            float r         = 0.0f;
+            for (uint32_t b = row_ptr[j]; b < row_ptr[j + 1]; b++) {
+                const uint32_t c = col[b] * SPARSE_BLOCK;
+                const float *vb  = &val[b * SPARSE_BLOCK];
+                if (c + SPARSE_BLOCK <= m) {
+                    for (uint32_t v = 0; v < SPARSE_BLOCK; v += VF_LEN) {
+                        s = vf_fmadd(vf_load(&xk[c + v]), vf_load(&vb[v]), s);
+                    }
+                } else {
+                    for (uint32_t v = 0; c + v < m; v++) r += xk[c + v] * vb[v];
+                }
+            }
+            y[k * ldy + j] = vf_hsum(s) + r;
+        }
+    }
+}
+
+/*
+ * dx[k * m] = sum_j dy[k * n + j] * w[j] over the stored blocks.
+ */
+static void sparse_axpy(uint32_t batch_len, uint32_t m, uint32_t n,
+                        const uint32_t *restrict row_ptr,
+                        const uint32_t *restrict col,
+                        const float *restrict val, const float *restrict dy,
+                        float *restrict dx) {
+    memset(dx, 0, (size_t)batch_len * m * sizeof(float));
+    for (uint32_t k = 0; k < batch_len; k++) {
+        float *dxk = &dx[k * m];
+        for (uint32_t j = 0; j < n; j++) {
+            const float d = dy[k * n + j];
+            const vf vd   = vf_set(d);
+            for (uint32_t b = row_ptr[j]; b < row_ptr[j + 1]; b++) {
+                const uint32_t c = col[b] * SPARSE_BLOCK;
+                const float *vb  = &val[b * SPARSE_BLOCK];
+                if (c + SPARSE_BLOCK <= m) {
+                    for (uint32_t v = 0; v < SPARSE_BLOCK; v += VF_LEN) {
+                        vf_store(&dxk[c + v], vf_fmadd(vd, vf_load(&vb[v]),
+                                                       vf_load(&dxk[c + v])));
+                    }
+                } else {
+                    for (uint32_t v = 0; c + v < m; v++) {
+                        dxk[c + v] += d * vb[v];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * w[j] -= rate * sum_k dy[k * n + j] * x[k * m] for the stored blocks. The
+ * pruned blocks stay 0.
+ */
+static void sparse_update(uint32_t batch_len, uint32_t m, uint32_t n,
+                          const uint32_t *restrict row_ptr,
+                          const uint32_t *restrict col, float *restrict val,
+                          const float *restrict x, const float *restrict dy,
+                          float rate) {
+    for (uint32_t j = 0; j < n; j++) {
+        for (uint32_t k = 0; k < batch_len; k++) {
+            const float d = -rate * dy[k * n + j];
+            if (d == 0.0f) continue;
+            const vf vd     = vf_set(d);
+            const float *xk = &x[k * m];
+            for (uint32_t b = row_ptr[j]; b < row_ptr[j + 1]; b++) {
+                const uint32_t c = col[b] * SPARSE_BLOCK;
+                float *vb        = &val[b * SPARSE_BLOCK];
+                if (c + SPARSE_BLOCK <= m) {
+                    for (uint32_t v = 0; v < SPARSE_BLOCK; v += VF_LEN) {
+                        vf_store(&vb[v], vf_fmadd(vd, vf_load(&xk[c + v]),
+                                                  vf_load(&vb[v])));
+                    }
+                } else {
+                    for (uint32_t v = 0; c + v < m; v++) vb[v] += d * xk[c + v];
+                }
+            }
+        }
+    }
+}
+
+/*
+ * The sparse input kernels (see struct svector): the nonzero elements of the
+ * input vector k are val[t] at the indices idx[t], t in [ptr[k], ptr[k + 1]).
+ */
+
+/*
+ * y[k * n + j] = sum_t val[t] * w[j * m + idx[t]]
+ *
+ * The weights of the nonzero inputs are gathered from each row j.
+ */
+static void svector_dot(uint32_t batch_len, uint32_t m, uint32_t n,
+                        const uint32_t *restrict ptr,
+                        const uint32_t *restrict idx,
+                        const float *restrict val, const float *restrict w,
+                        float *restrict y) {
+    for (uint32_t k = 0; k < batch_len; k++) {
+        const uint32_t t0 = ptr[k], t1 = ptr[k + 1];
+        const uint32_t tv = t0 + (t1 - t0) / VF_LEN * VF_LEN;
+        for (uint32_t j = 0; j < n; j++) {
+            const float *row = &w[(size_t)j * m];
+            vf s             = vf_set(0.0f);
+            float r          = 0.0f;
+            uint32_t t       = t0;
+            for (; t < tv; t += VF_LEN) {
+                s = vf_fmadd(vf_gather(row, &idx[t]), vf_load(&val[t]), s);
+            }
+            for (; t < t1; t++) r += row[idx[t]] * val[t];
+            y[k * n + j] = vf_hsum(s) + r;
+        }
+    }
+}
+
+/*
+ * w[j * m + idx[t]] -= rate * dy[k * n + j] * val[t]
+ *
+ * Only the weights of the nonzero inputs are updated. The rows with a zero
+ * delta (e.g. inactive relu outputs) are skipped.
+ */
+static void svector_update(uint32_t batch_len, uint32_t m, uint32_t n,
+                           const uint32_t *restrict ptr,
+                           const uint32_t *restrict idx,
+                           const float *restrict val,
+                           const float *restrict dy, float rate,
+                           float *restrict w) {
+    for (uint32_t k = 0; k < batch_len; k++) {
+        const uint32_t t0 = ptr[k], t1 = ptr[k + 1];
+        const uint32_t tv = t0 + (t1 - t0) / VF_LEN * VF_LEN;
+        for (uint32_t j = 0; j < n; j++) {
+            const float d = -rate * dy[k * n + j];
+            if (d == 0.0f) continue;
+            const vf vd = vf_set(d);
+            float *row  = &w[(size_t)j * m];
+            uint32_t t  = t0;
+            for (; t < tv; t += VF_LEN) {
+                vf_scatter(row, &idx[t], vf_fmadd(vd, vf_load(&val[t]),
+                                                  vf_gather(row, &idx[t])));
+            }
+            for (; t < t1; t++) row[idx[t]] += d * val[t];
+        }
+    }
+}
+
+/*
+ * Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2,
+ * 3"): the 128 bit block (counter, stream) is encrypted with the 64 bit key in
+ * 10 rounds. The rounds of RNG_LANES counters are independent, the compiler
+ * vectorizes the loop over the counters (32 x 32 -> 64 bit multiplications).
+ */
+#define PHILOX_M0 0xd2511f53u
+#define PHILOX_M1 0xcd9e8d57u
+#define PHILOX_W0 0x9e3779b9u
+#define PHILOX_W1 0xbb67ae85u
+#define RNG_LANES 16
+
+/*
+ * The 4 * RNG_LANES random words of the RNG_LANES blocks (counter, stream)
+ * to (counter + RNG_LANES - 1, stream), in the order of the counters.
+ */
+static void philox_lanes(uint64_t key, uint64_t counter, uint64_t stream,
+                         uint32_t out[4 * RNG_LANES]) {
+    const uint32_t k0 = (uint32_t)key, k1 = (uint32_t)(key >> 32);
+    for (uint32_t l = 0; l < RNG_LANES; l++) {
+        uint32_t c0 = (uint32_t)(counter + l);
+        uint32_t c1 = (uint32_t)((counter + l) >> 32);
+        uint32_t c2 = (uint32_t)stream, c3 = (uint32_t)(stream >> 32);
+        for (uint32_t r = 0; r < 10; r++) {
+            const uint32_t rk0 = k0 + r * PHILOX_W0, rk1 = k1 + r * PHILOX_W1;
+            const uint64_t p0  = (uint64_t)PHILOX_M0 * c0;
+            const uint64_t p1  = (uint64_t)PHILOX_M1 * c2;
+            const uint32_t n0  = (uint32_t)(p1 >> 32) ^ c1 ^ rk0;
+            const uint32_t n2  = (uint32_t)(p0 >> 32) ^ c3 ^ rk1;
+            c1                 = (uint32_t)p1;
+            c3                 = (uint32_t)p0;
+            c0                 = n0;
+            c2                 = n2;
+        }
+        out[4 * l]     = c0;
+        out[4 * l + 1] = c1;
+        out[4 * l + 2] = c2;
+        out[4 * l + 3] = c3;
+    }
+}
+
+/*
+ * The 4 * blocks random words of the blocks starting at `counter`.
+ */
+static void rng_bits(uint32_t blocks, uint64_t key, uint64_t counter,
+                     uint64_t stream, uint32_t *bits) {
+    uint32_t buf[4 * RNG_LANES];
+    for (uint32_t b = 0; b < blocks; b += RNG_LANES) {
+        const uint32_t n = blocks - b < RNG_LANES ? blocks - b : RNG_LANES;
+        philox_lanes(key, counter + b, stream, buf);
+        memcpy(&bits[4 * b], buf, 4 * n * sizeof(uint32_t));
+    }
+}
+
+/*
+ * Uniform floats in [0, 1) of the upper 24 bits of the random words. Each
+ * block of the counter yields 4 floats.
+ */
+static void rng_uniform(uint32_t len, uint64_t key, uint64_t counter,
+                        uint64_t stream, float *u) {
+    uint32_t buf[4 * RNG_LANES];
+    for (uint32_t i = 0; i < len; i += 4 * RNG_LANES) {
+        const uint32_t n = len - i < 4 * RNG_LANES ? len - i : 4 * RNG_LANES;
+        philox_lanes(key, counter + i / 4, stream, buf);
+        for (uint32_t j = 0; j < n; j++) {
+            u[i + j] = (float)(buf[j] >> 8) * 0x1p-24f;
+        }
+    }
+}
+
+/*
+ * Normal distributed floats (Box-Muller transform of the pairs of uniform
+ * floats). Each block of the counter yields 4 floats. The separate loops are
+ * vectorized with the vector math library (libmvec) if available.
+ */
+static void rng_normal(uint32_t len, uint64_t key, uint64_t counter,
+                       uint64_t stream, float mu, float sigma, float *x) {
+    enum { PAIRS = 2 * RNG_LANES };
+    uint32_t buf[4 * RNG_LANES];
+    float r[PAIRS], t[PAIRS], z0[PAIRS], z1[PAIRS];
+    for (uint32_t i = 0; i < len; i += 4 * RNG_LANES) {
+        philox_lanes(key, counter + i / 4, stream, buf);
+        for (uint32_t j = 0; j < PAIRS; j++) {
+            // u1 in (0, 1] avoids log(0)
+            r[j] = (float)((buf[2 * j] >> 8) + 1) * 0x1p-24f;
+            t[j] = (float)(buf[2 * j + 1] >> 8) * (0x1p-24f * 6.2831853f);
+        }
+        for (uint32_t j = 0; j < PAIRS; j++) {
+            r[j] = sigma * sqrtf(-2.0f * logf(r[j]));
+        }
+        for (uint32_t j = 0; j < PAIRS; j++) z0[j] = mu + r[j] * cosf(t[j]);
+        for (uint32_t j = 0; j < PAIRS; j++) z1[j] = mu + r[j] * sinf(t[j]);
+        const uint32_t n = len - i < 4 * RNG_LANES ? len - i : 4 * RNG_LANES;
+        for (uint32_t j = 0; j < n; j++) {
+            x[i + j] = j % 2 == 0 ? z0[j / 2] : z1[j / 2];
+        }
+    }
+}
+
+/* defined in gemm.c */
+void ISA(gemm_f32)(bool trans_a, bool trans_b, uint32_t m, uint32_t n,
+                   uint32_t k, float alpha, const float *a, uint32_t lda,
+                   const float *b, uint32_t ldb, float beta, float *c,
+                   uint32_t ldc);
+
+/* defined in qgemm.c */
+void ISA(qgemm_dot)(uint32_t n, uint32_t ld, const int8_t *x, const int8_t *w,
+                    const int32_t *wsum, int32_t *y);
+#if defined(__AVX512BW__)
+void ISA(qgemm_dot_vnni)(uint32_t n, uint32_t ld, const int8_t *x,
+                         const int8_t *w, const int32_t *wsum, int32_t *y);
+#endif
+
+const struct kern_simd ISA(kern_simd) = {
+    .isa             = VF_ISA,
+    .sigmoid         = sigmoid,
+    .relu            = relu,
+    .tanhg           = tanhg,
+    .sigmoid_derived = sigmoid_derived,
+    .relu_derived    = relu_derived,
+    .tanhg_derived   = tanhg_derived,
+    .adam_update     = adam_update,
+    .dropout_mask    = dropout_mask,
+    .argmax          = argmax,
+    .topk            = topk,
+    .softmax         = softmax,
+    .vec_delta       = vec_delta,
+    .softmax_xent    = softmax_xent,
+    .gemm_f32        = ISA(gemm_f32),
+    .qgemm_dot       = ISA(qgemm_dot),
+    .hgemm_dot       = hgemm_dot,
+    .sparse_dot      = sparse_dot,
+    .sparse_axpy     = sparse_axpy,
+    .sparse_update   = sparse_update,
+    .svector_dot     = svector_dot,
+    .svector_update  = svector_update,
+    .rng_bits        = rng_bits,
+    .rng_uniform     = rng_uniform,
+    .rng_normal      = rng_normal,
+#if defined(__AVX512BW__)
+    .qgemm_dot_vnni = ISA(qgemm_dot_vnni),
+#endif
+};
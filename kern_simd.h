@@ -0,0 +1,86 @@
+/**
+ * # The multiversioned kern functions
+ *
+ * The vectorized kernels of the kern module are compiled once per instruction
+ * set (`scalar`, `sse42`, `avx2`, `avx512`). Each variant is published as a
+ * table of function pointers `kern_simd_<isa>`. At program start the kern
+ * module selects the best table supported by the CPU (cpuid), so one build
+ * runs on every x86-64 machine with the best available instruction set.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The number of weights of a block of the sparse matrix (same as kern.h) */
+#define SPARSE_BLOCK 16
+
+/**
+ * ### struct kern_simd
+ *
+ * The table of the vectorized kernels of one instruction set.
+ */
+struct kern_simd {
+    const char *isa;
+    void (*sigmoid)(uint32_t len, float y[len]);
+    void (*relu)(uint32_t len, float y[len]);
+    void (*tanhg)(uint32_t len, float y[len]);
+    void (*sigmoid_derived)(uint32_t len, const float *result, float *delta);
+    void (*relu_derived)(uint32_t len, const float *result, float *delta);
+    void (*tanhg_derived)(uint32_t len, const float *result, float *delta);
+    void (*adam_update)(uint32_t len, const float *g, float rate, float beta1,
+                        float beta2, float vcorr, float epsilon, float *w,
+                        float *mom, float *veloc);
+    void (*dropout_mask)(uint32_t len, const float *vec, const float *u,
+                         float p, float *result);
+    uint32_t (*argmax)(uint32_t len, const float *x, float *max);
+    void (*topk)(uint32_t batch_len, uint32_t len, uint32_t k, const float *x,
+                 uint16_t *idx, float *val);
+    void (*softmax)(uint32_t len, const float *x, float *xs);
+    double (*vec_delta)(uint32_t len, const float *v1, const float *v2,
+                        float *d);
+    double (*softmax_xent)(uint32_t len, const float *x, const float *t,
+                           float *d);
+    void (*gemm_f32)(bool trans_a, bool trans_b, uint32_t m, uint32_t n,
+                     uint32_t k, float alpha, const float *a, uint32_t lda,
+                     const float *b, uint32_t ldb, float beta, float *c,
+                     uint32_t ldc);
+    void (*hgemm_dot)(uint32_t batch_len, uint32_t m, uint32_t n,
+                      const float *x, const uint16_t *w, bool bf16, float *y,
+                      uint32_t ldy);
+    void (*sparse_dot)(uint32_t batch_len, uint32_t m, uint32_t n,
+                       const uint32_t *row_ptr, const uint32_t *col,
+                       const float *val, const float *x, float *y,
+                       uint32_t ldy);
+    void (*sparse_axpy)(uint32_t batch_len, uint32_t m, uint32_t n,
+                        const uint32_t *row_ptr, const uint32_t *col,
+                        const float *val, const float *dy, float *dx);
+    void (*sparse_update)(uint32_t batch_len, uint32_t m, uint32_t n,
+                          const uint32_t *row_ptr, const uint32_t *col,
+                          float *val, const float *x, const float *dy,
+                          float rate);
+    void (*svector_dot)(uint32_t batch_len, uint32_t m, uint32_t n,
+                        const uint32_t *ptr, const uint32_t *idx,
+                        const float *val, const float *w, float *y);
+    void (*svector_update)(uint32_t batch_len, uint32_t m, uint32_t n,
+                           const uint32_t *ptr, const uint32_t *idx,
+                           const float *val, const float *dy, float rate,
+                           float *w);
+    void (*rng_bits)(uint32_t blocks, uint64_t key, uint64_t counter,
+                     uint64_t stream, uint32_t *bits);
+    void (*rng_uniform)(uint32_t len, uint64_t key, uint64_t counter,
+                        uint64_t stream, float *u);
+    void (*rng_normal)(uint32_t len, uint64_t key, uint64_t counter,
+                       uint64_t stream, float mu, float sigma, float *x);
+    void (*qgemm_dot)(uint32_t n, uint32_t ld, const int8_t *x,
+                      const int8_t *w, const int32_t *wsum, int32_t *y);
+    /* The AVX-512 VNNI variant (NULL if not built), checked at selection. */
+    void (*qgemm_dot_vnni)(uint32_t n, uint32_t ld, const int8_t *x,
+                           const int8_t *w, const int32_t *wsum, int32_t *y);
+};
+
+extern const struct kern_simd kern_simd_scalar;
+extern const struct kern_simd kern_simd_sse42;
+extern const struct kern_simd kern_simd_avx2;
+extern const struct kern_simd kern_simd_avx512;
@@ -0,0 +1,208 @@
+#include "pserver.h"
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * The shared memory: the version of the parameters (odd while the server
+ * writes them), the parameters and `slots` gradient slots per worker. The
+ * parameters and each slot start at a cache line.
+ */
+struct pserver {
+    uint32_t workers, len, staleness, slots;
+    uint32_t self;  // the worker or `workers` for the server
+    size_t size;    // the size of the parameters or a slot in bytes
+    void *map;
+    size_t map_len;
+    _Atomic uint64_t *version;
+    float *param;
+    char *grad;
+    int (*fd)[2];  // the socket pair of a worker: [0] server, [1] worker
+    struct pollfd *poll;
+    uint64_t pushed, acked;  // the pushes and acknowledgements of a worker
+    uint64_t pulled;         // the version of the parameters of a worker
+};
+
+struct pserver *pserver_create(uint32_t workers, uint32_t len,
+                               uint32_t staleness) {
+    struct pserver *ps = calloc(1, sizeof(*ps));
+    if (ps == NULL) return NULL;
+    ps->workers   = workers;
+    ps->len       = len;
+    ps->staleness = staleness;
+    ps->slots     = staleness + 1;
+    ps->self      = workers;
+    ps->size      = (sizeof(float) * len + 63) / 64 * 64;
+    ps->map_len   = 64 + ps->size * (1 + (size_t)workers * ps->slots);
+    ps->map       = mmap(NULL, ps->map_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ps->fd        = calloc(workers, sizeof(*ps->fd));
+    ps->poll      = calloc(workers, sizeof(struct pollfd));
+    if (ps->map == MAP_FAILED || ps->fd == NULL || ps->poll == NULL) {
+        if (ps->map != MAP_FAILED) munmap(ps->map, ps->map_len);
+        free(ps->fd);
+        free(ps->poll);
+        free(ps);
+        return NULL;
+    }
+    ps->version = ps->map;
+    ps->param   = (float *)((char *)ps->map + 64);
+    ps->grad    = (char *)ps->param + ps->size;
+    for (uint32_t w = 0; w < workers; w++) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, ps->fd[w])) {
+            err(EXIT_FAILURE, "create the parameter server sockets");
+        }
+    }
+    return ps;
+}
+
+void pserver_attach(struct pserver *ps, uint32_t worker) {
+    ps->self = worker;
+    for (uint32_t w = 0; w < ps->workers; w++) {
+        if (worker == ps->workers) {
+            // the server keeps the server ends of the pairs
+            close(ps->fd[w][1]);
+            ps->poll[w] = (struct pollfd){.fd     = ps->fd[w][0],
+                                          .events = POLLIN};
+        } else {
+            // a worker keeps the worker end of its pair
+            close(ps->fd[w][0]);
+            if (w != worker) close(ps->fd[w][1]);
+            ps->poll[w].fd = -1;
+        }
+    }
+}
+
+/*
+ * Wait for the acknowledgement of the oldest push of the worker.
+ */
+static void pserver_wait_ack(struct pserver *ps) {
+    uint32_t slot;
+    const ssize_t n = recv(ps->fd[ps->self][1], &slot, sizeof(slot), 0);
+    if (n != sizeof(slot)) {
+        errx(EXIT_FAILURE, "the parameter server has closed the connection");
+    }
+    ps->acked++;
+}
+
+float *pserver_slot(struct pserver *ps) {
+    const uint64_t slot = ps->self * ps->slots + ps->pushed % ps->slots;
+    return (float *)(ps->grad + slot * ps->size);
+}
+
+void pserver_push(struct pserver *ps, const struct pserver_push *push) {
+    struct pserver_push msg = *push;
+    msg.worker              = ps->self;
+    msg.slot                = (uint32_t)(ps->pushed % ps->slots);
+    if (send(ps->fd[ps->self][1], &msg, sizeof(msg), MSG_NOSIGNAL) !=
+        sizeof(msg)) {
+        err(EXIT_FAILURE, "push the gradient");
+    }
+    ps->pushed++;
+    while (ps->pushed - ps->acked > ps->staleness) pserver_wait_ack(ps);
+}
+
+bool pserver_pull(struct pserver *ps, float *param) {
+    uint64_t v = atomic_load_explicit(ps->version, memory_order_acquire);
+    if (v == ps->pulled) return false;
+    for (;;) {
+        if (v & 1) {
+            sched_yield();
+            v = atomic_load_explicit(ps->version, memory_order_acquire);
+            continue;
+        }
+        memcpy(param, ps->param, sizeof(float) * ps->len);
+        atomic_thread_fence(memory_order_acquire);
+        const uint64_t check =
+            atomic_load_explicit(ps->version, memory_order_relaxed);
+        if (check == v) break;
+        v = check;
+    }
+    ps->pulled = v;
+    return true;
+}
+
+uint32_t pserver_receive(struct pserver *ps, struct pserver_push *push) {
+    uint32_t n = 0;
+    for (;;) {
+        bool open = false;
+        for (uint32_t w = 0; w < ps->workers; w++) {
+            open |= ps->poll[w].fd >= 0;
+        }
+        if (!open) return 0;
+        if (poll(ps->poll, ps->workers, -1) < 0) {
+            if (errno == EINTR) continue;
+            err(EXIT_FAILURE, "wait for the workers");
+        }
+        for (uint32_t w = 0; w < ps->workers; w++) {
+            if (ps->poll[w].fd < 0 || ps->poll[w].revents == 0) continue;
+            ssize_t len;
+            while ((len = recv(ps->poll[w].fd, &push[n], sizeof(*push),
+                               MSG_DONTWAIT)) == sizeof(*push)) {
+                push[n++].worker = w;
+            }
+            if (len == 0 || (len < 0 && errno != EAGAIN)) {
+                // the worker has finished
+                close(ps->poll[w].fd);
+                ps->poll[w].fd = -1;
+            }
+        }
+        if (n > 0) return n;
+    }
+}
+
+const float *pserver_gradient(const struct pserver *ps,
+                              const struct pserver_push *push) {
+    const uint64_t slot = push->worker * ps->slots + push->slot;
+    return (const float *)(ps->grad + slot * ps->size);
+}
+
+float *pserver_publish_begin(struct pserver *ps) {
+    const uint64_t v = atomic_load_explicit(ps->version, memory_order_relaxed);
+    atomic_store_explicit(ps->version, v + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return ps->param;
+}
+
+void pserver_publish_end(struct pserver *ps) {
+    const uint64_t v = atomic_load_explicit(ps->version, memory_order_relaxed);
+    atomic_store_explicit(ps->version, v + 1, memory_order_release);
+}
+
+void pserver_ack(struct pserver *ps, const struct pserver_push *push,
+                 uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        const int fd = ps->poll[push[i].worker].fd;
+        // a finished worker needs no acknowledgement
+        if (fd >= 0) {
+            send(fd, &push[i].slot, sizeof(push[i].slot), MSG_NOSIGNAL);
+        }
+    }
+}
+
+uint32_t pserver_slots(const struct pserver *ps) {
+    return ps->workers * ps->slots;
+}
+
+void pserver_close(struct pserver *ps) {
+    if (ps->self < ps->workers) {
+        while (ps->pushed > ps->acked) pserver_wait_ack(ps);
+        close(ps->fd[ps->self][1]);
+    } else {
+        for (uint32_t w = 0; w < ps->workers; w++) {
+            if (ps->poll[w].fd >= 0) close(ps->poll[w].fd);
+        }
+    }
+    munmap(ps->map, ps->map_len);
+    free(ps->fd);
+    free(ps->poll);
+    free(ps);
+}
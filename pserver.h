@@ -0,0 +1,152 @@
+// The parameter server of the multi-process training (`gstnn -w N`): the
+// worker processes push the gradients of their batches to the server
+// process and pull the weights, which the server trains by the gradients.
+//
+// The server and the workers share a memory region (created before the
+// workers are forked): the published parameters and a ring of gradient slots
+// per worker. The parameters are published under a sequence lock, a worker
+// copies them when their version changed. The pushes and their
+// acknowledgements are messages on a Unix domain socket pair per worker, the
+// gradients stay in the shared slots.
+//
+// A worker may push `staleness` gradients ahead of their acknowledgement: its
+// parameters miss at most `staleness` of its own updates (0 waits for each
+// update).
+//
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * ### PSERVER_STALENESS - The default staleness of the workers.
+ */
+#define PSERVER_STALENESS 1
+
+/**
+ * ### struct pserver_push
+ *
+ * A push of a worker: the gradient in the shared slot and the statistics of
+ * its samples.
+ *
+ *  - `worker` The worker (set by the server).
+ *  - `slot` The gradient slot of the worker.
+ *  - `samples` The number of samples of the gradient.
+ *  - `hits` The number of correctly classified samples.
+ *  - `error` The mean error of the samples.
+ *  - `duration` The time the worker computed the gradient in microseconds.
+ */
+struct pserver_push {
+    uint32_t worker;
+    uint32_t slot;
+    uint32_t samples;
+    uint32_t hits;
+    double error;
+    double duration;
+};
+
+struct pserver;
+
+/**
+ * ### pserver_create()
+ *
+ * Create the shared memory and the sockets of the server and the workers.
+ * Call it before the workers are forked.
+ *
+ * #### Parameters
+ *
+ *  - `workers` The number of worker processes.
+ *  - `len` The number of parameters.
+ *  - `staleness` The number of pushes a worker may be ahead.
+ *
+ *  Returns the parameter server or NULL on failure.
+ */
+struct pserver *pserver_create(uint32_t workers, uint32_t len,
+                               uint32_t staleness);
+
+/**
+ * ### pserver_attach()
+ *
+ * Attach the calling process as the worker `worker` (after the fork) or as
+ * the server (`worker` is the number of workers).
+ */
+void pserver_attach(struct pserver *ps, uint32_t worker);
+
+/**
+ * ### pserver_slot()
+ *
+ * Return the gradient slot of the next push of the worker.
+ */
+float *pserver_slot(struct pserver *ps);
+
+/**
+ * ### pserver_push()
+ *
+ * Pass the gradient of the slot to the server. Waits until the worker is at
+ * most `staleness` pushes ahead of their acknowledgement.
+ */
+void pserver_push(struct pserver *ps, const struct pserver_push *push);
+
+/**
+ * ### pserver_pull()
+ *
+ * Copy the parameters into `param` if the server published a new version.
+ *
+ * Returns true if the parameters were copied.
+ */
+bool pserver_pull(struct pserver *ps, float *param);
+
+/**
+ * ### pserver_receive()
+ *
+ * Wait for the pushes of the workers (on the server). The gradient of a push
+ * is pserver_gradient().
+ *
+ * #### Parameters
+ *
+ *  - `push` The received pushes (room for all slots of all workers).
+ *
+ *  Returns the number of pushes or 0 if all workers have finished.
+ */
+uint32_t pserver_receive(struct pserver *ps, struct pserver_push *push);
+
+/**
+ * ### pserver_gradient()
+ *
+ * Return the gradient of a received push.
+ */
+const float *pserver_gradient(const struct pserver *ps,
+                              const struct pserver_push *push);
+
+/**
+ * ### pserver_publish_begin(), pserver_publish_end()
+ *
+ * Write the parameters (returned by pserver_publish_begin()) and publish the
+ * new version.
+ */
+float *pserver_publish_begin(struct pserver *ps);
+void pserver_publish_end(struct pserver *ps);
+
+/**
+ * ### pserver_ack()
+ *
+ * Acknowledge the received pushes: their slots are free again.
+ */
+void pserver_ack(struct pserver *ps, const struct pserver_push *push,
+                 uint32_t len);
+
+/**
+ * ### pserver_slots()
+ *
+ * Returns the number of gradient slots of all workers.
+ */
+uint32_t pserver_slots(const struct pserver *ps);
+
+/**
+ * ### pserver_close()
+ *
+ * Close the connection (a worker waits for its pending acknowledgements
+ * first) and release the shared memory.
+ */
+void pserver_close(struct pserver *ps);
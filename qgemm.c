@@ -0,0 +1,151 @@
+/*
+ * The int8 matrix vector products of the quantized inference.
+ */
+
+#include <stdint.h>
+
+#if defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+#include "simd.h"
+
+#if defined(__AVX512BW__)
+
+/*
+ * AVX-512: the int8 values are sign extended to int16 and multiplied by
+ * vpmaddwd (no saturation, in contrast to vpmaddubsw).
+ */
+static inline __m512i qdot_step(const int8_t *x, const int8_t *w, __m512i acc) {
+    const __m512i xv = _mm512_cvtepi8_epi16(_mm256_loadu_si256((void *)x));
+    const __m512i wv = _mm512_cvtepi8_epi16(_mm256_loadu_si256((void *)w));
+    return _mm512_add_epi32(acc, _mm512_madd_epi16(xv, wv));
+}
+#define QDOT_STEP 32
+#define qdot_zero() _mm512_setzero_si512()
+#define qdot_hsum(_v) _mm512_reduce_add_epi32(_v)
+typedef __m512i vqi;
+
+#elif defined(__AVX2__)
+
+static inline __m256i qdot_step(const int8_t *x, const int8_t *w, __m256i acc) {
+    const __m256i xv = _mm256_cvtepi8_epi16(_mm_loadu_si128((void *)x));
+    const __m256i wv = _mm256_cvtepi8_epi16(_mm_loadu_si128((void *)w));
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(xv, wv));
+}
+
+static inline int32_t qdot_hsum(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v),
+                              _mm256_extracti128_si256(v, 1));
+    s         = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s         = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    return _mm_cvtsi128_si32(s);
+}
+#define QDOT_STEP 16
+#define qdot_zero() _mm256_setzero_si256()
+typedef __m256i vqi;
+
+#elif defined(__SSE4_2__)
+
+static inline __m128i qdot_step(const int8_t *x, const int8_t *w, __m128i acc) {
+    const __m128i xv = _mm_cvtepi8_epi16(_mm_loadl_epi64((void *)x));
+    const __m128i wv = _mm_cvtepi8_epi16(_mm_loadl_epi64((void *)w));
+    return _mm_add_epi32(acc, _mm_madd_epi16(xv, wv));
+}
+
+static inline int32_t qdot_hsum(__m128i s) {
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    return _mm_cvtsi128_si32(s);
+}
+#define QDOT_STEP 8
+#define qdot_zero() _mm_setzero_si128()
+typedef __m128i vqi;
+
+#else
+
+static inline int32_t qdot_step(const int8_t *x, const int8_t *w, int32_t acc) {
+    return acc + (int32_t)x[0] * w[0];
+}
+#define QDOT_STEP 1
+#define qdot_zero() 0
+#define qdot_hsum(_v) (_v)
+typedef int32_t vqi;
+
+#endif
+
+/*
+ * y[j] = dot(x, w[j * ld]) for the n int8 rows of W. `ld` is a multiple of
+ * 64 and the rows are padded with zeros. Four rows share each load of `x`.
+ */
+void ISA(qgemm_dot)(uint32_t n, uint32_t ld, const int8_t *restrict x,
+                    const int8_t *restrict w, const int32_t *restrict wsum,
+                    int32_t *restrict y) {
+    (void)wsum;
+    uint32_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        const int8_t *w0 = &w[j * ld], *w1 = w0 + ld, *w2 = w1 + ld,
+                     *w3 = w2 + ld;
+        vqi s0 = qdot_zero(), s1 = s0, s2 = s0, s3 = s0;
+        for (uint32_t p = 0; p < ld; p += QDOT_STEP) {
+            s0 = qdot_step(&x[p], &w0[p], s0);
+            s1 = qdot_step(&x[p], &w1[p], s1);
+            s2 = qdot_step(&x[p], &w2[p], s2);
+            s3 = qdot_step(&x[p], &w3[p], s3);
+        }
+        y[j]     = qdot_hsum(s0);
+        y[j + 1] = qdot_hsum(s1);
+        y[j + 2] = qdot_hsum(s2);
+        y[j + 3] = qdot_hsum(s3);
+    }
+    for (; j < n; j++) {
+        vqi s = qdot_zero();
+        for (uint32_t p = 0; p < ld; p += QDOT_STEP) {
+            s = qdot_step(&x[p], &w[j * ld + p], s);
+        }
+        y[j] = qdot_hsum(s);
+    }
+}
+
+#if defined(__AVX512BW__)
+
+/*
+ * AVX-512 VNNI: vpdpbusd multiplies unsigned with signed bytes. The input is
+ * shifted to unsigned (x + 128) and the shift is removed with the row sums of
+ * the weights: dot(x + 128, w) - 128 * sum(w).
+ */
+__attribute__((target("avx512vnni"))) void
+ISA(qgemm_dot_vnni)(uint32_t n, uint32_t ld, const int8_t *restrict x,
+                    const int8_t *restrict w, const int32_t *restrict wsum,
+                    int32_t *restrict y) {
+    const __m512i shift = _mm512_set1_epi8((char)0x80);
+    uint32_t j          = 0;
+    for (; j + 4 <= n; j += 4) {
+        const int8_t *w0 = &w[j * ld], *w1 = w0 + ld, *w2 = w1 + ld,
+                     *w3 = w2 + ld;
+        __m512i s0 = _mm512_setzero_si512(), s1 = s0, s2 = s0, s3 = s0;
+        for (uint32_t p = 0; p < ld; p += 64) {
+            const __m512i xu =
+                _mm512_xor_si512(_mm512_loadu_si512(&x[p]), shift);
+            s0 = _mm512_dpbusd_epi32(s0, xu, _mm512_loadu_si512(&w0[p]));
+            s1 = _mm512_dpbusd_epi32(s1, xu, _mm512_loadu_si512(&w1[p]));
+            s2 = _mm512_dpbusd_epi32(s2, xu, _mm512_loadu_si512(&w2[p]));
+            s3 = _mm512_dpbusd_epi32(s3, xu, _mm512_loadu_si512(&w3[p]));
+        }
+        y[j]     = _mm512_reduce_add_epi32(s0) - 128 * wsum[j];
+        y[j + 1] = _mm512_reduce_add_epi32(s1) - 128 * wsum[j + 1];
+        y[j + 2] = _mm512_reduce_add_epi32(s2) - 128 * wsum[j + 2];
+        y[j + 3] = _mm512_reduce_add_epi32(s3) - 128 * wsum[j + 3];
+    }
+    for (; j < n; j++) {
+        __m512i s = _mm512_setzero_si512();
+        for (uint32_t p = 0; p < ld; p += 64) {
+            const __m512i xu =
+                _mm512_xor_si512(_mm512_loadu_si512(&x[p]), shift);
+            s = _mm512_dpbusd_epi32(s, xu, _mm512_loadu_si512(&w[j * ld + p]));
+        }
+        y[j] = _mm512_reduce_add_epi32(s) - 128 * wsum[j];
+    }
+}
+
+#endif
@@ -0,0 +1,88 @@
+#include "report.h"
+#include "stopwatch.h"
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdlib.h>
+
+struct report report_init(FILE *stream, enum report_format format,
+                          uint64_t every, uint64_t every_ms) {
+    return (struct report){.stream   = stream,
+                           .format   = format,
+                           .every    = every,
+                           .every_ms = every_ms,
+                           .start    = stopwatch_start(),
+                           .next     = every,
+                           .next_us  = 1e3 * (double)every_ms};
+}
+
+/*
+ * Write a report line if an interval has passed.
+ */
+static void report_interval(struct report *r) {
+    if ((r->every == 0 || r->samples < r->next) &&
+        (r->every_ms == 0 || stopwatch_stop_us(r->start) < r->next_us)) {
+        return;
+    }
+    report_write(r);
+    // the next interval starts now
+    if (r->every > 0) r->next = r->samples + r->every;
+    if (r->every_ms > 0) {
+        r->next_us = stopwatch_stop_us(r->start) + 1e3 * (double)r->every_ms;
+    }
+}
+
+void report_collect(struct report *r, uint32_t samples, uint32_t hits,
+                    double error, double duration) {
+    r->samples += samples;
+    r->hits += hits;
+    stats_collect2(&r->error, error);
+    stats_collect2(&r->duration, duration);
+    hist_collect(&r->duration_hist, duration);
+    report_interval(r);
+}
+
+void report_merge(struct report *r, const struct report *part) {
+    r->samples += part->samples;
+    r->hits += part->hits;
+    stats_merge(&r->error, &part->error, 2);
+    stats_merge(&r->duration, &part->duration, 2);
+    hist_merge(&r->duration_hist, &part->duration_hist);
+    report_interval(r);
+}
+
+void report_write(struct report *r) {
+    const double n = (double)r->samples;
+    struct report_record rec = {
+        .samples        = r->samples,
+        .hits           = r->hits,
+        .error_mean     = stats_mean(&r->error),
+        .error_rsdev    = stats_rsdev_unbiased(&r->error),
+        .duration_mean  = stats_mean(&r->duration),
+        .duration_rsdev = stats_rsdev_unbiased(&r->duration),
+        .elapsed        = stopwatch_stop_us(r->start) * 1e-6,
+        .duration_p50   = hist_quantile(&r->duration_hist, 0.5),
+        .duration_p90   = hist_quantile(&r->duration_hist, 0.9),
+        .duration_p99   = hist_quantile(&r->duration_hist, 0.99),
+        .duration_p999  = hist_quantile(&r->duration_hist, 0.999),
+        .duration_max   = hist_quantile(&r->duration_hist, 1.0)};
+    if (r->format == REPORT_BINARY) {
+        if (fwrite(&rec, sizeof(rec), 1, r->stream) != 1) {
+            err(EXIT_FAILURE, "writing report record");
+        }
+        return;
+    }
+    fprintf(r->stream,
+            "%1.4e, %4.02f, %.4f, %.3f, %5.2e, %4.02f, %" PRIu64
+            ", %5.2e, %5.2e, %5.2e, %5.2e, %5.2e\n",
+            rec.error_mean, rec.error_rsdev, (double)rec.hits / n,
+            100.0 * (1.0 - (double)rec.hits / n), rec.duration_mean,
+            rec.duration_rsdev, rec.samples, rec.duration_p50,
+            rec.duration_p90, rec.duration_p99, rec.duration_p999,
+            rec.duration_max);
+}
+
+void report_summary(struct report *r) {
+    if (r->samples > 0) report_write(r);
+    fflush(r->stream);
+}
@@ -0,0 +1,140 @@
+// The progress report of the training: the hits, the error and the duration
+// of the batches are accumulated in counters and a report line is written
+// every `every` samples or `every_ms` milliseconds only, so the reporting
+// costs no stream output per batch. A summary of all samples is written at
+// the end. The durations are counted in a histogram as well, which gives the
+// tail of the batch latency (the 50th to 99.9th percentile and the max).
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "hist.h"
+#include "stats.h"
+
+/**
+ * ### REPORT_SAMPLES, REPORT_MS - The default report interval.
+ */
+#define REPORT_SAMPLES 10000
+#define REPORT_MS 1000
+
+/**
+ * ### enum report_format
+ *
+ *  - `REPORT_CSV` A line of comma separated text (see report_write()).
+ *  - `REPORT_BINARY` A struct report_record.
+ */
+enum report_format { REPORT_CSV, REPORT_BINARY };
+
+/**
+ * ### struct report_record
+ *
+ * The binary report record (native byte order). All values refer to the
+ * samples since the start.
+ *
+ *  - `samples` The number of samples.
+ *  - `hits` The number of correctly classified samples.
+ *  - `error_mean`, `error_rsdev` The mean and the relative standard deviation
+ *     of the batch error.
+ *  - `duration_mean`, `duration_rsdev` The mean and the relative standard
+ *     deviation of the duration of a batch in microseconds.
+ *  - `elapsed` The time since the start in seconds.
+ *  - `duration_p50`, `duration_p90`, `duration_p99`, `duration_p999`,
+ *    `duration_max` The 50th, 90th, 99th and 99.9th percentile and the max of
+ *     the duration of a batch in microseconds (see hist_quantile()).
+ */
+struct report_record {
+    uint64_t samples;
+    uint64_t hits;
+    double error_mean;
+    double error_rsdev;
+    double duration_mean;
+    double duration_rsdev;
+    double elapsed;
+    double duration_p50;
+    double duration_p90;
+    double duration_p99;
+    double duration_p999;
+    double duration_max;
+};
+
+/**
+ * ### struct report
+ *
+ * The counters of the report. Zero `every` or `every_ms` disables the
+ * interval.
+ */
+struct report {
+    FILE *stream;
+    enum report_format format;
+    uint64_t every;
+    uint64_t every_ms;
+    uint64_t samples, hits;
+    struct stats error, duration;
+    struct hist duration_hist;
+    struct timespec start;
+    uint64_t next;   // the sample count of the next report
+    double next_us;  // the time of the next report (in microseconds)
+};
+
+/**
+ * ### report_init()
+ *
+ * Start the report.
+ *
+ * #### Parameters
+ *
+ *  - `stream` The stream of the report lines.
+ *  - `format` The format of the report lines.
+ *  - `every` Write a report line every `every` samples (or 0).
+ *  - `every_ms` Write a report line every `every_ms` milliseconds (or 0).
+ */
+struct report report_init(FILE *stream, enum report_format format,
+                          uint64_t every, uint64_t every_ms);
+
+/**
+ * ### report_collect()
+ *
+ * Add a batch to the counters and write a report line if an interval has
+ * passed.
+ *
+ * #### Parameters
+ *
+ *  - `r` The report.
+ *  - `samples` The number of samples of the batch.
+ *  - `hits` The number of correctly classified samples of the batch.
+ *  - `error` The error of the batch.
+ *  - `duration` The duration of the batch in microseconds.
+ */
+void report_collect(struct report *r, uint32_t samples, uint32_t hits,
+                    double error, double duration);
+
+/**
+ * ### report_merge()
+ *
+ * Add the counters of the report `part` (of a disjoint set of batches, e.g.
+ * a shard) and write a report line if an interval has passed. Merging the
+ * parts in a fixed order gives the same counters for any number of threads.
+ */
+void report_merge(struct report *r, const struct report *part);
+
+/**
+ * ### report_write()
+ *
+ * Write a report line of the counters. A text line holds the mean error, the
+ * relative standard deviation of the error, the accuracy, the error rate in
+ * percent, the mean duration of a batch (in microseconds), its relative
+ * standard deviation, the number of samples and the 50th, 90th, 99th and
+ * 99.9th percentile and the max of the duration of a batch.
+ */
+void report_write(struct report *r);
+
+/**
+ * ### report_summary()
+ *
+ * Write the report line of all samples (if any) and flush the stream.
+ */
+void report_summary(struct report *r);
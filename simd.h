@@ -0,0 +1,332 @@
+/**
+ * ======================================================================
+ * @file simd.h
+ *
+ * @brief Thin vector abstraction for the kern functions.
+ *
+ * The kernels are written once against the `vf_*` functions. Depending on the
+ * instruction set the translation unit is compiled for, a vector `vf` holds
+ * `VF_LEN` floats (AVX-512: 16, AVX2: 8, SSE4.2: 4, scalar fallback: 1).
+ *
+ * The kernel sources are compiled once per instruction set (see the Makefile)
+ * with `-DKERN_ISA=<isa>`; `ISA(name)` appends the instruction set to a symbol
+ * name (e.g. `gemm_f32_avx2`).
+ *
+ * `vf_load_f16()` and `vf_load_bf16()` widen 16 bit floats (see half.h) on the
+ * fly (F16C, AVX-512 or emulated).
+ * ======================================================================
+ */
+
+#pragma once
+
+#include <immintrin.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "half.h"
+
+#ifndef KERN_ISA
+#define KERN_ISA scalar
+#endif
+#define ISA_CAT2(_name, _isa) _name##_##_isa
+#define ISA_CAT(_name, _isa) ISA_CAT2(_name, _isa)
+#define ISA(_name) ISA_CAT(_name, KERN_ISA)
+
+#if defined(__AVX512F__)
+
+#define VF_ISA "avx512"
+#define VF_LEN 16
+typedef __m512 vf;
+typedef __mmask16 vm;
+
+static inline vf vf_load(const float *p) { return _mm512_loadu_ps(p); }
+static inline vf vf_load_f16(const uint16_t *p) {
+    return _mm512_cvtph_ps(_mm256_loadu_si256((const void *)p));
+}
+static inline vf vf_load_bf16(const uint16_t *p) {
+    const __m512i h = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const void *)p));
+    return _mm512_castsi512_ps(_mm512_slli_epi32(h, 16));
+}
+static inline void vf_store(float *p, vf a) { _mm512_storeu_ps(p, a); }
+/* p[i[0]], ..., p[i[15]] and the inverse (the indices must differ) */
+static inline vf vf_gather(const float *p, const uint32_t *i) {
+    return _mm512_i32gather_ps(_mm512_loadu_si512(i), p, 4);
+}
+static inline void vf_scatter(float *p, const uint32_t *i, vf a) {
+    _mm512_i32scatter_ps(p, _mm512_loadu_si512(i), a, 4);
+}
+static inline vf vf_set(float a) { return _mm512_set1_ps(a); }
+static inline vf vf_add(vf a, vf b) { return _mm512_add_ps(a, b); }
+static inline vf vf_sub(vf a, vf b) { return _mm512_sub_ps(a, b); }
+static inline vf vf_mul(vf a, vf b) { return _mm512_mul_ps(a, b); }
+static inline vf vf_div(vf a, vf b) { return _mm512_div_ps(a, b); }
+static inline vf vf_fmadd(vf a, vf b, vf c) { return _mm512_fmadd_ps(a, b, c); }
+static inline vf vf_fnmadd(vf a, vf b, vf c) {
+    return _mm512_fnmadd_ps(a, b, c);
+}
+static inline vf vf_max(vf a, vf b) { return _mm512_max_ps(a, b); }
+static inline vf vf_min(vf a, vf b) { return _mm512_min_ps(a, b); }
+static inline vf vf_sqrt(vf a) { return _mm512_sqrt_ps(a); }
+static inline float vf_hsum(vf a) { return _mm512_reduce_add_ps(a); }
+static inline float vf_hmax(vf a) { return _mm512_reduce_max_ps(a); }
+static inline vf vf_abs(vf a) { return _mm512_abs_ps(a); }
+static inline vf vf_round(vf a) {
+    return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEAREST_INT |
+                                       _MM_FROUND_NO_EXC);
+}
+/* 2^n for an integral valued `n` within [-127, 128] */
+static inline vf vf_pow2i(vf n) {
+    const __m512i e = _mm512_add_epi32(_mm512_cvtps_epi32(n),
+                                       _mm512_set1_epi32(127));
+    return _mm512_castsi512_ps(_mm512_slli_epi32(e, 23));
+}
+static inline vm vf_lt(vf a, vf b) {
+    return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ);
+}
+static inline vm vf_gt(vf a, vf b) {
+    return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ);
+}
+/* m ? a : b */
+static inline vf vf_select(vm m, vf a, vf b) {
+    return _mm512_mask_blend_ps(m, b, a);
+}
+
+#elif defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+
+#define VF_ISA "avx2"
+#define VF_LEN 8
+typedef __m256 vf;
+typedef __m256 vm;
+
+static inline vf vf_load(const float *p) { return _mm256_loadu_ps(p); }
+static inline vf vf_load_f16(const uint16_t *p) {
+    return _mm256_cvtph_ps(_mm_loadu_si128((const void *)p));
+}
+static inline vf vf_load_bf16(const uint16_t *p) {
+    const __m256i h = _mm256_cvtepu16_epi32(_mm_loadu_si128((const void *)p));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(h, 16));
+}
+static inline void vf_store(float *p, vf a) { _mm256_storeu_ps(p, a); }
+/* p[i[0]], ..., p[i[7]] and the inverse (no scatter in AVX2: emulated) */
+static inline vf vf_gather(const float *p, const uint32_t *i) {
+    return _mm256_i32gather_ps(p, _mm256_loadu_si256((const void *)i), 4);
+}
+static inline void vf_scatter(float *p, const uint32_t *i, vf a) {
+    float v[8];
+    _mm256_storeu_ps(v, a);
+    for (int k = 0; k < 8; k++) p[i[k]] = v[k];
+}
+static inline vf vf_set(float a) { return _mm256_set1_ps(a); }
+static inline vf vf_add(vf a, vf b) { return _mm256_add_ps(a, b); }
+static inline vf vf_sub(vf a, vf b) { return _mm256_sub_ps(a, b); }
+static inline vf vf_mul(vf a, vf b) { return _mm256_mul_ps(a, b); }
+static inline vf vf_div(vf a, vf b) { return _mm256_div_ps(a, b); }
+static inline vf vf_fmadd(vf a, vf b, vf c) { return _mm256_fmadd_ps(a, b, c); }
+static inline vf vf_fnmadd(vf a, vf b, vf c) {
+    return _mm256_fnmadd_ps(a, b, c);
+}
+static inline vf vf_max(vf a, vf b) { return _mm256_max_ps(a, b); }
+static inline vf vf_min(vf a, vf b) { return _mm256_min_ps(a, b); }
+static inline vf vf_sqrt(vf a) { return _mm256_sqrt_ps(a); }
+static inline float vf_hsum(vf a) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+    s        = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehdup_ps(s)));
+}
+static inline float vf_hmax(vf a) {
+    __m128 s = _mm_max_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+    s        = _mm_max_ps(s, _mm_movehl_ps(s, s));
+    return _mm_cvtss_f32(_mm_max_ss(s, _mm_movehdup_ps(s)));
+}
+static inline vf vf_abs(vf a) {
+    return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+}
+static inline vf vf_round(vf a) {
+    return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+}
+/* 2^n for an integral valued `n` within [-127, 128] */
+static inline vf vf_pow2i(vf n) {
+    const __m256i e = _mm256_add_epi32(_mm256_cvtps_epi32(n),
+                                       _mm256_set1_epi32(127));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(e, 23));
+}
+static inline vm vf_lt(vf a, vf b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline vm vf_gt(vf a, vf b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+/* m ? a : b */
+static inline vf vf_select(vm m, vf a, vf b) {
+    return _mm256_blendv_ps(b, a, m);
+}
+
+#elif defined(__SSE4_2__)
+
+#define VF_ISA "sse42"
+#define VF_LEN 4
+typedef __m128 vf;
+typedef __m128 vm;
+
+static inline vf vf_load(const float *p) { return _mm_loadu_ps(p); }
+/* no F16C in SSE4.2: emulated */
+static inline vf vf_load_f16(const uint16_t *p) {
+    return _mm_setr_ps(f16_to_f32(p[0]), f16_to_f32(p[1]), f16_to_f32(p[2]),
+                       f16_to_f32(p[3]));
+}
+static inline vf vf_load_bf16(const uint16_t *p) {
+    const __m128i h = _mm_cvtepu16_epi32(_mm_loadl_epi64((const void *)p));
+    return _mm_castsi128_ps(_mm_slli_epi32(h, 16));
+}
+static inline void vf_store(float *p, vf a) { _mm_storeu_ps(p, a); }
+/* p[i[0]], ..., p[i[3]] and the inverse (emulated) */
+static inline vf vf_gather(const float *p, const uint32_t *i) {
+    return _mm_setr_ps(p[i[0]], p[i[1]], p[i[2]], p[i[3]]);
+}
+static inline void vf_scatter(float *p, const uint32_t *i, vf a) {
+    float v[4];
+    _mm_storeu_ps(v, a);
+    for (int k = 0; k < 4; k++) p[i[k]] = v[k];
+}
+static inline vf vf_set(float a) { return _mm_set1_ps(a); }
+static inline vf vf_add(vf a, vf b) { return _mm_add_ps(a, b); }
+static inline vf vf_sub(vf a, vf b) { return _mm_sub_ps(a, b); }
+static inline vf vf_mul(vf a, vf b) { return _mm_mul_ps(a, b); }
+static inline vf vf_div(vf a, vf b) { return _mm_div_ps(a, b); }
+static inline vf vf_fmadd(vf a, vf b, vf c) {
+    return _mm_add_ps(_mm_mul_ps(a, b), c);
+}
+static inline vf vf_fnmadd(vf a, vf b, vf c) {
+    return _mm_sub_ps(c, _mm_mul_ps(a, b));
+}
+static inline vf vf_max(vf a, vf b) { return _mm_max_ps(a, b); }
+static inline vf vf_min(vf a, vf b) { return _mm_min_ps(a, b); }
+static inline vf vf_sqrt(vf a) { return _mm_sqrt_ps(a); }
+static inline float vf_hsum(vf a) {
+    const __m128 s = _mm_add_ps(a, _mm_movehl_ps(a, a));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehdup_ps(s)));
+}
+static inline float vf_hmax(vf a) {
+    const __m128 s = _mm_max_ps(a, _mm_movehl_ps(a, a));
+    return _mm_cvtss_f32(_mm_max_ss(s, _mm_movehdup_ps(s)));
+}
+static inline vf vf_abs(vf a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+static inline vf vf_round(vf a) {
+    return _mm_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+}
+/* 2^n for an integral valued `n` within [-127, 128] */
+static inline vf vf_pow2i(vf n) {
+    const __m128i e = _mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127));
+    return _mm_castsi128_ps(_mm_slli_epi32(e, 23));
+}
+static inline vm vf_lt(vf a, vf b) { return _mm_cmplt_ps(a, b); }
+static inline vm vf_gt(vf a, vf b) { return _mm_cmpgt_ps(a, b); }
+/* m ? a : b */
+static inline vf vf_select(vm m, vf a, vf b) { return _mm_blendv_ps(b, a, m); }
+
+#else
+
+#define VF_ISA "scalar"
+#define VF_LEN 1
+typedef float vf;
+typedef bool vm;
+
+static inline vf vf_load(const float *p) { return *p; }
+static inline vf vf_load_f16(const uint16_t *p) { return f16_to_f32(*p); }
+static inline vf vf_load_bf16(const uint16_t *p) { return bf16_to_f32(*p); }
+static inline void vf_store(float *p, vf a) { *p = a; }
+static inline vf vf_gather(const float *p, const uint32_t *i) { return p[*i]; }
+static inline void vf_scatter(float *p, const uint32_t *i, vf a) { p[*i] = a; }
+static inline vf vf_set(float a) { return a; }
+static inline vf vf_add(vf a, vf b) { return a + b; }
+static inline vf vf_sub(vf a, vf b) { return a - b; }
+static inline vf vf_mul(vf a, vf b) { return a * b; }
+static inline vf vf_div(vf a, vf b) { return a / b; }
+static inline vf vf_fmadd(vf a, vf b, vf c) { return a * b + c; }
+static inline vf vf_fnmadd(vf a, vf b, vf c) { return c - a * b; }
+static inline vf vf_max(vf a, vf b) { return a > b ? a : b; }
+static inline vf vf_min(vf a, vf b) { return a < b ? a : b; }
+static inline vf vf_sqrt(vf a) { return sqrtf(a); }
+static inline float vf_hsum(vf a) { return a; }
+static inline float vf_hmax(vf a) { return a; }
+static inline vf vf_abs(vf a) { return fabsf(a); }
+static inline vf vf_round(vf a) { return rintf(a); }
+/* 2^n for an integral valued `n` within [-127, 128] */
+static inline vf vf_pow2i(vf n) {
+    const uint32_t e = (uint32_t)((int32_t)n + 127) << 23;
+    float r;
+    memcpy(&r, &e, sizeof(r));
+    return r;
+}
+static inline vm vf_lt(vf a, vf b) { return a < b; }
+static inline vm vf_gt(vf a, vf b) { return a > b; }
+/* m ? a : b */
+static inline vf vf_select(vm m, vf a, vf b) { return m ? a : b; }
+
+#endif
+
+/*
+ * Compiler barrier for `_a`. It stops -ffast-math from reassociating an
+ * expression whose evaluation order matters (e.g. a Cody-Waite reduction).
+ */
+#define VF_BARRIER(_a) __asm__("" : "+v"(_a))
+
+/*
+ * Apply the vector function `_f` in place to the `_len` elements of `_y`.
+ * The remaining elements are processed in a zero padded vector.
+ */
+#define VF_MAP(_len, _y, _f)                                                   \
+    do {                                                                       \
+        uint32_t _i = 0;                                                       \
+        for (; _i + VF_LEN <= (_len); _i += VF_LEN) {                          \
+            vf_store(&(_y)[_i], _f(vf_load(&(_y)[_i])));                       \
+        }                                                                      \
+        if (_i < (_len)) {                                                     \
+            float _t[VF_LEN] = {0};                                            \
+            memcpy(_t, &(_y)[_i], ((_len)-_i) * sizeof(float));                \
+            vf_store(_t, _f(vf_load(_t)));                                     \
+            memcpy(&(_y)[_i], _t, ((_len)-_i) * sizeof(float));                \
+        }                                                                      \
+    } while (0)
+
+/*
+ * Update `_d` in place by the vector function `_f(y, d)` of the `_len`
+ * elements of `_y` and `_d`.
+ */
+#define VF_MAP2(_len, _y, _d, _f)                                              \
+    do {                                                                       \
+        uint32_t _i = 0;                                                       \
+        for (; _i + VF_LEN <= (_len); _i += VF_LEN) {                          \
+            vf_store(&(_d)[_i], _f(vf_load(&(_y)[_i]), vf_load(&(_d)[_i])));   \
+        }                                                                      \
+        if (_i < (_len)) {                                                     \
+            float _ty[VF_LEN] = {0}, _td[VF_LEN] = {0};                        \
+            memcpy(_ty, &(_y)[_i], ((_len)-_i) * sizeof(float));               \
+            memcpy(_td, &(_d)[_i], ((_len)-_i) * sizeof(float));               \
+            vf_store(_td, _f(vf_load(_ty), vf_load(_td)));                     \
+            memcpy(&(_d)[_i], _td, ((_len)-_i) * sizeof(float));               \
+        }                                                                      \
+    } while (0)
+
+/*
+ * exp(x) - Cephes style range reduction x = n * ln(2) + r, |r| <= ln(2) / 2,
+ * and a degree 7 polynomial for exp(r).
+ *
+ * The maximum relative error compared to `expf()` is below 2.5e-7 on
+ * [-87, 88] (see `test_activation_accuracy()`). Inputs below -87.33 are
+ * clamped to it, so the result is the smallest normal float (about 1.2e-38)
+ * and not 0. Inputs above 88.37 are clamped to it (about 2.4e38).
+ */
+static inline vf vf_exp(vf x) {
+    x          = vf_min(vf_max(x, vf_set(-87.33f)), vf_set(88.37f));
+    const vf n = vf_round(vf_mul(x, vf_set(1.44269504088896341f)));
+    vf r       = vf_fnmadd(n, vf_set(0.693359375f), x);
+    VF_BARRIER(r);
+    r    = vf_fnmadd(n, vf_set(-2.12194440e-4f), r);
+    vf p = vf_set(1.9875691500E-4f);
+    p          = vf_fmadd(p, r, vf_set(1.3981999507E-3f));
+    p          = vf_fmadd(p, r, vf_set(8.3334519073E-3f));
+    p          = vf_fmadd(p, r, vf_set(4.1665795894E-2f));
+    p          = vf_fmadd(p, r, vf_set(1.6666665459E-1f));
+    p          = vf_fmadd(p, r, vf_set(5.0000001201E-1f));
+    p          = vf_fmadd(p, vf_mul(r, r), vf_add(r, vf_set(1.0f)));
+    return vf_mul(p, vf_pow2i(n));
+}
@@ -5,6 +5,8 @@ void stats_collect0(struct stats c[static 1], double val);
 void stats_collect1(struct stats c[static 1], double val);
 void stats_collect2(struct stats c[static 1], double val);
 void stats_collect3(struct stats c[static 1], double val);
+void stats_merge(struct stats c[static 1], const struct stats d[static 1],
+                 unsigned moments);
 double stats_samples(struct stats c[static 1]);
 double stats_mean(struct stats c[static 1]);
 double stats_var(struct stats c[static 1]);
@@ -159,3 +159,41 @@ inline void stats_collect3(struct stats c[static 1], double val) {
     stats_collect(c, val, 3);
 }
 
+/**
+ * @brief Merge the statistic @a d into the statistic @a c.
+ *
+ * The pairwise update formulas of Pébay (see above) combine the moments of
+ * two disjoint sets of samples, so that partial statistics (e.g. of the
+ * shards of a data set) can be collected in parallel and merged. Merging the
+ * partial statistics in a fixed order gives the same result for any number
+ * of threads.
+ */
+inline void stats_merge(struct stats c[static 1],
+                        const struct stats d[static 1], unsigned moments) {
+    const double na = c->moment[0];
+    const double nb = d->moment[0];
+    if (nb == 0) return;
+    if (na == 0) {
+        *c = *d;
+        return;
+    }
+    const double n     = na + nb;
+    const double delta = d->moment[1] - c->moment[1];
+    const double m2a   = c->moment[2];
+    switch (moments) {
+    default:
+        c->moment[3] += d->moment[3] +
+                        delta * delta * delta * na * nb * (na - nb) / (n * n) +
+                        3 * delta * (na * d->moment[2] - nb * m2a) / n;
+        // fall through
+    case 2:
+        c->moment[2] += d->moment[2] + delta * delta * na * nb / n;
+        // fall through
+    case 1:
+        c->moment[1] += delta * nb / n;
+        // fall through
+    case 0:
+        c->moment[0] = n;
+    }
+}
+
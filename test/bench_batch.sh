@@ -0,0 +1,38 @@
+#!/bin/sh
+# Report the training and the inference throughput of the mnist net of
+# config.h versus the batch length (gstnn -b N). The net is trained from
+# scratch for each batch length in a temporary directory and tested with the
+# mnist test data. The throughput includes the file input and output, the
+# latency is the mean time of a prediction of a batch (without the reference
+# prediction of the quantized net).
+#
+# usage: test/bench_batch.sh [DATA_DIR]   (default: data)
+
+set -e
+cd "$(dirname "$0")/.."
+repo=$(pwd)
+data=$(cd "${1:-data}" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+make -s gstnn >/dev/null 2>&1
+mkdir -p "$work/data"
+cd "$work"
+printf "%6s %16s %16s %16s %9s\n" batch "train samples/s" \
+    "predict samples/s" "latency us/batch" accuracy
+for batch in 1 4 16 64 256; do
+    rm -f data/*
+    "$repo/gstnn" -s 1 -b "$batch" -t "$data/mnist_targets_train.f32" \
+        "$data/mnist_images_train.f32" 2>train.log >/dev/null
+    "$repo/gstnn" -b "$batch" -f "$data/mnist_images_test.f32" \
+        2>predict.log >/dev/null
+    "$repo/gstnn" -b "$batch" -f -t "$data/mnist_targets_test.f32" \
+        "$data/mnist_images_test.f32" 2>test.log >/dev/null
+    train=$(grep '^batch' train.log | cut -d' ' -f3)
+    predict=$(grep '^batch' predict.log | cut -d' ' -f3)
+    latency=$(grep '^batch' predict.log | cut -d' ' -f6)
+    accuracy=$(grep -v -e '^quantized' -e '^batch' test.log | tail -1 |
+        cut -d, -f3)
+    printf "%6s %16s %16s %16s %9s\n" "$batch" "$train" "$predict" \
+        "$latency" "$accuracy"
+done
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Report the throughput of the sharded evaluation of the mnist test data
+# with the frozen net of config.h (gstnn -f -j N) versus the number of
+# threads, from 1 thread to the number of processors. The net is trained for
+# one epoch in a temporary directory first. The merged summary (samples,
+# hits, mean and deviation of the error) must be bit identical to the summary
+# of 1 thread.
+#
+# usage: test/bench_eval.sh [DATA_DIR] [BATCH]
+#        (default: data 64)
+
+set -e
+cd "$(dirname "$0")/.."
+repo=$(pwd)
+data=$(cd "${1:-data}" && pwd)
+batch=${2:-64}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+make -s gstnn >/dev/null 2>&1
+mkdir -p "$work/data"
+cd "$work"
+"$repo/gstnn" -s 1 -b "$batch" -t "$data/mnist_targets_train.f32" \
+    "$data/mnist_images_train.f32" 2>/dev/null >/dev/null
+cpus=$(getconf _NPROCESSORS_ONLN)
+printf "%7s %15s %8s %9s %9s\n" threads "eval samples/s" speedup accuracy \
+    identical
+threads=1
+while [ "$threads" -le "$cpus" ]; do
+    "$repo/gstnn" -f -j "$threads" -b "$batch" -m binary -l summary.bin \
+        -t "$data/mnist_targets_test.f32" "$data/mnist_images_test.f32" \
+        2>eval.log >/dev/null
+    # the samples, hits and error of the last (summary) record of 12 values
+    summary=$(tail -c 96 summary.bin | head -c 32 | cksum)
+    reference=${reference:-$summary}
+    eval=$(grep '^batch' eval.log | cut -d' ' -f3)
+    base=${base:-$eval}
+    speedup=$(echo "$eval $base" | awk '{printf "%.2f", $1 / $2}')
+    accuracy=$(grep '^evaluation' eval.log | cut -d' ' -f7)
+    identical=no
+    [ "$summary" = "$reference" ] && identical=yes
+    printf "%7s %15s %8s %9s %9s\n" "$threads" "$eval" "$speedup" \
+        "$accuracy" "$identical"
+    if [ "$threads" -lt "$cpus" ] && [ $((threads * 2)) -gt "$cpus" ]; then
+        threads=$cpus
+    else
+        threads=$((threads * 2))
+    fi
+done
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Report the Hogwild training throughput of the mnist net of config.h versus
+# the number of training threads (gstnn -j N), from 1 thread to the number of
+# processors. The net is trained from scratch for each thread count in a
+# temporary directory and tested with the mnist test data. The speedup is the
+# throughput relative to 1 thread.
+#
+# usage: test/bench_hogwild.sh [DATA_DIR] [EPOCHS]   (default: data 1)
+
+set -e
+cd "$(dirname "$0")/.."
+repo=$(pwd)
+data=$(cd "${1:-data}" && pwd)
+epochs=${2:-1}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+make -s gstnn >/dev/null 2>&1
+mkdir -p "$work/data"
+cd "$work"
+cpus=$(getconf _NPROCESSORS_ONLN)
+printf "%7s %16s %8s %9s\n" threads "train samples/s" speedup accuracy
+threads=1
+while [ "$threads" -le "$cpus" ]; do
+    rm -f data/*
+    "$repo/gstnn" -s 1 -j "$threads" -e "$epochs" \
+        -t "$data/mnist_targets_train.f32" "$data/mnist_images_train.f32" \
+        2>train.log >/dev/null
+    "$repo/gstnn" -f -t "$data/mnist_targets_test.f32" \
+        "$data/mnist_images_test.f32" 2>test.log >/dev/null
+    train=$(grep '^batch' train.log | cut -d' ' -f3)
+    base=${base:-$train}
+    speedup=$(echo "$train $base" | awk '{printf "%.2f", $1 / $2}')
+    accuracy=$(grep -v -e '^quantized' -e '^batch' test.log | tail -1 |
+        cut -d, -f3)
+    printf "%7s %16s %8s %9s\n" "$threads" "$train" "$speedup" "$accuracy"
+    if [ "$threads" -lt "$cpus" ] && [ $((threads * 2)) -gt "$cpus" ]; then
+        threads=$cpus
+    else
+        threads=$((threads * 2))
+    fi
+done
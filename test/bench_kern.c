@@ -0,0 +1,391 @@
+// Micro benchmarks of the kern functions. Run with `make bench`.
+//
+
+#include "../kern.c"
+#include "../trace.c"
+#include "../stopwatch.h"
+
+#define BENCH_SECONDS 0.5
+
+/*
+ * Fill the vector with deterministic values in [-0.5, 0.5).
+ */
+static void bench_fill(uint32_t len, float v[len], uint32_t seed) {
+    for (uint32_t i = 0; i < len; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        v[i] = (float)(seed >> 8) / (float)(1u << 24) - 0.5f;
+    }
+}
+
+/*
+ * Print the number of processed items (samples, elements) per second.
+ */
+static void bench_report(const char *name, uint32_t items, uint64_t runs,
+                         double us) {
+    printf("  %-26s %14.1f items/s (%9.3f us/call)\n", name,
+           (double)runs * items * 1e6 / us, us / (double)runs);
+}
+
+/*
+ * Runs `_stmt` repeatedly for about BENCH_SECONDS and reports the throughput
+ * of `_items` per call.
+ */
+#define BENCH(_name, _items, _stmt)                                            \
+    do {                                                                       \
+        uint64_t _runs = 0;                                                    \
+        double _us     = 0.0;                                                  \
+        struct timespec _sw = stopwatch_start();                               \
+        do {                                                                   \
+            _stmt;                                                             \
+            ++_runs;                                                           \
+        } while ((_us = stopwatch_stop_us(_sw)) < BENCH_SECONDS * 1e6);        \
+        bench_report(_name, _items, _runs, _us);                               \
+    } while (0)
+
+static void bench_train(uint32_t batch_len, uint32_t m, uint32_t n) {
+    float *x     = matrix_alloc(batch_len, m);
+    float *dy    = matrix_alloc(batch_len, n);
+    float *w     = matrix_alloc(m, n);
+    float *mom   = matrix_alloc(m, n);
+    float *veloc = matrix_alloc(m, n);
+    float *grad  = matrix_alloc(m, n);
+    bench_fill(batch_len * m, x, 1);
+    bench_fill(batch_len * n, dy, 2);
+    bench_fill(m * n, w, 3);
+    matrix_init(m, n, mom);
+    matrix_init(m, n, veloc);
+    printf("train %u x %u, batch %u (samples/s)\n", m, n, batch_len);
+    BENCH("train_sgd", batch_len,
+          train_sgd(batch_len, m, n, x, dy, 1e-6f, w));
+    float counter = 1.0f;
+    BENCH("train_adam", batch_len,
+          counter = train_adam(batch_len, m, n, x, dy, counter, 1e-6f, 0.9f,
+                               0.999f, 1e-8f, w, mom, veloc, grad));
+    free(x);
+    free(dy);
+    free(w);
+    free(mom);
+    free(veloc);
+    free(grad);
+}
+
+/*
+ * The scalar reference: libm called through a function pointer per element.
+ */
+static float ref_sigmoid(float x) { return 1.0f / (1.0f + expf(-x)); }
+
+static void ref_map(uint32_t len, float y[len], float (*f)(float)) {
+    for (uint32_t i = 0; i < len; i++) y[i] = f(y[i]);
+}
+
+static void bench_activation(uint32_t len) {
+    float *y = matrix_alloc(1, len);
+    float *d = matrix_alloc(1, len);
+    bench_fill(len, y, 4);
+    bench_fill(len, d, 5);
+    printf("activation, %u elements (elements/s)\n", len);
+    BENCH("sigmoid (libm reference)", len, ref_map(len, y, ref_sigmoid));
+    bench_fill(len, y, 4);
+    BENCH("sigmoid", len, sigmoid(len, y));
+    bench_fill(len, y, 4);
+    BENCH("tanh (libm reference)", len, ref_map(len, y, tanhf));
+    bench_fill(len, y, 4);
+    BENCH("tanhg", len, tanhg(len, y));
+    BENCH("relu", len, relu(len, y));
+    BENCH("sigmoid_derived", len, sigmoid_derived(len, y, d));
+    BENCH("tanhg_derived", len, tanhg_derived(len, y, d));
+    BENCH("relu_derived", len, relu_derived(len, y, d));
+    free(y);
+    free(d);
+}
+
+/*
+ * The previous generator: random() per element.
+ */
+static void ref_uniform(uint32_t len, float u[len]) {
+    for (uint32_t i = 0; i < len; i++) {
+        u[i] = (float)random() / (float)(RAND_MAX);
+    }
+}
+
+/*
+ * The output loss of a batch: the sigmoid, mean squared error and derivative
+ * chain versus the fused softmax cross entropy.
+ */
+static void bench_loss(uint32_t batch_len, uint32_t n) {
+    float *x = matrix_alloc(batch_len, n);
+    float *y = matrix_alloc(batch_len, n);
+    float *t = matrix_alloc(batch_len, n);
+    float *d = matrix_alloc(batch_len, n);
+    bench_fill(batch_len * n, x, 14);
+    matrix_init(batch_len, n, t);
+    for (uint32_t k = 0; k < batch_len; k++) t[k * n + k % n] = 1.0f;
+    const uint32_t len = batch_len * n;
+    printf("output loss %u x %u (samples/s)\n", batch_len, n);
+    BENCH("sigmoid + vec_delta + derived", batch_len, {
+        memcpy(y, x, len * sizeof(float));
+        sigmoid(len, y);
+        vec_delta(len, y, t, d);
+        sigmoid_derived(len, y, d);
+    });
+    BENCH("softmax_xent", batch_len, softmax_xent(batch_len, n, x, t, d));
+    free(x);
+    free(y);
+    free(t);
+    free(d);
+}
+
+static void bench_rng(uint32_t len) {
+    float *u = matrix_alloc(1, len);
+    float *y = matrix_alloc(1, len);
+    bench_fill(len, y, 13);
+    struct rng r = rng_stream(0);
+    printf("random numbers, %u elements (elements/s)\n", len);
+    BENCH("uniform (random reference)", len, ref_uniform(len, u));
+    BENCH("rng_uniform", len, rng_uniform(&r, len, u));
+    BENCH("rng_normal", len, rng_normal(&r, len, 0.0f, 1.0f, u));
+    BENCH("dropout", len, dropout(len, y, 0.5f, u));
+    free(u);
+    free(y);
+}
+
+/*
+ * Compare the float, the 16 bit and the int8 inference of a layer.
+ */
+static void bench_trans_quantized(uint32_t batch_len, uint32_t m,
+                                  uint32_t n) {
+    float *x = matrix_alloc(batch_len, m);
+    float *w = matrix_alloc(m, n);
+    float *y = matrix_alloc(batch_len, n);
+    bench_fill(batch_len * m, x, 8);
+    bench_fill(m * n, w, 9);
+    struct qmatrix q  = qmatrix_quantize(m, n, w);
+    struct hmatrix hf = hmatrix_create_or_load(NULL, WEIGHT_F16, m, n);
+    struct hmatrix hb = hmatrix_create_or_load(NULL, WEIGHT_BF16, m, n);
+    printf("trans_act %u x %u, batch %u (samples/s)\n", m, n, batch_len);
+    BENCH("trans_act (fp32)", batch_len,
+          trans_act(batch_len, m, n, w, NULL, x, relu, y));
+    BENCH("trans_act_h (fp16)", batch_len,
+          trans_act_h(batch_len, hf, NULL, x, relu, y));
+    BENCH("trans_act_h (bf16)", batch_len,
+          trans_act_h(batch_len, hb, NULL, x, relu, y));
+    BENCH("trans_act_q8 (int8)", batch_len,
+          trans_act_q8(batch_len, q, NULL, x, relu, y));
+    qmatrix_free(q);
+    hmatrix_free(hf);
+    hmatrix_free(hb);
+    free(x);
+    free(w);
+    free(y);
+}
+
+/*
+ * Compare the dense with the block sparse (pruned) forward and backward pass
+ * of a layer.
+ */
+static void bench_trans_sparse(uint32_t batch_len, uint32_t m, uint32_t n) {
+    float *x  = matrix_alloc(batch_len, m);
+    float *w  = matrix_alloc(m, n);
+    float *y  = matrix_alloc(batch_len, n);
+    float *dx = matrix_alloc(batch_len, m);
+    bench_fill(batch_len * m, x, 10);
+    bench_fill(m * n, w, 11);
+    bench_fill(batch_len * n, y, 12);
+    printf("sparse %u x %u, batch %u (samples/s)\n", m, n, batch_len);
+    BENCH("trans_act (dense)", batch_len,
+          trans_act(batch_len, m, n, w, NULL, x, relu, y));
+    BENCH("loss (dense)", batch_len, loss(batch_len, m, n, w, y, dx));
+    const float ratios[] = {0.8f, 0.9f};
+    for (uint32_t r = 0; r < ARRAY_LENGTH(ratios); r++) {
+        struct smatrix s = smatrix_prune(m, n, w, ratios[r]);
+        char name[32];
+        snprintf(name, sizeof(name), "trans_act_sparse (%.0f%%)",
+                 100.0 * ratios[r]);
+        BENCH(name, batch_len,
+              trans_act_sparse(batch_len, s, NULL, x, relu, y));
+        snprintf(name, sizeof(name), "loss_sparse (%.0f%%)", 100.0 * ratios[r]);
+        BENCH(name, batch_len, loss_sparse(batch_len, s, y, dx));
+        smatrix_free(s);
+    }
+    free(x);
+    free(w);
+    free(y);
+    free(dx);
+}
+
+/*
+ * Compare the dense with the sparse input forward pass and sgd update of a
+ * layer at several input densities (mnist images have a density of ~19%).
+ */
+static void bench_svector(uint32_t batch_len, uint32_t m, uint32_t n) {
+    float *x         = matrix_alloc(batch_len, m);
+    float *w         = matrix_alloc(m, n);
+    float *y         = matrix_alloc(batch_len, n);
+    float *dy        = matrix_alloc(batch_len, n);
+    uint32_t *ptr    = reallocarray(NULL, batch_len + 1, sizeof(uint32_t));
+    uint32_t *idx    = reallocarray(NULL, batch_len * m, sizeof(uint32_t));
+    float *val       = matrix_alloc(batch_len, m);
+    struct svector s = {m, ptr, idx, val};
+    bench_fill(m * n, w, 13);
+    bench_fill(batch_len * n, dy, 14);
+    printf("sparse input %u x %u, batch %u (samples/s)\n", m, n, batch_len);
+    const float densities[] = {0.01f, 0.05f, 0.1f, 0.2f, 0.5f, 1.0f};
+    for (uint32_t r = 0; r < ARRAY_LENGTH(densities); r++) {
+        bench_fill(batch_len * m, x, 15);
+        for (uint32_t i = 0; i < batch_len * m; i++) {
+            if (x[i] + 0.5f >= densities[r]) x[i] = 0.0f;
+        }
+        const float density = svector_compress(batch_len, m, x, &s);
+        printf(" density %.0f%%\n", 100.0 * density);
+        BENCH("trans_act (dense)", batch_len,
+              trans_act(batch_len, m, n, w, NULL, x, relu, y));
+        BENCH("trans_act_svector", batch_len, {
+            svector_compress(batch_len, m, x, &s);
+            trans_act_svector(batch_len, n, w, NULL, s, relu, y);
+        });
+        BENCH("train_sgd (dense)", batch_len,
+              train_sgd(batch_len, m, n, x, dy, 1e-9f, w));
+        BENCH("train_sgd_svector", batch_len,
+              train_sgd_svector(batch_len, n, s, dy, 1e-9f, w));
+    }
+    free(x);
+    free(w);
+    free(y);
+    free(dy);
+    free(ptr);
+    free(idx);
+    free(val);
+}
+
+/*
+ * Compare the layers of the convolutional (config_conv_mnist.h) with the dense
+ * mnist net (config_mnist.h): 28 x 28 images, 8 filters of 5 x 5 pixels and
+ * a 2 x 2 max pooling versus a hidden layer of 280 neurons.
+ */
+static void bench_conv(uint32_t batch_len) {
+    const struct conv2d g = {
+        .c = 1, .h = 28, .w = 28, .k = 5, .stride = 1, .pad = 2, .f = 8};
+    const struct pool2d p = {.c = 8, .h = 28, .w = 28, .k = 2, .stride = 2};
+    const uint32_t pixels = 28 * 28, patch = 25, pooled = 14 * 14 * 8;
+    float *x     = matrix_alloc(batch_len, pixels);
+    float *wc    = matrix_alloc(patch, 8);
+    float *wo    = matrix_alloc(pooled, 10);
+    float *col   = matrix_alloc(batch_len * pixels, patch);
+    float *dcol  = matrix_alloc(batch_len * pixels, patch);
+    float *yc    = matrix_alloc(batch_len * pixels, 8);
+    float *dc    = matrix_alloc(batch_len * pixels, 8);
+    float *yp    = matrix_alloc(batch_len, pooled);
+    float *dp    = matrix_alloc(batch_len, pooled);
+    float *dx    = matrix_alloc(batch_len, pixels);
+    uint32_t *ip = reallocarray(NULL, batch_len * pooled, sizeof(uint32_t));
+    float *wh    = matrix_alloc(pixels, 280);
+    float *yh    = matrix_alloc(batch_len, 280);
+    float *y     = matrix_alloc(batch_len, 10);
+    bench_fill(batch_len * pixels, x, 15);
+    bench_fill(patch * 8, wc, 16);
+    bench_fill(pooled * 10, wo, 17);
+    bench_fill(pixels * 280, wh, 18);
+    bench_fill(batch_len * pixels * 8, dc, 19);
+    bench_fill(batch_len * pooled, dp, 20);
+    const double conv_flops  = 2.0 * (pixels * patch * 8 + pooled * 10);
+    const double dense_flops = 2.0 * (pixels * 280 + 280 * 10);
+    printf("conv net %.2f MFLOP, dense net %.2f MFLOP, batch %u "
+           "(samples/s)\n",
+           conv_flops * 1e-6, dense_flops * 1e-6, batch_len);
+    BENCH("im2col", batch_len, im2col(batch_len, g, x, col));
+    BENCH("conv2d", batch_len,
+          conv2d(batch_len, g, wc, NULL, x, relu, col, yc));
+    BENCH("maxpool", batch_len, maxpool(batch_len, p, yc, yp, ip));
+    BENCH("maxpool_loss", batch_len, maxpool_loss(batch_len, p, dp, ip, dc));
+    BENCH("conv2d_train_sgd", batch_len,
+          conv2d_train_sgd(batch_len, g, col, dc, 1e-6f, wc, NULL));
+    BENCH("conv2d_loss", batch_len,
+          conv2d_loss(batch_len, g, wc, dc, dcol, dx));
+    BENCH("conv net forward", batch_len, {
+        conv2d(batch_len, g, wc, NULL, x, relu, col, yc);
+        maxpool(batch_len, p, yc, yp, ip);
+        trans_act(batch_len, pooled, 10, wo, NULL, yp, NULL, y);
+    });
+    BENCH("dense net forward", batch_len, {
+        trans_act(batch_len, pixels, 280, wh, NULL, x, relu, yh);
+        trans_act(batch_len, 280, 10, wo, NULL, yh, NULL, y);
+    });
+    free(x);
+    free(wc);
+    free(wo);
+    free(col);
+    free(dcol);
+    free(yc);
+    free(dc);
+    free(yp);
+    free(dp);
+    free(dx);
+    free(ip);
+    free(wh);
+    free(yh);
+    free(y);
+}
+
+/*
+ * Compare the built-in gemm with OpenBLAS for the products of the mnist net.
+ */
+static void bench_gemm(uint32_t m, uint32_t n, uint32_t k, bool ta, bool tb) {
+    float *a = matrix_alloc(m, k);
+    float *b = matrix_alloc(k, n);
+    float *c = matrix_alloc(m, n);
+    bench_fill(m * k, a, 6);
+    bench_fill(k * n, b, 7);
+    printf("gemm %u x %u x %u, trans %d %d (products/s)\n", m, n, k, ta, tb);
+    BENCH("gemm_f32 (builtin)", 1,
+          gemm_f32(ta, tb, m, n, k, 1.0f, a, ta ? m : k, b, tb ? k : n, 0.0f, c,
+                   n));
+#ifdef WITH_OPENBLAS
+    BENCH("cblas_sgemm (openblas)", 1,
+          cblas_sgemm(CblasRowMajor, ta ? CblasTrans : CblasNoTrans,
+                      tb ? CblasTrans : CblasNoTrans, m, n, k, 1.0f, a,
+                      ta ? m : k, b, tb ? k : n, 0.0f, c, n));
+#endif
+    free(a);
+    free(b);
+    free(c);
+}
+
+int main() {
+    printf("instruction set: %s\n", kern_isa());
+    const uint32_t gemm_batches[] = {1, 16, 256};
+    for (uint32_t b = 0; b < ARRAY_LENGTH(gemm_batches); b++) {
+        const uint32_t l = gemm_batches[b];
+        bench_gemm(l, 280, 784, false, true);  // trans, hidden layer
+        bench_gemm(l, 10, 280, false, true);   // trans, output layer
+        bench_gemm(l, 280, 10, false, false);  // loss
+        bench_gemm(280, 784, l, true, false);  // train_sgd, hidden layer
+    }
+    bench_trans_quantized(1, 784, 280);
+    bench_trans_quantized(1, 280, 10);
+    bench_trans_quantized(16, 784, 280);
+    bench_trans_sparse(1, 784, 280);
+    bench_trans_sparse(16, 784, 280);
+    bench_svector(1, 784, 280);
+    bench_svector(16, 784, 280);
+    bench_loss(1, 10);
+    bench_loss(64, 10);
+    bench_conv(1);
+    bench_conv(16);
+    // the activation functions of all instruction sets supported by the CPU
+    const char *best = kern_isa();
+    const char *isa[] = {"scalar", "sse42", "avx2", "avx512"};
+    for (uint32_t i = 0; i < ARRAY_LENGTH(isa); i++) {
+        if (!kern_isa_select(isa[i])) continue;
+        printf("instruction set: %s\n", isa[i]);
+        bench_activation(280);
+        bench_activation(280 * 64);
+        bench_rng(280 * 64);
+    }
+    kern_isa_select(best);
+    const uint32_t batches[] = {1, 16, 64};
+    for (uint32_t b = 0; b < ARRAY_LENGTH(batches); b++) {
+        bench_train(batches[b], 784, 280);
+        bench_train(batches[b], 280, 10);
+    }
+    return EXIT_SUCCESS;
+}
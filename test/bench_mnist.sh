@@ -0,0 +1,38 @@
+#!/bin/sh
+# Compare the accuracy per FLOP of the dense (config_mnist.h) and the
+# convolutional (config_conv_mnist.h) mnist net. Both nets are trained from
+# scratch in a temporary directory and tested with the mnist test data. The
+# time is the mean time of a training step (the forward and the backward pass
+# of a sample).
+#
+# usage: test/bench_mnist.sh [DATA_DIR]   (default: data)
+
+set -e
+cd "$(dirname "$0")/.."
+repo=$(pwd)
+data=$(cd "${1:-data}" && pwd)
+work=$(mktemp -d)
+if [ -f config.h ]; then cp config.h "$work/config.h.orig"; fi
+trap 'cp "$work/config.h.orig" config.h 2>/dev/null; rm -rf "$work"' EXIT
+
+# the multiply-adds per sample (2 FLOP each):
+#  dense: 784 x 280 + 280 x 10
+#  conv:  28 x 28 pixels x 5 x 5 x 8 filters + 14 x 14 x 8 x 10
+for net in "config_mnist 222320" "config_conv_mnist 172480"; do
+    set -- $net
+    cp "$1.h" config.h
+    make -s gstnn >/dev/null 2>&1
+    mkdir -p "$work/$1/data"
+    (cd "$work/$1" &&
+     "$repo/gstnn" -s 1 -t "$data/mnist_targets_train.f32" \
+        "$data/mnist_images_train.f32" 2>train.log >/dev/null &&
+     "$repo/gstnn" -f -t "$data/mnist_targets_test.f32" \
+        "$data/mnist_images_test.f32" 2>test.log >/dev/null)
+    us=$(grep -v '^batch' "$work/$1/train.log" | tail -1 | cut -d, -f5)
+    grep -v -e '^quantized' -e '^batch' "$work/$1/test.log" | tail -1 |
+        awk -F', ' -v net="$1" -v madd="$2" -v us="$us" '{
+            mflop = 2 * madd / 1e6
+            printf "%-18s accuracy %.4f, %.3f MFLOP/sample, %.1f us/step, " \
+                   "accuracy/MFLOP %.3f\n", net, $3, mflop, us, $3 / mflop
+        }'
+done
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Report the data parallel training throughput of the mnist net of config.h
+# versus the number of threads (gstnn -d N), from 1 thread to the number of
+# processors. The net is trained from scratch with the same seed for each
+# thread count in a temporary directory and tested with the mnist test data.
+# The trained weights must be bit identical to the weights of 1 thread.
+#
+# usage: test/bench_parallel.sh [DATA_DIR] [BATCH] [EPOCHS]
+#        (default: data 64 3)
+
+set -e
+cd "$(dirname "$0")/.."
+repo=$(pwd)
+data=$(cd "${1:-data}" && pwd)
+batch=${2:-64}
+epochs=${3:-3}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+make -s gstnn >/dev/null 2>&1
+mkdir -p "$work/data"
+cd "$work"
+cpus=$(getconf _NPROCESSORS_ONLN)
+printf "%7s %16s %8s %9s %9s\n" threads "train samples/s" speedup accuracy \
+    identical
+threads=1
+while [ "$threads" -le "$cpus" ]; do
+    rm -f data/*
+    "$repo/gstnn" -s 1 -b "$batch" -d "$threads" -e "$epochs" \
+        -t "$data/mnist_targets_train.f32" "$data/mnist_images_train.f32" \
+        2>train.log >/dev/null
+    weights=$(cat data/* | cksum)
+    "$repo/gstnn" -f -t "$data/mnist_targets_test.f32" \
+        "$data/mnist_images_test.f32" 2>test.log >/dev/null
+    train=$(grep '^batch' train.log | cut -d' ' -f3)
+    base=${base:-$train}
+    reference=${reference:-$weights}
+    speedup=$(echo "$train $base" | awk '{printf "%.2f", $1 / $2}')
+    accuracy=$(grep -v -e '^quantized' -e '^batch' test.log | tail -1 |
+        cut -d, -f3)
+    identical=no
+    [ "$weights" = "$reference" ] && identical=yes
+    printf "%7s %16s %8s %9s %9s\n" "$threads" "$train" "$speedup" \
+        "$accuracy" "$identical"
+    if [ "$threads" -lt "$cpus" ] && [ $((threads * 2)) -gt "$cpus" ]; then
+        threads=$cpus
+    else
+        threads=$((threads * 2))
+    fi
+done
@@ -0,0 +1,55 @@
+#!/bin/sh
+# Report the training throughput of the mnist net of config.h with the
+# parameter server (gstnn -w N) versus the number of worker processes, from
+# 1 worker to the number of processors. The first row (0 workers) trains in
+# a single process. The net is trained from scratch with the same seed for
+# each worker count in a temporary directory and tested with the mnist test
+# data.
+#
+# usage: test/bench_pserver.sh [DATA_DIR] [BATCH] [EPOCHS] [STALENESS]
+#                              [BATCHES]
+#        (default: data 64 3 1 1)
+
+set -e
+cd "$(dirname "$0")/.."
+repo=$(pwd)
+data=$(cd "${1:-data}" && pwd)
+batch=${2:-64}
+epochs=${3:-3}
+staleness=${4:-1}
+batches=${5:-1}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+make -s gstnn >/dev/null 2>&1
+mkdir -p "$work/data"
+cd "$work"
+cpus=$(getconf _NPROCESSORS_ONLN)
+printf "%7s %16s %8s %9s\n" workers "train samples/s" speedup accuracy
+workers=0
+while [ "$workers" -le "$cpus" ]; do
+    rm -f data/*
+    if [ "$workers" -eq 0 ]; then
+        set -- -e "$epochs"
+    else
+        set -- -e "$epochs" -w "$workers,$staleness,$batches"
+    fi
+    "$repo/gstnn" -s 1 -b "$batch" "$@" \
+        -t "$data/mnist_targets_train.f32" "$data/mnist_images_train.f32" \
+        2>train.log >/dev/null
+    "$repo/gstnn" -f -t "$data/mnist_targets_test.f32" \
+        "$data/mnist_images_test.f32" 2>test.log >/dev/null
+    train=$(grep '^batch' train.log | cut -d' ' -f3)
+    base=${base:-$train}
+    speedup=$(echo "$train $base" | awk '{printf "%.2f", $1 / $2}')
+    accuracy=$(grep -v -e '^quantized' -e '^batch' test.log | tail -1 |
+        cut -d, -f3)
+    printf "%7s %16s %8s %9s\n" "$workers" "$train" "$speedup" "$accuracy"
+    if [ "$workers" -lt "$cpus" ] && [ $((workers * 2)) -gt "$cpus" ]; then
+        workers=$cpus
+    elif [ "$workers" -eq 0 ]; then
+        workers=1
+    else
+        workers=$((workers * 2))
+    fi
+done
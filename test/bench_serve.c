@@ -0,0 +1,165 @@
+// The load generator of the inference server (`gstnn -u SOCKET`): CLIENTS
+// threads connect to the socket, each keeps DEPTH requests in flight (closed
+// loop) for SECONDS seconds. The request latency is the time from sending a
+// request to receiving its reply, counted in a histogram per client (see
+// hist.h), which are merged at the end. Prints a row of the number of
+// clients, the depth, the throughput (requests/s) and the 50th, 90th, 99th
+// and 99.9th percentile and the max of the latency (us). Run with
+// `make bench_serve`.
+//
+// usage: test/bench_serve [-c CLIENTS] [-d DEPTH] [-s SECONDS]
+//                         [-n INPUT_LENGTH] [-i INPUT_FILE] SOCKET
+//
+
+#include "../hist.c"
+#include "../stopwatch.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define BENCH_REPLY_MAX 65536
+
+/*
+ * A client: its share of the input vectors and its latencies.
+ */
+struct bench_client {
+    pthread_t thread;
+    const char *path;
+    const float *input;
+    uint32_t input_len, vectors, depth;
+    double seconds;
+    struct hist latency;
+};
+
+static void *bench_client(void *arg) {
+    struct bench_client *c  = arg;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, c->path, sizeof(addr.sun_path) - 1);
+    const int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        err(EXIT_FAILURE, "connect to %s", c->path);
+    }
+    // the send times of the requests in flight (a ring of `depth`)
+    struct timespec *sent = calloc(c->depth, sizeof(*sent));
+    char *reply           = malloc(BENCH_REPLY_MAX);
+    if (sent == NULL || reply == NULL) err(EXIT_FAILURE, "allocate a client");
+    const size_t size = sizeof(float) * c->input_len;
+    uint64_t next = 0, done = 0;
+
+    struct timespec start = stopwatch_start();
+    while (stopwatch_stop_us(start) < c->seconds * 1e6) {
+        while (next - done < c->depth) {
+            sent[next % c->depth] = stopwatch_start();
+            const float *x =
+                &c->input[(size_t)(next % c->vectors) * c->input_len];
+            if (send(fd, x, size, MSG_NOSIGNAL) != (ssize_t)size) {
+                err(EXIT_FAILURE, "send a request");
+            }
+            next++;
+        }
+        if (recv(fd, reply, BENCH_REPLY_MAX, 0) <= 0) {
+            errx(EXIT_FAILURE, "the server has closed the connection");
+        }
+        hist_collect(&c->latency, stopwatch_stop_us(sent[done++ % c->depth]));
+    }
+    // receive the replies in flight (not counted)
+    for (; done < next; done++) recv(fd, reply, BENCH_REPLY_MAX, 0);
+    close(fd);
+    free(sent);
+    free(reply);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t clients = 1, depth = 1, input_len = 784;
+    double seconds   = 2.0;
+    const char *file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:i:n:s:")) != EOF) {
+        switch (opt) {
+            case 'c':
+                clients = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                depth = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                file = optarg;
+                break;
+            case 'n':
+                input_len = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                seconds = strtod(optarg, NULL);
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (optind != argc - 1 || clients == 0 || depth == 0 || input_len == 0) {
+        fprintf(stderr,
+                "%s [-c CLIENTS] [-d DEPTH] [-s SECONDS] [-n INPUT_LENGTH] "
+                "[-i INPUT_FILE] SOCKET\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // The input vectors of the file (or a zero vector)
+    uint32_t vectors = 1;
+    float *input     = calloc(input_len, sizeof(float));
+    if (file != NULL) {
+        FILE *fp = fopen(file, "r");
+        if (fp == NULL) err(EXIT_FAILURE, "open %s", file);
+        fseek(fp, 0, SEEK_END);
+        const long n = ftell(fp) / (long)(sizeof(float) * input_len);
+        rewind(fp);
+        if (n > 0) {
+            vectors = (uint32_t)n;
+            input   = reallocarray(input, (size_t)n * input_len, sizeof(float));
+            if (input == NULL ||
+                fread(input, sizeof(float) * input_len, vectors, fp) !=
+                    vectors) {
+                err(EXIT_FAILURE, "read %s", file);
+            }
+        }
+        fclose(fp);
+    }
+
+    struct bench_client *c = calloc(clients, sizeof(*c));
+    if (c == NULL || input == NULL) err(EXIT_FAILURE, "allocate the clients");
+    struct timespec start = stopwatch_start();
+    for (uint32_t i = 0; i < clients; i++) {
+        // the clients begin at different vectors
+        const uint32_t first = (uint32_t)((uint64_t)vectors * i / clients);
+        c[i] = (struct bench_client){
+            .path      = argv[optind],
+            .input     = &input[(size_t)first * input_len],
+            .input_len = input_len,
+            .vectors   = vectors - first,
+            .depth     = depth,
+            .seconds   = seconds};
+        pthread_create(&c[i].thread, NULL, bench_client, &c[i]);
+    }
+    // The percentiles of the latencies of all clients
+    static struct hist latency;
+    for (uint32_t i = 0; i < clients; i++) {
+        pthread_join(c[i].thread, NULL);
+        hist_merge(&latency, &c[i].latency);
+    }
+    const double us = stopwatch_stop_us(start);
+    printf("%7u %5u %12.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", clients, depth,
+           (double)latency.count * 1e6 / us, hist_quantile(&latency, 0.5),
+           hist_quantile(&latency, 0.9), hist_quantile(&latency, 0.99),
+           hist_quantile(&latency, 0.999), hist_quantile(&latency, 1.0));
+    free(c);
+    free(input);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Report the throughput and the latency percentiles of the inference server
+# (gstnn -u SOCKET) of the net of config.h versus the number of clients. The
+# server is started for each micro-batch length and deadline (BATCH,WAIT_US
+# pairs) and loaded by test/bench_serve with 1 to 64 closed loop clients,
+# which send the mnist test images. The weights are initialized randomly in
+# a temporary directory.
+#
+# usage: test/bench_serve.sh [DATA_DIR] [SECONDS] [BATCH,WAIT_US ...]
+#        (default: data 2 1,0 32,0 32,1000)
+
+set -e
+cd "$(dirname "$0")/.."
+repo=$(pwd)
+data=$(cd "${1:-data}" && pwd)
+seconds=${2:-2}
+[ $# -gt 2 ] && shift 2 || set -- 1,0 32,0 32,1000
+work=$(mktemp -d)
+trap 'kill "$server" 2>/dev/null || true; rm -rf "$work"' EXIT
+
+make -s gstnn test/bench_serve >/dev/null 2>&1
+mkdir -p "$work/data"
+cd "$work"
+printf "%5s %7s %7s %5s %12s %9s %9s %9s %9s %9s\n" batch wait_us clients \
+    depth requests/s p50_us p90_us p99_us p99.9_us max_us
+for config in "$@"; do
+    batch=${config%,*}
+    wait=${config#*,}
+    "$repo/gstnn" -b "$batch" -u "$work/gstnn.sock,$wait" 2>server.log &
+    server=$!
+    while [ ! -S "$work/gstnn.sock" ]; do sleep 0.1; done
+    for clients in 1 4 16 64; do
+        row=$("$repo/test/bench_serve" -c "$clients" -s "$seconds" \
+            -i "$data/mnist_images_test.f32" "$work/gstnn.sock")
+        printf "%5s %7s %s\n" "$batch" "$wait" "$row"
+    done
+    kill -TERM "$server"
+    wait "$server"
+done
@@ -0,0 +1,175 @@
+#include "../batchio.c"
+#include "../trace.c"
+#include "test.h"
+
+#include <unistd.h>
+
+TEST_INIT();
+
+enum { N = 10, B = 4, IN = 3, OUT = 2 };
+
+/*
+ * Write the N input vectors {i, 0.5, -i} and target vectors {2 * i, 1}.
+ */
+static void batchio_data(FILE *input, FILE *target) {
+    for (uint32_t i = 0; i < N; i++) {
+        const float x[IN]  = {(float)i, 0.5f, -(float)i};
+        const float t[OUT] = {(float)(2 * i), 1.0f};
+        fwrite(x, sizeof(float), IN, input);
+        fwrite(t, sizeof(float), OUT, target);
+    }
+}
+
+/*
+ * Pass the vectors in batches of B through a ring of 2 batches: the batches
+ * arrive in order (of the file or `order`), the last batch is shorter and
+ * the outputs are written in order.
+ */
+static void batchio_check(FILE *input, FILE *target, const uint32_t *order,
+                          const char *name) {
+    FILE *output = tmpfile();
+    struct batchio *io = batchio_open(input, target, output, B, IN, OUT,
+                                      sizeof(float) * OUT, 2, order);
+    struct batch *b;
+    uint32_t n = 0, batches = 0;
+    bool ordered = true;
+    while ((b = batchio_read(io)) != NULL) {
+        for (uint32_t k = 0; k < b->len; k++, n++) {
+            const float r = order ? (float)order[n] : (float)n;
+            ordered &= b->input[k * IN] == r && b->input[k * IN + 2] == -r &&
+                       b->target[k * OUT] == 2 * r;
+            float *y       = b->output;
+            y[k * OUT]     = b->input[k * IN] + b->target[k * OUT];
+            y[k * OUT + 1] = (float)batches;
+        }
+        ++batches;
+        batchio_write(io, b);
+    }
+    batchio_close(io);
+    printf("%s:\n", name);
+    test(ordered && n == N && batches == 3 &&
+         "Read the batches in order, the last batch is shorter");
+
+    float y[N * OUT];
+    rewind(output);
+    bool written = fread(y, sizeof(float) * OUT, N + 1, output) == N;
+    for (uint32_t i = 0; i < N; i++) {
+        const float r = order ? (float)order[i] : (float)i;
+        written &= y[i * OUT] == 3 * r &&
+                   y[i * OUT + 1] == (float)(i / B);
+    }
+    test(written && "Write the outputs of the batches in order");
+    fclose(output);
+}
+
+/*
+ * The regular files are mapped into memory.
+ */
+static void test_batchio_mapped() {
+    FILE *input  = tmpfile();
+    FILE *target = tmpfile();
+    batchio_data(input, target);
+    rewind(input);
+    rewind(target);
+    struct dataset d = dataset_map(input, IN);
+    test(d.data != NULL && d.rec == N && d.data[IN] == 1.0f &&
+         "Map the records of a regular file");
+    dataset_unmap(d);
+    batchio_check(input, target, NULL, "mapped files");
+    fclose(input);
+    fclose(target);
+}
+
+/*
+ * The pipes are read by the reader thread.
+ */
+static void test_batchio_pipe() {
+    int in[2], tg[2];
+    if (pipe(in) || pipe(tg)) {
+        test(false && "Create the pipes");
+        return;
+    }
+    FILE *input  = fdopen(in[0], "r");
+    FILE *target = fdopen(tg[0], "r");
+    FILE *in_w   = fdopen(in[1], "w");
+    FILE *tg_w   = fdopen(tg[1], "w");
+    batchio_data(in_w, tg_w);
+    fclose(in_w);
+    fclose(tg_w);
+    test(dataset_map(input, IN).data == NULL && "A pipe is not mapped");
+    batchio_check(input, target, NULL, "pipes");
+    fclose(input);
+    fclose(target);
+}
+
+/*
+ * The records of the mapped files are gathered in the given order, a pipe
+ * cannot be read in order.
+ */
+static void test_batchio_order() {
+    FILE *input  = tmpfile();
+    FILE *target = tmpfile();
+    batchio_data(input, target);
+    rewind(input);
+    rewind(target);
+    const uint32_t order[N] = {3, 9, 0, 7, 1, 8, 2, 6, 4, 5};
+    batchio_check(input, target, order, "ordered mapped files");
+    fclose(input);
+    fclose(target);
+
+    int fd[2];
+    if (pipe(fd)) {
+        test(false && "Create the pipe");
+        return;
+    }
+    input = fdopen(fd[0], "r");
+    close(fd[1]);
+    test(batchio_open(input, NULL, NULL, B, IN, OUT, sizeof(float) * OUT, 2,
+                      order) == NULL &&
+         "A pipe is not read in order");
+    fclose(input);
+}
+
+/*
+ * An empty input stream has no batch.
+ */
+static void test_batchio_empty() {
+    FILE *input = tmpfile();
+    struct batchio *io =
+        batchio_open(input, NULL, NULL, 8, 3, 1, sizeof(float), 4, NULL);
+    test(batchio_read(io) == NULL && "An empty input has no batch");
+    batchio_close(io);
+    fclose(input);
+}
+
+/*
+ * Gather the records of a mapped file in a given order.
+ */
+static void test_dataset_gather() {
+    FILE *input  = tmpfile();
+    FILE *target = tmpfile();
+    batchio_data(input, target);
+    rewind(input);
+    const struct dataset d = dataset_map(input, IN);
+    const uint32_t rows[4] = {7, 2, 2, 9};
+    float x[4 * IN];
+    dataset_gather(&d, rows, 4, x);
+    bool gathered = true;
+    for (uint32_t k = 0; k < 4; k++) {
+        gathered &= x[k * IN] == (float)rows[k] && x[k * IN + 1] == 0.5f &&
+                    x[k * IN + 2] == -(float)rows[k];
+    }
+    test(d.rec == N && gathered && "Gather the records in the given order");
+    dataset_unmap(d);
+    fclose(input);
+    fclose(target);
+}
+
+int main() {
+    test_batchio_mapped();
+    test_batchio_pipe();
+    test_batchio_order();
+    test_batchio_empty();
+    test_dataset_gather();
+    return TEST_RESULT;
+}
@@ -0,0 +1,202 @@
+#include "../iserver.c"
+#include "../stopwatch.h"
+#include "test.h"
+
+#include <stdio.h>
+#include <sys/wait.h>
+
+TEST_INIT();
+
+enum { IN = 2, PIPELINE = 4096 };
+
+static char path[64];
+
+/*
+ * Connect to the server (in a client process).
+ */
+static int client_connect(void) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, path);
+    const int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        _exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/*
+ * Fork a client, which sends the requests {id, k} for k < n and checks that
+ * the replies are id * 10 + k. A message of 3 floats is sent first if
+ * `invalid`: the server closes the connection and the client reconnects.
+ */
+static pid_t client_fork(uint32_t id, uint32_t n, bool invalid) {
+    const pid_t pid = fork();
+    if (pid != 0) return pid;
+    int fd = client_connect();
+    if (invalid) {
+        const float x[IN + 1] = {0};
+        float y;
+        send(fd, x, sizeof(x), 0);
+        if (recv(fd, &y, sizeof(y), 0) != 0) _exit(EXIT_FAILURE);
+        close(fd);
+        fd = client_connect();
+    }
+    for (uint32_t k = 0; k < n; k++) {
+        const float x[IN] = {(float)id, (float)k};
+        send(fd, x, sizeof(x), 0);
+    }
+    bool ok = true;
+    for (uint32_t k = 0; k < n; k++) {
+        float y;
+        ok &= recv(fd, &y, sizeof(y), 0) == sizeof(y) &&
+              y == (float)(id * 10 + k);
+    }
+    close(fd);
+    _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static bool client_wait(pid_t pid) {
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * Serve the batches until `requests` requests are served: the output of a
+ * request {id, k} is id * 10 + k. Returns the number of batches.
+ */
+static uint32_t serve(struct iserver *srv, uint32_t requests,
+                      uint32_t batch_len) {
+    uint32_t batches = 0;
+    bool ok          = true;
+    while (requests > 0) {
+        struct iserver_batch *batch = iserver_read(srv);
+        if (batch == NULL) break;
+        ok &= batch->len > 0 && batch->len <= batch_len;
+        float *y = batch->output;
+        for (uint32_t i = 0; i < batch->len; i++) {
+            y[i] = batch->input[i * IN] * 10 + batch->input[i * IN + 1];
+        }
+        iserver_write(srv, batch);
+        requests -= batch->len < requests ? batch->len : requests;
+        batches++;
+    }
+    test(ok);
+    return batches;
+}
+
+/*
+ * A full batch is returned without waiting for the deadline.
+ */
+static void test_iserver_full(void) {
+    struct iserver *srv = iserver_open(path, 4, IN, sizeof(float), 10000000);
+    test(srv != NULL);
+    const pid_t pid        = client_fork(1, 4, false);
+    struct timespec period = stopwatch_start();
+    test(serve(srv, 4, 4) == 1);
+    test(stopwatch_stop_us(period) < 5e6);
+    test(client_wait(pid));
+    iserver_close(srv);
+    test(access(path, F_OK) != 0);
+}
+
+/*
+ * A single request is returned after the deadline.
+ */
+static void test_iserver_deadline(void) {
+    struct iserver *srv = iserver_open(path, 4, IN, sizeof(float), 50000);
+    const pid_t pid     = client_fork(2, 1, false);
+
+    struct iserver_batch *batch = iserver_read(srv);
+    test(batch != NULL && batch->len == 1 && batch->wait_us >= 50000);
+    *(float *)batch->output = 20.0f;
+    iserver_write(srv, batch);
+    test(client_wait(pid));
+    iserver_close(srv);
+}
+
+/*
+ * The requests of several clients share the batches and each client
+ * receives its replies in order. A client with an invalid message is
+ * disconnected.
+ */
+static void test_iserver_clients(void) {
+    struct iserver *srv = iserver_open(path, 4, IN, sizeof(float), 1000);
+    pid_t pid[3];
+    for (uint32_t id = 0; id < 3; id++) pid[id] = client_fork(id, 5, id == 1);
+    test(serve(srv, 15, 4) >= 4);
+    bool ok = true;
+    for (uint32_t id = 0; id < 3; id++) ok &= client_wait(pid[id]);
+    test(ok);
+    iserver_close(srv);
+}
+
+/*
+ * A client, which sends all its requests before it receives the replies, is
+ * served: the server receives its requests while its replies are queued.
+ */
+static void test_iserver_pipeline(void) {
+    struct iserver *srv = iserver_open(path, 64, IN, sizeof(float), 1000);
+    const pid_t pid     = client_fork(3, PIPELINE, false);
+    test(serve(srv, PIPELINE, 64) > 0);
+    iserver_close(srv);
+    test(client_wait(pid));
+}
+
+/*
+ * A client, which takes no reply, does not stall the other clients and is
+ * disconnected after the timeout.
+ */
+static void test_iserver_stalled(void) {
+    struct iserver *srv = iserver_open(path, 64, IN, sizeof(float), 1000);
+    srv->timeout_ns     = 100000000;
+    int go[2];
+    test(pipe(go) == 0);
+    const pid_t stalled = fork();
+    if (stalled == 0) {
+        const int fd = client_connect();
+        for (uint32_t k = 0; k < PIPELINE; k++) {
+            const float x[IN] = {4.0f, (float)k};
+            send(fd, x, sizeof(x), 0);
+        }
+        // receive the replies after the server has dropped the connection
+        char c;
+        (void)!read(go[0], &c, sizeof(c));
+        uint32_t n = 0;
+        float y;
+        while (recv(fd, &y, sizeof(y), 0) == sizeof(y)) n++;
+        _exit(n < PIPELINE ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    const pid_t pid = client_fork(5, 5, false);
+    test(serve(srv, PIPELINE + 5, 64) > 0);
+    test(client_wait(pid));
+    test(srv->clients > 0 && iserver_expiry(srv) != UINT64_MAX);
+    struct timespec period = stopwatch_start();
+    iserver_close(srv);
+    test(stopwatch_stop_us(period) < 5e6);
+    (void)!write(go[1], "", 1);
+    test(client_wait(stalled));
+    close(go[0]);
+    close(go[1]);
+}
+
+/*
+ * A stopped server returns no batch.
+ */
+static void test_iserver_stop(void) {
+    struct iserver *srv = iserver_open(path, 4, IN, sizeof(float), 1000);
+    iserver_stop(srv);
+    test(iserver_read(srv) == NULL);
+    iserver_close(srv);
+}
+
+int main() {
+    snprintf(path, sizeof(path), "/tmp/test_iserver.%d.sock", (int)getpid());
+    test_iserver_full();
+    test_iserver_deadline();
+    test_iserver_clients();
+    test_iserver_pipeline();
+    test_iserver_stalled();
+    test_iserver_stop();
+    return TEST_RESULT;
+}
@@ -3,8 +3,12 @@
 //
 
 #include "../kern.c"
+#include "../trace.c"
+#include "../simd.h"
 #include "test.h"
 
+#include <sys/wait.h>
+
 TEST_INIT();
 
 static void test_trans() {
@@ -28,6 +32,395 @@ static void test_trans() {
     test(vec_is_equal_f32(N, y_expected, y, 0.001) && "Calculate y = x * w");
 }
 
+/*
+ * Compare the fused bias and activation with a naive batch reference.
+ */
+static void test_trans_act() {
+    enum { B = 2, M = 5, N = 70 };
+    float x[B * M], w[M * N], b[N], y[B * N], y_expected[B * N];
+    for (uint32_t i = 0; i < B * M; i++) x[i] = (float)i * 0.1f - 0.4f;
+    for (uint32_t i = 0; i < M * N; i++) w[i] = (float)(i % 13) * 0.1f - 0.6f;
+    for (uint32_t j = 0; j < N; j++) b[j] = (float)(j % 3) * 0.1f - 0.1f;
+    for (uint32_t k = 0; k < B; k++) {
+        for (uint32_t j = 0; j < N; j++) {
+            float sum = b[j];
+            for (uint32_t i = 0; i < M; i++) sum += x[k * M + i] * w[j * M + i];
+            y_expected[k * N + j] = sum > 0.0f ? sum : 0.0f;
+        }
+    }
+    trans_act(B, M, N, w, b, x, relu, y);
+    test(vec_is_equal_f32(B * N, y_expected, y, 0.0001f) &&
+         "Calculate y = relu(x * w + b)");
+    trans_act(B, M, N, w, NULL, x, NULL, y_expected);
+    trans(B, M, N, w, x, y);
+    test(vec_is_equal_f32(B * N, y_expected, y, 0.0001f) &&
+         "trans_act without bias and activation is equal to trans");
+}
+
+/*
+ * The int8 product must be exact and close to the float product.
+ */
+static void test_trans_act_q8() {
+    enum { B = 3, M = 130, N = 70 };
+    float x[B * M], w[M * N], b[N], y[B * N], y_expected[B * N];
+    for (uint32_t i = 0; i < B * M; i++) x[i] = (float)(i % 11) * 0.1f - 0.5f;
+    for (uint32_t i = 0; i < M * N; i++) w[i] = (float)(i % 13) * 0.1f - 0.6f;
+    for (uint32_t j = 0; j < N; j++) b[j] = (float)(j % 3) * 0.1f - 0.1f;
+    struct qmatrix q = qmatrix_quantize(M, N, w);
+    test(q.w != NULL && q.ld % 64 == 0 && q.ld >= M &&
+         "Quantize the weight matrix to padded int8 rows");
+
+    bool exact = true;
+    trans_act_q8(B, q, NULL, x, NULL, y);
+    for (uint32_t k = 0; k < B; k++) {
+        int8_t xq[M];
+        const float sx = quantize_row(M, &x[k * M], xq);
+        for (uint32_t j = 0; j < N; j++) {
+            int32_t sum = 0;
+            for (uint32_t i = 0; i < M; i++) sum += xq[i] * q.w[j * q.ld + i];
+            const float ref = sx * q.scale[j] * (float)sum;
+            if (fabsf(y[k * N + j] - ref) > 1e-5f * (1.0f + fabsf(ref))) {
+                exact = false;
+            }
+        }
+    }
+    test(exact && "The int8 product is exact");
+
+    trans_act_q8(B, q, b, x, relu, y);
+    trans_act(B, M, N, w, b, x, relu, y_expected);
+    float max = 0.0f, max_err = 0.0f;
+    for (uint32_t i = 0; i < B * N; i++) {
+        max     = fmaxf(max, fabsf(y_expected[i]));
+        max_err = fmaxf(max_err, fabsf(y[i] - y_expected[i]));
+    }
+    printf("int8 max. relative error: %g\n", max_err / max);
+    test(max_err < 0.01f * max && "Calculate y = relu(x * w + b) with int8");
+    qmatrix_free(q);
+}
+
+static void test_half_conversion() {
+    test(f32_to_f16(1.0f) == 0x3c00 && f32_to_f16(-2.0f) == 0xc000 &&
+         f32_to_f16(65504.0f) == 0x7bff && f32_to_f16(65520.0f) == 0x7c00 &&
+         "Convert float to fp16");
+    test(f32_to_f16(1.0f + 0x1p-11f) == 0x3c00 &&
+         f32_to_f16(1.0f + 3 * 0x1p-11f) == 0x3c02 &&
+         f32_to_f16(0x1p-24f) == 0x0001 && f32_to_f16(0x1p-26f) == 0 &&
+         "Round float to the nearest even fp16");
+    bool exact = true;
+    for (uint32_t h = 0; h < 0x10000; h++) {
+        if ((h & 0x7c00) == 0x7c00) continue;  // infinity and NaN
+        if (f32_to_f16(f16_to_f32((uint16_t)h)) != h) exact = false;
+    }
+    test(exact && "Convert all finite fp16 values to float and back");
+    test(f32_to_bf16(1.0f) == 0x3f80 && bf16_to_f32(0x3f80) == 1.0f &&
+         f32_to_bf16(1.0f + 0x1p-8f) == 0x3f80 &&
+         f32_to_bf16(1.0f + 3 * 0x1p-8f) == 0x3f82 &&
+         "Round float to the nearest even bf16");
+}
+
+/*
+ * The 16 bit weights are converted on the fly; the product is accumulated in
+ * float like the product of the float weights.
+ */
+static void test_trans_act_h() {
+    enum { B = 3, M = 37, N = 70 };
+    float x[B * M], w[M * N], b[N], y[B * N], y_expected[B * N];
+    for (uint32_t i = 0; i < B * M; i++) x[i] = (float)(i % 11) * 0.1f - 0.5f;
+    for (uint32_t i = 0; i < M * N; i++) w[i] = (float)(i % 13) * 0.1f - 0.6f;
+    for (uint32_t j = 0; j < N; j++) b[j] = (float)(j % 3) * 0.1f - 0.1f;
+    const enum weight_type types[] = {WEIGHT_F16, WEIGHT_BF16};
+    for (uint32_t t = 0; t < ARRAY_LENGTH(types); t++) {
+        struct hmatrix h = hmatrix_create_or_load(NULL, types[t], M, N);
+        hmatrix_store(h, w);
+        float *wf = hmatrix_to_f32(h);
+        trans_act_h(B, h, b, x, relu, y);
+        trans_act(B, M, N, wf, b, x, relu, y_expected);
+        test(vec_is_equal_f32(B * N, y_expected, y, 1e-4f) &&
+             "Calculate y = relu(x * w + b) with 16 bit weights");
+        free(wf);
+        hmatrix_free(h);
+    }
+}
+
+/*
+ * The dense m x n matrix of the block sparse matrix `s` (pruned weights 0).
+ */
+static void sparse_to_dense(struct smatrix s, float w[s.m * s.n]) {
+    memset(w, 0, sizeof(float) * s.m * s.n);
+    for (uint32_t j = 0; j < s.n; j++) {
+        for (uint32_t b = s.row_ptr[j]; b < s.row_ptr[j + 1]; b++) {
+            for (uint32_t v = 0; v < SPARSE_BLOCK; v++) {
+                const uint32_t i = s.col[b] * SPARSE_BLOCK + v;
+                if (i < s.m) w[j * s.m + i] = s.val[b * SPARSE_BLOCK + v];
+            }
+        }
+    }
+}
+
+/*
+ * Write the sparse matrix with the uint32 `value` at the file offset `pos`
+ * and load it in a child process (smatrix_load() exits on an invalid file).
+ * Returns true if the child has loaded the file.
+ */
+static bool sparse_load_corrupt(const char *filename, struct smatrix s,
+                                long pos, uint32_t value, uint32_t m,
+                                uint32_t n) {
+    if (!smatrix_save(filename, s)) return false;
+    FILE *fp = fopen(filename, "r+");
+    if (fp == NULL) return false;
+    fseek(fp, pos, SEEK_SET);
+    fwrite(&value, sizeof(value), 1, fp);
+    fclose(fp);
+    fflush(NULL);
+    const pid_t pid = fork();
+    if (pid == 0) {
+        fclose(stderr);
+        smatrix_free(smatrix_load(filename, m, n));
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+/*
+ * The sparse kernels compute the same as the dense kernels with the pruned
+ * weights (M is not a multiple of the block length).
+ */
+static void test_sparse() {
+    enum { B = 3, M = 37, N = 70 };
+    float x[B * M], w[M * N], wd[M * N], b[N], dy[B * N], y[B * N],
+        y_expected[B * N], dx[B * M], dx_expected[B * M];
+    for (uint32_t i = 0; i < B * M; i++) x[i] = (float)(i % 11) * 0.1f - 0.5f;
+    // no zeros and no blocks with the same norm
+    for (uint32_t i = 0; i < M * N; i++) w[i] = cosf((float)i * 0.37f) * 0.5f;
+    for (uint32_t j = 0; j < N; j++) b[j] = (float)(j % 3) * 0.1f - 0.1f;
+    for (uint32_t i = 0; i < B * N; i++) dy[i] = (float)(i % 7) * 0.1f - 0.3f;
+
+    struct smatrix s = smatrix_prune(M, N, w, 0.0f);
+    sparse_to_dense(s, wd);
+    test(s.nnzb == 3 * N && vec_is_equal_f32(M * N, w, wd, 1e-9f) &&
+         "Store all blocks without pruning");
+    smatrix_free(s);
+
+    s = smatrix_prune(M, N, w, 0.8f);
+    test(fabsf(smatrix_density(s) - 0.2f) < 0.01f &&
+         "Prune 80% of the weight blocks");
+    sparse_to_dense(s, wd);
+    trans_act_sparse(B, s, b, x, relu, y);
+    trans_act(B, M, N, wd, b, x, relu, y_expected);
+    test(vec_is_equal_f32(B * N, y_expected, y, 1e-5f) &&
+         "Calculate y = relu(x * w + b) with the sparse weights");
+    memset(dx, 0, sizeof(dx));
+    loss_sparse(B, s, dy, dx);
+    loss(B, M, N, wd, dy, dx_expected);
+    test(vec_is_equal_f32(B * M, dx_expected, dx, 1e-5f) &&
+         "Calculate dx = dy * w with the sparse weights");
+
+    train_sgd_sparse(B, s, x, dy, 0.1f);
+    train_sgd(B, M, N, x, dy, 0.1f, w);
+    for (uint32_t i = 0; i < M * N; i++) {
+        if (wd[i] == 0.0f) w[i] = 0.0f;
+    }
+    sparse_to_dense(s, wd);
+    test(vec_is_equal_f32(M * N, w, wd, 1e-5f) &&
+         "Update the stored blocks only (sgd)");
+
+    const uint32_t len = s.nnzb * SPARSE_BLOCK;
+    float *mom   = calloc(len, sizeof(float));
+    float *veloc = calloc(len, sizeof(float));
+    float *grad  = calloc(len, sizeof(float));
+    float mom_d[M * N] = {0}, veloc_d[M * N] = {0}, grad_d[M * N];
+    memcpy(w, wd, sizeof(w));
+    train_adam_sparse(B, s, x, dy, 1.0f, 0.01f, 0.9f, 0.999f, 1e-8f, mom,
+                      veloc, grad);
+    train_adam(B, M, N, x, dy, 1.0f, 0.01f, 0.9f, 0.999f, 1e-8f, w, mom_d,
+               veloc_d, grad_d);
+    for (uint32_t i = 0; i < M * N; i++) {
+        if (wd[i] == 0.0f) w[i] = 0.0f;
+    }
+    sparse_to_dense(s, wd);
+    test(vec_is_equal_f32(M * N, w, wd, 1e-5f) &&
+         "Update the stored blocks only (adam)");
+    free(mom);
+    free(veloc);
+    free(grad);
+
+    const char *filename = "/tmp/test_kern.sparse";
+    test(smatrix_save(filename, s) && "Write the sparse matrix file");
+    struct smatrix l = smatrix_load(filename, M, N);
+    test(l.nnzb == s.nnzb &&
+         vec_is_equal_f32(l.nnzb * SPARSE_BLOCK, s.val, l.val, 1e-9f) &&
+         "Read the sparse matrix file");
+    smatrix_free(l);
+
+    // a decreasing row pointer or a block column out of range is rejected
+    const long row_ptr = 8 + 4 * sizeof(uint32_t);
+    const long col     = row_ptr + (N + 1) * sizeof(uint32_t);
+    test(!sparse_load_corrupt(filename, s, row_ptr + sizeof(uint32_t),
+                              s.nnzb + 1, M, N) &&
+         "Reject a row pointer beyond the number of blocks");
+    test(s.row_ptr[N - 2] > 0 &&
+         !sparse_load_corrupt(filename, s,
+                              row_ptr + (N - 1) * sizeof(uint32_t), 0, M, N) &&
+         "Reject a decreasing row pointer");
+    test(!sparse_load_corrupt(filename, s, col,
+                              (M + SPARSE_BLOCK - 1) / SPARSE_BLOCK, M, N) &&
+         "Reject a block column beyond the rows");
+    test(sparse_load_corrupt(filename, s, col, s.col[0], M, N) &&
+         "Read the unchanged sparse matrix file");
+    unlink(filename);
+    smatrix_free(s);
+}
+
+/*
+ * The sparse input products must be equal to the dense products, including
+ * an all zero input vector and the scalar tails.
+ */
+static void test_svector() {
+    enum { B = 3, M = 37, N = 11 };
+    float x[B * M] = {0}, w[M * N], w_dense[M * N], b[N], dy[B * N];
+    float y[B * N], y_expected[B * N];
+    uint32_t ptr[B + 1], idx[B * M];
+    float val[B * M];
+    struct svector s = {.ptr = ptr, .idx = idx, .val = val};
+    for (uint32_t i = 0; i < M; i += 3) x[i] = cosf((float)i);  // vector 0
+    for (uint32_t i = 0; i < M; i++) x[2 * M + i] = sinf(i + 1.0f);
+    for (uint32_t i = 0; i < M * N; i++) w[i] = w_dense[i] = cosf(0.7f * i);
+    for (uint32_t j = 0; j < N; j++) b[j] = 0.1f * (float)j - 0.5f;
+    for (uint32_t i = 0; i < B * N; i++) dy[i] = sinf(0.3f * i);
+    const float density = svector_compress(B, M, x, &s);
+    test(ptr[1] == 13 && ptr[2] == 13 && ptr[3] == 13 + M &&
+         fabsf(density - (13.0f + M) / (B * M)) < 1e-6f &&
+         "Compress the nonzero input elements");
+    trans_act(B, M, N, w, b, x, relu, y_expected);
+    trans_act_svector(B, N, w, b, s, relu, y);
+    test(vec_is_equal_f32(B * N, y_expected, y, 1e-5f) &&
+         "Calculate y = relu(x * w + b) of the sparse inputs");
+    train_sgd(B, M, N, x, dy, 0.5f, w_dense);
+    train_sgd_svector(B, N, s, dy, 0.5f, w);
+    test(vec_is_equal_f32(M * N, w_dense, w, 1e-5f) &&
+         "Train only the weights of the nonzero inputs");
+}
+
+/*
+ * Compare the im2col convolution, its filter gradient and its input delta
+ * with a direct convolution (stride 2, padding 1).
+ */
+static void test_conv2d() {
+    enum { B = 2, C = 3, H = 7, W = 6, K = 3, F = 5, OH = 4, OW = 3 };
+    enum { M = K * K * C, P = OH * OW };
+    const struct conv2d g = {
+        .c = C, .h = H, .w = W, .k = K, .stride = 2, .pad = 1, .f = F};
+    float x[B * C * H * W], w[F * M], b[F], col[B * M * P], dcol[B * M * P];
+    float y[B * F * P], y_expected[B * F * P], dy[B * F * P];
+    float dw[F * M] = {0}, db[F] = {0};
+    float dx[B * C * H * W], dx_expected[B * C * H * W] = {0};
+    for (uint32_t i = 0; i < ARRAY_LENGTH(x); i++) x[i] = cosf((float)i);
+    for (uint32_t i = 0; i < ARRAY_LENGTH(w); i++) w[i] = sinf((float)i);
+    for (uint32_t i = 0; i < ARRAY_LENGTH(dy); i++) dy[i] = cosf(0.3f * i);
+    for (uint32_t j = 0; j < F; j++) b[j] = 0.1f * (float)j - 0.2f;
+    test(CONV_OUT(H, K, 2, 1) == OH && CONV_OUT(W, K, 2, 1) == OW);
+    for (uint32_t l = 0; l < B; l++) {
+        for (uint32_t j = 0; j < F; j++) {
+            for (uint32_t o = 0; o < P; o++) {
+                const uint32_t out = (l * F + j) * P + o;
+                float sum          = b[j];
+                db[j] += dy[out];
+                for (uint32_t ch = 0; ch < C; ch++) {
+                    for (uint32_t ky = 0; ky < K; ky++) {
+                        for (uint32_t kx = 0; kx < K; kx++) {
+                            const int iy = (int)(o / OW) * 2 - 1 + (int)ky;
+                            const int ix = (int)(o % OW) * 2 - 1 + (int)kx;
+                            if (iy < 0 || iy >= H || ix < 0 || ix >= W) {
+                                continue;
+                            }
+                            const uint32_t in =
+                                ((l * C + ch) * H + iy) * W + ix;
+                            const uint32_t wi = j * M + (ch * K + ky) * K + kx;
+                            sum += x[in] * w[wi];
+                            dw[wi] += dy[out] * x[in];
+                            dx_expected[in] += dy[out] * w[wi];
+                        }
+                    }
+                }
+                y_expected[out] = sum > 0.0f ? sum : 0.0f;
+            }
+        }
+    }
+    conv2d(B, g, w, b, x, relu, col, y);
+    test(vec_is_equal_f32(ARRAY_LENGTH(y), y_expected, y, 1e-4f) &&
+         "Calculate y = relu(conv(x, w) + b)");
+    conv2d_loss(B, g, w, dy, dcol, dx);
+    test(vec_is_equal_f32(ARRAY_LENGTH(dx), dx_expected, dx, 1e-4f) &&
+         "Calculate the input delta of the convolution");
+    // train with the rate -1 from 0 to get the gradient
+    float grad[F * M] = {0}, grad_b[F] = {0};
+    conv2d_train_sgd(B, g, col, dy, -1.0f, grad, grad_b);
+    test(vec_is_equal_f32(F * M, dw, grad, 1e-4f) &&
+         vec_is_equal_f32(F, db, grad_b, 1e-4f) &&
+         "The filter and the bias gradient of the packed patches");
+}
+
+/*
+ * The pooling deltas are the adjoint of the pooling:
+ * <pool(x), dy> == <x, pool_loss(dy)>.
+ */
+static void test_pool() {
+    enum { B = 2, C = 3, H = 5, W = 4, OH = 2, OW = 2 };
+    const struct pool2d p = {.c = C, .h = H, .w = W, .k = 2, .stride = 2};
+    float x[B * C * H * W], dx[B * C * H * W];
+    float y[B * C * OH * OW], dy[B * C * OH * OW];
+    float max_expected[B * C * OH * OW], avg_expected[B * C * OH * OW];
+    uint32_t idx[B * C * OH * OW];
+    for (uint32_t i = 0; i < ARRAY_LENGTH(x); i++) x[i] = cosf((float)i);
+    for (uint32_t i = 0; i < ARRAY_LENGTH(dy); i++) dy[i] = sinf((float)i);
+    for (uint32_t q = 0; q < B * C; q++) {
+        for (uint32_t o = 0; o < OH * OW; o++) {
+            float max = -FLT_MAX, sum = 0.0f;
+            for (uint32_t k = 0; k < 4; k++) {
+                const uint32_t iy = o / OW * 2 + k / 2;
+                const uint32_t ix = o % OW * 2 + k % 2;
+                const float v     = x[(q * H + iy) * W + ix];
+                max               = fmaxf(max, v);
+                sum += v;
+            }
+            max_expected[q * OH * OW + o] = max;
+            avg_expected[q * OH * OW + o] = sum / 4.0f;
+        }
+    }
+    maxpool(B, p, x, y, idx);
+    test(vec_is_equal_f32(ARRAY_LENGTH(y), max_expected, y, 1e-6f) &&
+         "Calculate the maximum of the windows");
+    maxpool_loss(B, p, dy, idx, dx);
+    double ydy = 0.0, xdx = 0.0;
+    for (uint32_t i = 0; i < ARRAY_LENGTH(y); i++) ydy += y[i] * dy[i];
+    for (uint32_t i = 0; i < ARRAY_LENGTH(x); i++) xdx += x[i] * dx[i];
+    test(fabs(ydy - xdx) < 1e-5 && "maxpool_loss is the adjoint of maxpool");
+    avgpool(B, p, x, y);
+    test(vec_is_equal_f32(ARRAY_LENGTH(y), avg_expected, y, 1e-6f) &&
+         "Calculate the mean of the windows");
+    avgpool_loss(B, p, dy, dx);
+    ydy = xdx = 0.0;
+    for (uint32_t i = 0; i < ARRAY_LENGTH(y); i++) ydy += y[i] * dy[i];
+    for (uint32_t i = 0; i < ARRAY_LENGTH(x); i++) xdx += x[i] * dx[i];
+    test(fabs(ydy - xdx) < 1e-5 && "avgpool_loss is the adjoint of avgpool");
+}
+
+static void test_train_sgd_bias() {
+    float dy[]         = {0.5f, -1.0f, 0.25f, 0.5f, 1.0f, 0.25f};
+    float b[]          = {0.1f, 0.2f, 0.3f};
+    float b_expected[] = {0.0f, 0.2f, 0.25f};
+    train_sgd_bias(2, ARRAY_LENGTH(b), dy, 0.1f, b);
+    test(vec_is_equal_f32(ARRAY_LENGTH(b), b_expected, b, 0.0001f) &&
+         "Calculate b -= N * sum(dy)");
+    float *bias = bias_create_or_load(NULL, 3);
+    float zero[3] = {0.0f, 0.0f, 0.0f};
+    test(vec_is_equal_f32(3, zero, bias, 1e-9f) &&
+         "A new bias vector should be initialized with 0");
+    free(bias);
+}
+
 static void test_train_sgd() {
     float x[] = {0.4f, 0.8f, 0.1f, 0.66f, 0.2f};
     float y[] = {0.7639f, -0.582f, 0.102f, -0.582f, 0.072f, -0.582f, -0.582f};
@@ -59,6 +452,42 @@ static void test_train_sgd() {
          "Calculate w -= N * x^T * y");
 }
 
+/*
+ * The gradients of the samples sum up to the gradient of the batch, and
+ * subtracting it (vec_axpy) is the update of train_sgd() and
+ * train_sgd_bias().
+ */
+static void test_weights_grad() {
+    enum { B = 3, M = 5, N = 4 };
+    float x[B * M], dy[B * N], w[N * M], w_sgd[N * M], b[N], b_sgd[N];
+    rng_uniform(kern_rng(), B * M, x);
+    rng_uniform(kern_rng(), B * N, dy);
+    for (uint32_t i = 0; i < N * M; i++) w[i] = w_sgd[i] = 0.1f * (float)i;
+    for (uint32_t i = 0; i < N; i++) b[i] = b_sgd[i] = 0.5f;
+
+    float grad[N * M], sum[N * M], db[N];
+    weights_grad(B, M, N, x, dy, grad);
+    weights_grad(1, M, N, x, dy, sum);
+    for (uint32_t k = 1; k < B; k++) {
+        float g[N * M];
+        weights_grad(1, M, N, &x[k * M], &dy[k * N], g);
+        vec_axpy(N * M, 1.0f, g, sum);
+    }
+    test(vec_is_equal_f32(N * M, grad, sum, 1e-5f) &&
+         "The batch gradient is the sum of the sample gradients");
+
+    train_sgd(B, M, N, x, dy, 0.1f, w_sgd);
+    vec_axpy(N * M, -0.1f, grad, w);
+    test(vec_is_equal_f32(N * M, w_sgd, w, 1e-5f) &&
+         "Subtracting the gradient is the update of train_sgd()");
+
+    bias_grad(B, N, dy, db);
+    train_sgd_bias(B, N, dy, 0.1f, b_sgd);
+    vec_axpy(N, -0.1f, db, b);
+    test(vec_is_equal_f32(N, b_sgd, b, 1e-5f) &&
+         "Subtracting the bias gradient is the update of train_sgd_bias()");
+}
+
 /*
  * TODO check mom and veloc result with expected values
  */
@@ -103,14 +532,56 @@ static void test_train_adam() {
         0.0f, 0.0f, 0.0f, 0.0f, 0.0f,  //
     };
 
+    float grad[ARRAY_LENGTH(w)];
+
     const int M = ARRAY_LENGTH(x);
     const int N = ARRAY_LENGTH(y);
-    train_adam(1, M, N, x, y, 1.0f, 1.0f, 0.9f, .99f, 1e-8f, w, mom, vel);
+    train_adam(1, M, N, x, y, 1.0f, 1.0f, 0.9f, .99f, 1e-8f, w, mom, vel,
+               grad);
     vec_write_f32(stdout, N * M, w, "calculated result");
     test(vec_is_equal_f32(N * M, w_expected, w, 0.001) &&
          "Calculate adam optimization");
 }
 
+/*
+ * Compare the fused adam step of a batch against a scalar reference
+ * computed from the summed batch gradient.
+ */
+static void test_train_adam_batch() {
+    enum { B = 3, M = 21, N = 5 };
+    float x[B * M], dy[B * N];
+    float w[M * N], mom[M * N], vel[M * N], grad[M * N];
+    float w_ref[M * N], mom_ref[M * N], vel_ref[M * N];
+    for (uint32_t i = 0; i < B * M; i++) x[i] = (float)(i % 7) * 0.1f - 0.3f;
+    for (uint32_t i = 0; i < B * N; i++) dy[i] = (float)(i % 5) * 0.2f - 0.4f;
+    for (uint32_t i = 0; i < M * N; i++) {
+        w[i] = w_ref[i] = (float)(i % 11) * 0.01f;
+        mom[i] = mom_ref[i] = 0.01f;
+        vel[i] = vel_ref[i] = 0.02f;
+    }
+    const float counter = 3.0f, rate = 0.01f, b1 = 0.9f, b2 = 0.999f;
+    for (uint32_t j = 0; j < N; j++) {
+        for (uint32_t i = 0; i < M; i++) {
+            float g = 0.0f;
+            for (uint32_t k = 0; k < B; k++) g += dy[k * N + j] * x[k * M + i];
+            float *mr = &mom_ref[j * M + i], *vr = &vel_ref[j * M + i];
+            *mr = b1 * *mr + (1 - b1) * g;
+            *vr = b2 * *vr + (1 - b2) * g * g;
+            w_ref[j * M + i] -= rate * (*mr / (1 - powf(b1, counter))) /
+                                sqrtf(*vr / (1 - powf(b2, counter)) + 1e-8f);
+        }
+    }
+    float next = train_adam(B, M, N, x, dy, counter, rate, b1, b2, 1e-8f, w,
+                            mom, vel, grad);
+    test(next == counter + 1.0f && "Adam should increment the counter");
+    test(vec_is_equal_f32(M * N, mom_ref, mom, 1e-5f) &&
+         "Adam 1st moment of a batch");
+    test(vec_is_equal_f32(M * N, vel_ref, vel, 1e-5f) &&
+         "Adam 2nd moment of a batch");
+    test(vec_is_equal_f32(M * N, w_ref, w, 1e-4f) &&
+         "Adam weight update of a batch");
+}
+
 static void test_weight_delta() {
     float x[] = {0.0f, 0.0f, 0.0f, 0.0f, 0.2f};
     float y[] = {0.7639f, -0.582f, 0.102f, -0.582f, 0.072f, -0.582f, -0.582f};
@@ -150,6 +621,91 @@ static void test_dropout() {
     vec_write_f32(stdout, ARRAY_LENGTH(y), d, "vector with drop out values");
 }
 
+/*
+ * The Philox known answers (Random123) and the properties of the streams.
+ */
+static void test_rng() {
+    uint32_t bits[4];
+    struct rng r = {.seed = 0, .stream = 0, .counter = 0};
+    rng_bits(&r, 1, bits);
+    test(bits[0] == 0x6627e8d5 && bits[1] == 0xe169c58d &&
+         bits[2] == 0xbc57ac4c && bits[3] == 0x9b00dbd8 && r.counter == 1 &&
+         "Philox4x32-10 of the zero counter and key");
+    r = (struct rng){.seed    = 0x299f31d0a4093822,
+                     .stream  = 0x0370734413198a2e,
+                     .counter = 0x85a308d3243f6a88};
+    rng_bits(&r, 1, bits);
+    test(bits[0] == 0xd16cfe09 && bits[1] == 0x94fdcceb &&
+         bits[2] == 0x5001e420 && bits[3] == 0x24126ea1 &&
+         "Philox4x32-10 of the pi counter and key");
+
+    enum { N = 100000 };
+    static float u[N], v[N];
+    kern_seed(42);
+    r = rng_stream(1);
+    rng_uniform(&r, N, u);
+    r = rng_stream(1);
+    rng_uniform(&r, 40, v);
+    rng_uniform(&r, N - 40, &v[40]);
+    test(vec_is_equal_f32(N, u, v, 1e-9f) &&
+         "A stream is reproducible in any chunks");
+    r = rng_stream(2);
+    rng_uniform(&r, N, v);
+    double mean = 0.0, min = 1.0, max = 0.0;
+    uint32_t same = 0;
+    for (uint32_t i = 0; i < N; i++) {
+        mean += u[i];
+        min = fmin(min, u[i]);
+        max = fmax(max, u[i]);
+        same += u[i] == v[i];
+    }
+    mean /= N;
+    test(min >= 0.0 && max < 1.0 && fabs(mean - 0.5) < 0.01 && same < 10 &&
+         "Uniform floats in [0, 1), the streams are independent");
+
+    rng_normal(&r, N, 1.0f, 2.0f, u);
+    mean = 0.0;
+    double var = 0.0;
+    for (uint32_t i = 0; i < N; i++) mean += u[i];
+    mean /= N;
+    for (uint32_t i = 0; i < N; i++) var += (u[i] - mean) * (u[i] - mean);
+    var /= N - 1;
+    printf("normal mean: %g, variance: %g\n", mean, var);
+    test(fabs(mean - 1.0) < 0.03 && fabs(var - 4.0) < 0.1 &&
+         "Normal floats with the mean 1 and the variance 4");
+
+    float y[N / 10], d0[N / 10], d1[N / 10];
+    for (uint32_t i = 0; i < N / 10; i++) y[i] = 1.0f;
+    kern_seed(7);
+    dropout(N / 10, y, 0.25f, d0);
+    kern_seed(7);
+    dropout(N / 10, y, 0.25f, d1);
+    uint32_t dropped = 0;
+    for (uint32_t i = 0; i < N / 10; i++) dropped += d0[i] == 0.0f;
+    test(vec_is_equal_f32(N / 10, d0, d1, 1e-9f) &&
+         fabs(dropped / (N / 10.0) - 0.25) < 0.02 &&
+         "The dropout is reproducible with the seed");
+}
+
+static void test_rng_shuffle() {
+    enum { N = 1000 };
+    uint32_t x[N], y[N], count[N] = {0}, first = 0;
+    for (uint32_t i = 0; i < N; i++) x[i] = y[i] = i;
+    struct rng r = rng_stream(3), q = rng_stream(3);
+    rng_shuffle(&r, N, x);
+    rng_shuffle(&q, N, y);
+    bool moved = false;
+    for (uint32_t i = 0; i < N; i++) {
+        count[x[i] % N]++;
+        moved |= x[i] != i;
+        first += x[i] == y[i];
+    }
+    bool permuted = true;
+    for (uint32_t i = 0; i < N; i++) permuted &= count[i] == 1;
+    test(permuted && moved && first == N &&
+         "Shuffle is a reproducible permutation");
+}
+
 static void test_argmax() {
     float y[] = {0.7639f, -0.582f, 0.102f, -0.582f, 0.072f, -0.582f, -0.582f};
     float max;
@@ -166,6 +722,48 @@ static void test_argmax() {
          "Argmax should return the position of the max element (2)");
 }
 
+/*
+ * Rank a batch of vectors with elements in [lo, lo + 8) and check the top k.
+ */
+static bool topk_check(int lo) {
+    enum { B = 37, LEN = 10, K = 3 };
+    float x[B * LEN], val[B * K];
+    uint16_t idx[B * K];
+    for (uint32_t i = 0; i < B * LEN; i++) x[i] = (float)(lo + random() % 8);
+    topk(B, LEN, K, x, idx, val);
+    bool ok = true;
+    for (uint32_t s = 0; s < B; s++) {
+        float max;
+        const float *v = &x[s * LEN];
+        ok &= idx[s * K] == argmax(LEN, v, &max) && val[s * K] == max;
+        for (uint32_t r = 0; r < K; r++) {
+            // the values are descending and the equal values are in order
+            ok &= v[idx[s * K + r]] == val[s * K + r];
+            ok &= r == 0 || val[s * K + r] < val[s * K + r - 1] ||
+                  (val[s * K + r] == val[s * K + r - 1] &&
+                   idx[s * K + r] > idx[s * K + r - 1]);
+            // no element out of the top k is greater or equal and first
+            for (uint32_t j = 0; j < LEN; j++) {
+                bool in = false;
+                for (uint32_t q = 0; q < K; q++) in |= idx[s * K + q] == j;
+                ok &= in || v[j] < val[s * K + K - 1] ||
+                      (v[j] == val[s * K + K - 1] && j > idx[s * K + K - 1]);
+            }
+        }
+    }
+    return ok;
+}
+
+/*
+ * The batch of 37 vectors is ranked by the SIMD lanes and the scalar tail.
+ */
+static void test_topk() {
+    test(topk_check(0) &&
+         "Topk should return the k max elements of each vector");
+    test(topk_check(-9) && "Topk should rank the negative elements");
+    test(topk_check(-7) && "Topk should rank the mixed-sign elements");
+}
+
 static void test_softmax() {
     float x[] = {0.7639f, -0.582f, 0.102f, -0.582f, 0.072f, -0.582f, -0.582f};
     float xs[ARRAY_LENGTH(x)];
@@ -179,14 +777,216 @@ static void test_softmax() {
          "The sum of the softmax vector elements should be equal 1");
 }
 
+/*
+ * The fused loss matches the softmax and the cross entropy in double
+ * precision, also for logits that overflow exp().
+ */
+static void test_softmax_xent() {
+    enum { B = 2, N = 37 };
+    float x[B * N], t[B * N] = {0}, d[B * N], d_expected[B * N];
+    for (uint32_t i = 0; i < B * N; i++) x[i] = (float)(i % 9) * 0.7f - 2.0f;
+    x[N + 5] = 1000.0f;  // exp(1000) overflows
+    t[3]     = 1.0f;
+    t[N + 5] = 0.5f;
+    t[N + 6] = 0.5f;
+    double loss_expected = 0.0;
+    for (uint32_t k = 0; k < B; k++) {
+        double max = x[k * N], sum = 0.0;
+        for (uint32_t i = 0; i < N; i++) max = fmax(max, x[k * N + i]);
+        for (uint32_t i = 0; i < N; i++) sum += exp(x[k * N + i] - max);
+        for (uint32_t i = 0; i < N; i++) {
+            const double lp = x[k * N + i] - max - log(sum);
+            d_expected[k * N + i] = (float)(exp(lp) - t[k * N + i]);
+            loss_expected -= t[k * N + i] * lp;
+        }
+    }
+    loss_expected /= B;
+    const float loss = softmax_xent(B, N, x, t, d);
+    printf("cross entropy: %g, expected: %g\n", loss, loss_expected);
+    test(fabs(loss - loss_expected) < 1e-4 * loss_expected &&
+         "Calculate the mean cross entropy of the logits");
+    test(vec_is_equal_f32(B * N, d_expected, d, 1e-6f) &&
+         "Calculate the gradient softmax(x) - t of the logits");
+    float xs[N];
+    softmax(N, &x[N], xs);
+    test(xs[5] > 0.999999f && xs[5] <= 1.0f && xs[6] < 1e-30f &&
+         "The softmax of large logits is stable");
+}
+
+/*
+ * Check the documented error bounds of the polynomial approximations.
+ */
+static void test_activation_accuracy() {
+    enum { LEN = 40003 };
+    static float x[LEN], y[LEN];
+    double max_err = 0.0;
+    for (uint32_t i = 0; i < LEN; i++) x[i] = -87.0f + (float)i * 175.0f / LEN;
+    memcpy(y, x, sizeof(y));
+    VF_MAP(LEN, y, vf_exp);
+    for (uint32_t i = 0; i < LEN; i++) {
+        double e = fabs((y[i] - exp(x[i])) / exp(x[i]));
+        if (e > max_err) max_err = e;
+    }
+    printf("exp max. relative error: %g\n", max_err);
+    test(max_err < 2.5e-7 && "exp approximation error");
+
+    for (uint32_t i = 0; i < LEN; i++) x[i] = -20.0f + (float)i * 40.0f / LEN;
+    memcpy(y, x, sizeof(y));
+    sigmoid(LEN, y);
+    max_err = 0.0;
+    for (uint32_t i = 0; i < LEN; i++) {
+        double e = fabs(y[i] - 1.0 / (1.0 + exp(-x[i])));
+        if (e > max_err) max_err = e;
+    }
+    printf("sigmoid max. absolute error: %g\n", max_err);
+    test(max_err < 3e-7 && "sigmoid approximation error");
+
+    memcpy(y, x, sizeof(y));
+    tanhg(LEN, y);
+    max_err = 0.0;
+    for (uint32_t i = 0; i < LEN; i++) {
+        double e = fabs(y[i] - tanh(x[i]));
+        if (e > max_err) max_err = e;
+    }
+    printf("tanh max. absolute error: %g\n", max_err);
+    test(max_err < 4e-7 && "tanh approximation error");
+}
+
+static void test_activation_derived() {
+    float y[]     = {0.0f, 0.25f, 0.5f, -0.5f, 0.75f, 1.0f, 0.1f, 0.2f, 0.3f,
+                 0.4f, -0.1f};
+    const uint32_t len = ARRAY_LENGTH(y);
+    float d[ARRAY_LENGTH(y)], d_expected[ARRAY_LENGTH(y)];
+
+    for (uint32_t i = 0; i < len; i++) {
+        d[i]          = 2.0f;
+        d_expected[i] = 2.0f * y[i] * (1.0f - y[i]);
+    }
+    sigmoid_derived(len, y, d);
+    test(vec_is_equal_f32(len, d_expected, d, 1e-6f) &&
+         "Calculate sigmoid derivative y * (1 - y)");
+
+    for (uint32_t i = 0; i < len; i++) {
+        d[i]          = 2.0f;
+        d_expected[i] = 2.0f * (1.0f - y[i] * y[i]);
+    }
+    tanhg_derived(len, y, d);
+    test(vec_is_equal_f32(len, d_expected, d, 1e-6f) &&
+         "Calculate tanh derivative 1 - y^2");
+
+    for (uint32_t i = 0; i < len; i++) {
+        d[i]          = 2.0f;
+        d_expected[i] = y[i] > 0.0f ? 2.0f : 0.0f;
+    }
+    relu_derived(len, y, d);
+    test(vec_is_equal_f32(len, d_expected, d, 1e-6f) &&
+         "Calculate relu derivative");
+
+    relu(len, y);
+    test(y[3] == 0.0f && y[10] == 0.0f && y[4] == 0.75f &&
+         "relu sets negative values to 0");
+}
+
+/*
+ * The reference product: OpenBLAS if available, a naive loop otherwise.
+ */
+static void gemm_reference(bool ta, bool tb, uint32_t m, uint32_t n,
+                           uint32_t k, float alpha, const float *a,
+                           uint32_t lda, const float *b, uint32_t ldb,
+                           float beta, float *c, uint32_t ldc) {
+#ifdef WITH_OPENBLAS
+    cblas_sgemm(CblasRowMajor, ta ? CblasTrans : CblasNoTrans,
+                tb ? CblasTrans : CblasNoTrans, m, n, k, alpha, a, lda, b, ldb,
+                beta, c, ldc);
+#else
+    for (uint32_t i = 0; i < m; i++) {
+        for (uint32_t j = 0; j < n; j++) {
+            double sum = 0.0;
+            for (uint32_t p = 0; p < k; p++) {
+                const float ai = ta ? a[p * lda + i] : a[i * lda + p];
+                const float bj = tb ? b[j * ldb + p] : b[p * ldb + j];
+                sum += (double)ai * bj;
+            }
+            c[i * ldc + j] = alpha * (float)sum + beta * c[i * ldc + j];
+        }
+    }
+#endif
+}
+
+/*
+ * The built-in gemm must match the reference within the tolerance for all
+ * transpositions and for the shapes of the mnist net (including the edges of
+ * the register and cache blocks).
+ */
+static void test_gemm() {
+    const uint32_t shapes[][3] = {
+        {1, 280, 784}, {1, 10, 280}, {1, 280, 10},  {280, 784, 1},
+        {10, 280, 16}, {16, 280, 784}, {7, 33, 300}, {73, 2050, 3},
+    };
+    bool ok = true;
+    for (uint32_t s = 0; s < ARRAY_LENGTH(shapes); s++) {
+        const uint32_t m = shapes[s][0], n = shapes[s][1], k = shapes[s][2];
+        float *a = matrix_alloc(m, k), *b = matrix_alloc(k, n);
+        float *c = matrix_alloc(m, n), *c_ref = matrix_alloc(m, n);
+        for (uint32_t i = 0; i < m * k; i++) a[i] = (float)(i % 17) * 0.1f - 0.8f;
+        for (uint32_t i = 0; i < k * n; i++) b[i] = (float)(i % 13) * 0.1f - 0.6f;
+        for (uint32_t t = 0; t < 4; t++) {
+            const bool ta = t & 1, tb = t & 2;
+            const float beta = t == 3 ? 0.0f : 0.5f;
+            for (uint32_t i = 0; i < m * n; i++) c[i] = c_ref[i] = 1.0f;
+            gemm_f32(ta, tb, m, n, k, 0.75f, a, ta ? m : k, b, tb ? k : n, beta,
+                     c, n);
+            gemm_reference(ta, tb, m, n, k, 0.75f, a, ta ? m : k, b,
+                           tb ? k : n, beta, c_ref, n);
+            for (uint32_t i = 0; i < m * n; i++) {
+                if (fabsf(c[i] - c_ref[i]) > 1e-4f * (1.0f + fabsf(c_ref[i]))) {
+                    printf("gemm %u x %u x %u (trans %d, %d): [%u] %f != %f\n",
+                           m, n, k, ta, tb, i, c[i], c_ref[i]);
+                    ok = false;
+                    break;
+                }
+            }
+        }
+        free(a);
+        free(b);
+        free(c);
+        free(c_ref);
+    }
+    test(ok && "The built-in gemm matches the reference product");
+}
+
 int main() {
     srandom(time(NULL));
-    test_trans();
-    test_train_sgd();
-    test_weight_delta();
-    test_dropout();
-    test_train_adam();
-    test_argmax();
-    test_softmax();
+    test_half_conversion();
+    // run the tests with all instruction sets supported by the CPU
+    const char *isa[] = {"scalar", "sse42", "avx2", "avx512"};
+    for (uint32_t i = 0; i < ARRAY_LENGTH(isa); i++) {
+        if (!kern_isa_select(isa[i])) continue;
+        printf("instruction set: %s\n", kern_isa());
+        test_gemm();
+        test_trans();
+        test_trans_act();
+        test_trans_act_q8();
+        test_trans_act_h();
+        test_sparse();
+        test_svector();
+        test_conv2d();
+        test_pool();
+        test_train_sgd_bias();
+        test_train_sgd();
+        test_weights_grad();
+        test_weight_delta();
+        test_dropout();
+        test_rng();
+        test_rng_shuffle();
+        test_train_adam();
+        test_train_adam_batch();
+        test_argmax();
+        test_topk();
+        test_softmax();
+        test_softmax_xent();
+        test_activation_accuracy();
+        test_activation_derived();
+    }
     return TEST_RESULT;
 }
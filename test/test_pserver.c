@@ -0,0 +1,89 @@
+#include "../pserver.c"
+#include "test.h"
+
+#include <sys/wait.h>
+
+TEST_INIT();
+
+enum { LEN = 100, PUSHES = 20 };
+
+/*
+ * Fork the workers: a worker pushes PUSHES gradients of the value worker + 1
+ * and pulls the parameters after each push. With staleness 0 the pulled
+ * parameters contain all the pushes of the worker (checked by a single
+ * worker).
+ */
+static void pserver_fork(struct pserver *ps, uint32_t workers,
+                         uint32_t staleness, pid_t pid[]) {
+    for (uint32_t w = 0; w < workers; w++) {
+        pid[w] = fork();
+        if (pid[w] != 0) continue;
+        pserver_attach(ps, w);
+        float param[LEN];
+        bool ok = true;
+        for (uint32_t i = 0; i < PUSHES; i++) {
+            float *grad = pserver_slot(ps);
+            for (uint32_t k = 0; k < LEN; k++) grad[k] = (float)(w + 1);
+            pserver_push(ps, &(struct pserver_push){.samples = 1});
+            pserver_pull(ps, param);
+            if (workers == 1 && staleness == 0) {
+                for (uint32_t k = 0; k < LEN; k++) {
+                    ok &= param[k] == (float)(i + 1);
+                }
+            }
+        }
+        pserver_close(ps);
+        _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+}
+
+/*
+ * Sum the pushed gradients into the parameters (on the server): the
+ * parameters are the sum of all pushes of all workers.
+ */
+static void test_pserver_sum(uint32_t workers, uint32_t staleness) {
+    struct pserver *ps = pserver_create(workers, LEN, staleness);
+    test(ps != NULL);
+    memset(pserver_publish_begin(ps), 0, sizeof(float) * LEN);
+    pserver_publish_end(ps);
+
+    pid_t pid[workers];
+    pserver_fork(ps, workers, staleness, pid);
+    pserver_attach(ps, workers);
+    struct pserver_push push[pserver_slots(ps)];
+    float sum[LEN] = {0};
+    uint32_t pushes = 0, n;
+    bool slots_ok = true;
+    while ((n = pserver_receive(ps, push)) > 0) {
+        for (uint32_t i = 0; i < n; i++) {
+            slots_ok &= push[i].worker < workers && push[i].slot <= staleness;
+            const float *grad = pserver_gradient(ps, &push[i]);
+            for (uint32_t k = 0; k < LEN; k++) sum[k] += grad[k];
+        }
+        memcpy(pserver_publish_begin(ps), sum, sizeof(sum));
+        pserver_publish_end(ps);
+        pserver_ack(ps, push, n);
+        pushes += n;
+    }
+    pserver_close(ps);
+    bool workers_ok = true;
+    for (uint32_t w = 0; w < workers; w++) {
+        int status;
+        waitpid(pid[w], &status, 0);
+        workers_ok &= WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    const float expected = PUSHES * workers * (workers + 1) / 2.0f;
+    test(workers_ok);
+    test(pushes == PUSHES * workers);
+    test(slots_ok);
+    test(sum[0] == expected && sum[LEN - 1] == expected);
+}
+
+int main() {
+    test_pserver_sum(1, 0);
+    test_pserver_sum(1, 1);
+    test_pserver_sum(3, 0);
+    test_pserver_sum(3, 2);
+    return TEST_RESULT;
+}
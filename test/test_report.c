@@ -0,0 +1,158 @@
+#include "../hist.c"
+#include "../report.c"
+#include "../stats.c"
+#include "test.h"
+
+#include <string.h>
+
+TEST_INIT();
+
+/*
+ * Count the lines of the stream.
+ */
+static uint32_t report_lines(FILE *stream) {
+    uint32_t n = 0;
+    rewind(stream);
+    for (int c; (c = fgetc(stream)) != EOF;) n += c == '\n';
+    return n;
+}
+
+/*
+ * A text line every 10 samples and the summary of all samples.
+ */
+static void test_report_csv() {
+    FILE *stream    = tmpfile();
+    struct report r = report_init(stream, REPORT_CSV, 10, 0);
+    for (uint32_t i = 0; i < 25; i++) report_collect(&r, 1, i % 5 != 0, 0.5, 2);
+    test(report_lines(stream) == 2 && "Write a line every 10 samples");
+    report_summary(&r);
+    test(report_lines(stream) == 3 && "Write the summary at the end");
+
+    char line[128] = "";
+    rewind(stream);
+    for (uint32_t i = 0; i < 3; i++) fgets(line, sizeof(line), stream);
+    double error, accuracy;
+    unsigned long long samples;
+    test(sscanf(line, "%lf, %*f, %lf, %*f, %*f, %*f, %llu", &error,
+                &accuracy, &samples) == 3 &&
+         error == 0.5 && accuracy == 0.8 && samples == 25 &&
+         "The summary reports all samples");
+    fclose(stream);
+}
+
+/*
+ * The binary records and the time interval.
+ */
+static void test_report_binary() {
+    FILE *stream    = tmpfile();
+    struct report r = report_init(stream, REPORT_BINARY, 0, 1);
+    const struct timespec pause = {0, 2000000};
+    for (uint32_t i = 0; i < 3; i++) {
+        report_collect(&r, 4, 3, 1.0, 10.0);
+        nanosleep(&pause, NULL);
+    }
+    report_collect(&r, 4, 3, 1.0, 10.0);
+    report_summary(&r);
+
+    struct report_record rec[8];
+    rewind(stream);
+    const size_t n = fread(rec, sizeof(rec[0]), 8, stream);
+    test(n == 4 && rec[0].samples == 8 && "Write a record every millisecond");
+    test(rec[n - 1].samples == 16 && rec[n - 1].hits == 12 &&
+         rec[n - 1].duration_mean == 10.0 &&
+         "The last record is the summary");
+    test(rec[n - 1].duration_p50 == 10.0 && rec[n - 1].duration_p999 == 10.0 &&
+         rec[n - 1].duration_max == 10.0 &&
+         "The percentiles of equal durations are the duration");
+    fclose(stream);
+}
+
+/*
+ * The moments of the merged parts equal the moments of all samples, empty
+ * statistics are neutral.
+ */
+static void test_stats_merge() {
+    struct stats all = {0}, part[5] = {0}, merged = {0}, empty = {0};
+    for (uint32_t i = 0; i < 1000; i++) {
+        const double x = (double)((i * 7919u) % 1009u) * 0.01 + (i % 3);
+        stats_collect3(&all, x);
+        // parts of different lengths
+        stats_collect3(&part[i < 10 ? 0 : i < 400 ? 1 : i < 401 ? 2 : 3], x);
+    }
+    for (uint32_t k = 0; k < 5; k++) stats_merge(&merged, &part[k], 3);
+    stats_merge(&merged, &empty, 3);
+    test(stats_samples(&merged) == 1000);
+    test(fabs(stats_mean(&merged) - stats_mean(&all)) < 1e-12);
+    test(fabs(stats_var(&merged) / stats_var(&all) - 1) < 1e-12);
+    test(fabs(stats_skew(&merged) - stats_skew(&all)) < 1e-9);
+}
+
+/*
+ * The merged shard reports equal the report of all batches and write the
+ * interval lines.
+ */
+static void test_report_merge() {
+    FILE *stream      = tmpfile();
+    struct report r   = report_init(stream, REPORT_CSV, 10, 0);
+    struct report all = report_init(NULL, REPORT_CSV, 0, 0);
+    struct report shard[3];
+    for (uint32_t k = 0; k < 3; k++) {
+        shard[k] = report_init(NULL, REPORT_CSV, 0, 0);
+        for (uint32_t i = 0; i < 8; i++) {
+            report_collect(&shard[k], 1, i % 4 != 0, k + 0.1 * i, 2.0);
+            report_collect(&all, 1, i % 4 != 0, k + 0.1 * i, 2.0);
+        }
+    }
+    // a line after 16 samples, the next interval ends at 26
+    for (uint32_t k = 0; k < 3; k++) report_merge(&r, &shard[k]);
+    test(report_lines(stream) == 1 && "Write a line when 10 samples passed");
+    test(r.samples == 24 && r.hits == 18);
+    test(fabs(stats_mean(&r.error) - stats_mean(&all.error)) < 1e-12);
+    test(fabs(stats_var(&r.error) / stats_var(&all.error) - 1) < 1e-12);
+    test(stats_mean(&r.duration) == 2.0);
+    fclose(stream);
+}
+
+/*
+ * The quantiles of the histogram are within its relative resolution, the
+ * small durations and the max are exact and merged halves are the whole.
+ */
+static void test_hist() {
+    static struct hist all, even, odd, empty;
+    test(hist_quantile(&empty, 0.5) == 0.0);
+    for (uint32_t i = 1; i <= 100000; i++) {
+        const double us = (double)i * 0.1;
+        hist_collect(&all, us);
+        hist_collect(i % 2 ? &odd : &even, us);
+    }
+    const double q[]        = {0.5, 0.9, 0.99, 0.999};
+    const double expected[] = {5000.0, 9000.0, 9900.0, 9990.0};
+    bool ok                 = true;
+    for (uint32_t k = 0; k < 4; k++) {
+        const double v = hist_quantile(&all, q[k]);
+        ok &= fabs(v / expected[k] - 1.0) < 1.0 / (1 << HIST_SUB_BITS);
+    }
+    test(ok && "The quantiles are within the bucket resolution");
+    test(hist_quantile(&all, 1.0) == 10000.0 && "The max is exact");
+    test(hist_quantile(&all, 0.0) == 0.1 && "The min is the first bucket");
+
+    hist_merge(&even, &odd);
+    test(even.count == all.count && even.max == all.max &&
+         memcmp(even.bucket, all.bucket, sizeof(all.bucket)) == 0 &&
+         "The merged halves are the whole");
+
+    struct hist small = {0};
+    hist_collect(&small, 0.037);
+    hist_collect(&small, 1e9);
+    test(hist_quantile(&small, 0.5) == 0.037 && "Small durations are exact");
+    test(hist_quantile(&small, 1.0) == 1e9 && "The max beyond the range");
+}
+
+int main() {
+    test_report_csv();
+    test_report_binary();
+    test_stats_merge();
+    test_report_merge();
+    test_hist();
+    return TEST_RESULT;
+}
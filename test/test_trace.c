@@ -0,0 +1,133 @@
+#ifndef WITH_TRACE
+#define WITH_TRACE
+#endif
+#include "../trace.c"
+#include "test.h"
+
+#include <pthread.h>
+#include <string.h>
+
+TEST_INIT();
+
+enum { SPANS = 10, THREADS = 2 };
+
+static char path[64];
+
+/*
+ * Return the contents of the trace file (free it).
+ */
+static char *trace_read(void) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return NULL;
+    fseek(fp, 0, SEEK_END);
+    const long len = ftell(fp);
+    rewind(fp);
+    char *text = calloc((size_t)len + 1, 1);
+    if (text != NULL && fread(text, 1, (size_t)len, fp) != (size_t)len) {
+        text[0] = '\0';
+    }
+    fclose(fp);
+    return text;
+}
+
+static uint32_t count(const char *text, const char *pattern) {
+    uint32_t n = 0;
+    for (const char *p = text; (p = strstr(p, pattern)) != NULL; p++) n++;
+    return n;
+}
+
+/*
+ * Record SPANS spans "outer", each with a nested span "inner".
+ */
+static void *trace_spans(void *arg) {
+    TRACE_THREAD(arg);
+    for (uint32_t i = 0; i < SPANS; i++) {
+        TRACE_SCOPE("outer");
+        TRACE_BEGIN(span, "inner");
+        TRACE_END(span);
+    }
+    return NULL;
+}
+
+/*
+ * No span is recorded before trace_start().
+ */
+static void test_trace_disabled(void) {
+    trace_spans("main");
+    test(trace_ring == NULL);
+    test(atomic_load(&trace_rings) == NULL);
+}
+
+/*
+ * The spans of all threads (finished or not) are written and nested.
+ */
+static void test_trace_threads(void) {
+    trace_start();
+    trace_spans("main");
+    const struct trace_event *e = trace_ring->event;
+    test(trace_ring->len == 2 * SPANS);
+    test(strcmp(e[0].name, "inner") == 0 && strcmp(e[1].name, "outer") == 0);
+    test(e[1].begin <= e[0].begin && e[0].begin <= e[0].end &&
+         e[0].end <= e[1].end);
+
+    pthread_t thread[THREADS];
+    for (uint32_t i = 0; i < THREADS; i++) {
+        pthread_create(&thread[i], NULL, trace_spans, "worker");
+    }
+    for (uint32_t i = 0; i < THREADS; i++) pthread_join(thread[i], NULL);
+    test(trace_write(path));
+    test(!trace_enabled && atomic_load(&trace_rings) == NULL);
+
+    char *text = trace_read();
+    test(text != NULL && strncmp(text, "{\"displayTimeUnit\"", 18) == 0);
+    test(count(text, "\"ph\":\"X\"") == (THREADS + 1) * 2 * SPANS);
+    test(count(text, "\"name\":\"inner\"") == (THREADS + 1) * SPANS);
+    test(count(text, "\"thread_name\"") == THREADS + 1);
+    test(count(text, "\"name\":\"worker\"") == THREADS);
+    test(count(text, "\"dur\":-") == 0);
+    test(strcmp(&text[strlen(text) - 4], "\n]}\n") == 0);
+    free(text);
+}
+
+/*
+ * A full ring keeps the last TRACE_EVENTS spans.
+ */
+static void test_trace_ring(void) {
+    trace_start();
+    for (uint32_t i = 0; i < TRACE_EVENTS + 3; i++) {
+        TRACE_SCOPE(i < 3 ? "first" : "last");
+    }
+    test(trace_ring->len == TRACE_EVENTS + 3);
+    test(trace_write(path));
+    char *text = trace_read();
+    test(text != NULL && count(text, "\"ph\":\"X\"") == TRACE_EVENTS);
+    test(count(text, "\"first\"") == 0);
+    free(text);
+}
+
+/*
+ * The discarded spans are not written.
+ */
+static void test_trace_discard(void) {
+    trace_start();
+    trace_spans("main");
+    trace_discard();
+    TRACE_BEGIN(span, "after");
+    TRACE_END(span);
+    test(trace_write(path));
+    char *text = trace_read();
+    test(text != NULL && count(text, "\"ph\":\"X\"") == 1);
+    test(count(text, "\"name\":\"after\"") == 1);
+    free(text);
+    test(!trace_write("/nonexistent/trace.json"));
+}
+
+int main() {
+    snprintf(path, sizeof(path), "/tmp/test_trace.%d.json", (int)getpid());
+    test_trace_disabled();
+    test_trace_threads();
+    test_trace_ring();
+    test_trace_discard();
+    remove(path);
+    return TEST_RESULT;
+}
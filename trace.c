@@ -0,0 +1,90 @@
+#include "trace.h"
+
+#include <stdio.h>
+
+#ifdef WITH_TRACE
+#include <err.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+bool trace_enabled                          = false;
+_Thread_local struct trace_ring *trace_ring = NULL;
+
+// the registered rings (the last one first) and their number
+static _Atomic(struct trace_ring *) trace_rings = NULL;
+static atomic_uint trace_threads                = 0;
+static uint64_t trace_origin                    = 0;
+
+void trace_start(void) {
+    trace_origin  = trace_now();
+    trace_enabled = true;
+}
+
+struct trace_ring *trace_ring_create(void) {
+    struct trace_ring *r = malloc(sizeof(struct trace_ring));
+    if (NULL == r) {
+        err(EXIT_FAILURE, "allocate the trace ring");
+    }
+    r->tid  = atomic_fetch_add(&trace_threads, 1) + 1;
+    r->name = NULL;
+    r->len  = 0;
+    r->next = atomic_load(&trace_rings);
+    while (!atomic_compare_exchange_weak(&trace_rings, &r->next, r)) {
+    }
+    return trace_ring = r;
+}
+
+void trace_thread(const char *name) {
+    if (!trace_enabled) return;
+    struct trace_ring *r = trace_ring != NULL ? trace_ring : trace_ring_create();
+    r->name              = name;
+}
+
+void trace_discard(void) {
+    for (struct trace_ring *r = atomic_load(&trace_rings); r != NULL;
+         r = r->next) {
+        r->len = 0;
+    }
+}
+
+bool trace_write(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (NULL == fp) return false;
+    const int pid        = (int)getpid();
+    struct trace_ring *r = atomic_exchange(&trace_rings, NULL);
+    trace_ring           = NULL;
+    trace_enabled        = false;
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"args\":{\"name\":\"gstnn\"}}",
+            pid);
+    while (r != NULL) {
+        if (r->name != NULL) {
+            fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                        "\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                    pid, r->tid, r->name);
+        }
+        // the oldest spans of a full ring are overwritten
+        const uint64_t first = r->len > TRACE_EVENTS ? r->len - TRACE_EVENTS : 0;
+        if (first > 0) {
+            warnx("trace: the first %llu spans of thread %u are dropped",
+                  (unsigned long long)first, r->tid);
+        }
+        for (uint64_t i = first; i < r->len; i++) {
+            const struct trace_event *e = &r->event[i & (TRACE_EVENTS - 1)];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+                        "\"ts\":%.3f,\"dur\":%.3f}",
+                    e->name, pid, r->tid,
+                    (double)(e->begin - trace_origin) * 1e-3,
+                    (double)(e->end - e->begin) * 1e-3);
+        }
+        struct trace_ring *next = r->next;
+        free(r);
+        r = next;
+    }
+    fprintf(fp, "\n]}\n");
+    const bool ok = !ferror(fp);
+    return fclose(fp) == 0 && ok;
+}
+#endif
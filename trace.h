@@ -0,0 +1,161 @@
+// The trace hooks of the kernels and the phases of the batch loops: a span
+// (its name, begin and end) is recorded in the ring buffer of the calling
+// thread and the rings of all threads are written as a Chrome trace (JSON,
+// shown by chrome://tracing or https://ui.perfetto.dev) at the end
+// (`gstnn -T FILE`).
+//
+// The hooks are compiled in by `make TRACE=1` (WITH_TRACE) only: otherwise
+// the TRACE_* macros expand to nothing and cost nothing. Built in, a hook of
+// a disabled trace (without -T) tests a flag, a recorded span reads the
+// monotonic clock twice and writes an event into the ring of its thread
+// (no lock, no atomic operation).
+//
+// Each ring keeps the last TRACE_EVENTS spans of its thread. The rings are
+// registered (lock-free) at the first span of a thread and live until
+// trace_write(), so the spans of finished threads are written too.
+//
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef WITH_TRACE
+#include <time.h>
+
+/**
+ * ### TRACE_EVENTS - The number of spans of a ring (a power of two).
+ */
+#define TRACE_EVENTS (1u << 16)
+
+/**
+ * ### struct trace_event
+ *
+ * A recorded span: its name (a string constant) and the begin and the end
+ * in ns of the monotonic clock.
+ */
+struct trace_event {
+    const char *name;
+    uint64_t begin;
+    uint64_t end;
+};
+
+/**
+ * ### struct trace_ring
+ *
+ * The spans of a thread.
+ *
+ *  - `next` The ring of the thread registered before.
+ *  - `tid` The number of the thread (in the order of the registration).
+ *  - `name` The name of the thread (see trace_thread()) or NULL.
+ *  - `len` The number of the recorded spans (the last TRACE_EVENTS are kept).
+ */
+struct trace_ring {
+    struct trace_ring *next;
+    uint32_t tid;
+    const char *name;
+    uint64_t len;
+    struct trace_event event[TRACE_EVENTS];
+};
+
+/**
+ * ### struct trace_span
+ *
+ * A span in progress (see TRACE_BEGIN()).
+ */
+struct trace_span {
+    const char *name;
+    uint64_t begin;
+};
+
+extern bool trace_enabled;
+extern _Thread_local struct trace_ring *trace_ring;
+
+/**
+ * ### trace_start()
+ *
+ * Enable the recording of the spans. The timestamps of the trace are
+ * relative to this call. Call it before the threads are created.
+ */
+void trace_start(void);
+
+/**
+ * ### trace_thread()
+ *
+ * Name the calling thread in the trace (a string constant, e.g. "reader").
+ */
+void trace_thread(const char *name);
+
+/**
+ * ### trace_discard()
+ *
+ * Discard the recorded spans of all threads: a forked process calls it, so
+ * it does not write the spans of its parent again.
+ */
+void trace_discard(void);
+
+/**
+ * ### trace_write()
+ *
+ * Write the spans of all threads as a Chrome trace (JSON) of the process to
+ * the file `path`, release the rings and stop the recording. Call it after
+ * the other threads have finished.
+ *
+ * Returns false on failure (see errno).
+ */
+bool trace_write(const char *path);
+
+/*
+ * Register a ring for the calling thread.
+ */
+struct trace_ring *trace_ring_create(void);
+
+static inline uint64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static inline struct trace_span trace_begin(const char *name) {
+    return (struct trace_span){name, trace_enabled ? trace_now() : 0};
+}
+
+static inline void trace_end(struct trace_span *span) {
+    if (!trace_enabled) return;
+    struct trace_ring *r = trace_ring != NULL ? trace_ring : trace_ring_create();
+    r->event[r->len++ & (TRACE_EVENTS - 1)] =
+        (struct trace_event){span->name, span->begin, trace_now()};
+}
+
+/**
+ * ### TRACE_BEGIN(span, name), TRACE_END(span)
+ *
+ * Record the span `name` from TRACE_BEGIN() to TRACE_END() (in the same
+ * block), e.g. a phase of a loop.
+ */
+#define TRACE_BEGIN(span, name) struct trace_span span = trace_begin(name)
+#define TRACE_END(span) trace_end(&(span))
+
+/**
+ * ### TRACE_SCOPE(name), TRACE_KERNEL()
+ *
+ * Record the span `name` (or the name of the function) from here to the end
+ * of the block.
+ */
+#define TRACE_SCOPE(name)                                                   \
+    struct trace_span trace_scope_ __attribute__((cleanup(trace_end))) =    \
+        trace_begin(name)
+#define TRACE_KERNEL() TRACE_SCOPE(__func__)
+
+/**
+ * ### TRACE_THREAD(name) - Name the calling thread (see trace_thread()).
+ */
+#define TRACE_THREAD(name) trace_thread(name)
+
+#else
+#define TRACE_BEGIN(span, name) ((void)0)
+#define TRACE_END(span) ((void)0)
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_KERNEL() ((void)0)
+#define TRACE_THREAD(name) ((void)0)
+#endif